@@ -1,4 +1,7 @@
 #include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
 /**
  * Functions for handling the local dialer
  */
@@ -10,9 +13,107 @@
 #include "libp2p/utils/linked_list.h"
 #include "multiaddr/multiaddr.h"
 #include "libp2p/net/multistream.h"
+#include "libp2p/secio/secio.h"
+#include "libp2p/utils/logger.h"
+
+// defaults for the connection cache
+#define DIALER_MAX_CONNECTIONS 64
+#define DIALER_IDLE_TIMEOUT_SECS 300
 
 struct TransportDialer* libp2p_conn_tcp_transport_dialer_new();
 
+/***
+ * Close a cached connection, and free it
+ * @param connection the connection
+ */
+static void libp2p_conn_dialer_connection_free(struct DialerConnection* connection) {
+	if (connection == NULL)
+		return;
+	if (connection->session != NULL)
+		libp2p_session_context_free(connection->session);
+	if (connection->peer_id != NULL)
+		free(connection->peer_id);
+	if (connection->address != NULL)
+		free(connection->address);
+	free(connection);
+}
+
+/***
+ * Check that the other side has not hung up on a cached session. Nothing is read.
+ * @param session the session
+ * @returns true(1) if the session looks usable, false(0) otherwise
+ */
+static int libp2p_conn_dialer_session_is_healthy(struct SessionContext* session) {
+	if (session == NULL || session->default_stream == NULL || session->insecure_stream == NULL
+			|| session->insecure_stream->socket_descriptor == NULL)
+		return 0;
+	struct pollfd fds;
+	fds.fd = *((int*)session->insecure_stream->socket_descriptor);
+	fds.events = POLLIN;
+	fds.revents = 0;
+	int rc = poll(&fds, 1, 0);
+	if (rc < 0 || (fds.revents & (POLLERR | POLLNVAL)))
+		return 0;
+	if (rc > 0 && (fds.revents & (POLLIN | POLLHUP))) {
+		// something is waiting. If it is the end of the stream, the peer is gone.
+		char c;
+		if (recv(fds.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+/***
+ * Remove an entry from the dialer's list of connections, and free it
+ * @param dialer the dialer
+ * @param entry the list entry
+ * @param previous the entry before it (NULL if it is first)
+ */
+static void libp2p_conn_dialer_connection_remove(struct Dialer* dialer, struct Libp2pLinkedList* entry, struct Libp2pLinkedList* previous) {
+	if (previous == NULL)
+		dialer->connections = entry->next;
+	else
+		previous->next = entry->next;
+	dialer->num_connections--;
+	libp2p_conn_dialer_connection_free((struct DialerConnection*)entry->item);
+	entry->item = NULL;
+	entry->next = NULL;
+	libp2p_utils_linked_list_free(entry);
+}
+
+/***
+ * Find the entry in the dialer's list of connections that holds a session
+ * @param dialer the dialer
+ * @param session the session
+ * @param previous where to put the entry before it (NULL if it is first)
+ * @returns the entry, or NULL if the dialer does not have the session
+ */
+static struct Libp2pLinkedList* libp2p_conn_dialer_connection_find(struct Dialer* dialer, const struct SessionContext* session, struct Libp2pLinkedList** previous) {
+	*previous = NULL;
+	if (session == NULL)
+		return NULL;
+	for(struct Libp2pLinkedList* current = dialer->connections; current != NULL; current = current->next) {
+		if (((struct DialerConnection*)current->item)->session == session)
+			return current;
+		*previous = current;
+	}
+	return NULL;
+}
+
+/***
+ * A borrower is done with a connection. It is freed if it was closed and no one else has it.
+ * @param dialer the dialer
+ * @param entry the list entry
+ * @param previous the entry before it (NULL if it is first)
+ */
+static void libp2p_conn_dialer_connection_release(struct Dialer* dialer, struct Libp2pLinkedList* entry, struct Libp2pLinkedList* previous) {
+	struct DialerConnection* connection = (struct DialerConnection*)entry->item;
+	if (connection->borrowers > 0)
+		connection->borrowers--;
+	if (connection->closed && connection->borrowers == 0)
+		libp2p_conn_dialer_connection_remove(dialer, entry, previous);
+}
+
 /**
  * Create a Dialer with the specified local information
  */
@@ -20,6 +121,7 @@ struct Dialer* libp2p_conn_dialer_new(char* peer_id, struct PrivateKey* private_
 	int success = 0;
 	struct Dialer* dialer = (struct Dialer*)malloc(sizeof(struct Dialer));
 	if (dialer != NULL) {
+		dialer->connections = NULL;
 		dialer->peer_id = malloc(strlen(peer_id) + 1);
 		if (dialer->peer_id != NULL) {
 			strcpy(dialer->peer_id, peer_id);
@@ -29,6 +131,11 @@ struct Dialer* libp2p_conn_dialer_new(char* peer_id, struct PrivateKey* private_
 				//TODO: build transport dialers
 				dialer->transport_dialers = NULL;
 				dialer->fallback_dialer = libp2p_conn_tcp_transport_dialer_new(peer_id, private_key);
+				dialer->num_connections = 0;
+				dialer->max_connections = DIALER_MAX_CONNECTIONS;
+				dialer->idle_timeout_secs = DIALER_IDLE_TIMEOUT_SECS;
+				dialer->connection_hits = 0;
+				dialer->connection_misses = 0;
 				return dialer;
 			}
 		}
@@ -55,6 +162,14 @@ void libp2p_conn_dialer_free(struct Dialer* in) {
 		}
 		if (in->fallback_dialer != NULL)
 			libp2p_conn_transport_dialer_free((struct TransportDialer*)in->fallback_dialer);
+		while (in->connections != NULL) {
+			struct Libp2pLinkedList* next = in->connections->next;
+			libp2p_conn_dialer_connection_free((struct DialerConnection*)in->connections->item);
+			in->connections->item = NULL;
+			in->connections->next = NULL;
+			libp2p_utils_linked_list_free(in->connections);
+			in->connections = next;
+		}
 		free(in);
 	}
 	return;
@@ -78,22 +193,258 @@ struct Connection* libp2p_conn_dialer_get_connection(const struct Dialer* dialer
 
 /**
  * return a Stream that is already set up to use the passed in protocol
+ * NOTE: the stream comes from the dialer's connections, so it may be one that is
+ * already open. The dialer owns it, so do not close it. Hand it back with
+ * libp2p_conn_dialer_release_stream when done.
  * @param dialer the dialer to use
  * @param multiaddress the host to dial
  * @param protocol the protocol to use (right now only 'multistream' is supported)
  * @returns the ready-to-use stream
  */
-struct Stream* libp2p_conn_dialer_get_stream(const struct Dialer* dialer, const struct MultiAddress* multiaddress, const char* protocol) {
+struct Stream* libp2p_conn_dialer_get_stream(struct Dialer* dialer, const struct MultiAddress* multiaddress, const char* protocol) {
 	// this is a shortcut for now. Other protocols will soon be implemented
 	if (strcmp(protocol, "multistream") != 0)
 		return NULL;
-	char* ip;
-	int port = multiaddress_get_ip_port(multiaddress);
-	if (!multiaddress_get_ip_address(multiaddress, &ip)) {
-		free(ip);
+	struct SessionContext* session = libp2p_conn_dialer_get_session(dialer, NULL, multiaddress, NULL, NULL);
+	if (session == NULL)
 		return NULL;
+	return session->default_stream;
+}
+
+/***
+ * Hand back a stream from libp2p_conn_dialer_get_stream
+ * @param dialer the dialer
+ * @param stream the stream
+ * @returns true(1) if the stream was found, false(0) otherwise
+ */
+int libp2p_conn_dialer_release_stream(struct Dialer* dialer, struct Stream* stream) {
+	struct Libp2pLinkedList* previous = NULL;
+	for(struct Libp2pLinkedList* current = dialer->connections; current != NULL; current = current->next) {
+		struct DialerConnection* connection = (struct DialerConnection*)current->item;
+		if (stream != NULL && connection->session->default_stream == stream) {
+			libp2p_conn_dialer_connection_release(dialer, current, previous);
+			return 1;
+		}
+		previous = current;
+	}
+	return 0;
+}
+
+/***
+ * Close connections that have not been used for idle_timeout_secs. Borrowed connections are left open.
+ * @param dialer the dialer
+ * @returns the number of connections closed
+ */
+int libp2p_conn_dialer_evict_idle(struct Dialer* dialer) {
+	int evicted = 0;
+	time_t now = time(NULL);
+	struct Libp2pLinkedList* previous = NULL;
+	struct Libp2pLinkedList* current = dialer->connections;
+	while (current != NULL) {
+		struct Libp2pLinkedList* next = current->next;
+		struct DialerConnection* connection = (struct DialerConnection*)current->item;
+		if (connection->borrowers == 0 && (connection->closed || now - connection->last_used >= dialer->idle_timeout_secs)) {
+			libp2p_conn_dialer_connection_remove(dialer, current, previous);
+			evicted++;
+		} else {
+			previous = current;
+		}
+		current = next;
+	}
+	return evicted;
+}
+
+/***
+ * Hand back a session that the dialer handed out. It stays open for the next caller.
+ * @param dialer the dialer
+ * @param session the session
+ * @returns true(1) if the session was found, false(0) otherwise
+ */
+int libp2p_conn_dialer_release_session(struct Dialer* dialer, struct SessionContext* session) {
+	struct Libp2pLinkedList* previous = NULL;
+	struct Libp2pLinkedList* current = libp2p_conn_dialer_connection_find(dialer, session, &previous);
+	if (current == NULL)
+		return 0;
+	libp2p_conn_dialer_connection_release(dialer, current, previous);
+	return 1;
+}
+
+/***
+ * Borrow a session that was already handed out once more, i.e. for a copy of a peer.
+ * Hand it back with libp2p_conn_dialer_release_session.
+ * @param dialer the dialer
+ * @param session the session
+ * @returns true(1) if the session is still open, false(0) otherwise
+ */
+int libp2p_conn_dialer_retain_session(struct Dialer* dialer, struct SessionContext* session) {
+	struct Libp2pLinkedList* previous = NULL;
+	struct Libp2pLinkedList* current = libp2p_conn_dialer_connection_find(dialer, session, &previous);
+	if (current == NULL || ((struct DialerConnection*)current->item)->closed)
+		return 0;
+	((struct DialerConnection*)current->item)->borrowers++;
+	return 1;
+}
+
+/***
+ * Hand back a session that the dialer handed out because it failed. It is not handed
+ * out again, and is closed once every borrower has handed it back.
+ * @param dialer the dialer
+ * @param session the session
+ * @returns true(1) if the session was found, false(0) otherwise
+ */
+int libp2p_conn_dialer_close_session(struct Dialer* dialer, struct SessionContext* session) {
+	struct Libp2pLinkedList* previous = NULL;
+	struct Libp2pLinkedList* current = libp2p_conn_dialer_connection_find(dialer, session, &previous);
+	if (current == NULL)
+		return 0;
+	((struct DialerConnection*)current->item)->closed = 1;
+	libp2p_conn_dialer_connection_release(dialer, current, previous);
+	return 1;
+}
+
+/***
+ * Retrieve a session to a peer. An open session is reused if there is one,
+ * otherwise the peer is dialed (and secured if a private key is given). A session
+ * is only reused if it is secured the same way.
+ * NOTE: The dialer owns the session, and keeps it open until it is handed back with
+ * libp2p_conn_dialer_release_session (or libp2p_conn_dialer_close_session if it failed).
+ * @param dialer the dialer
+ * @param peer_id the remote peer ID as null terminated string (NULL to go by address only)
+ * @param multiaddress where to dial
+ * @param private_key the local key for secio (NULL to not secure the connection)
+ * @param peerstore where secio looks up and adds the remote peer
+ * @returns the session, or NULL on error
+ */
+struct SessionContext* libp2p_conn_dialer_get_session(struct Dialer* dialer, const char* peer_id, const struct MultiAddress* multiaddress,
+		struct RsaPrivateKey* private_key, struct Peerstore* peerstore) {
+	struct Libp2pLinkedList* previous = NULL;
+	struct Libp2pLinkedList* current = NULL;
+	struct DialerConnection* connection = NULL;
+	struct SessionContext* session = NULL;
+	char* ip = NULL;
+	int secure = private_key != NULL;
+
+	if (dialer->idle_timeout_secs > 0)
+		libp2p_conn_dialer_evict_idle(dialer);
+
+	// look in the cache
+	current = dialer->connections;
+	while (current != NULL) {
+		connection = (struct DialerConnection*)current->item;
+		if (!connection->closed && connection->secure == secure
+				&& ( (peer_id != NULL && connection->peer_id != NULL && strcmp(peer_id, connection->peer_id) == 0)
+				|| (multiaddress != NULL && strcmp(multiaddress->string, connection->address) == 0)))
+			break;
+		previous = current;
+		current = current->next;
+	}
+	if (current != NULL) {
+		if (libp2p_conn_dialer_session_is_healthy(connection->session)) {
+			dialer->connection_hits++;
+			connection->last_used = time(NULL);
+			connection->borrowers++;
+			// move it to the front
+			if (previous != NULL) {
+				previous->next = current->next;
+				current->next = dialer->connections;
+				dialer->connections = current;
+			}
+			return connection->session;
+		}
+		libp2p_logger_debug("dialer", "Cached connection to %s is gone.\n", connection->address);
+		// the borrowers find out when they use it
+		connection->closed = 1;
+		if (connection->borrowers == 0)
+			libp2p_conn_dialer_connection_remove(dialer, current, previous);
+	}
+	dialer->connection_misses++;
+	if (multiaddress == NULL)
+		return NULL;
+
+	// dial
+	int port = multiaddress_get_ip_port(multiaddress);
+	if (!multiaddress_get_ip_address(multiaddress, &ip))
+		goto error;
+	session = libp2p_session_context_new();
+	if (session == NULL)
+		goto error;
+	session->insecure_stream = libp2p_net_multistream_connect(ip, port);
+	if (session->insecure_stream == NULL)
+		goto error;
+	session->default_stream = session->insecure_stream;
+	if (private_key != NULL && libp2p_secio_initiate_handshake(session, private_key, peerstore) <= 0) {
+		libp2p_logger_error("dialer", "Secio handshake with %s failed.\n", multiaddress->string);
+		goto error;
 	}
-	struct Stream* stream = libp2p_net_multistream_connect(ip, port);
 	free(ip);
-	return stream;
+	ip = NULL;
+
+	// make room by closing the least recently used connection no one has borrowed, and remember it
+	if (dialer->max_connections > 0 && dialer->num_connections >= dialer->max_connections) {
+		struct Libp2pLinkedList* oldest = NULL;
+		struct Libp2pLinkedList* oldest_previous = NULL;
+		previous = NULL;
+		for(current = dialer->connections; current != NULL; current = current->next) {
+			if (((struct DialerConnection*)current->item)->borrowers == 0) {
+				oldest = current;
+				oldest_previous = previous;
+			}
+			previous = current;
+		}
+		if (oldest != NULL)
+			libp2p_conn_dialer_connection_remove(dialer, oldest, oldest_previous);
+		else
+			libp2p_logger_debug("dialer", "All %d connections are borrowed. Going over the limit.\n", dialer->num_connections);
+	}
+	connection = (struct DialerConnection*) malloc(sizeof(struct DialerConnection));
+	current = libp2p_utils_linked_list_new();
+	if (connection == NULL || current == NULL) {
+		if (connection != NULL)
+			free(connection);
+		if (current != NULL)
+			libp2p_utils_linked_list_free(current);
+		goto error;
+	}
+	connection->session = session;
+	connection->secure = secure;
+	connection->borrowers = 1;
+	connection->closed = 0;
+	connection->last_used = time(NULL);
+	connection->address = malloc(strlen(multiaddress->string) + 1);
+	if (connection->address != NULL)
+		strcpy(connection->address, multiaddress->string);
+	connection->peer_id = NULL;
+	// secio learns who is on the other end
+	if (peer_id == NULL)
+		peer_id = session->remote_peer_id;
+	if (peer_id != NULL) {
+		connection->peer_id = malloc(strlen(peer_id) + 1);
+		if (connection->peer_id != NULL)
+			strcpy(connection->peer_id, peer_id);
+	}
+	current->item = connection;
+	current->next = dialer->connections;
+	dialer->connections = current;
+	dialer->num_connections++;
+	if (connection->address == NULL) {
+		// without an address it can not be found again
+		libp2p_conn_dialer_connection_remove(dialer, current, NULL);
+		return NULL;
+	}
+	// secio put the session in the peerstore's copy of the peer, which now borrows it too
+	if (secure && peerstore != NULL && session->remote_peer_id != NULL) {
+		struct Libp2pPeer* remote_peer = libp2p_peerstore_get_peer(peerstore, (unsigned char*)session->remote_peer_id, strlen(session->remote_peer_id));
+		if (remote_peer != NULL && remote_peer->sessionContext == session && remote_peer->dialer == NULL) {
+			remote_peer->dialer = dialer;
+			connection->borrowers++;
+		}
+	}
+	return session;
+
+	error:
+	if (ip != NULL)
+		free(ip);
+	if (session != NULL)
+		libp2p_session_context_free(session);
+	return NULL;
 }
@@ -12,11 +12,16 @@ struct SessionContext* libp2p_session_context_new() {
 		memset(&context->aes_decode_stream_block[0], 0, 16);
 		context->aes_encode_nonce_offset = 0;
 		memset(&context->aes_encode_stream_block[0], 0, 16);
+		mbedtls_aes_init(&context->aes_encode_context);
+		mbedtls_aes_init(&context->aes_decode_context);
+		mbedtls_md_init(&context->mac_encode_context);
+		mbedtls_md_init(&context->mac_decode_context);
 		context->chosen_cipher = NULL;
 		context->chosen_curve = NULL;
 		context->chosen_hash = NULL;
 		context->datastore = NULL;
 		context->default_stream = NULL;
+		context->dht_upgraded = 0;
 		context->ephemeral_private_key = NULL;
 		context->filestore = NULL;
 		context->host = NULL;
@@ -68,6 +73,10 @@ int libp2p_session_context_free(struct SessionContext* context) {
 			free(context->remote_peer_id);
 			context->remote_peer_id = NULL;
 		}
+		if (context->remote_key.data != NULL) {
+			free(context->remote_key.data);
+			context->remote_key.data = NULL;
+		}
 		if (context->remote_ephemeral_public_key != NULL) {
 			free(context->remote_ephemeral_public_key);
 			context->remote_ephemeral_public_key = NULL;
@@ -84,6 +93,10 @@ int libp2p_session_context_free(struct SessionContext* context) {
 			libp2p_crypto_ephemeral_key_free(context->ephemeral_private_key);
 			context->ephemeral_private_key = NULL;
 		}
+		mbedtls_aes_free(&context->aes_encode_context);
+		mbedtls_aes_free(&context->aes_decode_context);
+		mbedtls_md_free(&context->mac_encode_context);
+		mbedtls_md_free(&context->mac_decode_context);
 		free(context);
 	}
 	return 1;
@@ -3,6 +3,7 @@
 
 #include "libp2p/db/datastore.h"
 #include "libp2p/os/utils.h"
+#include "libp2p/utils/logger.h"
 
 int alloc_and_assign(char** result, const char* string) {
 	*result = malloc(strlen(string)+1);
@@ -46,6 +47,14 @@ int libp2p_datastore_new(struct Datastore** datastore) {
 	(*datastore)->storage_max = NULL;
 	(*datastore)->gc_period = NULL;
 	(*datastore)->params = NULL;
+	(*datastore)->bloom_filter_size = 0;
+	(*datastore)->datastore_has = NULL;
+	(*datastore)->bloom_filter = NULL;
+	(*datastore)->bloom_filter_lookups = 0;
+	(*datastore)->bloom_filter_negatives = 0;
+	(*datastore)->bloom_filter_false_positives = 0;
+	(*datastore)->backend_put = NULL;
+	(*datastore)->backend_get = NULL;
 	return 1;
 }
 
@@ -69,7 +78,200 @@ int libp2p_datastore_free(struct Datastore* datastore) {
 			free(datastore->params);
 		if (datastore->handle != NULL)
 			datastore->datastore_close(datastore);
+		libp2p_utils_bloom_filter_free(datastore->bloom_filter);
 		free(datastore);
 	}
 	return 1;
 }
+
+/***
+ * Ask the bloom filter (if there is one) whether a key may be stored
+ * @param datastore the datastore, or NULL if there is none
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns false(0) if the key is certainly not stored, true(1) if it may be
+ */
+int libp2p_datastore_may_have(const struct Datastore* datastore, const unsigned char* key, size_t key_size) {
+	if (datastore == NULL || datastore->bloom_filter == NULL)
+		return 1;
+	// the counters are statistics, not part of what the datastore holds
+	struct Datastore* counters = (struct Datastore*)datastore;
+	counters->bloom_filter_lookups++;
+	if (!libp2p_utils_bloom_filter_contains(datastore->bloom_filter, key, key_size)) {
+		counters->bloom_filter_negatives++;
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Count a key that got past the bloom filter, but was not stored
+ * @param datastore the datastore
+ */
+static void libp2p_datastore_bloom_filter_missed(const struct Datastore* datastore) {
+	if (datastore->bloom_filter != NULL)
+		((struct Datastore*)datastore)->bloom_filter_false_positives++;
+}
+
+/***
+ * The datastore_get that is used while there is a bloom filter
+ */
+static int libp2p_datastore_filtered_get(const char* key, size_t key_size, unsigned char* data, size_t max_data_length, size_t* data_length,
+		const struct Datastore* datastore) {
+	if (!libp2p_datastore_may_have(datastore, (const unsigned char*)key, key_size))
+		return 0;
+	int retVal = datastore->backend_get(key, key_size, data, max_data_length, data_length, datastore);
+	if (!retVal)
+		libp2p_datastore_bloom_filter_missed(datastore);
+	return retVal;
+}
+
+/***
+ * The datastore_put that is used while there is a bloom filter
+ */
+static int libp2p_datastore_filtered_put(const unsigned char* key, size_t key_size, unsigned char* data, size_t data_length, const struct Datastore* datastore) {
+	// added first, so that a failed put can only cost a false positive
+	if (datastore->bloom_filter != NULL)
+		libp2p_utils_bloom_filter_add(datastore->bloom_filter, key, key_size);
+	return datastore->backend_put(key, key_size, data, data_length, datastore);
+}
+
+/***
+ * See if a key is stored, without retrieving its value
+ * NOTE: this asks the bloom filter first (if there is one), then datastore_has.
+ * If the datastore has no datastore_has, the value is retrieved into a buffer of
+ * DATASTORE_HAS_MAX_VALUE_SIZE bytes, and a key with a larger value may be reported absent.
+ * @param datastore the datastore
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns true(1) if the key is stored, false(0) otherwise
+ */
+int libp2p_datastore_has(const struct Datastore* datastore, const unsigned char* key, size_t key_size) {
+	int retVal = 0;
+	if (datastore == NULL || key == NULL || key_size == 0)
+		return 0;
+	if (!libp2p_datastore_may_have(datastore, key, key_size))
+		return 0;
+	if (datastore->datastore_has != NULL) {
+		retVal = datastore->datastore_has(key, key_size, datastore);
+	} else {
+		// the slow way. Go around the filter, as it was asked already
+		int (*get)(const char*, size_t, unsigned char*, size_t, size_t*, const struct Datastore*) =
+				datastore->backend_get != NULL ? datastore->backend_get : datastore->datastore_get;
+		if (get == NULL)
+			return 0;
+		size_t buffer_size = DATASTORE_HAS_MAX_VALUE_SIZE;
+		unsigned char* buffer = malloc(buffer_size);
+		if (buffer == NULL)
+			return 0;
+		retVal = get((const char*)key, key_size, buffer, buffer_size, &buffer_size, datastore);
+		free(buffer);
+		// a failed get may only mean the value was too big, so it is not counted as a miss
+		return retVal;
+	}
+	if (!retVal)
+		libp2p_datastore_bloom_filter_missed(datastore);
+	return retVal;
+}
+
+/***
+ * Store a value, and remember its key in the bloom filter
+ * @param datastore the datastore
+ * @param key the key
+ * @param key_size the size of the key
+ * @param data the value
+ * @param data_length the size of the value
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_datastore_put(struct Datastore* datastore, const unsigned char* key, size_t key_size, unsigned char* data, size_t data_length) {
+	if (datastore == NULL || datastore->datastore_put == NULL)
+		return 0;
+	// while there is a filter, datastore_put keeps it current
+	return datastore->datastore_put(key, key_size, data, data_length, datastore);
+}
+
+/***
+ * Open the datastore, and build its bloom filter
+ * @param datastore the datastore
+ * @param argc passed to datastore_open
+ * @param argv passed to datastore_open
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_datastore_open(struct Datastore* datastore, int argc, char** argv) {
+	if (datastore == NULL || datastore->datastore_open == NULL)
+		return 0;
+	if (!datastore->datastore_open(argc, argv, datastore))
+		return 0;
+	if (!libp2p_datastore_bloom_filter_build(datastore))
+		libp2p_logger_error("datastore", "Unable to build the bloom filter. Continuing without it.\n");
+	return 1;
+}
+
+/***
+ * Build a bloom filter of bloom_filter_size bytes from the keys in an open datastore.
+ * Nothing is built if bloom_filter_size is 0, or the datastore has no cursor.
+ * NOTE: datastore_put and datastore_get are replaced with versions that go through
+ * the filter, so callers that use them directly are covered too.
+ * @param datastore the datastore
+ * @returns true(1) on success (even if nothing was built), false(0) on error
+ */
+int libp2p_datastore_bloom_filter_build(struct Datastore* datastore) {
+	unsigned char* key = NULL;
+	unsigned char* value = NULL;
+	int key_length = 0, value_length = 0;
+
+	libp2p_utils_bloom_filter_free(datastore->bloom_filter);
+	datastore->bloom_filter = NULL;
+	datastore->bloom_filter_lookups = 0;
+	datastore->bloom_filter_negatives = 0;
+	datastore->bloom_filter_false_positives = 0;
+	if (datastore->bloom_filter_size <= 0)
+		return 1;
+	if (datastore->datastore_cursor_open == NULL || datastore->datastore_cursor_get == NULL || datastore->datastore_cursor_close == NULL)
+		return 1;
+
+	struct BloomFilter* filter = libp2p_utils_bloom_filter_new(datastore->bloom_filter_size, 0);
+	if (filter == NULL)
+		return 0;
+	if (!datastore->datastore_cursor_open(datastore)) {
+		libp2p_utils_bloom_filter_free(filter);
+		return 0;
+	}
+	enum DatastoreCursorOp op = CURSOR_FIRST;
+	while (datastore->datastore_cursor_get(&key, &key_length, &value, &value_length, op, datastore)) {
+		libp2p_utils_bloom_filter_add(filter, key, key_length);
+		free(key);
+		key = NULL;
+		if (value != NULL) {
+			free(value);
+			value = NULL;
+		}
+		op = CURSOR_NEXT;
+	}
+	datastore->datastore_cursor_close(datastore);
+	datastore->bloom_filter = filter;
+
+	// put the filter in front of the backend
+	if (datastore->datastore_put != NULL && datastore->datastore_put != libp2p_datastore_filtered_put) {
+		datastore->backend_put = datastore->datastore_put;
+		datastore->datastore_put = libp2p_datastore_filtered_put;
+	}
+	if (datastore->datastore_get != NULL && datastore->datastore_get != libp2p_datastore_filtered_get) {
+		datastore->backend_get = datastore->datastore_get;
+		datastore->datastore_get = libp2p_datastore_filtered_get;
+	}
+	libp2p_logger_debug("datastore", "Bloom filter of %d bytes built with %lu keys.\n", datastore->bloom_filter_size, (unsigned long)filter->num_keys);
+	return 1;
+}
+
+/***
+ * The share of keys that were not stored, but got past the bloom filter
+ * @param datastore the datastore
+ * @returns the observed false positive rate (0.0 if nothing has been asked yet)
+ */
+double libp2p_datastore_bloom_filter_false_positive_rate(const struct Datastore* datastore) {
+	unsigned long not_stored = datastore->bloom_filter_negatives + datastore->bloom_filter_false_positives;
+	if (not_stored == 0)
+		return 0.0;
+	return (double)datastore->bloom_filter_false_positives / not_stored;
+}
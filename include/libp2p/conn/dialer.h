@@ -1,3 +1,5 @@
+#pragma once
+
 /***
  * A local dialer. Uses MultiAddr to figure out the best way to
  * connect to a client, then returns an open Connection that can be
@@ -9,10 +11,27 @@
  * build connections that negotiate many protocols
  */
 
+#include <time.h>
 #include "libp2p/crypto/key.h"
+#include "libp2p/crypto/rsa.h"
 #include "multiaddr/multiaddr.h"
 #include "libp2p/conn/connection.h"
+#include "libp2p/conn/session.h"
 #include "libp2p/conn/transport_dialer.h"
+#include "libp2p/peer/peerstore.h"
+
+/**
+ * A connection the dialer keeps open so that it can be used again
+ */
+struct DialerConnection {
+	char* peer_id; // the remote peer ID as null terminated string (may be NULL)
+	char* address; // the multiaddress that was dialed
+	struct SessionContext* session;
+	int secure; // true(1) if secio was negotiated
+	int borrowers; // sessions handed out and not yet released. The connection is not closed while this is > 0
+	int closed; // a borrower reported it failed. It is not handed out again, and is freed once released
+	time_t last_used;
+};
 
 struct Dialer {
 	/**
@@ -30,6 +49,16 @@ struct Dialer {
 	//TODO: See dial.go, need to implement Protector
 
 	struct TransportDialer* fallback_dialer; // the default dialer. NOTE: this should not be in the list of transport_dialers
+
+	/**
+	 * Open connections, most recently used first. The dialer owns them.
+	 */
+	struct Libp2pLinkedList* connections;
+	int num_connections;
+	int max_connections; // when full, the least recently used connection that is not borrowed is closed
+	int idle_timeout_secs; // connections unused for this long (and not borrowed) are closed
+	unsigned long connection_hits;
+	unsigned long connection_misses;
 };
 
 /**
@@ -43,6 +72,8 @@ struct Dialer* libp2p_conn_dialer_new(char* peer_id, struct PrivateKey* private_
 
 /**
  * free resources from the Dialer struct
+ * NOTE: this closes every connection, borrowed or not. Free the peers that hold
+ * sessions from this dialer first.
  * @param in the Dialer struct to relieve of their resources
  */
 void libp2p_conn_dialer_free(struct Dialer* in);
@@ -57,10 +88,70 @@ struct Connection* libp2p_conn_dialer_get_connection(const struct Dialer* dialer
 
 /**
  * return a Stream that is already set up to use the passed in protocol
+ * NOTE: the stream comes from the dialer's connections, so it may be one that is
+ * already open. The dialer owns it, so do not close it. Hand it back with
+ * libp2p_conn_dialer_release_stream when done.
  * @param dialer the dialer to use
  * @param multiaddress the host to dial
  * @param protocol the protocol to use (right now only 'multistream' is supported)
  * @returns the ready-to-use stream
  */
-struct Stream* libp2p_conn_dialer_get_stream(const struct Dialer* dialer, const struct MultiAddress* multiaddress, const char* protocol);
+struct Stream* libp2p_conn_dialer_get_stream(struct Dialer* dialer, const struct MultiAddress* multiaddress, const char* protocol);
+
+/***
+ * Hand back a stream from libp2p_conn_dialer_get_stream
+ * @param dialer the dialer
+ * @param stream the stream
+ * @returns true(1) if the stream was found, false(0) otherwise
+ */
+int libp2p_conn_dialer_release_stream(struct Dialer* dialer, struct Stream* stream);
+
+
+/***
+ * Retrieve a session to a peer. An open session is reused if there is one,
+ * otherwise the peer is dialed (and secured if a private key is given). A session
+ * is only reused if it is secured the same way.
+ * NOTE: The dialer owns the session, and keeps it open until it is handed back with
+ * libp2p_conn_dialer_release_session (or libp2p_conn_dialer_close_session if it failed).
+ * @param dialer the dialer
+ * @param peer_id the remote peer ID as null terminated string (NULL to go by address only)
+ * @param multiaddress where to dial
+ * @param private_key the local key for secio (NULL to not secure the connection)
+ * @param peerstore where secio looks up and adds the remote peer
+ * @returns the session, or NULL on error
+ */
+struct SessionContext* libp2p_conn_dialer_get_session(struct Dialer* dialer, const char* peer_id, const struct MultiAddress* multiaddress,
+		struct RsaPrivateKey* private_key, struct Peerstore* peerstore);
 
+/***
+ * Hand back a session that the dialer handed out. It stays open for the next caller.
+ * @param dialer the dialer
+ * @param session the session
+ * @returns true(1) if the session was found, false(0) otherwise
+ */
+int libp2p_conn_dialer_release_session(struct Dialer* dialer, struct SessionContext* session);
+
+/***
+ * Borrow a session that was already handed out once more, i.e. for a copy of a peer.
+ * Hand it back with libp2p_conn_dialer_release_session.
+ * @param dialer the dialer
+ * @param session the session
+ * @returns true(1) if the session is still open, false(0) otherwise
+ */
+int libp2p_conn_dialer_retain_session(struct Dialer* dialer, struct SessionContext* session);
+
+/***
+ * Hand back a session that the dialer handed out because it failed. It is not handed
+ * out again, and is closed once every borrower has handed it back.
+ * @param dialer the dialer
+ * @param session the session
+ * @returns true(1) if the session was found, false(0) otherwise
+ */
+int libp2p_conn_dialer_close_session(struct Dialer* dialer, struct SessionContext* session);
+
+/***
+ * Close connections that have not been used for idle_timeout_secs. Borrowed connections are left open.
+ * @param dialer the dialer
+ * @returns the number of connections closed
+ */
+int libp2p_conn_dialer_evict_idle(struct Dialer* dialer);
@@ -3,6 +3,8 @@
 #include "libp2p/crypto/key.h"
 #include "libp2p/db/datastore.h"
 #include "libp2p/db/filestore.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/md.h"
 
 /***
  * Holds the details of communication between two hosts
@@ -27,6 +29,8 @@ struct SessionContext {
 	struct Stream* insecure_stream;
 	struct Stream* secure_stream;
 	struct Stream* default_stream;
+	// true(1) once the remote has been asked to speak the DHT protocol on this session
+	int dht_upgraded;
 	struct Datastore* datastore;
 	struct Filestore* filestore;
 	// filled in during negotiations
@@ -42,6 +46,15 @@ struct SessionContext {
 	unsigned char aes_encode_stream_block[16];
 	size_t aes_decode_nonce_offset;
 	unsigned char aes_decode_stream_block[16];
+	/**
+	 * Keyed cipher and mac contexts, one per direction. These are set up once by
+	 * libp2p_secio_make_mac_and_cipher so that each frame does not have to
+	 * re-run the AES key schedule and HMAC pad derivation.
+	 */
+	mbedtls_aes_context aes_encode_context;
+	mbedtls_aes_context aes_decode_context;
+	mbedtls_md_context_t mac_encode_context;
+	mbedtls_md_context_t mac_decode_context;
 	/**
 	 * The mac function to use
 	 * @param 1 the incoming data bytes
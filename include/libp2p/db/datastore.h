@@ -1,11 +1,16 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
+#include "libp2p/utils/bloom_filter.h"
 
 /***
  * Interface to data storage
  */
 
+// the largest value libp2p_datastore_has can retrieve from a datastore without datastore_has
+#define DATASTORE_HAS_MAX_VALUE_SIZE 65535
+
 enum DatastoreCursorOp { CURSOR_FIRST, CURSOR_NEXT };
 
 struct Datastore {
@@ -29,9 +34,21 @@ struct Datastore {
 	int (*datastore_cursor_open)(struct Datastore* datastore);
 	int (*datastore_cursor_close)(struct Datastore* datastore);
 	int (*datastore_cursor_get)(unsigned char** key, int* key_length, unsigned char** value, int* value_length, enum DatastoreCursorOp op, struct Datastore* datastore);
+	// true(1) if the key is stored. Optional, see libp2p_datastore_has
+	int (*datastore_has)(const unsigned char* key, size_t key_size, const struct Datastore* datastore);
 	// generic connection and status variables for the datastore
 	void* handle; // a handle to the database
 	void* cursor; // a current cursor
+	// the keys that may be stored. NULL unless built with libp2p_datastore_bloom_filter_build
+	struct BloomFilter* bloom_filter;
+	unsigned long bloom_filter_lookups; // keys the filter was asked about
+	unsigned long bloom_filter_negatives; // keys the filter knew were not stored
+	unsigned long bloom_filter_false_positives; // keys the filter let through that were not stored
+	// the backend's put and get, once the bloom filter is in front of them
+	int (*backend_put)(const unsigned char* key, size_t key_size, unsigned char* data, size_t data_length, const struct Datastore* datastore);
+	int (*backend_get)(const char* key, size_t key_size,
+			unsigned char* data, size_t max_data_length, size_t* data_length,
+			const struct Datastore* datastore);
 };
 
 /***
@@ -57,3 +74,61 @@ int libp2p_datastore_new(struct Datastore** datastore);
  * @returns true(1)
  */
 int libp2p_datastore_free(struct Datastore* datastore);
+
+/***
+ * See if a key is stored, without retrieving its value
+ * NOTE: this asks the bloom filter first (if there is one), then datastore_has.
+ * If the datastore has no datastore_has, the value is retrieved into a buffer of
+ * DATASTORE_HAS_MAX_VALUE_SIZE bytes, and a key with a larger value may be reported absent.
+ * @param datastore the datastore
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns true(1) if the key is stored, false(0) otherwise
+ */
+int libp2p_datastore_has(const struct Datastore* datastore, const unsigned char* key, size_t key_size);
+
+/***
+ * Open the datastore, and build its bloom filter
+ * @param datastore the datastore
+ * @param argc passed to datastore_open
+ * @param argv passed to datastore_open
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_datastore_open(struct Datastore* datastore, int argc, char** argv);
+
+/***
+ * Ask the bloom filter (if there is one) whether a key may be stored
+ * @param datastore the datastore, or NULL if there is none
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns false(0) if the key is certainly not stored, true(1) if it may be
+ */
+int libp2p_datastore_may_have(const struct Datastore* datastore, const unsigned char* key, size_t key_size);
+
+/***
+ * Store a value, and remember its key in the bloom filter
+ * @param datastore the datastore
+ * @param key the key
+ * @param key_size the size of the key
+ * @param data the value
+ * @param data_length the size of the value
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_datastore_put(struct Datastore* datastore, const unsigned char* key, size_t key_size, unsigned char* data, size_t data_length);
+
+/***
+ * Build a bloom filter of bloom_filter_size bytes from the keys in an open datastore.
+ * Nothing is built if bloom_filter_size is 0, or the datastore has no cursor.
+ * NOTE: datastore_put and datastore_get are replaced with versions that go through
+ * the filter, so callers that use them directly are covered too.
+ * @param datastore the datastore
+ * @returns true(1) on success (even if nothing was built), false(0) on error
+ */
+int libp2p_datastore_bloom_filter_build(struct Datastore* datastore);
+
+/***
+ * The share of keys that were not stored, but got past the bloom filter
+ * @param datastore the datastore
+ * @returns the observed false positive rate (0.0 if nothing has been asked yet)
+ */
+double libp2p_datastore_bloom_filter_false_positive_rate(const struct Datastore* datastore);
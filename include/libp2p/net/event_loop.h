@@ -0,0 +1,204 @@
+#pragma once
+
+#include <stddef.h>
+#include "libp2p/conn/session.h"
+#include "libp2p/net/stream.h"
+#include "libp2p/utils/vector.h"
+
+/***
+ * An epoll based event loop. One thread watches many connections, and hands
+ * each complete (varint framed, and possibly secio encrypted) message to the
+ * protocol handlers. Sockets are non-blocking, and writes that do not go out
+ * right away are queued until the socket can take them.
+ *
+ * Sessions in the loop also support the asynchronous side of struct Stream. A
+ * message that arrives while a read_async request is outstanding goes to that
+ * request instead of the protocol handlers. A read can also ask for only the
+ * messages it recognizes, leaving the rest to other reads or the handlers.
+ *
+ * NOTE: Once a session is added to the loop, the loop owns it. Writes through
+ * the session's stream are queued behind what the loop is already sending, and
+ * blocking reads fail, as they would stall every session in the loop. A handler
+ * that expects more from the remote asks for it with libp2p_net_event_loop_read.
+ */
+
+/***
+ * Decide whether a message is the one a read is waiting for
+ * @param message the message
+ * @param message_size the size of the message
+ * @param user_data what was handed to the read
+ * @returns true(1) if the read wants it, false(0) otherwise
+ */
+typedef int (*EventLoopReadMatch)(const unsigned char* message, size_t message_size, void* user_data);
+
+/***
+ * An outstanding asynchronous read or write
+ */
+struct Libp2pEventLoopRequest {
+	StreamReadCallback read_callback;
+	StreamWriteCallback write_callback;
+	// for reads, which messages are wanted (NULL for whatever comes next)
+	EventLoopReadMatch matches;
+	void* user_data;
+	// for writes, the value of bytes_queued that means this write has been sent
+	unsigned long long end;
+	struct Libp2pEventLoopRequest* next;
+};
+
+struct Libp2pEventLoopConnection {
+	int socket_fd;
+	int is_listener;
+	// NULL for a listener
+	struct SessionContext* session;
+	// bytes waiting for room in the send buffer
+	unsigned char* outgoing;
+	size_t outgoing_size;
+	size_t outgoing_sent;
+	// true(1) if epoll is watching for room to write
+	int watching_writes;
+	// totals, so that completed writes can be found after the buffer moves
+	unsigned long long bytes_queued;
+	unsigned long long bytes_sent;
+	// outstanding requests, oldest first
+	struct Libp2pEventLoopRequest* reads;
+	struct Libp2pEventLoopRequest* reads_tail;
+	struct Libp2pEventLoopRequest* writes;
+	struct Libp2pEventLoopRequest* writes_tail;
+	// true(1) once the connection is being torn down
+	int closing;
+	// for a session the loop does not own, who to hand it back to (NULL if the loop frees it)
+	void (*session_closed)(struct SessionContext* session, void* user_data);
+	void* session_closed_user_data;
+	struct Libp2pEventLoopConnection* prev;
+	struct Libp2pEventLoopConnection* next;
+};
+
+struct Libp2pEventLoop {
+	int epoll_fd;
+	int running;
+	// the handlers that complete messages are passed to. Not owned by the loop
+	struct Libp2pVector* protocol_handlers;
+	struct Libp2pEventLoopConnection* connections;
+	int num_connections;
+	// connections indexed by socket descriptor
+	struct Libp2pEventLoopConnection** by_fd;
+	int by_fd_capacity;
+};
+
+/***
+ * Build a new event loop
+ * @param protocol_handlers the handlers that incoming messages are dispatched to
+ * @returns the event loop, or NULL on error
+ */
+struct Libp2pEventLoop* libp2p_net_event_loop_new(struct Libp2pVector* protocol_handlers);
+
+/***
+ * Watch a listening socket, and add each connection it accepts to the loop
+ * @param loop the event loop
+ * @param socket_fd the listening socket. The loop closes it when it is freed
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_add_listener(struct Libp2pEventLoop* loop, int socket_fd);
+
+/***
+ * Add a connected session to the loop. Its socket is made non-blocking.
+ * @param loop the event loop
+ * @param session the session. The loop frees it when the connection closes
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_add_session(struct Libp2pEventLoop* loop, struct SessionContext* session);
+
+/***
+ * Add a connected session that belongs to someone else to the loop. Its socket is made non-blocking.
+ * @param loop the event loop
+ * @param session the session. The loop does not free it
+ * @param closed called once the session has left the loop, because it failed or the loop was freed
+ * @param user_data handed to closed
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_add_borrowed_session(struct Libp2pEventLoop* loop, struct SessionContext* session,
+		void (*closed)(struct SessionContext* session, void* user_data), void* user_data);
+
+/***
+ * Send a message on a session in the loop. It is framed (and encrypted if the session
+ * is secure) right away, and written as the socket has room for it.
+ * @param loop the event loop
+ * @param session the session
+ * @param data the message
+ * @param data_size the size of the message
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_queue_write(struct Libp2pEventLoop* loop, struct SessionContext* session, const unsigned char* data, size_t data_size);
+
+/***
+ * Ask for the next message on a session in the loop
+ * @param loop the event loop
+ * @param session the session
+ * @param callback called with the message, or with a false(0) status if the session closes first
+ * @param user_data handed to the callback
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_read(struct Libp2pEventLoop* loop, struct SessionContext* session, StreamReadCallback callback, void* user_data);
+
+/***
+ * Ask for the next message on a session in the loop that a match function accepts.
+ * Messages it does not accept go to other reads, or the protocol handlers.
+ * @param loop the event loop
+ * @param session the session
+ * @param matches decides which messages are wanted (NULL for whatever comes next)
+ * @param callback called with the message, or with a false(0) status if the session closes first
+ * @param user_data handed to matches and the callback
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_read_matching(struct Libp2pEventLoop* loop, struct SessionContext* session, EventLoopReadMatch matches,
+		StreamReadCallback callback, void* user_data);
+
+/***
+ * Give up on a read that has not been answered. Its callback is not called, and a
+ * message that would have gone to it goes to other reads, or the protocol handlers.
+ * @param loop the event loop
+ * @param session the session
+ * @param callback the callback the read was made with
+ * @param user_data the user_data the read was made with
+ * @returns true(1) if the read was outstanding, false(0) otherwise
+ */
+int libp2p_net_event_loop_read_cancel(struct Libp2pEventLoop* loop, struct SessionContext* session, StreamReadCallback callback, void* user_data);
+
+/***
+ * Send a message on a session in the loop, and find out when it has gone out
+ * @param loop the event loop
+ * @param session the session
+ * @param data the message
+ * @param data_size the size of the message
+ * @param callback called when the message has been sent (may be NULL). This can happen before this returns
+ * @param user_data handed to the callback
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_write(struct Libp2pEventLoop* loop, struct SessionContext* session, const unsigned char* data, size_t data_size, StreamWriteCallback callback, void* user_data);
+
+/***
+ * Wait for events once, and handle them
+ * @param loop the event loop
+ * @param timeout_ms the milliseconds to wait, or -1 to wait forever
+ * @returns the number of events handled, or -1 on error
+ */
+int libp2p_net_event_loop_run_once(struct Libp2pEventLoop* loop, int timeout_ms);
+
+/***
+ * Handle events until libp2p_net_event_loop_stop is called
+ * @param loop the event loop
+ * @returns true(1) if stopped, false(0) on error
+ */
+int libp2p_net_event_loop_run(struct Libp2pEventLoop* loop);
+
+/***
+ * Ask a running loop to return. Safe to call from a protocol handler.
+ * @param loop the event loop
+ */
+void libp2p_net_event_loop_stop(struct Libp2pEventLoop* loop);
+
+/***
+ * Close all connections and free the loop
+ * @param loop the event loop
+ */
+void libp2p_net_event_loop_free(struct Libp2pEventLoop* loop);
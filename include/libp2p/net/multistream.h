@@ -2,6 +2,7 @@
 
 #include "libp2p/net/stream.h"
 #include "libp2p/conn/session.h"
+#include <sys/uio.h>
 
 /***
  * An implementation of the libp2p multistream
@@ -23,6 +24,122 @@
  * @returns the number of bytes written
  */
 int libp2p_net_multistream_read(void* stream_context, unsigned char** data, size_t* data_length, int timeout_secs);
+/***
+ * Take the next complete message out of the stream's read buffer, if there is one.
+ * This does not touch the socket, so after one read many messages may be pulled out.
+ * @param stream the stream
+ * @param results where to put the message. NOTE: this memory is allocated
+ * @param results_size the size of the message
+ * @returns 1 if a message was retrieved, 0 if a complete message has not arrived yet, -1 on error
+ */
+int libp2p_net_multistream_next_message(struct Stream* stream, unsigned char** results, size_t* results_size);
+/***
+ * Start gathering a message (or secio frame) that is too big for the stream's read buffer
+ * @param stream the stream
+ * @param size the number of bytes to gather
+ * @returns true(1) on success, false(0) if it is too big or out of memory
+ */
+int libp2p_net_multistream_gather_start(struct Stream* stream, size_t size);
+/***
+ * Move what has arrived of the message being gathered out of the read buffer
+ * @param stream the stream
+ * @param results the whole message, once it is here. NOTE: the caller then owns this memory
+ * @param results_size the size of the message
+ * @returns true(1) if the whole message is here, false(0) if not yet
+ */
+int libp2p_net_multistream_gather(struct Stream* stream, unsigned char** results, size_t* results_size);
+/***
+ * Retrieve the next message if it has already arrived, without waiting on the socket.
+ * This is for callers that watch the socket themselves, and fill the stream's read
+ * buffer when it becomes readable (see socket_fill_buffer).
+ * NOTE: A message too large for the read buffer is gathered over as many calls as it takes
+ * @param stream_context the session context
+ * @param results where to put the message. NOTE: this memory is allocated
+ * @param results_size the size of the message
+ * @returns 1 if a message was retrieved, 0 if a complete message has not arrived yet, -1 on error
+ */
+int libp2p_net_multistream_try_read(void* stream_context, unsigned char** results, size_t* results_size);
+/***
+ * Ask for the next message without waiting for it. The stream must be in an event loop.
+ * @param stream_context the session context
+ * @param callback called with the message
+ * @param user_data handed to the callback
+ * @returns true(1) if the request was accepted, false(0) otherwise
+ */
+int libp2p_net_multistream_read_async(void* stream_context, StreamReadCallback callback, void* user_data);
+
+/***
+ * Write without waiting for the socket. The stream must be in an event loop.
+ * @param stream_context the session context
+ * @param data what to write
+ * @param data_size how much to write
+ * @param callback called when the bytes are sent (may be NULL)
+ * @param user_data handed to the callback
+ * @returns true(1) if the write was accepted, false(0) otherwise
+ */
+int libp2p_net_multistream_write_async(void* stream_context, const unsigned char* data, size_t data_size, StreamWriteCallback callback, void* user_data);
+
+/**
+ * A message held as the pieces it arrived in
+ */
+struct MessageChain {
+	struct iovec* iov;
+	int count;
+	int capacity;
+	size_t total_size;
+};
+
+/***
+ * Start reading a message a piece at a time. Follow this with calls to
+ * libp2p_net_multistream_read_piece until the whole message has been retrieved.
+ * @param stream_context the session context
+ * @param message_size the size of the whole message
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_multistream_read_start(void* stream_context, size_t* message_size, int timeout_secs);
+
+/***
+ * Retrieve the next piece of a message started with libp2p_net_multistream_read_start.
+ * Over secio, a piece is what came out of one frame, handed over as it was decrypted.
+ * @param stream_context the session context
+ * @param piece where to put the piece. NOTE: this memory is allocated
+ * @param piece_size the size of the piece. Zero when the message is complete.
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_multistream_read_piece(void* stream_context, unsigned char** piece, size_t* piece_size, int timeout_secs);
+
+/***
+ * Read a whole message as a chain of pieces, without joining them together
+ * @param stream_context the session context
+ * @param timeout_secs the seconds before a timeout
+ * @returns the chain, or NULL on error
+ */
+struct MessageChain* libp2p_net_multistream_read_chain(void* stream_context, int timeout_secs);
+
+struct MessageChain* libp2p_net_multistream_chain_new();
+
+/***
+ * Add a piece to the end of a chain
+ * @param chain the chain
+ * @param piece the piece. The chain takes ownership of it
+ * @param piece_size the size of the piece
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_multistream_chain_add(struct MessageChain* chain, unsigned char* piece, size_t piece_size);
+
+/***
+ * Join the pieces of a chain together. A chain of one piece is handed over without a copy.
+ * @param chain the chain. It is emptied by this call
+ * @param results where to put the bytes. NOTE: this memory is allocated
+ * @param results_size the number of bytes
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_multistream_chain_linearize(struct MessageChain* chain, unsigned char** results, size_t* results_size);
+
+void libp2p_net_multistream_chain_free(struct MessageChain* chain);
+
 /**
  * Write to an open multistream host
  * @param socket_fd the socket file descriptor
@@ -2,6 +2,28 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include "libp2p/utils/ring_buffer.h"
+
+/**
+ * Counters for the read paths. read_syscalls / reads is the number of
+ * system calls it takes to do a read.
+ */
+struct SocketStatistics {
+	unsigned long reads;
+	unsigned long read_syscalls;
+};
+
+/***
+ * Retrieve the counters of the read paths
+ * @param stats where to put the counters
+ */
+void socket_statistics_get(struct SocketStatistics* stats);
+
+/***
+ * Reset the counters of the read paths
+ */
+void socket_statistics_reset();
 
 int socket_open4();
 int socket_bind4(int s, uint32_t ip, uint16_t port);
@@ -25,7 +47,41 @@ int socket_listen(int s, uint32_t *localip, uint16_t *localport);
  * @returns number of bytes, 0, or negative number on error (i.e. EAGAIN or EWOULDBLOCK)
 */
 ssize_t socket_read(int s, char *buf, size_t len, int flags, int timeout_secs);
+/***
+ * Pull as much as is available (and fits) into a ring buffer with one system call
+ * @param s the socket
+ * @param buffer the ring buffer to fill
+ * @param flags network flags
+ * @param num_secs the number of seconds before a timeout
+ * @returns number of bytes, 0, or negative number on error
+ */
+ssize_t socket_fill_buffer(int s, struct RingBuffer* buffer, int flags, int num_secs);
+/***
+ * Read exactly len bytes, serving what we can from the ring buffer first. The buffer
+ * is refilled with as many bytes as are available, so that small reads (i.e. length
+ * prefixes) do not each cost a system call. Reads larger than the ring buffer go
+ * straight into buf.
+ * @param s the socket
+ * @param buffer the ring buffer attached to the stream (if NULL, reads go straight to the socket)
+ * @param buf where to put the bytes
+ * @param len the number of bytes wanted
+ * @param flags network flags
+ * @param num_secs the number of seconds before a timeout
+ * @returns the number of bytes placed in buf. Less than len on timeout, error, or a closed socket
+ */
+ssize_t socket_read_buffered(int s, struct RingBuffer* buffer, char* buf, size_t len, int flags, int num_secs);
 ssize_t socket_write(int s, const char *buf, size_t len, int flags);
+/***
+ * Write several buffers with as few system calls as possible. Framed protocols
+ * should use this to put the header and the body in the same segment.
+ * NOTE: the iov array is modified as bytes are written
+ * @param s the socket
+ * @param iov the buffers to write
+ * @param iovcnt the number of buffers
+ * @param flags network flags (i.e. MSG_MORE if more data will follow right away)
+ * @returns the number of bytes written, or -1 on error
+ */
+ssize_t socket_writev(int s, struct iovec* iov, int iovcnt, int flags);
 /**
  * Used to send the size of the next transmission for "framed" transmissions. NOTE: This will send in big endian format
  * @param s the socket descriptor
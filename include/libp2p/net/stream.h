@@ -1,5 +1,28 @@
 #pragma once
 
+#include <stddef.h>
+#include "libp2p/utils/ring_buffer.h"
+
+struct Libp2pEventLoop;
+
+/***
+ * Called when an asynchronous read completes
+ * @param stream_context the stream context
+ * @param buffer the message. NOTE: the callback owns this memory
+ * @param buffer_size the size of the message
+ * @param status true(1) on success, false(0) if the stream failed or was closed first
+ * @param user_data what was handed to read_async
+ */
+typedef void (*StreamReadCallback)(void* stream_context, unsigned char* buffer, size_t buffer_size, int status, void* user_data);
+
+/***
+ * Called when an asynchronous write has been handed to the operating system
+ * @param stream_context the stream context
+ * @param status true(1) on success, false(0) if the stream failed or was closed first
+ * @param user_data what was handed to write_async
+ */
+typedef void (*StreamWriteCallback)(void* stream_context, int status, void* user_data);
+
 /**
  * An interface in front of various streams
  */
@@ -9,6 +32,32 @@ struct Stream {
 	 */
 	void* socket_descriptor;
 	struct MultiAddress *address;
+	/**
+	 * Bytes received from the socket but not yet consumed (may be NULL)
+	 */
+	struct RingBuffer* read_buffer;
+	/**
+	 * Decrypted bytes that have not yet been handed out as a message. This grows
+	 * as needed, and its memory may be handed to the reader.
+	 */
+	unsigned char* pending;
+	size_t pending_size;
+	size_t pending_capacity;
+	/**
+	 * Bytes of the current message not yet handed out by a piece at a time read
+	 */
+	size_t message_remaining;
+	/**
+	 * A message (or secio frame) too big for read_buffer, gathered as it arrives
+	 * so that an event loop never waits for it (NULL if there is none)
+	 */
+	unsigned char* large;
+	size_t large_size;
+	size_t large_filled;
+	/**
+	 * The event loop that drives the asynchronous functions (NULL if not in one)
+	 */
+	struct Libp2pEventLoop* event_loop;
 
 	/**
 	 * Reads from the stream
@@ -45,4 +94,25 @@ struct Stream {
 	 * @returns true(1) if something is waiting, false(0) otherwise
 	 */
 	int (*peek)(void* stream_context);
+
+	/***
+	 * Ask for the next message without waiting for it. Requests are answered in order,
+	 * so many can be outstanding at once. The stream must be in an event loop.
+	 * @param stream_context the stream context
+	 * @param callback called with the message
+	 * @param user_data handed to the callback
+	 * @returns true(1) if the request was accepted, false(0) otherwise
+	 */
+	int (*read_async)(void* stream_context, StreamReadCallback callback, void* user_data);
+
+	/***
+	 * Write without waiting for the socket. The stream must be in an event loop.
+	 * @param stream_context the stream context
+	 * @param buffer what to write. It is copied before this returns
+	 * @param buffer_size how much to write
+	 * @param callback called when the bytes are sent (may be NULL)
+	 * @param user_data handed to the callback
+	 * @returns true(1) if the write was accepted, false(0) otherwise
+	 */
+	int (*write_async)(void* stream_context, const unsigned char* buffer, size_t buffer_size, StreamWriteCallback callback, void* user_data);
 };
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libp2p/conn/session.h"
+#include "libp2p/net/stream.h"
+
+/***
+ * A yamux stream multiplexer. Many logical streams (channels) share one connection,
+ * which is usually a secio session, so a second protocol to the same peer does not
+ * cost another TCP connection and handshake.
+ *
+ * Each channel is handed out as its own SessionContext. Its default_stream reads
+ * and writes varint framed messages like multistream does, so protocol code (i.e.
+ * libp2p_routing_dht_upgrade_stream) works on a channel unchanged. Each channel has
+ * its own receive window, so a reader that falls behind only slows its own sender.
+ *
+ * Frames go on the wire as the yamux spec has them. Over secio they are carried in
+ * secio frames, otherwise they are written to the socket as they are (no varint prefix).
+ *
+ * NOTE: This is not thread safe. Reading one channel may buffer data for others.
+ */
+
+#define YAMUX_VERSION 0
+#define YAMUX_HEADER_SIZE 12
+// the receive window every channel starts with
+#define YAMUX_INITIAL_WINDOW (256 * 1024)
+// the most data put in one frame
+#define YAMUX_MAX_FRAME_DATA (16 * 1024)
+// the largest message a channel will read. The window is opened this far for one message
+#define YAMUX_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+enum YamuxFrameType {
+	YAMUX_TYPE_DATA = 0,
+	YAMUX_TYPE_WINDOW_UPDATE = 1,
+	YAMUX_TYPE_PING = 2,
+	YAMUX_TYPE_GO_AWAY = 3
+};
+
+#define YAMUX_FLAG_SYN 1
+#define YAMUX_FLAG_ACK 2
+#define YAMUX_FLAG_FIN 4
+#define YAMUX_FLAG_RST 8
+
+struct YamuxSession;
+
+struct YamuxChannel {
+	struct YamuxSession* yamux;
+	uint32_t id;
+	// what protocol code is handed. Its default_stream is this channel
+	struct SessionContext* context;
+	int accepted;
+	int local_closed;
+	int remote_closed;
+	int reset;
+	// bytes we may still send
+	uint32_t send_window;
+	// bytes the other side may still send
+	uint32_t recv_window;
+	// received, but not yet read
+	unsigned char* buffer;
+	size_t buffer_size;
+	size_t buffer_capacity;
+	struct YamuxChannel* next;
+};
+
+struct YamuxSession {
+	// the connection that carries the channels. Not owned by the session
+	struct SessionContext* parent;
+	uint32_t next_id;
+	struct YamuxChannel* channels;
+	int num_channels;
+	// bytes read from the connection that do not make a whole frame yet
+	unsigned char* input;
+	size_t input_size;
+	size_t input_capacity;
+	// the other side will not accept new channels
+	int go_away;
+	// the connection is not usable
+	int failed;
+};
+
+/***
+ * Negotiate yamux on a connection (client side)
+ * @param context the connection
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_yamux_upgrade_stream(struct SessionContext* context);
+
+/***
+ * Answer a request to use yamux (server side)
+ * @param context the connection
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_yamux_handshake(struct SessionContext* context);
+
+/***
+ * Start multiplexing a connection
+ * @param parent the connection. It must stay open until the session is freed
+ * @param initiator true(1) if we opened the connection. This keeps channel ids from colliding
+ * @returns the session, or NULL on error
+ */
+struct YamuxSession* libp2p_yamux_session_new(struct SessionContext* parent, int initiator);
+
+/***
+ * Close all channels and free the session. The connection itself is left open.
+ * NOTE: channel contexts handed out by the session are freed too
+ * @param yamux the session
+ */
+void libp2p_yamux_session_free(struct YamuxSession* yamux);
+
+/***
+ * Open a new channel
+ * @param yamux the session
+ * @returns the channel's context, or NULL on error. Free it with libp2p_session_context_free
+ */
+struct SessionContext* libp2p_yamux_open(struct YamuxSession* yamux);
+
+/***
+ * Wait for the other side to open a channel
+ * @param yamux the session
+ * @param timeout_secs the seconds to wait
+ * @returns the channel's context, or NULL on timeout or error. Free it with libp2p_session_context_free
+ */
+struct SessionContext* libp2p_yamux_accept(struct YamuxSession* yamux, int timeout_secs);
+
+/***
+ * Read once from the connection, and deliver the frames that arrived
+ * @param yamux the session
+ * @param timeout_secs the seconds to wait
+ * @returns true(1) on success, false(0) on timeout or error
+ */
+int libp2p_yamux_process(struct YamuxSession* yamux, int timeout_secs);
+
+/***
+ * Deliver bytes that arrived on the connection. For callers that read the
+ * connection themselves (i.e. an event loop).
+ * @param yamux the session
+ * @param bytes the bytes
+ * @param bytes_size the number of bytes
+ * @returns true(1) on success, false(0) if the other side broke the protocol
+ */
+int libp2p_yamux_handle_bytes(struct YamuxSession* yamux, const unsigned char* bytes, size_t bytes_size);
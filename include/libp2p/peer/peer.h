@@ -6,6 +6,7 @@
 #include "libp2p/conn/session.h"
 
 struct Peerstore;
+struct Dialer;
 
 enum ConnectionType {
 	// sender does not have a connection to the peer, and no extra information (default)
@@ -24,6 +25,7 @@ struct Libp2pPeer {
 	struct Libp2pLinkedList* addr_head; // protobuf field 2 of multiaddr bytes (repeatable) (stored here as a struct MultiAddr)
 	enum ConnectionType connection_type; // protobuf field 3 (a varint)
 	struct SessionContext *sessionContext; // not protobuf'd, the current connection to the peer
+	struct Dialer* dialer; // not protobuf'd, the dialer that owns sessionContext (NULL if the peer owns it)
 	int is_local; // not protobuf'd, true if this is the local peer
 };
 
@@ -48,14 +50,18 @@ void libp2p_peer_free(struct Libp2pPeer* in);
 
 /**
  * Attempt to connect to the peer, setting connection_type correctly
- * NOTE: If successful, this will set peer->connection to the stream
+ * NOTE: If successful, this will set peer->sessionContext. With a dialer, the
+ * session belongs to the dialer's connections. The peer borrows it until it is
+ * freed, or connects again.
  *
- * @param privateKey the local private key to use
+ * @param privateKey the local private key to use (with a dialer, NULL does not secure the connection)
  * @param peer the peer to connect to
  * @param peerstore if connection is successfull, will add peer to peerstore
+ * @param timeout seconds to keep trying addresses
+ * @param dialer reuses an open connection to the peer if it has one (NULL to always dial)
  * @returns true(1) on success, false(0) if we could not connect
  */
-int libp2p_peer_connect(struct RsaPrivateKey* privateKey, struct Libp2pPeer* peer, struct Peerstore* peerstore, int timeout);
+int libp2p_peer_connect(struct RsaPrivateKey* privateKey, struct Libp2pPeer* peer, struct Peerstore* peerstore, int timeout, struct Dialer* dialer);
 
 /***
  * Clean up a bad connection
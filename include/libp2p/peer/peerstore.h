@@ -14,18 +14,43 @@
  */
 struct PeerEntry {
 	struct Libp2pPeer* peer;
+	// the sha256 of the peer id, which is where the peer sits in the kademlia keyspace
+	unsigned char kademlia_id[32];
 	// other metadata for the peer goes here
 	// TODO: add some type of timer to expire the record
 };
 
+// the number of peers a leaf of the kademlia index holds before it is split
+#define PEERSTORE_KADEMLIA_LEAF_SIZE 16
+
+/**
+ * A node in a binary trie of peers by kademlia_id. Peers that share a longer
+ * prefix are closer by XOR distance, so the peers closest to a key are found
+ * by walking towards the key, without looking at every peer.
+ */
+struct PeerstoreKademliaNode {
+	// both NULL for a leaf
+	struct PeerstoreKademliaNode* children[2];
+	// leaves only
+	struct PeerEntry** entries;
+	int num_entries;
+	int entries_capacity;
+};
+
 /**
  * Contains a collection of peers and their metadata
- * NOTE: this is currently a linked list. Perhaps a better algo would
- * improve performance, but will wait.
+ * NOTE: entries are kept in a linked list in the order they were added (the
+ * local peer is first), and in a hash table by peer id for lookups.
  */
 struct Peerstore {
 	struct Libp2pLinkedList* head_entry;
 	struct Libp2pLinkedList* last_entry;
+	size_t num_entries;
+	// open addressing by peer id. Empty slots are NULL
+	struct PeerEntry** index;
+	size_t index_capacity;
+	// by XOR distance
+	struct PeerstoreKademliaNode* kademlia_index;
 };
 
 struct PeerEntry* libp2p_peer_entry_new();
@@ -79,6 +104,17 @@ struct PeerEntry* libp2p_peerstore_get_peer_entry(struct Peerstore* peerstore, c
  */
 struct Libp2pPeer* libp2p_peerstore_get_peer(struct Peerstore* peerstore, const unsigned char* peer_id, size_t peer_id_size);
 
+/***
+ * Find the peers closest to a key by XOR distance (of the sha256 of each)
+ * @param peerstore the peerstore
+ * @param key the key (a peer id or a hash)
+ * @param key_size the size of the key
+ * @param results where to put the peers, closest first. They belong to the peerstore
+ * @param max_results the most peers to find
+ * @returns the number of peers put in results
+ */
+int libp2p_peerstore_get_closest_peers(struct Peerstore* peerstore, const unsigned char* key, size_t key_size, struct Libp2pPeer** results, int max_results);
+
 /**
  * Retrieves the local peer, which is always the first in the collection
  * @param peerstore the peerstore
@@ -1,26 +1,51 @@
 #pragma once
 
+#include <time.h>
 #include "libp2p/db/datastore.h"
 #include "libp2p/peer/peer.h"
+#include "libp2p/utils/vector.h"
+
+// how long an announcement is kept
+#define PROVIDERSTORE_DEFAULT_TTL_SECS (24 * 60 * 60)
+// the most providers kept for one hash. When full, the oldest announcement is dropped
+#define PROVIDERSTORE_DEFAULT_MAX_PER_KEY 64
 
 /**
- * Contains a hash and the peer id of
- * who can provide it
+ * The peer id of someone who can provide a hash,
+ * and when they said so
  */
 struct ProviderEntry {
-	unsigned char* hash;
-	int hash_size;
 	unsigned char* peer_id;
 	int peer_id_size;
+	time_t timestamp;
+};
+
+/**
+ * A hash, and the peers who can provide it
+ */
+struct ProviderKey {
+	unsigned char* hash;
+	int hash_size;
+	// ProviderEntry structs, oldest announcement first
+	struct Libp2pVector* providers;
+	// the next key in the same bucket
+	struct ProviderKey* next;
 };
 
 /***
  * A structure to store providers. The implementation
- * is a vector of ProviderEntry structures, which contain
- * the hash and peer id.
+ * is a hash table of ProviderKey structures, each holding
+ * the peers that announced that hash.
  */
 struct ProviderStore {
-	struct Libp2pVector* provider_entries;
+	struct ProviderKey** buckets;
+	size_t num_buckets;
+	size_t num_keys;
+	size_t num_entries;
+	int ttl_secs;
+	int max_per_key;
+	// the bucket where the next expire pass starts
+	size_t expire_position;
 	// this is requred so we can look locally for requests
 	const struct Datastore* datastore;
 	const struct Libp2pPeer* local_peer;
@@ -38,6 +63,53 @@ struct ProviderStore* libp2p_providerstore_new(const struct Datastore* datastore
  */
 void libp2p_providerstore_free(struct ProviderStore* in);
 
+/***
+ * Free a ProviderEntry
+ * @param in the entry
+ */
+void libp2p_providerstore_entry_free(struct ProviderEntry* in);
+
+/***
+ * Remember that a peer can provide a hash. If the peer already announced it, only the time is updated.
+ * @param store the ProviderStore
+ * @param hash the hash
+ * @param hash_size the length of the hash
+ * @param peer_id the peer id
+ * @param peer_id_size the length of the peer id
+ * @returns true(1) on success, false(0) otherwise
+ */
 int libp2p_providerstore_add(struct ProviderStore* store, const unsigned char* hash, int hash_size, const unsigned char* peer_id, int peer_id_size);
 
+/**
+ * See if someone has announced a key. If so, pass the peer_id
+ * NOTE: This will check to see if I can provide it from my datastore
+ *
+ * @param store the list of providers
+ * @param hash what we're looking for
+ * @param hash_size the length of the hash
+ * @param peer_id the peer_id of who can provide it
+ * @param peer_id_size the allocated size of peer_id
+ * @returns true(1) if we found something, false(0) if not.
+ */
 int libp2p_providerstore_get(struct ProviderStore* store, const unsigned char* hash, int hash_size, unsigned char** peer_id, int *peer_id_size);
+
+/***
+ * Retrieve the peers that announced a hash, most recent first
+ * NOTE: this does not look in the datastore
+ * @param store the ProviderStore
+ * @param hash what we're looking for
+ * @param hash_size the length of the hash
+ * @param max_results the most peers to return
+ * @param results a new vector of ProviderEntry structs. Free each with libp2p_providerstore_entry_free
+ * @returns the number of peers found
+ */
+int libp2p_providerstore_get_providers(struct ProviderStore* store, const unsigned char* hash, int hash_size, int max_results, struct Libp2pVector** results);
+
+/***
+ * Drop announcements older than ttl_secs, a few buckets at a time.
+ * Each call continues where the last one stopped.
+ * @param store the ProviderStore
+ * @param max_buckets the most buckets to look at
+ * @returns the number of announcements dropped
+ */
+int libp2p_providerstore_expire(struct ProviderStore* store, size_t max_buckets);
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stddef.h>
+#include <time.h>
+
+#include "libp2p/record/record.h"
+#include "libp2p/crypto/key.h"
+#include "libp2p/db/datastore.h"
+
+/***
+ * The values stored by PUT_VALUE and served by GET_VALUE.
+ *
+ * A record's signature is checked once, when it is put. It is then kept in the
+ * datastore in a compact encoding (see libp2p_record_store_encode), and the most
+ * recently used records are kept decoded in memory, so that a popular key does
+ * not cost a datastore read and a decode each time it is asked for.
+ *
+ * NOTE: This is not thread safe.
+ */
+
+// how long a record is served after it was received
+#define RECORD_STORE_DEFAULT_TTL_SECS (36 * 60 * 60)
+// the number of decoded records kept in memory
+#define RECORD_STORE_DEFAULT_MAX_CACHED 1024
+// the largest encoded record that is stored
+#define RECORD_STORE_MAX_ENCODED_SIZE (64 * 1024)
+// records are kept in the datastore under this prefix, so they do not collide with blocks
+#define RECORD_STORE_KEY_PREFIX "/record/"
+// the first byte of an encoded record
+#define RECORD_STORE_ENCODING_VERSION 1
+
+struct RecordStoreEntry {
+	struct Libp2pRecord* record;
+	// when the record was received
+	time_t received;
+	// the next entry in the same bucket
+	struct RecordStoreEntry* bucket_next;
+	// most recently used first
+	struct RecordStoreEntry* lru_prev;
+	struct RecordStoreEntry* lru_next;
+};
+
+struct RecordStore {
+	// where records are kept. Not owned by the store
+	struct Datastore* datastore;
+	// the cached records, by key
+	struct RecordStoreEntry** buckets;
+	size_t num_buckets;
+	struct RecordStoreEntry* lru_head;
+	struct RecordStoreEntry* lru_tail;
+	size_t num_cached;
+	size_t max_cached;
+	time_t ttl_secs;
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+};
+
+/***
+ * Build a new record store
+ * @param datastore where the records are kept
+ * @param max_cached the number of records to keep decoded in memory (0 for none)
+ * @returns the record store, or NULL on error
+ */
+struct RecordStore* libp2p_record_store_new(struct Datastore* datastore, size_t max_cached);
+
+/***
+ * Free the record store. The datastore is left alone.
+ * @param store the record store
+ */
+void libp2p_record_store_free(struct RecordStore* store);
+
+/***
+ * Check that a record was signed by the holder of a public key
+ * @param record the record
+ * @param public_key the author's public key
+ * @returns true(1) if the author is the hash of the key, and the signature is good, false(0) otherwise
+ */
+int libp2p_record_store_validate(const struct Libp2pRecord* record, const struct PublicKey* public_key);
+
+/***
+ * Validate a record, and store it. A record that has not expired is only
+ * replaced by one from the same author.
+ * @param store the record store
+ * @param record the record. It is copied
+ * @param public_key the author's public key
+ * @returns true(1) on success, false(0) if the record is not valid or could not be stored
+ */
+int libp2p_record_store_put(struct RecordStore* store, const struct Libp2pRecord* record, const struct PublicKey* public_key);
+
+/***
+ * Retrieve a record that has not expired
+ * @param store the record store
+ * @param key the key
+ * @param key_size the size of the key
+ * @param record a new copy of the record. Free it with libp2p_record_free
+ * @returns true(1) if found, false(0) otherwise
+ */
+int libp2p_record_store_get(struct RecordStore* store, const unsigned char* key, size_t key_size, struct Libp2pRecord** record);
+
+/***
+ * The number of bytes libp2p_record_store_encode needs
+ * @param record the record
+ * @returns the maximum size of the encoded record
+ */
+size_t libp2p_record_store_encode_size(const struct Libp2pRecord* record);
+
+/***
+ * Encode a record for the datastore. This is the version byte, the time received
+ * (8 bytes, big endian), then the key, value, author and signature, each as a varint
+ * length followed by its bytes.
+ * @param record the record
+ * @param received when the record was received
+ * @param buffer where to put the results
+ * @param max_buffer_size the size of buffer
+ * @param bytes_written the number of bytes used
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_record_store_encode(const struct Libp2pRecord* record, time_t received, unsigned char* buffer, size_t max_buffer_size, size_t* bytes_written);
+
+/***
+ * Decode a record encoded by libp2p_record_store_encode
+ * @param buffer the encoded record
+ * @param buffer_size the size of buffer
+ * @param record the new record
+ * @param received when the record was received
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_record_store_decode(const unsigned char* buffer, size_t buffer_size, struct Libp2pRecord** record, time_t* received);
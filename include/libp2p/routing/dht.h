@@ -77,6 +77,18 @@ int dht_nodes(int af,
 void dht_dump_tables(FILE *f);
 int dht_get_nodes(struct sockaddr_in *sin, int *num,
                   struct sockaddr_in6 *sin6, int *num6);
+/**
+ * Queue packets instead of sending them one by one
+ * @param enable 1 to queue until dht_flush, 0 to send right away (the
+ *        default).  Anything queued is sent when queueing is turned off.
+ * @returns 1
+ **/
+int dht_queue_sends(int enable);
+/**
+ * Send everything that has been queued, in as few system calls as possible
+ * @returns the number of packets sent
+ **/
+int dht_flush(void);
 int dht_uninit(void);
 
 /* This must be provided by the user. */
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "libp2p/conn/session.h"
+#include "libp2p/net/event_loop.h"
+#include "libp2p/peer/peer.h"
+#include "libp2p/peer/peerstore.h"
+#include "libp2p/record/message.h"
+#include "libp2p/record/record.h"
+#include "libp2p/utils/vector.h"
+
+/***
+ * Iterative Kademlia lookups over libp2p streams.
+ *
+ * A lookup starts from the closest peers in the peerstore, and asks up to alpha
+ * of them at a time. Each answer can bring peers that are closer, and those are
+ * asked next. The lookup is done when the k closest peers that answered have all
+ * been asked, or as soon as it finds what it is after (a provider, a record, or
+ * the peer itself). A peer that does not answer in time is dropped from the lookup.
+ *
+ * Many lookups can run at once. All network work is done by the thread that runs
+ * the event loop, in libp2p_routing_dht_lookup_engine_process. Lookups can be
+ * started from any thread, and waited on with a condition variable, or finished
+ * with a callback.
+ */
+
+// the number of queries a lookup has outstanding at once
+#define DHT_LOOKUP_ALPHA 3
+// the number of closest peers that have to answer before a lookup is done
+#define DHT_LOOKUP_K 20
+// how long a peer has to answer
+#define DHT_LOOKUP_QUERY_TIMEOUT_MS 5000
+// the most peers a lookup keeps track of
+#define DHT_LOOKUP_MAX_CANDIDATES 256
+
+enum DhtLookupPeerState {
+	DHT_LOOKUP_PEER_NEW,
+	DHT_LOOKUP_PEER_QUERYING,
+	DHT_LOOKUP_PEER_RESPONDED,
+	DHT_LOOKUP_PEER_FAILED
+};
+
+struct DhtLookupQuery;
+
+struct DhtLookupPeer {
+	struct Libp2pPeer* peer;
+	// XOR of the sha256 of the peer id and the target
+	unsigned char distance[32];
+	enum DhtLookupPeerState state;
+	// the query outstanding to this peer, if any
+	struct DhtLookupQuery* query;
+};
+
+struct DhtLookupEngine;
+
+struct DhtLookup {
+	struct DhtLookupEngine* engine;
+	enum MessageType message_type;
+	char* key;
+	size_t key_size;
+	// the sha256 of the key
+	unsigned char target[32];
+	// closest first
+	struct DhtLookupPeer** candidates;
+	int num_candidates;
+	int outstanding;
+	// what was found. Providers are Libp2pPeer structs
+	struct Libp2pVector* providers;
+	struct Libp2pRecord* record;
+	struct Libp2pPeer* found_peer;
+	// set once the lookup is over
+	int done;
+	// true(1) if it found what it was after
+	int succeeded;
+	// statistics
+	int num_queries;
+	int num_responses;
+	int num_timeouts;
+	int max_outstanding;
+	// called from the event loop thread when the lookup is over (may be NULL)
+	void (*callback)(struct DhtLookup* lookup, void* user_data);
+	void* user_data;
+	struct DhtLookup* next;
+};
+
+struct DhtLookupEngine {
+	// protects pending, and the done flag of each lookup
+	pthread_mutex_t lock;
+	pthread_cond_t done_condition;
+	// started, but not yet picked up by the event loop thread
+	struct DhtLookup* pending;
+	// only touched by the event loop thread
+	struct DhtLookup* running;
+	int num_running;
+	int alpha;
+	int k;
+	int query_timeout_ms;
+	// where lookups start, and where the peers they find are added. Not owned by the engine
+	struct Peerstore* peerstore;
+	// the loop the sessions are in. Not owned by the engine
+	struct Libp2pEventLoop* loop;
+	/***
+	 * Find a session to a peer that is in the event loop. It is upgraded to the DHT protocol when it is first asked
+	 * @param peer the peer
+	 * @param context session_for_peer_context
+	 * @returns the session, or NULL if the peer cannot be reached
+	 */
+	struct SessionContext* (*session_for_peer)(struct Libp2pPeer* peer, void* context);
+	void* session_for_peer_context;
+};
+
+/***
+ * Build a new lookup engine
+ * @param peerstore where lookups start
+ * @param loop the event loop the sessions are in
+ * @param session_for_peer finds a session to a peer
+ * @param session_for_peer_context handed to session_for_peer
+ * @returns the engine, or NULL on error
+ */
+struct DhtLookupEngine* libp2p_routing_dht_lookup_engine_new(struct Peerstore* peerstore, struct Libp2pEventLoop* loop,
+		struct SessionContext* (*session_for_peer)(struct Libp2pPeer* peer, void* context), void* session_for_peer_context);
+
+/***
+ * Finish all lookups (unsuccessfully), and free the engine. The lookups themselves
+ * still belong to whoever started them.
+ * NOTE: call this from the event loop thread
+ * @param engine the engine
+ */
+void libp2p_routing_dht_lookup_engine_free(struct DhtLookupEngine* engine);
+
+/***
+ * Start the lookups that are waiting, handle queries that have timed out, and send
+ * queries where there is room. Call this from the event loop thread, after each
+ * libp2p_net_event_loop_run_once.
+ * @param engine the engine
+ * @returns the number of lookups running
+ */
+int libp2p_routing_dht_lookup_engine_process(struct DhtLookupEngine* engine);
+
+/***
+ * Start a lookup. Safe to call from any thread.
+ * @param engine the engine
+ * @param message_type MESSAGE_TYPE_FIND_NODE, MESSAGE_TYPE_GET_PROVIDERS or MESSAGE_TYPE_GET_VALUE
+ * @param key the peer id or key to look for
+ * @param key_size the size of the key
+ * @param callback called when the lookup is over (may be NULL)
+ * @param user_data handed to the callback
+ * @returns the lookup (free it with libp2p_routing_dht_lookup_free), or NULL on error
+ */
+struct DhtLookup* libp2p_routing_dht_lookup_start(struct DhtLookupEngine* engine, enum MessageType message_type,
+		const char* key, size_t key_size, void (*callback)(struct DhtLookup* lookup, void* user_data), void* user_data);
+
+/***
+ * Wait for a lookup to finish, while another thread runs the event loop
+ * @param lookup the lookup
+ * @param timeout_ms the most milliseconds to wait
+ * @returns true(1) if the lookup is over, false(0) on timeout
+ */
+int libp2p_routing_dht_lookup_wait(struct DhtLookup* lookup, int timeout_ms);
+
+/***
+ * Run the event loop until a lookup is over. For callers that have no
+ * other thread running the loop.
+ * @param lookup the lookup
+ * @param timeout_ms the most milliseconds to run. The lookup is ended if it is not over by then
+ * @returns true(1) if the lookup succeeded, false(0) otherwise
+ */
+int libp2p_routing_dht_lookup_run(struct DhtLookup* lookup, int timeout_ms);
+
+/***
+ * The closest peers that answered a lookup
+ * @param lookup the lookup
+ * @param results where to put the peers, closest first. They belong to the lookup
+ * @param max_results the most peers to return
+ * @returns the number of peers put in results
+ */
+int libp2p_routing_dht_lookup_closest_peers(struct DhtLookup* lookup, struct Libp2pPeer** results, int max_results);
+
+/***
+ * Free a lookup. If it is still running, it is ended first (without its callback).
+ * NOTE: a lookup that is still running must be freed from the event loop thread
+ * @param lookup the lookup
+ */
+void libp2p_routing_dht_lookup_free(struct DhtLookup* lookup);
+
+struct Dialer;
+
+/***
+ * What libp2p_routing_dht_lookup_dial needs to reach peers
+ */
+struct DhtLookupDialer {
+	// keeps the sessions open between lookups. Free the loop before the dialer
+	struct Dialer* dialer;
+	// the local key, to secure sessions (NULL to not secure them)
+	struct RsaPrivateKey* private_key;
+	// where the peers and their sessions are kept
+	struct Peerstore* peerstore;
+	// the loop the sessions are added to
+	struct Libp2pEventLoop* loop;
+	// how long to keep trying a peer's addresses
+	int timeout_secs;
+};
+
+/***
+ * A session_for_peer that dials peers through a dialer, so a session is
+ * opened once and reused by every lookup that asks the peer.
+ * NOTE: dialing a peer that is not connected yet blocks (and so stalls the
+ * event loop) for up to timeout_secs
+ * @param peer the peer
+ * @param context a struct DhtLookupDialer
+ * @returns the session, in the loop, or NULL if the peer cannot be reached
+ */
+struct SessionContext* libp2p_routing_dht_lookup_dial(struct Libp2pPeer* peer, void* context);
@@ -4,13 +4,22 @@
 #include "libp2p/peer/peerstore.h"
 #include "libp2p/peer/providerstore.h"
 #include "libp2p/net/protocol.h"
+#include "libp2p/record/message.h"
+#include "libp2p/record/record_store.h"
 
 
 /***
  * This is where kademlia and dht talk to the outside world
  */
 
-struct Libp2pProtocolHandler* libp2p_routing_dht_build_protocol_handler(struct Peerstore* peer_store, struct ProviderStore* provider_store);
+/***
+ * Build the handler for incoming DHT requests
+ * @param peer_store the peers we know of
+ * @param provider_store who provides what
+ * @param record_store the records for PUT_VALUE and GET_VALUE (may be NULL)
+ * @returns the handler
+ */
+struct Libp2pProtocolHandler* libp2p_routing_dht_build_protocol_handler(struct Peerstore* peer_store, struct ProviderStore* provider_store, struct RecordStore* record_store);
 
 /**
  * Take existing stream and upgrade to the Kademlia / DHT protocol/codec
@@ -19,6 +28,37 @@ struct Libp2pProtocolHandler* libp2p_routing_dht_build_protocol_handler(struct P
  */
 int libp2p_routing_dht_upgrade_stream(struct SessionContext* context);
 
+/***
+ * An asynchronous request that has not been answered
+ */
+struct DhtAsyncRequest;
+
+/***
+ * Send a message to a peer, and have its response handed to a callback. This returns at
+ * once, so many requests (to one peer or many) can be outstanding. A response goes to the
+ * oldest outstanding request with the same message type and key. The session must be
+ * in an event loop. It is upgraded to the DHT protocol with the first request.
+ * @param session the session
+ * @param message the message to send
+ * @param callback called with the response, or with NULL if there was an error. The callback owns the response
+ * @param user_data handed to the callback
+ * @param handle where to put what libp2p_routing_dht_cancel_message_async needs (may be NULL)
+ * @returns true(1) if the request was sent, false(0) otherwise
+ */
+int libp2p_routing_dht_send_message_async(struct SessionContext* session, struct Libp2pMessage* message,
+		void (*callback)(struct SessionContext* session, struct Libp2pMessage* response, void* user_data), void* user_data,
+		struct DhtAsyncRequest** handle);
+
+/***
+ * Give up on an asynchronous request, i.e. when the peer takes too long. Its callback is
+ * not called. A response that comes after this is left to the protocol handlers.
+ * NOTE: only while the request is outstanding, as the handle is freed when its callback is called
+ * @param session the session the request was sent on
+ * @param handle the handle from libp2p_routing_dht_send_message_async
+ * @returns true(1) if the request was given up on, false(0) otherwise
+ */
+int libp2p_routing_dht_cancel_message_async(struct SessionContext* session, struct DhtAsyncRequest* handle);
+
 /**
  * Handle a client requesting an upgrade to the DHT protocol
  * @param context the context
@@ -32,6 +72,8 @@ int libp2p_routing_dht_handshake(struct SessionContext* context);
  * a protobuf'd kademlia message.
  * @param session the context
  * @param peerstore a list of peers
+ * @param providerstore who provides what
+ * @param record_store the records for PUT_VALUE and GET_VALUE (may be NULL)
  * @returns true(1) on success, otherwise false(0)
  */
-int libp2p_routing_dht_handle_message(struct SessionContext* session, struct Peerstore* peerstore, struct ProviderStore* providerstore);
+int libp2p_routing_dht_handle_message(struct SessionContext* session, struct Peerstore* peerstore, struct ProviderStore* providerstore, struct RecordStore* record_store);
@@ -20,4 +20,10 @@ int announce_kademlia (char* peer_id, uint16_t port);
  */
 struct MultiAddress** search_kademlia(char* peer_id, int timeout);
 
+/***
+ * Ping a node, so it can be added to the routing table. Safe to call from any thread.
+ * @param ip the node's address (IPv4 or IPv6)
+ * @param port the node's port
+ * @returns true(1) if the ping was queued, false(0) otherwise
+ */
 int ping_kademlia (char *ip, uint16_t port);
@@ -10,6 +10,13 @@
  * Handling of a secure connection
  */
 
+/**
+ * A secio frame is a 4 byte big endian length, the encrypted data, and a 32 byte MAC.
+ * Buffers passed to the in place functions need this much room around the data.
+ */
+#define SECIO_FRAME_HEADROOM 4
+#define SECIO_FRAME_TAILROOM 32
+
 
 struct Libp2pProtocolHandler* libp2p_secio_build_protocol_handler(struct RsaPrivateKey* private_key, struct Peerstore* peer_store);
 
@@ -32,3 +39,65 @@ int libp2p_secio_handshake(struct SessionContext* session, struct RsaPrivateKey*
  * @returns true(1) on success, false(0) otherwise
  */
 int libp2p_secio_initiate_handshake(struct SessionContext* session_context, struct RsaPrivateKey* private_key, struct Peerstore* peer_store);
+
+/***
+ * Turn a buffer into a complete secio frame, in place. The buffer must be laid out as
+ * SECIO_FRAME_HEADROOM bytes, then the data, then SECIO_FRAME_TAILROOM bytes.
+ * @param session the session information
+ * @param frame the beginning of the buffer (the data starts at frame + SECIO_FRAME_HEADROOM)
+ * @param data_size the number of bytes of data
+ * @param frame_size the total size of the frame, ready to be written to the wire
+ * @returns true(1) on success, otherwise false(0)
+ */
+int libp2p_secio_frame_in_place(struct SessionContext* session, unsigned char* frame, size_t data_size, size_t* frame_size);
+
+/***
+ * Verify the MAC and decrypt a frame in place
+ * @param session the session information
+ * @param buffer the frame (without the length prefix). The plain text will be left at the start of it
+ * @param buffer_size the size of the frame, including the MAC
+ * @param data_size the number of plain text bytes
+ * @returns true(1) on success, otherwise false(0)
+ */
+int libp2p_secio_decrypt_in_place(struct SessionContext* session, unsigned char* buffer, size_t buffer_size, size_t* data_size);
+
+/***
+ * Write a buffer completely to the session's default stream
+ * @param session the session information
+ * @param bytes the bytes to write
+ * @param bytes_size the number of bytes to write
+ * @returns true(1) if all bytes were written, false(0) otherwise
+ */
+int libp2p_secio_write_frame(struct SessionContext* session, const unsigned char* bytes, size_t bytes_size);
+
+/***
+ * Read and decrypt the next frame into memory the caller already has. If the frame
+ * does not fit, it is read into newly allocated memory instead.
+ * @param session the session
+ * @param buffer where to put the frame. Needs room for the data plus SECIO_FRAME_TAILROOM
+ * @param buffer_size the room available in buffer
+ * @param allocated NULL if the frame went into buffer, otherwise the memory it went into (the caller frees it)
+ * @param num_bytes the number of plain text bytes
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_secio_encrypted_read_into(struct SessionContext* session, unsigned char* buffer, size_t buffer_size, unsigned char** allocated, size_t* num_bytes, int timeout_secs);
+
+/***
+ * Check whether a whole frame is sitting in the stream's read buffer, so that reading
+ * it will not wait on the socket
+ * @param session the session
+ * @returns 1 if a frame can be read without waiting, 0 if not yet, -1 if the frame is
+ * too big for the read buffer (its prefix has arrived, but it must be gathered elsewhere)
+ */
+int libp2p_secio_frame_ready(struct SessionContext* session);
+
+/***
+ * Decrypt the next frame if all of it has arrived, without waiting on the socket. A frame
+ * too big for the read buffer is gathered over as many calls as it takes.
+ * @param session the session
+ * @param results the plain text. NOTE: this memory is allocated
+ * @param num_bytes the number of plain text bytes
+ * @returns 1 if a frame was decrypted, 0 if it has not all arrived yet, -1 on error
+ */
+int libp2p_secio_try_read_frame(struct SessionContext* session, unsigned char** results, size_t* num_bytes);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A bloom filter over binary keys. It can say a key is certainly not
+ * in a set, or that it may be.
+ */
+
+// hashes per key when none is given
+#define BLOOM_FILTER_DEFAULT_HASHES 7
+
+struct BloomFilter {
+	unsigned char* bits;
+	size_t num_bits;
+	int num_hashes;
+	// the number of keys added
+	size_t num_keys;
+};
+
+/***
+ * Allocate a new, empty bloom filter
+ * @param size_bytes the size of the bit array in bytes
+ * @param num_hashes the number of bits set per key (0 for the default)
+ * @returns the filter, or NULL on error
+ */
+struct BloomFilter* libp2p_utils_bloom_filter_new(size_t size_bytes, int num_hashes);
+
+/***
+ * Free the resources of a bloom filter
+ * @param filter the filter
+ */
+void libp2p_utils_bloom_filter_free(struct BloomFilter* filter);
+
+/***
+ * Add a key
+ * @param filter the filter
+ * @param key the key
+ * @param key_size the size of the key
+ */
+void libp2p_utils_bloom_filter_add(struct BloomFilter* filter, const unsigned char* key, size_t key_size);
+
+/***
+ * See if a key may have been added
+ * @param filter the filter
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns false(0) if the key was never added, true(1) if it may have been
+ */
+int libp2p_utils_bloom_filter_contains(const struct BloomFilter* filter, const unsigned char* key, size_t key_size);
+
+/***
+ * Estimate how often a key that was never added is reported as maybe added,
+ * from how many bits are set
+ * @param filter the filter
+ * @returns the estimated false positive rate (0.0 to 1.0)
+ */
+double libp2p_utils_bloom_filter_false_positive_rate(const struct BloomFilter* filter);
+
+/***
+ * Remove all keys
+ * @param filter the filter
+ */
+void libp2p_utils_bloom_filter_clear(struct BloomFilter* filter);
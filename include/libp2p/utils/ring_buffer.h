@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * A fixed size circular byte buffer. Used to hold bytes that have been
+ * pulled from a socket but not yet consumed by the reader.
+ */
+
+struct RingBuffer {
+	unsigned char* data;
+	size_t capacity;
+	size_t head; // where the next read starts
+	size_t size; // the number of bytes waiting to be read
+};
+
+/***
+ * Allocate a new ring buffer
+ * @param capacity the maximum number of bytes it can hold
+ * @returns the RingBuffer, or NULL on error
+ */
+struct RingBuffer* libp2p_utils_ring_buffer_new(size_t capacity);
+
+/***
+ * Free the resources of a ring buffer
+ * @param buffer the buffer to free
+ */
+void libp2p_utils_ring_buffer_free(struct RingBuffer* buffer);
+
+/***
+ * The number of bytes waiting to be read
+ * @param buffer the buffer
+ * @returns the number of bytes that can be read
+ */
+size_t libp2p_utils_ring_buffer_size(const struct RingBuffer* buffer);
+
+/***
+ * The number of bytes that can still be written
+ * @param buffer the buffer
+ * @returns the free space
+ */
+size_t libp2p_utils_ring_buffer_space(const struct RingBuffer* buffer);
+
+/***
+ * Copy bytes out of the buffer, and remove them
+ * @param buffer the buffer
+ * @param out where to put the bytes
+ * @param out_size the maximum number of bytes to copy
+ * @returns the number of bytes copied
+ */
+size_t libp2p_utils_ring_buffer_read(struct RingBuffer* buffer, unsigned char* out, size_t out_size);
+
+/***
+ * Copy bytes out of the buffer, but leave them there
+ * @param buffer the buffer
+ * @param out where to put the bytes
+ * @param out_size the maximum number of bytes to copy
+ * @returns the number of bytes copied
+ */
+size_t libp2p_utils_ring_buffer_peek(const struct RingBuffer* buffer, unsigned char* out, size_t out_size);
+
+/***
+ * Copy bytes into the buffer
+ * @param buffer the buffer
+ * @param in the bytes to add
+ * @param in_size the number of bytes to add
+ * @returns the number of bytes added (less than in_size if the buffer fills up)
+ */
+size_t libp2p_utils_ring_buffer_write(struct RingBuffer* buffer, const unsigned char* in, size_t in_size);
+
+/***
+ * Get the free regions of the buffer, so that something (i.e. readv) can fill them directly.
+ * Follow with libp2p_utils_ring_buffer_produce to tell the buffer how much was filled.
+ * @param buffer the buffer
+ * @param first the first free region
+ * @param first_size the size of the first free region
+ * @param second the region after the wrap (may be NULL)
+ * @param second_size the size of the second region (may be 0)
+ */
+void libp2p_utils_ring_buffer_free_regions(struct RingBuffer* buffer, unsigned char** first, size_t* first_size, unsigned char** second, size_t* second_size);
+
+/***
+ * Mark bytes that were placed in the free regions as readable
+ * @param buffer the buffer
+ * @param num_bytes the number of bytes that were placed
+ */
+void libp2p_utils_ring_buffer_produce(struct RingBuffer* buffer, size_t num_bytes);
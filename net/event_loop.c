@@ -0,0 +1,666 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "varint.h"
+#include "libp2p/net/event_loop.h"
+#include "libp2p/net/multistream.h"
+#include "libp2p/net/p2pnet.h"
+#include "libp2p/net/protocol.h"
+#include "libp2p/secio/secio.h"
+#include "libp2p/utils/logger.h"
+
+// the most events handled per call to epoll_wait
+#define EVENT_LOOP_MAX_EVENTS 64
+
+/***
+ * An epoll based event loop that dispatches complete messages to protocol handlers
+ */
+
+/***
+ * Turn on non-blocking mode for a socket
+ * @param socket_fd the socket
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_net_event_loop_set_nonblocking(int socket_fd) {
+	int flags = fcntl(socket_fd, F_GETFL, 0);
+	if (flags < 0)
+		return 0;
+	return fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+/***
+ * Tell epoll which events we care about for a connection
+ * @param loop the event loop
+ * @param connection the connection
+ * @param operation EPOLL_CTL_ADD or EPOLL_CTL_MOD
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_net_event_loop_watch(struct Libp2pEventLoop* loop, struct Libp2pEventLoopConnection* connection, int operation) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof(struct epoll_event));
+	event.events = EPOLLIN;
+	if (connection->outgoing_size > connection->outgoing_sent)
+		event.events |= EPOLLOUT;
+	event.data.ptr = connection;
+	if (epoll_ctl(loop->epoll_fd, operation, connection->socket_fd, &event) != 0)
+		return 0;
+	connection->watching_writes = (event.events & EPOLLOUT) != 0;
+	return 1;
+}
+
+/***
+ * Start watching a socket
+ * @param loop the event loop
+ * @param socket_fd the socket
+ * @param session the session, or NULL if this is a listener
+ * @returns the new connection, or NULL on error
+ */
+static struct Libp2pEventLoopConnection* libp2p_net_event_loop_connection_add(struct Libp2pEventLoop* loop, int socket_fd, struct SessionContext* session) {
+	if (socket_fd < 0)
+		return NULL;
+	// make room in the index
+	if (socket_fd >= loop->by_fd_capacity) {
+		int new_capacity = loop->by_fd_capacity * 2;
+		if (new_capacity <= socket_fd)
+			new_capacity = socket_fd + 1;
+		struct Libp2pEventLoopConnection** tmp = realloc(loop->by_fd, sizeof(struct Libp2pEventLoopConnection*) * new_capacity);
+		if (tmp == NULL)
+			return NULL;
+		memset(&tmp[loop->by_fd_capacity], 0, sizeof(struct Libp2pEventLoopConnection*) * (new_capacity - loop->by_fd_capacity));
+		loop->by_fd = tmp;
+		loop->by_fd_capacity = new_capacity;
+	}
+	if (loop->by_fd[socket_fd] != NULL) {
+		libp2p_logger_error("event_loop", "Socket %d is already in the event loop.\n", socket_fd);
+		return NULL;
+	}
+	if (!libp2p_net_event_loop_set_nonblocking(socket_fd))
+		return NULL;
+
+	struct Libp2pEventLoopConnection* connection = (struct Libp2pEventLoopConnection*) malloc(sizeof(struct Libp2pEventLoopConnection));
+	if (connection == NULL)
+		return NULL;
+	connection->socket_fd = socket_fd;
+	connection->is_listener = session == NULL;
+	connection->session = session;
+	connection->outgoing = NULL;
+	connection->outgoing_size = 0;
+	connection->outgoing_sent = 0;
+	connection->watching_writes = 0;
+	connection->bytes_queued = 0;
+	connection->bytes_sent = 0;
+	connection->reads = NULL;
+	connection->reads_tail = NULL;
+	connection->writes = NULL;
+	connection->writes_tail = NULL;
+	connection->closing = 0;
+	connection->session_closed = NULL;
+	connection->session_closed_user_data = NULL;
+	if (!libp2p_net_event_loop_watch(loop, connection, EPOLL_CTL_ADD)) {
+		libp2p_logger_error("event_loop", "Unable to watch socket %d: %s\n", socket_fd, strerror(errno));
+		free(connection);
+		return NULL;
+	}
+	connection->prev = NULL;
+	connection->next = loop->connections;
+	if (loop->connections != NULL)
+		loop->connections->prev = connection;
+	loop->connections = connection;
+	loop->num_connections++;
+	loop->by_fd[socket_fd] = connection;
+	if (session != NULL)
+		session->insecure_stream->event_loop = loop;
+	return connection;
+}
+
+/***
+ * Add a request to the end of a list
+ * @param head the front of the list
+ * @param tail the end of the list
+ * @param request the request
+ */
+static void libp2p_net_event_loop_request_append(struct Libp2pEventLoopRequest** head, struct Libp2pEventLoopRequest** tail, struct Libp2pEventLoopRequest* request) {
+	request->next = NULL;
+	if (*tail != NULL)
+		(*tail)->next = request;
+	else
+		*head = request;
+	*tail = request;
+}
+
+/***
+ * Take the request at the front of a list
+ * @param head the front of the list
+ * @param tail the end of the list
+ * @returns the request, or NULL if the list is empty
+ */
+static struct Libp2pEventLoopRequest* libp2p_net_event_loop_request_pop(struct Libp2pEventLoopRequest** head, struct Libp2pEventLoopRequest** tail) {
+	struct Libp2pEventLoopRequest* request = *head;
+	if (request != NULL) {
+		*head = request->next;
+		if (*head == NULL)
+			*tail = NULL;
+	}
+	return request;
+}
+
+/***
+ * Take the oldest read that wants a message
+ * @param connection the connection
+ * @param message the message
+ * @param message_size the size of the message
+ * @returns the request, or NULL if no read wants it
+ */
+static struct Libp2pEventLoopRequest* libp2p_net_event_loop_read_take(struct Libp2pEventLoopConnection* connection, const unsigned char* message, size_t message_size) {
+	struct Libp2pEventLoopRequest* previous = NULL;
+	for(struct Libp2pEventLoopRequest* request = connection->reads; request != NULL; request = request->next) {
+		if (request->matches == NULL || request->matches(message, message_size, request->user_data)) {
+			if (previous == NULL)
+				connection->reads = request->next;
+			else
+				previous->next = request->next;
+			if (connection->reads_tail == request)
+				connection->reads_tail = previous;
+			return request;
+		}
+		previous = request;
+	}
+	return NULL;
+}
+
+/***
+ * Let the writers know which of their writes have gone out
+ * @param connection the connection
+ */
+static void libp2p_net_event_loop_complete_writes(struct Libp2pEventLoopConnection* connection) {
+	while (connection->writes != NULL && connection->writes->end <= connection->bytes_sent) {
+		struct Libp2pEventLoopRequest* request = libp2p_net_event_loop_request_pop(&connection->writes, &connection->writes_tail);
+		request->write_callback(connection->session, 1, request->user_data);
+		free(request);
+	}
+}
+
+/***
+ * Stop watching a connection, and close it
+ * @param loop the event loop
+ * @param connection the connection
+ */
+static void libp2p_net_event_loop_connection_remove(struct Libp2pEventLoop* loop, struct Libp2pEventLoopConnection* connection) {
+	struct Libp2pEventLoopRequest* request = NULL;
+	// nothing more can be asked of this connection, and what is outstanding fails
+	connection->closing = 1;
+	while ( (request = libp2p_net_event_loop_request_pop(&connection->reads, &connection->reads_tail)) != NULL) {
+		request->read_callback(connection->session, NULL, 0, 0, request->user_data);
+		free(request);
+	}
+	while ( (request = libp2p_net_event_loop_request_pop(&connection->writes, &connection->writes_tail)) != NULL) {
+		request->write_callback(connection->session, 0, request->user_data);
+		free(request);
+	}
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, connection->socket_fd, NULL);
+	loop->by_fd[connection->socket_fd] = NULL;
+	if (connection->prev != NULL)
+		connection->prev->next = connection->next;
+	else
+		loop->connections = connection->next;
+	if (connection->next != NULL)
+		connection->next->prev = connection->prev;
+	loop->num_connections--;
+	if (connection->session_closed != NULL) {
+		// the session is not ours, so its owner closes it
+		connection->session->insecure_stream->event_loop = NULL;
+		connection->session_closed(connection->session, connection->session_closed_user_data);
+	} else if (connection->session != NULL)
+		libp2p_session_context_free(connection->session); // this closes the socket
+	else
+		close(connection->socket_fd);
+	if (connection->outgoing != NULL)
+		free(connection->outgoing);
+	free(connection);
+}
+
+/***
+ * Find the connection of a session
+ * @param loop the event loop
+ * @param session the session
+ * @returns the connection, or NULL if the session is not in the loop
+ */
+static struct Libp2pEventLoopConnection* libp2p_net_event_loop_find(struct Libp2pEventLoop* loop, struct SessionContext* session) {
+	if (session == NULL || session->insecure_stream == NULL || session->insecure_stream->socket_descriptor == NULL)
+		return NULL;
+	int socket_fd = *((int*)session->insecure_stream->socket_descriptor);
+	if (socket_fd < 0 || socket_fd >= loop->by_fd_capacity)
+		return NULL;
+	struct Libp2pEventLoopConnection* connection = loop->by_fd[socket_fd];
+	if (connection == NULL || connection->session != session || connection->closing)
+		return NULL;
+	return connection;
+}
+
+/***
+ * Write as much of the queued bytes as the socket will take right now
+ * @param loop the event loop
+ * @param connection the connection
+ * @returns true(1) on success, false(0) if the connection failed
+ */
+static int libp2p_net_event_loop_flush(struct Libp2pEventLoop* loop, struct Libp2pEventLoopConnection* connection) {
+	while (connection->outgoing_sent < connection->outgoing_size) {
+		ssize_t bytes = send(connection->socket_fd, &connection->outgoing[connection->outgoing_sent],
+				connection->outgoing_size - connection->outgoing_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			libp2p_logger_debug("event_loop", "Unable to write to socket %d: %s\n", connection->socket_fd, strerror(errno));
+			return 0;
+		}
+		connection->outgoing_sent += bytes;
+		connection->bytes_sent += bytes;
+	}
+	if (connection->outgoing_sent == connection->outgoing_size) {
+		connection->outgoing_sent = 0;
+		connection->outgoing_size = 0;
+	}
+	// only bother epoll when we start or stop waiting to write
+	if (connection->watching_writes != (connection->outgoing_size > 0)) {
+		if (!libp2p_net_event_loop_watch(loop, connection, EPOLL_CTL_MOD))
+			return 0;
+	}
+	libp2p_net_event_loop_complete_writes(connection);
+	return 1;
+}
+
+/***
+ * Hand each complete message that has arrived to whoever asked for it with a read
+ * request, or to the protocol handlers if nobody did
+ * @param loop the event loop
+ * @param connection the connection
+ * @returns true(1) if the connection should stay open, false(0) otherwise
+ */
+static int libp2p_net_event_loop_dispatch(struct Libp2pEventLoop* loop, struct Libp2pEventLoopConnection* connection) {
+	unsigned char* message = NULL;
+	size_t message_size = 0;
+	int rc = 0;
+	while ( (rc = libp2p_net_multistream_try_read(connection->session, &message, &message_size)) > 0) {
+		struct Libp2pEventLoopRequest* request = libp2p_net_event_loop_read_take(connection, message, message_size);
+		if (request != NULL) {
+			request->read_callback(connection->session, message, message_size, 1, request->user_data);
+			free(request);
+			continue;
+		}
+		rc = libp2p_protocol_marshal(message, message_size, connection->session, loop->protocol_handlers);
+		free(message);
+		message = NULL;
+		if (rc <= 0)
+			return 0;
+	}
+	return rc == 0;
+}
+
+/***
+ * The socket has something for us. Pull it in with one system call, and dispatch
+ * what is complete. Nothing here waits, so a message too big for the read buffer
+ * is gathered over as many calls as it takes.
+ * @param loop the event loop
+ * @param connection the connection
+ * @returns true(1) if the connection should stay open, false(0) otherwise
+ */
+static int libp2p_net_event_loop_readable(struct Libp2pEventLoop* loop, struct Libp2pEventLoopConnection* connection) {
+	struct Stream* stream = connection->session->insecure_stream;
+	if (stream == NULL || stream->read_buffer == NULL)
+		return 0;
+	if (libp2p_utils_ring_buffer_space(stream->read_buffer) == 0) {
+		// nobody could make use of what is in the buffer
+		libp2p_logger_error("event_loop", "Read buffer full on socket %d.\n", connection->socket_fd);
+		return 0;
+	}
+	ssize_t bytes = 0;
+	if (stream->large != NULL && libp2p_utils_ring_buffer_size(stream->read_buffer) == 0) {
+		// the rest of a large message goes straight to where it is being gathered
+		bytes = recv(connection->socket_fd, &stream->large[stream->large_filled], stream->large_size - stream->large_filled, MSG_DONTWAIT);
+		if (bytes > 0)
+			stream->large_filled += bytes;
+	} else {
+		bytes = socket_fill_buffer(connection->socket_fd, stream->read_buffer, MSG_DONTWAIT, 0);
+	}
+	if (bytes < 0)
+		return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+	// dispatch what arrived, even if the other side has now closed the connection
+	if (!libp2p_net_event_loop_dispatch(loop, connection))
+		return 0;
+	return bytes > 0;
+}
+
+/***
+ * Accept waiting connections on a listener
+ * @param loop the event loop
+ * @param listener the listening connection
+ */
+static void libp2p_net_event_loop_accept(struct Libp2pEventLoop* loop, struct Libp2pEventLoopConnection* listener) {
+	while (1) {
+		uint32_t ip = 0;
+		uint16_t port = 0;
+		int socket_fd = socket_accept4(listener->socket_fd, &ip, &port);
+		if (socket_fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				libp2p_logger_error("event_loop", "Accept on socket %d failed: %s\n", listener->socket_fd, strerror(errno));
+			return;
+		}
+		char ip_string[INET_ADDRSTRLEN];
+		struct in_addr address;
+		address.s_addr = ip;
+		inet_ntop(AF_INET, &address, ip_string, INET_ADDRSTRLEN);
+		struct Stream* stream = libp2p_net_multistream_stream_new(socket_fd, ip_string, port);
+		if (stream == NULL) {
+			close(socket_fd);
+			continue;
+		}
+		struct SessionContext* session = libp2p_session_context_new();
+		if (session == NULL) {
+			libp2p_net_multistream_stream_free(stream); // this closes the socket
+			continue;
+		}
+		session->insecure_stream = stream;
+		session->default_stream = stream;
+		session->port = port;
+		if (!libp2p_net_event_loop_add_session(loop, session))
+			libp2p_session_context_free(session);
+	}
+}
+
+/***
+ * Build a new event loop
+ * @param protocol_handlers the handlers that incoming messages are dispatched to
+ * @returns the event loop, or NULL on error
+ */
+struct Libp2pEventLoop* libp2p_net_event_loop_new(struct Libp2pVector* protocol_handlers) {
+	struct Libp2pEventLoop* loop = (struct Libp2pEventLoop*) malloc(sizeof(struct Libp2pEventLoop));
+	if (loop == NULL)
+		return NULL;
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		libp2p_logger_error("event_loop", "Unable to create epoll descriptor: %s\n", strerror(errno));
+		free(loop);
+		return NULL;
+	}
+	loop->running = 0;
+	loop->protocol_handlers = protocol_handlers;
+	loop->connections = NULL;
+	loop->num_connections = 0;
+	loop->by_fd = NULL;
+	loop->by_fd_capacity = 0;
+	return loop;
+}
+
+/***
+ * Watch a listening socket, and add each connection it accepts to the loop
+ * @param loop the event loop
+ * @param socket_fd the listening socket. The loop closes it when it is freed
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_add_listener(struct Libp2pEventLoop* loop, int socket_fd) {
+	return libp2p_net_event_loop_connection_add(loop, socket_fd, NULL) != NULL;
+}
+
+/***
+ * Add a connected session to the loop. Its socket is made non-blocking.
+ * @param loop the event loop
+ * @param session the session. The loop frees it when the connection closes
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_add_session(struct Libp2pEventLoop* loop, struct SessionContext* session) {
+	if (session == NULL || session->insecure_stream == NULL || session->insecure_stream->socket_descriptor == NULL)
+		return 0;
+	int socket_fd = *((int*)session->insecure_stream->socket_descriptor);
+	return libp2p_net_event_loop_connection_add(loop, socket_fd, session) != NULL;
+}
+
+/***
+ * Add a connected session that belongs to someone else to the loop. Its socket is made non-blocking.
+ * @param loop the event loop
+ * @param session the session. The loop does not free it
+ * @param closed called once the session has left the loop, because it failed or the loop was freed
+ * @param user_data handed to closed
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_add_borrowed_session(struct Libp2pEventLoop* loop, struct SessionContext* session,
+		void (*closed)(struct SessionContext* session, void* user_data), void* user_data) {
+	if (session == NULL || session->insecure_stream == NULL || session->insecure_stream->socket_descriptor == NULL || closed == NULL)
+		return 0;
+	int socket_fd = *((int*)session->insecure_stream->socket_descriptor);
+	struct Libp2pEventLoopConnection* connection = libp2p_net_event_loop_connection_add(loop, socket_fd, session);
+	if (connection == NULL)
+		return 0;
+	connection->session_closed = closed;
+	connection->session_closed_user_data = user_data;
+	return 1;
+}
+
+/***
+ * Send a message on a session in the loop. It is framed (and encrypted if the session
+ * is secure) right away, and written as the socket has room for it.
+ * @param loop the event loop
+ * @param session the session
+ * @param data the message
+ * @param data_size the size of the message
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_queue_write(struct Libp2pEventLoop* loop, struct SessionContext* session, const unsigned char* data, size_t data_size) {
+	return libp2p_net_event_loop_write(loop, session, data, data_size, NULL, NULL);
+}
+
+/***
+ * Ask for the next message on a session in the loop
+ * @param loop the event loop
+ * @param session the session
+ * @param callback called with the message, or with a false(0) status if the session closes first
+ * @param user_data handed to the callback
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_read(struct Libp2pEventLoop* loop, struct SessionContext* session, StreamReadCallback callback, void* user_data) {
+	return libp2p_net_event_loop_read_matching(loop, session, NULL, callback, user_data);
+}
+
+/***
+ * Ask for the next message on a session in the loop that a match function accepts.
+ * Messages it does not accept go to other reads, or the protocol handlers.
+ * @param loop the event loop
+ * @param session the session
+ * @param matches decides which messages are wanted (NULL for whatever comes next)
+ * @param callback called with the message, or with a false(0) status if the session closes first
+ * @param user_data handed to matches and the callback
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_read_matching(struct Libp2pEventLoop* loop, struct SessionContext* session, EventLoopReadMatch matches,
+		StreamReadCallback callback, void* user_data) {
+	struct Libp2pEventLoopConnection* connection = libp2p_net_event_loop_find(loop, session);
+	if (connection == NULL || callback == NULL)
+		return 0;
+	struct Libp2pEventLoopRequest* request = (struct Libp2pEventLoopRequest*) malloc(sizeof(struct Libp2pEventLoopRequest));
+	if (request == NULL)
+		return 0;
+	request->read_callback = callback;
+	request->write_callback = NULL;
+	request->matches = matches;
+	request->user_data = user_data;
+	request->end = 0;
+	libp2p_net_event_loop_request_append(&connection->reads, &connection->reads_tail, request);
+	return 1;
+}
+
+/***
+ * Give up on a read that has not been answered. Its callback is not called, and a
+ * message that would have gone to it goes to other reads, or the protocol handlers.
+ * @param loop the event loop
+ * @param session the session
+ * @param callback the callback the read was made with
+ * @param user_data the user_data the read was made with
+ * @returns true(1) if the read was outstanding, false(0) otherwise
+ */
+int libp2p_net_event_loop_read_cancel(struct Libp2pEventLoop* loop, struct SessionContext* session, StreamReadCallback callback, void* user_data) {
+	struct Libp2pEventLoopConnection* connection = libp2p_net_event_loop_find(loop, session);
+	struct Libp2pEventLoopRequest* previous = NULL;
+	if (connection == NULL)
+		return 0;
+	for(struct Libp2pEventLoopRequest* request = connection->reads; request != NULL; request = request->next) {
+		if (request->read_callback == callback && request->user_data == user_data) {
+			if (previous == NULL)
+				connection->reads = request->next;
+			else
+				previous->next = request->next;
+			if (connection->reads_tail == request)
+				connection->reads_tail = previous;
+			free(request);
+			return 1;
+		}
+		previous = request;
+	}
+	return 0;
+}
+
+/***
+ * Send a message on a session in the loop, and find out when it has gone out
+ * @param loop the event loop
+ * @param session the session
+ * @param data the message
+ * @param data_size the size of the message
+ * @param callback called when the message has been sent (may be NULL). This can happen before this returns
+ * @param user_data handed to the callback
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_event_loop_write(struct Libp2pEventLoop* loop, struct SessionContext* session, const unsigned char* data, size_t data_size, StreamWriteCallback callback, void* user_data) {
+	struct Libp2pEventLoopConnection* connection = libp2p_net_event_loop_find(loop, session);
+	if (connection == NULL || data_size == 0)
+		return 0;
+
+	unsigned char varint[12];
+	size_t varint_size = 0;
+	varint_encode(data_size, &varint[0], 12, &varint_size);
+	int secure = session->secure_stream != NULL;
+	size_t headroom = secure ? SECIO_FRAME_HEADROOM : 0;
+	size_t frame_size = headroom + varint_size + data_size + (secure ? SECIO_FRAME_TAILROOM : 0);
+	struct Libp2pEventLoopRequest* request = NULL;
+	if (callback != NULL) {
+		request = (struct Libp2pEventLoopRequest*) malloc(sizeof(struct Libp2pEventLoopRequest));
+		if (request == NULL)
+			return 0;
+	}
+
+	// drop what has already been sent, and make room for the frame
+	if (connection->outgoing_sent > 0) {
+		connection->outgoing_size -= connection->outgoing_sent;
+		memmove(connection->outgoing, &connection->outgoing[connection->outgoing_sent], connection->outgoing_size);
+		connection->outgoing_sent = 0;
+	}
+	unsigned char* tmp = realloc(connection->outgoing, connection->outgoing_size + frame_size);
+	if (tmp == NULL)
+		goto error;
+	connection->outgoing = tmp;
+
+	// build the frame where it will be sent from
+	unsigned char* frame = &connection->outgoing[connection->outgoing_size];
+	memcpy(&frame[headroom], varint, varint_size);
+	memcpy(&frame[headroom + varint_size], data, data_size);
+	if (secure) {
+		if (!libp2p_secio_frame_in_place(session, frame, varint_size + data_size, &frame_size))
+			goto error;
+	}
+	connection->outgoing_size += frame_size;
+	connection->bytes_queued += frame_size;
+	if (request != NULL) {
+		request->read_callback = NULL;
+		request->write_callback = callback;
+		request->matches = NULL;
+		request->user_data = user_data;
+		request->end = connection->bytes_queued;
+		libp2p_net_event_loop_request_append(&connection->writes, &connection->writes_tail, request);
+	}
+	// the message is queued. If the socket has failed, epoll reports it, and the
+	// connection is closed from there.
+	libp2p_net_event_loop_flush(loop, connection);
+	return 1;
+
+	error:
+	if (request != NULL)
+		free(request);
+	return 0;
+}
+
+/***
+ * Wait for events once, and handle them
+ * @param loop the event loop
+ * @param timeout_ms the milliseconds to wait, or -1 to wait forever
+ * @returns the number of events handled, or -1 on error
+ */
+int libp2p_net_event_loop_run_once(struct Libp2pEventLoop* loop, int timeout_ms) {
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	int num_events = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+	if (num_events < 0) {
+		if (errno == EINTR)
+			return 0;
+		libp2p_logger_error("event_loop", "epoll_wait failed: %s\n", strerror(errno));
+		return -1;
+	}
+	for(int i = 0; i < num_events; i++) {
+		struct Libp2pEventLoopConnection* connection = (struct Libp2pEventLoopConnection*) events[i].data.ptr;
+		if (connection->is_listener) {
+			libp2p_net_event_loop_accept(loop, connection);
+			continue;
+		}
+		int keep = 1;
+		if (events[i].events & EPOLLOUT)
+			keep = libp2p_net_event_loop_flush(loop, connection);
+		if (keep && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			keep = libp2p_net_event_loop_readable(loop, connection);
+		if (!keep)
+			libp2p_net_event_loop_connection_remove(loop, connection);
+	}
+	return num_events;
+}
+
+/***
+ * Handle events until libp2p_net_event_loop_stop is called
+ * @param loop the event loop
+ * @returns true(1) if stopped, false(0) on error
+ */
+int libp2p_net_event_loop_run(struct Libp2pEventLoop* loop) {
+	loop->running = 1;
+	while (loop->running) {
+		if (libp2p_net_event_loop_run_once(loop, 1000) < 0) {
+			loop->running = 0;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/***
+ * Ask a running loop to return. Safe to call from a protocol handler.
+ * @param loop the event loop
+ */
+void libp2p_net_event_loop_stop(struct Libp2pEventLoop* loop) {
+	loop->running = 0;
+}
+
+/***
+ * Close all connections and free the loop
+ * @param loop the event loop
+ */
+void libp2p_net_event_loop_free(struct Libp2pEventLoop* loop) {
+	if (loop == NULL)
+		return;
+	while (loop->connections != NULL)
+		libp2p_net_event_loop_connection_remove(loop, loop->connections);
+	close(loop->epoll_fd);
+	if (loop->by_fd != NULL)
+		free(loop->by_fd);
+	free(loop);
+}
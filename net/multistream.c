@@ -11,16 +11,33 @@
 #include "libp2p/secio/secio.h"
 #include "varint.h"
 #include "libp2p/net/multistream.h"
+#include "libp2p/net/event_loop.h"
 #include "libp2p/utils/logger.h"
 #include "multiaddr/multiaddr.h"
 
 // NOTE: this is normally set to 5 seconds, but you may want to increase this during debugging
 int multistream_default_timeout = 5;
+// the size of the receive buffer attached to each stream
+size_t multistream_read_buffer_size = 65536;
+// the largest message (or secio frame) a stream accepts from the other side
+size_t multistream_max_message_size = 16 * 1024 * 1024;
 
 /***
  * An implementation of the libp2p multistream
  */
 
+/***
+ * Drop the stream's pending buffer
+ * @param stream the stream
+ */
+static void libp2p_net_multistream_pending_free(struct Stream* stream) {
+	if (stream->pending != NULL)
+		free(stream->pending);
+	stream->pending = NULL;
+	stream->pending_size = 0;
+	stream->pending_capacity = 0;
+}
+
 /***
  * Close the Multistream interface
  * NOTE: This also closes the socket
@@ -39,6 +56,11 @@ int libp2p_net_multistream_close(void* stream_context) {
 	if (stream->address != NULL)
 		multiaddress_free(stream->address);
 	stream->address = NULL;
+	libp2p_utils_ring_buffer_free(stream->read_buffer);
+	stream->read_buffer = NULL;
+	libp2p_net_multistream_pending_free(stream);
+	if (stream->large != NULL)
+		free(stream->large);
 	free(stream);
 	secure_context->default_stream = NULL;
 	secure_context->insecure_stream = NULL;
@@ -69,6 +91,10 @@ int libp2p_net_multistream_peek(void* stream_context) {
 		// Ooff, we're having problems. Don't use this socket again.
 		return -1;
 	}
+	// include what has already been pulled off the socket
+	if (stream->read_buffer != NULL)
+		bytes += libp2p_utils_ring_buffer_size(stream->read_buffer);
+	bytes += stream->pending_size;
 	return bytes;
 }
 
@@ -84,39 +110,368 @@ int libp2p_net_multistream_write(void* stream_context, const unsigned char* data
 	struct Stream* stream = session_context->default_stream;
 	int num_bytes = 0;
 
+	if (session_context->insecure_stream != NULL && session_context->insecure_stream->event_loop != NULL) {
+		// the loop owns the socket, so this waits its turn behind what is already queued
+		if (!libp2p_net_event_loop_queue_write(session_context->insecure_stream->event_loop, session_context, data, data_length))
+			return 0;
+		return data_length;
+	}
 	if (data_length > 0) { // only do this is if there is something to send
 		// first send the size
 		unsigned char varint[12];
 		size_t varint_size = 0;
 		varint_encode(data_length, &varint[0], 12, &varint_size);
-		// now put the size with the data
-		unsigned char* buffer = (unsigned char*)malloc(data_length + varint_size);
-		if (buffer == NULL)
-			return 0;
-		memset(buffer, 0, data_length + varint_size);
-		memcpy(buffer, varint, varint_size);
-		memcpy(&buffer[varint_size], data, data_length);
 		// determine if this should run through the secio protocol or not
 		if (session_context->secure_stream == NULL) {
 			int sd = *((int*)stream->socket_descriptor);
-			// do a "raw" write
-			num_bytes = socket_write(sd, (char*)varint, varint_size, 0);
-			if (num_bytes == 0) {
-				free(buffer);
+			// do a "raw" write, the size and the data in one call
+			struct iovec iov[2];
+			iov[0].iov_base = varint;
+			iov[0].iov_len = varint_size;
+			iov[1].iov_base = (void*)data;
+			iov[1].iov_len = data_length;
+			ssize_t written = socket_writev(sd, iov, 2, 0);
+			if (written <= 0)
 				return 0;
-			}
-			// then send the actual data
-			num_bytes += socket_write(sd, (char*)data, data_length, 0);
+			num_bytes = written;
 		} else {
+			// now put the size with the data
+			unsigned char* buffer = (unsigned char*)malloc(data_length + varint_size);
+			if (buffer == NULL)
+				return 0;
+			memcpy(buffer, varint, varint_size);
+			memcpy(&buffer[varint_size], data, data_length);
 			// write using secio
 			num_bytes = stream->write(stream_context, buffer, data_length + varint_size);
+			free(buffer);
 		}
-		free(buffer);
 	}
 
 	return num_bytes;
 }
 
+/***
+ * Check the size the other side claims a message has, before anything is allocated for it
+ * @param message_size the size from the varint prefix
+ * @returns true(1) if it is acceptable, false(0) otherwise
+ */
+static int libp2p_net_multistream_size_ok(size_t message_size) {
+	if (message_size == 0 || message_size > multistream_max_message_size) {
+		libp2p_logger_error("multistream", "Refusing a message of %lu bytes.\n", (unsigned long)message_size);
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Decode the varint length prefix at the front of a read buffer, without removing it
+ * @param buffer the read buffer
+ * @param message_size the size of the message that follows the prefix
+ * @param varint_size the size of the prefix itself
+ * @returns 1 if decoded, 0 if more bytes are needed, -1 if it is not a valid prefix (or the size is not acceptable)
+ */
+static int libp2p_net_multistream_peek_varint(const struct RingBuffer* buffer, size_t* message_size, size_t* varint_size) {
+	unsigned char varint[10];
+	size_t available = libp2p_utils_ring_buffer_peek(buffer, varint, 10);
+	for(size_t i = 0; i < available; i++) {
+		if (varint[i] >> 7 == 0) {
+			*varint_size = i + 1;
+			*message_size = varint_decode(varint, *varint_size, NULL);
+			return libp2p_net_multistream_size_ok(*message_size) ? 1 : -1;
+		}
+	}
+	return available == 10 ? -1 : 0;
+}
+
+/***
+ * Take the next complete message out of the stream's read buffer, if there is one.
+ * This does not touch the socket, so after one read many messages may be pulled out.
+ * @param stream the stream
+ * @param results where to put the message. NOTE: this memory is allocated
+ * @param results_size the size of the message
+ * @returns 1 if a message was retrieved, 0 if a complete message has not arrived yet, -1 on error
+ */
+int libp2p_net_multistream_next_message(struct Stream* stream, unsigned char** results, size_t* results_size) {
+	unsigned char varint[10];
+	size_t message_size = 0, varint_size = 0;
+	struct RingBuffer* buffer = stream->read_buffer;
+	if (buffer == NULL)
+		return 0;
+	int rc = libp2p_net_multistream_peek_varint(buffer, &message_size, &varint_size);
+	if (rc <= 0)
+		return rc;
+	if (libp2p_utils_ring_buffer_size(buffer) < varint_size + message_size)
+		return 0;
+	*results = malloc(message_size);
+	if (*results == NULL)
+		return -1;
+	libp2p_utils_ring_buffer_read(buffer, varint, varint_size);
+	libp2p_utils_ring_buffer_read(buffer, *results, message_size);
+	*results_size = message_size;
+	return 1;
+}
+
+/***
+ * Read one varint prefixed message from a raw (not secio) stream. Bytes are pulled in
+ * as large chunks into the stream's read buffer, and the prefix is decoded from there.
+ * @param stream the stream
+ * @param results where to put the message. NOTE: this memory is allocated
+ * @param results_size the size of the message
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_net_multistream_read_raw(struct Stream* stream, unsigned char** results, size_t* results_size, int timeout_secs) {
+	int socket_fd = *((int*)stream->socket_descriptor);
+	struct RingBuffer* buffer = stream->read_buffer;
+	unsigned char varint[10];
+	size_t message_size = 0, varint_size = 0;
+	int rc = 0;
+
+	if (buffer != NULL) {
+		while (1) {
+			rc = libp2p_net_multistream_next_message(stream, results, results_size);
+			if (rc != 0)
+				return rc > 0;
+			rc = libp2p_net_multistream_peek_varint(buffer, &message_size, &varint_size);
+			if (rc < 0) {
+				libp2p_logger_error("multistream", "Invalid varint on socket %d\n", socket_fd);
+				return 0;
+			}
+			if (rc > 0 && varint_size + message_size > buffer->capacity)
+				break; // too big for the buffer, read it directly below
+			ssize_t bytes = socket_fill_buffer(socket_fd, buffer, 0, timeout_secs);
+			if (bytes < 0 && errno == EINTR)
+				continue;
+			if (bytes <= 0) {
+				// timeout, closed socket, or error
+				libp2p_logger_debug("multistream", "Unable to read from socket %d\n", socket_fd);
+				return 0;
+			}
+		}
+		libp2p_utils_ring_buffer_read(buffer, varint, varint_size);
+	} else {
+		// no read buffer, so gather the varint a byte at a time
+		while (1) {
+			if (socket_read_buffered(socket_fd, NULL, (char*)&varint[varint_size], 1, 0, timeout_secs) != 1) {
+				libp2p_logger_debug("multistream", "Unable to read varint on socket %d\n", socket_fd);
+				return 0;
+			}
+			varint_size++;
+			if (varint[varint_size - 1] >> 7 == 0)
+				break;
+			if (varint_size == 10) {
+				libp2p_logger_error("multistream", "Invalid varint on socket %d\n", socket_fd);
+				return 0;
+			}
+		}
+		message_size = varint_decode(varint, varint_size, NULL);
+		if (!libp2p_net_multistream_size_ok(message_size))
+			return 0;
+	}
+
+	// the message body
+	*results = malloc(message_size);
+	if (*results == NULL) {
+		libp2p_logger_error("multistream", "Unable to allocate %lu bytes of memory.\n", message_size);
+		return 0;
+	}
+	if (socket_read_buffered(socket_fd, buffer, (char*)*results, message_size, 0, timeout_secs) != message_size) {
+		libp2p_logger_error("multistream", "socket read returned error %d on socket descriptor %d.\n", errno, socket_fd);
+		free(*results);
+		*results = NULL;
+		return 0;
+	}
+	*results_size = message_size;
+	return 1;
+}
+
+/***
+ * Decode a varint length prefix
+ * @param bytes the bytes that start with the prefix
+ * @param bytes_size the number of bytes available
+ * @param message_size the size of the message that follows the prefix
+ * @param varint_size the size of the prefix itself
+ * @returns 1 if decoded, 0 if more bytes are needed, -1 if it is not a valid prefix
+ */
+static int libp2p_net_multistream_decode_varint(const unsigned char* bytes, size_t bytes_size, size_t* message_size, size_t* varint_size) {
+	for(size_t i = 0; i < bytes_size && i < 10; i++) {
+		if (bytes[i] >> 7 == 0) {
+			*varint_size = i + 1;
+			*message_size = varint_decode(bytes, *varint_size, NULL);
+			return 1;
+		}
+	}
+	return bytes_size >= 10 ? -1 : 0;
+}
+
+/***
+ * Make room in the stream's pending buffer
+ * @param stream the stream
+ * @param needed the number of free bytes needed after what is already pending
+ * @returns true(1) on success, false(0) if out of memory
+ */
+static int libp2p_net_multistream_pending_reserve(struct Stream* stream, size_t needed) {
+	if (stream->pending_capacity - stream->pending_size >= needed)
+		return 1;
+	size_t new_capacity = stream->pending_capacity * 2;
+	if (new_capacity < stream->pending_size + needed)
+		new_capacity = stream->pending_size + needed;
+	unsigned char* tmp = realloc(stream->pending, new_capacity);
+	if (tmp == NULL)
+		return 0;
+	stream->pending = tmp;
+	stream->pending_capacity = new_capacity;
+	return 1;
+}
+
+/***
+ * Decrypt the next frame and add it to the stream's pending bytes
+ * @param session the session
+ * @param stream the stream
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_net_multistream_pending_fill(struct SessionContext* session, struct Stream* stream, int timeout_secs) {
+	unsigned char* allocated = NULL;
+	size_t num_bytes = 0;
+	if (!libp2p_secio_encrypted_read_into(session, &stream->pending[stream->pending_size], stream->pending_capacity - stream->pending_size, &allocated, &num_bytes, timeout_secs))
+		return 0;
+	if (allocated == NULL) {
+		stream->pending_size += num_bytes;
+	} else if (stream->pending_size == 0) {
+		// adopt the frame, no copy needed
+		free(stream->pending);
+		stream->pending = allocated;
+		stream->pending_size = num_bytes;
+		stream->pending_capacity = num_bytes + SECIO_FRAME_TAILROOM;
+	} else {
+		if (!libp2p_net_multistream_pending_reserve(stream, num_bytes)) {
+			free(allocated);
+			return 0;
+		}
+		memcpy(&stream->pending[stream->pending_size], allocated, num_bytes);
+		stream->pending_size += num_bytes;
+		free(allocated);
+	}
+	return 1;
+}
+
+/***
+ * Decrypt frames until the varint prefix of the next message is pending
+ * @param session the session
+ * @param stream the stream
+ * @param message_size the size of the message (checked against multistream_max_message_size)
+ * @param varint_size the size of the prefix, which is still at the front of the pending bytes
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_net_multistream_secure_prefix(struct SessionContext* session, struct Stream* stream, size_t* message_size, size_t* varint_size, int timeout_secs) {
+	int rc = 0;
+	while ( (rc = libp2p_net_multistream_decode_varint(stream->pending, stream->pending_size, message_size, varint_size)) == 0) {
+		if (!libp2p_net_multistream_pending_fill(session, stream, timeout_secs))
+			return 0;
+	}
+	if (rc < 0) {
+		libp2p_logger_error("multistream", "Invalid varint in secure stream.\n");
+		return 0;
+	}
+	// the size comes from the other side, so check it before doing any arithmetic with it
+	return libp2p_net_multistream_size_ok(*message_size);
+}
+
+/***
+ * Take a message out of the stream's pending bytes, if all of it has been decrypted
+ * @param stream the stream
+ * @param message_size the size of the message
+ * @param varint_size the size of the prefix in front of the message
+ * @param results where to put the message. NOTE: this memory is allocated
+ * @param results_size the size of the message
+ * @returns 1 if the message was retrieved, 0 if it is not all pending yet, -1 on error
+ */
+static int libp2p_net_multistream_pending_take(struct Stream* stream, size_t message_size, size_t varint_size, unsigned char** results, size_t* results_size) {
+	size_t available = stream->pending_size - varint_size;
+	if (available == message_size) {
+		// exactly one message is pending. Hand over the memory.
+		memmove(stream->pending, &stream->pending[varint_size], message_size);
+		*results = stream->pending;
+		*results_size = message_size;
+		stream->pending = NULL;
+		stream->pending_size = 0;
+		stream->pending_capacity = 0;
+		return 1;
+	}
+	if (available > message_size) {
+		// more than one message is pending. Copy this one out, and keep the rest.
+		*results = malloc(message_size);
+		if (*results == NULL)
+			return -1;
+		memcpy(*results, &stream->pending[varint_size], message_size);
+		stream->pending_size -= varint_size + message_size;
+		memmove(stream->pending, &stream->pending[varint_size + message_size], stream->pending_size);
+		*results_size = message_size;
+		return 1;
+	}
+	return 0;
+}
+
+/***
+ * Read one varint prefixed message through secio. Frames are decrypted into the
+ * stream's pending buffer, and anything after the message stays there for the next read.
+ * Large messages are decrypted directly into the memory handed to the caller.
+ * @param session the session
+ * @param stream the stream
+ * @param results where to put the message. NOTE: this memory is allocated
+ * @param results_size the size of the message
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_net_multistream_read_secure(struct SessionContext* session, struct Stream* stream, unsigned char** results, size_t* results_size, int timeout_secs) {
+	size_t message_size = 0, varint_size = 0, num_bytes = 0, filled = 0;
+	unsigned char* allocated = NULL;
+
+	// gather enough to know the size of the message
+	if (!libp2p_net_multistream_secure_prefix(session, stream, &message_size, &varint_size, timeout_secs))
+		return 0;
+
+	int rc = libp2p_net_multistream_pending_take(stream, message_size, varint_size, results, results_size);
+	if (rc != 0)
+		return rc > 0;
+
+	// the message is still arriving. Decrypt the rest of it where it will end up.
+	*results = malloc(message_size + SECIO_FRAME_TAILROOM);
+	if (*results == NULL) {
+		libp2p_logger_error("multistream", "Unable to allocate %lu bytes of memory.\n", message_size);
+		return 0;
+	}
+	filled = stream->pending_size - varint_size;
+	memcpy(*results, &stream->pending[varint_size], filled);
+	stream->pending_size = 0;
+	while (filled < message_size) {
+		if (!libp2p_secio_encrypted_read_into(session, &(*results)[filled], message_size + SECIO_FRAME_TAILROOM - filled, &allocated, &num_bytes, timeout_secs)) {
+			free(*results);
+			*results = NULL;
+			return 0;
+		}
+		if (allocated != NULL) {
+			// this frame runs past the end of the message. Keep what is left over.
+			size_t needed = message_size - filled;
+			if (num_bytes < needed)
+				needed = num_bytes;
+			memcpy(&(*results)[filled], allocated, needed);
+			filled += needed;
+			memmove(allocated, &allocated[needed], num_bytes - needed);
+			libp2p_net_multistream_pending_free(stream);
+			stream->pending = allocated;
+			stream->pending_size = num_bytes - needed;
+			stream->pending_capacity = num_bytes + SECIO_FRAME_TAILROOM;
+		} else {
+			filled += num_bytes;
+		}
+	}
+	*results_size = message_size;
+	return 1;
+}
+
 /**
  * Read from a multistream socket
  * @param socket_fd the socket file descriptor
@@ -128,96 +483,369 @@ int libp2p_net_multistream_write(void* stream_context, const unsigned char* data
 int libp2p_net_multistream_read(void* stream_context, unsigned char** results, size_t* results_size, int timeout_secs) {
 	struct SessionContext* session_context = (struct SessionContext*)stream_context;
 	struct Stream* stream = session_context->default_stream;
-	int bytes = 0;
 
-	// TODO: this is arbitrary, and should be dynamic
-	size_t buffer_size = 362144;
-	char buffer[buffer_size];
-	char* pos = buffer;
-	size_t num_bytes_requested = 0, left = 0, already_read = 0;
+	if (session_context->insecure_stream != NULL && session_context->insecure_stream->event_loop != NULL) {
+		// waiting here would stall every other session in the loop
+		libp2p_logger_error("multistream", "Blocking read on a session in an event loop. Use read_async.\n");
+		return 0;
+	}
+	if (session_context->secure_stream == NULL) {
+		if (!libp2p_net_multistream_read_raw(stream, results, results_size, timeout_secs))
+			return 0;
+	} else { // use secio instead of raw read/writes
+		if (!libp2p_net_multistream_read_secure(session_context, stream, results, results_size, timeout_secs))
+			return 0;
+	}
+
+	return *results_size;
+}
+
+/***
+ * Start gathering a message (or secio frame) that is too big for the stream's read buffer
+ * @param stream the stream
+ * @param size the number of bytes to gather
+ * @returns true(1) on success, false(0) if it is too big or out of memory
+ */
+int libp2p_net_multistream_gather_start(struct Stream* stream, size_t size) {
+	if (size > multistream_max_message_size) {
+		libp2p_logger_error("multistream", "Refusing a message of %lu bytes.\n", (unsigned long)size);
+		return 0;
+	}
+	stream->large = malloc(size > 0 ? size : 1);
+	if (stream->large == NULL)
+		return 0;
+	stream->large_size = size;
+	stream->large_filled = 0;
+	return 1;
+}
+
+/***
+ * Move what has arrived of the message being gathered out of the read buffer
+ * @param stream the stream
+ * @param results the whole message, once it is here. NOTE: the caller then owns this memory
+ * @param results_size the size of the message
+ * @returns true(1) if the whole message is here, false(0) if not yet
+ */
+int libp2p_net_multistream_gather(struct Stream* stream, unsigned char** results, size_t* results_size) {
+	if (stream->large == NULL)
+		return 0;
+	if (stream->read_buffer != NULL)
+		stream->large_filled += libp2p_utils_ring_buffer_read(stream->read_buffer, &stream->large[stream->large_filled], stream->large_size - stream->large_filled);
+	if (stream->large_filled < stream->large_size)
+		return 0;
+	*results = stream->large;
+	*results_size = stream->large_size;
+	stream->large = NULL;
+	stream->large_size = 0;
+	stream->large_filled = 0;
+	return 1;
+}
+
+/***
+ * Retrieve the next message if it has already arrived, without waiting on the socket.
+ * This is for callers that watch the socket themselves, and fill the stream's read
+ * buffer when it becomes readable (see socket_fill_buffer).
+ * NOTE: A message too large for the read buffer is gathered over as many calls as it
+ * takes (see libp2p_net_multistream_gather). A message that claims to be bigger than
+ * multistream_max_message_size is an error, so the connection should be closed.
+ * @param stream_context the session context
+ * @param results where to put the message. NOTE: this memory is allocated
+ * @param results_size the size of the message
+ * @returns 1 if a message was retrieved, 0 if a complete message has not arrived yet, -1 on error
+ */
+int libp2p_net_multistream_try_read(void* stream_context, unsigned char** results, size_t* results_size) {
+	struct SessionContext* session_context = (struct SessionContext*)stream_context;
+	struct Stream* stream = session_context->default_stream;
+	size_t message_size = 0, varint_size = 0;
+	int rc = 0;
+
+	if (stream == NULL)
+		return -1;
 
 	if (session_context->secure_stream == NULL) {
-		int socketDescriptor = *( (int*) stream->socket_descriptor);
-		// first read the varint
-		while(1) {
-			unsigned char c = '\0';
-			bytes = socket_read(socketDescriptor, (char*)&c, 1, 0, timeout_secs);
-			if (bytes <= 0) {
-				// possible error
-				if (bytes < 0)
-					libp2p_logger_error("multistream", "socket_read returned %d reading socket %d\n", bytes, socketDescriptor);
+		if (stream->large == NULL) {
+			rc = libp2p_net_multistream_next_message(stream, results, results_size);
+			if (rc != 0 || stream->read_buffer == NULL)
+				return rc;
+			rc = libp2p_net_multistream_peek_varint(stream->read_buffer, &message_size, &varint_size);
+			if (rc <= 0 || varint_size + message_size <= stream->read_buffer->capacity)
+				return rc;
+			// too big for the read buffer, so gather it as it arrives
+			unsigned char varint[10];
+			if (!libp2p_net_multistream_gather_start(stream, message_size))
+				return -1;
+			libp2p_utils_ring_buffer_read(stream->read_buffer, varint, varint_size);
+		}
+		return libp2p_net_multistream_gather(stream, results, results_size);
+	}
+
+	while (1) {
+		rc = libp2p_net_multistream_decode_varint(stream->pending, stream->pending_size, &message_size, &varint_size);
+		if (rc < 0) {
+			libp2p_logger_error("multistream", "Invalid varint in secure stream.\n");
+			return -1;
+		}
+		if (rc > 0) {
+			// otherwise frames would be decrypted and kept for a message that never ends
+			if (!libp2p_net_multistream_size_ok(message_size))
+				return -1;
+			rc = libp2p_net_multistream_pending_take(stream, message_size, varint_size, results, results_size);
+			if (rc != 0)
+				return rc;
+		}
+		unsigned char* frame = NULL;
+		size_t num_bytes = 0;
+		rc = libp2p_secio_try_read_frame(session_context, &frame, &num_bytes);
+		if (rc <= 0)
+			return rc;
+		if (stream->pending_size == 0) {
+			// adopt the frame, no copy needed
+			libp2p_net_multistream_pending_free(stream);
+			stream->pending = frame;
+			stream->pending_size = num_bytes;
+			stream->pending_capacity = num_bytes;
+			continue;
+		}
+		if (!libp2p_net_multistream_pending_reserve(stream, num_bytes)) {
+			free(frame);
+			return -1;
+		}
+		memcpy(&stream->pending[stream->pending_size], frame, num_bytes);
+		stream->pending_size += num_bytes;
+		free(frame);
+	}
+}
+
+/***
+ * Ask for the next message without waiting for it. The stream must be in an event loop.
+ * Secure streams are decrypted by the loop, so this serves secio as well.
+ * @param stream_context the session context
+ * @param callback called with the message
+ * @param user_data handed to the callback
+ * @returns true(1) if the request was accepted, false(0) otherwise
+ */
+int libp2p_net_multistream_read_async(void* stream_context, StreamReadCallback callback, void* user_data) {
+	struct SessionContext* session_context = (struct SessionContext*)stream_context;
+	struct Stream* stream = session_context->insecure_stream;
+	if (stream == NULL || stream->event_loop == NULL)
+		return 0;
+	return libp2p_net_event_loop_read(stream->event_loop, session_context, callback, user_data);
+}
+
+/***
+ * Write without waiting for the socket. The stream must be in an event loop.
+ * Secure streams are encrypted by the loop, so this serves secio as well.
+ * @param stream_context the session context
+ * @param data what to write
+ * @param data_size how much to write
+ * @param callback called when the bytes are sent (may be NULL)
+ * @param user_data handed to the callback
+ * @returns true(1) if the write was accepted, false(0) otherwise
+ */
+int libp2p_net_multistream_write_async(void* stream_context, const unsigned char* data, size_t data_size, StreamWriteCallback callback, void* user_data) {
+	struct SessionContext* session_context = (struct SessionContext*)stream_context;
+	struct Stream* stream = session_context->insecure_stream;
+	if (stream == NULL || stream->event_loop == NULL)
+		return 0;
+	return libp2p_net_event_loop_write(stream->event_loop, session_context, data, data_size, callback, user_data);
+}
+
+/***
+ * Start reading a message a piece at a time. Follow this with calls to
+ * libp2p_net_multistream_read_piece until the whole message has been retrieved.
+ * @param stream_context the session context
+ * @param message_size the size of the whole message
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_multistream_read_start(void* stream_context, size_t* message_size, int timeout_secs) {
+	struct SessionContext* session_context = (struct SessionContext*)stream_context;
+	struct Stream* stream = session_context->default_stream;
+	size_t varint_size = 0;
+	unsigned char varint[10];
+
+	if (session_context->secure_stream != NULL) {
+		if (!libp2p_net_multistream_secure_prefix(session_context, stream, message_size, &varint_size, timeout_secs))
+			return 0;
+		stream->pending_size -= varint_size;
+		memmove(stream->pending, &stream->pending[varint_size], stream->pending_size);
+	} else {
+		int socket_fd = *((int*)stream->socket_descriptor);
+		while (1) {
+			if (socket_read_buffered(socket_fd, stream->read_buffer, (char*)&varint[varint_size], 1, 0, timeout_secs) != 1)
 				return 0;
-			}
-			pos[0] = c;
-			if (c >> 7 == 0) {
-				pos[1] = 0;
-				num_bytes_requested = varint_decode((unsigned char*)buffer, strlen(buffer), NULL);
+			varint_size++;
+			if (varint[varint_size - 1] >> 7 == 0)
 				break;
+			if (varint_size == 10) {
+				libp2p_logger_error("multistream", "Invalid varint on socket %d\n", socket_fd);
+				return 0;
 			}
-			pos++;
-		}
-		if (num_bytes_requested <= 0) {
-			libp2p_logger_debug("multistream", "Reading the varint returned %d on socket %d\n", num_bytes_requested, socketDescriptor);
-			return 0;
 		}
+		*message_size = varint_decode(varint, varint_size, NULL);
+	}
+	stream->message_remaining = *message_size;
+	return 1;
+}
 
-		left = num_bytes_requested;
-		do {
-			bytes = socket_read(socketDescriptor, &buffer[already_read], left, 0, timeout_secs);
-			if (bytes < 0) {
-				bytes = 0;
-				if ( errno == EAGAIN ) {
-					// do something intelligent
-				} else {
-					libp2p_logger_error("multistream", "socket read returned error %d on socket descriptor %d.\n", errno, socketDescriptor);
-					return 0;
-				}
-			}
-			left = left - bytes;
-			already_read += bytes;
-		} while (left > 0);
+/***
+ * Retrieve the next piece of a message started with libp2p_net_multistream_read_start.
+ * Over secio, a piece is what came out of one frame, handed over as it was decrypted.
+ * @param stream_context the session context
+ * @param piece where to put the piece. NOTE: this memory is allocated
+ * @param piece_size the size of the piece. Zero when the message is complete.
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_multistream_read_piece(void* stream_context, unsigned char** piece, size_t* piece_size, int timeout_secs) {
+	struct SessionContext* session_context = (struct SessionContext*)stream_context;
+	struct Stream* stream = session_context->default_stream;
 
-		if (already_read != num_bytes_requested)
-			return 0;
+	*piece = NULL;
+	*piece_size = 0;
+	if (stream->message_remaining == 0)
+		return 1;
 
-		// parse the results, removing the leading size indicator
-		*results = malloc(num_bytes_requested);
-		if (*results == NULL)
+	if (session_context->secure_stream != NULL) {
+		if (stream->pending_size == 0 && !libp2p_net_multistream_pending_fill(session_context, stream, timeout_secs))
 			return 0;
-		memcpy(*results, buffer, num_bytes_requested);
-		*results_size = num_bytes_requested;
-	} else { // use secio instead of raw read/writes
-		unsigned char* read_from_stream;
-		size_t size_read_from_stream;
-		if (session_context->default_stream->read(session_context, &read_from_stream, &size_read_from_stream, timeout_secs) == 0) {
-			return 0;
-		}
-		// pull out num_bytes_requested
-		num_bytes_requested = varint_decode(read_from_stream, size_read_from_stream, &left);
-		memcpy(buffer, read_from_stream, size_read_from_stream);
-		free(read_from_stream);
-		buffer_size = size_read_from_stream;
-		while (num_bytes_requested > buffer_size - left) {
-			// need to read more into buffer
-			if (session_context->default_stream->read(session_context, &read_from_stream, &size_read_from_stream, timeout_secs) == 0) {
+		if (stream->pending_size <= stream->message_remaining) {
+			// hand over the whole pending buffer
+			*piece = stream->pending;
+			*piece_size = stream->pending_size;
+			stream->pending = NULL;
+			stream->pending_size = 0;
+			stream->pending_capacity = 0;
+		} else {
+			// the end of the message, with the start of the next one after it
+			*piece = malloc(stream->message_remaining);
+			if (*piece == NULL)
 				return 0;
-			}
-			memcpy(&buffer[buffer_size], read_from_stream, size_read_from_stream);
-			free(read_from_stream);
-			buffer_size += size_read_from_stream;
+			*piece_size = stream->message_remaining;
+			memcpy(*piece, stream->pending, *piece_size);
+			stream->pending_size -= *piece_size;
+			memmove(stream->pending, &stream->pending[*piece_size], stream->pending_size);
 		}
-		*results = malloc(num_bytes_requested);
-		*results_size = num_bytes_requested;
-		if (*results == NULL) {
-			libp2p_logger_error("multistream", "Unable to allocate %lu bytes of memory.", num_bytes_requested);
+	} else {
+		int socket_fd = *((int*)stream->socket_descriptor);
+		size_t wanted = stream->message_remaining;
+		if (stream->read_buffer != NULL && libp2p_utils_ring_buffer_size(stream->read_buffer) > 0 && libp2p_utils_ring_buffer_size(stream->read_buffer) < wanted)
+			wanted = libp2p_utils_ring_buffer_size(stream->read_buffer);
+		if (wanted > multistream_read_buffer_size)
+			wanted = multistream_read_buffer_size;
+		*piece = malloc(wanted);
+		if (*piece == NULL)
+			return 0;
+		if (socket_read_buffered(socket_fd, stream->read_buffer, (char*)*piece, wanted, 0, timeout_secs) != wanted) {
+			free(*piece);
+			*piece = NULL;
 			return 0;
 		}
-		memcpy(*results, &buffer[left], num_bytes_requested);
+		*piece_size = wanted;
 	}
+	stream->message_remaining -= *piece_size;
+	return 1;
+}
 
-	return num_bytes_requested;
+/***
+ * Read a whole message as a chain of pieces, without joining them together
+ * @param stream_context the session context
+ * @param timeout_secs the seconds before a timeout
+ * @returns the chain, or NULL on error
+ */
+struct MessageChain* libp2p_net_multistream_read_chain(void* stream_context, int timeout_secs) {
+	size_t message_size = 0;
+	unsigned char* piece = NULL;
+	size_t piece_size = 0;
+	struct MessageChain* chain = NULL;
+
+	if (!libp2p_net_multistream_read_start(stream_context, &message_size, timeout_secs))
+		return NULL;
+	chain = libp2p_net_multistream_chain_new();
+	if (chain == NULL)
+		return NULL;
+	while (chain->total_size < message_size) {
+		if (!libp2p_net_multistream_read_piece(stream_context, &piece, &piece_size, timeout_secs)
+				|| !libp2p_net_multistream_chain_add(chain, piece, piece_size)) {
+			if (piece != NULL)
+				free(piece);
+			libp2p_net_multistream_chain_free(chain);
+			return NULL;
+		}
+	}
+	return chain;
+}
+
+struct MessageChain* libp2p_net_multistream_chain_new() {
+	struct MessageChain* chain = (struct MessageChain*)malloc(sizeof(struct MessageChain));
+	if (chain != NULL) {
+		chain->iov = NULL;
+		chain->count = 0;
+		chain->capacity = 0;
+		chain->total_size = 0;
+	}
+	return chain;
+}
+
+/***
+ * Add a piece to the end of a chain
+ * @param chain the chain
+ * @param piece the piece. The chain takes ownership of it
+ * @param piece_size the size of the piece
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_multistream_chain_add(struct MessageChain* chain, unsigned char* piece, size_t piece_size) {
+	if (chain->count == chain->capacity) {
+		int new_capacity = chain->capacity == 0 ? 4 : chain->capacity * 2;
+		struct iovec* tmp = realloc(chain->iov, sizeof(struct iovec) * new_capacity);
+		if (tmp == NULL)
+			return 0;
+		chain->iov = tmp;
+		chain->capacity = new_capacity;
+	}
+	chain->iov[chain->count].iov_base = piece;
+	chain->iov[chain->count].iov_len = piece_size;
+	chain->count++;
+	chain->total_size += piece_size;
+	return 1;
 }
 
+/***
+ * Join the pieces of a chain together. A chain of one piece is handed over without a copy.
+ * @param chain the chain. It is emptied by this call
+ * @param results where to put the bytes. NOTE: this memory is allocated
+ * @param results_size the number of bytes
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_net_multistream_chain_linearize(struct MessageChain* chain, unsigned char** results, size_t* results_size) {
+	if (chain->count == 1) {
+		*results = chain->iov[0].iov_base;
+	} else {
+		*results = malloc(chain->total_size);
+		if (*results == NULL)
+			return 0;
+		size_t pos = 0;
+		for(int i = 0; i < chain->count; i++) {
+			memcpy(&(*results)[pos], chain->iov[i].iov_base, chain->iov[i].iov_len);
+			pos += chain->iov[i].iov_len;
+			free(chain->iov[i].iov_base);
+		}
+	}
+	*results_size = chain->total_size;
+	chain->count = 0;
+	chain->total_size = 0;
+	return 1;
+}
+
+void libp2p_net_multistream_chain_free(struct MessageChain* chain) {
+	if (chain != NULL) {
+		for(int i = 0; i < chain->count; i++)
+			free(chain->iov[i].iov_base);
+		if (chain->iov != NULL)
+			free(chain->iov);
+		free(chain);
+	}
+}
 
 /**
  * Connect to a multistream host, and this includes the multistream handshaking.
@@ -345,6 +973,10 @@ void libp2p_net_multistream_stream_free(struct Stream* stream) {
 		}
 		if (stream->address != NULL)
 			multiaddress_free(stream->address);
+		libp2p_utils_ring_buffer_free(stream->read_buffer);
+		libp2p_net_multistream_pending_free(stream);
+		if (stream->large != NULL)
+			free(stream->large);
 		free(stream);
 	}
 }
@@ -358,6 +990,16 @@ void libp2p_net_multistream_stream_free(struct Stream* stream) {
 struct Stream* libp2p_net_multistream_stream_new(int socket_fd, const char* ip, int port) {
 	struct Stream* out = (struct Stream*)malloc(sizeof(struct Stream));
 	if (out != NULL) {
+		out->address = NULL;
+		out->read_buffer = libp2p_utils_ring_buffer_new(multistream_read_buffer_size);
+		out->pending = NULL;
+		out->pending_size = 0;
+		out->pending_capacity = 0;
+		out->message_remaining = 0;
+		out->large = NULL;
+		out->large_size = 0;
+		out->large_filled = 0;
+		out->event_loop = NULL;
 		out->socket_descriptor = malloc(sizeof(int));
 		*((int*)out->socket_descriptor) = socket_fd;
 		int res = *((int*)out->socket_descriptor);
@@ -369,6 +1011,8 @@ struct Stream* libp2p_net_multistream_stream_new(int socket_fd, const char* ip,
 		out->read = libp2p_net_multistream_read;
 		out->write = libp2p_net_multistream_write;
 		out->peek = libp2p_net_multistream_peek;
+		out->read_async = libp2p_net_multistream_read_async;
+		out->write_async = libp2p_net_multistream_write_async;
 		char str[strlen(ip) + 50];
 		sprintf(str, "/ip4/%s/tcp/%d", ip, port);
 		out->address = multiaddress_new_from_string(str);
@@ -1,6 +1,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
@@ -10,6 +12,7 @@
 #include <errno.h>
 
 #include "libp2p/net/p2pnet.h"
+#include "libp2p/utils/ring_buffer.h"
 
 /**
  * associate an IP address with an port to a socket.
@@ -139,6 +142,79 @@ int socket_listen(int s, uint32_t *localip, uint16_t *localport)
    return s;
 }
 
+// counters for the read paths, see socket_statistics_get. Every connection thread
+// updates them, so they are only changed atomically
+static struct SocketStatistics socket_statistics = { 0, 0 };
+// how long a write waits for room in the send buffer of a non-blocking socket
+static const int socket_write_timeout_secs = 5;
+
+/***
+ * Add to one of the counters in socket_statistics
+ * @param counter the counter
+ * @param amount what to add
+ */
+static inline void socket_statistics_add(unsigned long* counter, unsigned long amount)
+{
+	__atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+/***
+ * Receive with a deadline. Rather than setting SO_RCVTIMEO before every read, try a
+ * non-blocking receive first (one system call when data is waiting), and only poll
+ * for the timeout when there is nothing to read yet.
+ * @param s the socket
+ * @param msg where to put the data
+ * @param flags network flags
+ * @param num_secs the number of seconds before a timeout (0 waits forever)
+ * @returns number of bytes, 0, or negative number on error (errno is EAGAIN on timeout)
+ */
+static ssize_t socket_recvmsg_timeout(int s, struct msghdr* msg, int flags, int num_secs)
+{
+	struct pollfd pfd;
+	int ready = 0;
+	ssize_t rc;
+
+	socket_statistics_add(&socket_statistics.reads, 1);
+	socket_statistics_add(&socket_statistics.read_syscalls, 1);
+	rc = recvmsg(s, msg, flags | MSG_DONTWAIT);
+	if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || (flags & MSG_DONTWAIT))
+		return rc;
+
+	// nothing is waiting, so wait for it
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	socket_statistics_add(&socket_statistics.read_syscalls, 1);
+	ready = poll(&pfd, 1, num_secs > 0 ? num_secs * 1000 : -1);
+	if (ready == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (ready < 0)
+		return -1;
+	socket_statistics_add(&socket_statistics.read_syscalls, 1);
+	return recvmsg(s, msg, flags | MSG_DONTWAIT);
+}
+
+/***
+ * Retrieve the counters of the read paths
+ * @param stats where to put the counters
+ */
+void socket_statistics_get(struct SocketStatistics* stats)
+{
+	stats->reads = __atomic_load_n(&socket_statistics.reads, __ATOMIC_RELAXED);
+	stats->read_syscalls = __atomic_load_n(&socket_statistics.read_syscalls, __ATOMIC_RELAXED);
+}
+
+/***
+ * Reset the counters of the read paths
+ */
+void socket_statistics_reset()
+{
+	__atomic_store_n(&socket_statistics.reads, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&socket_statistics.read_syscalls, 0, __ATOMIC_RELAXED);
+}
+
 /***
  * Reads data from a socket, used instead of recv so if a protocol needs
  * to use something else before or after it can be done here instead of
@@ -153,12 +229,86 @@ int socket_listen(int s, uint32_t *localip, uint16_t *localport)
  */
 ssize_t socket_read(int s, char *buf, size_t len, int flags, int num_secs)
 {
-	struct timeval tv;
-	tv.tv_sec = num_secs;
-	tv.tv_usec = 0;
-	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(struct timeval));
+	struct iovec iov;
+	struct msghdr msg;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	return socket_recvmsg_timeout(s, &msg, flags, num_secs);
+}
+
+/***
+ * Pull as much as is available (and fits) into a ring buffer with one system call
+ * @param s the socket
+ * @param buffer the ring buffer to fill
+ * @param flags network flags
+ * @param num_secs the number of seconds before a timeout
+ * @returns number of bytes, 0, or negative number on error
+ */
+ssize_t socket_fill_buffer(int s, struct RingBuffer* buffer, int flags, int num_secs)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	unsigned char* first = NULL;
+	unsigned char* second = NULL;
+	size_t first_size = 0, second_size = 0;
+
+	libp2p_utils_ring_buffer_free_regions(buffer, &first, &first_size, &second, &second_size);
+	if (first_size == 0)
+		return 0;
+	iov[0].iov_base = first;
+	iov[0].iov_len = first_size;
+	iov[1].iov_base = second;
+	iov[1].iov_len = second_size;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = second_size > 0 ? 2 : 1;
+
+	ssize_t rc = socket_recvmsg_timeout(s, &msg, flags, num_secs);
+	if (rc > 0)
+		libp2p_utils_ring_buffer_produce(buffer, rc);
+	return rc;
+}
 
-	return recv(s, buf, len, flags);
+/***
+ * Read exactly len bytes, serving what we can from the ring buffer first. The buffer
+ * is refilled with as many bytes as are available, so that small reads (i.e. length
+ * prefixes) do not each cost a system call. Reads larger than the ring buffer go
+ * straight into buf.
+ * @param s the socket
+ * @param buffer the ring buffer attached to the stream (if NULL, reads go straight to the socket)
+ * @param buf where to put the bytes
+ * @param len the number of bytes wanted
+ * @param flags network flags
+ * @param num_secs the number of seconds before a timeout
+ * @returns the number of bytes placed in buf. Less than len on timeout, error, or a closed socket
+ */
+ssize_t socket_read_buffered(int s, struct RingBuffer* buffer, char* buf, size_t len, int flags, int num_secs)
+{
+	size_t already_read = 0;
+	ssize_t rc = 0;
+
+	while (already_read < len) {
+		if (buffer != NULL && libp2p_utils_ring_buffer_size(buffer) > 0) {
+			already_read += libp2p_utils_ring_buffer_read(buffer, (unsigned char*)&buf[already_read], len - already_read);
+			continue;
+		}
+		if (buffer != NULL && len - already_read < buffer->capacity) {
+			rc = socket_fill_buffer(s, buffer, flags, num_secs);
+		} else {
+			rc = socket_read(s, &buf[already_read], len - already_read, flags, num_secs);
+			if (rc > 0)
+				already_read += rc;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+	}
+	return already_read;
 }
 
 /* Same reason as socket_read, but to send data instead of receive.
@@ -168,6 +318,79 @@ ssize_t socket_write(int s, const char *buf, size_t len, int flags)
    return send(s, buf, len, flags);
 }
 
+/***
+ * Wait for room in the send buffer of a non-blocking socket
+ * @param s the socket
+ * @returns true(1) if the socket can be written to, false(0) on timeout or error
+ */
+static int socket_wait_writable(int s)
+{
+	struct pollfd fds;
+	int rc;
+
+	fds.fd = s;
+	fds.events = POLLOUT;
+	fds.revents = 0;
+	do {
+		rc = poll(&fds, 1, socket_write_timeout_secs * 1000);
+	} while (rc < 0 && errno == EINTR);
+	if (rc == 0)
+		errno = EAGAIN;
+	return rc > 0 && (fds.revents & POLLOUT);
+}
+
+/***
+ * Write several buffers with as few system calls as possible. Framed protocols
+ * should use this to put the header and the body in the same segment.
+ * NOTE: the iov array is modified as bytes are written
+ * @param s the socket
+ * @param iov the buffers to write
+ * @param iovcnt the number of buffers
+ * @param flags network flags (i.e. MSG_MORE if more data will follow right away)
+ * @returns the number of bytes written, or -1 on error
+ */
+ssize_t socket_writev(int s, struct iovec* iov, int iovcnt, int flags)
+{
+	struct msghdr msg;
+	ssize_t total = 0;
+	ssize_t rc;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	// skip empty buffers at the front
+	while (msg.msg_iovlen > 0 && msg.msg_iov[0].iov_len == 0) {
+		msg.msg_iov++;
+		msg.msg_iovlen--;
+	}
+	while (msg.msg_iovlen > 0) {
+		rc = sendmsg(s, &msg, flags);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				// the send buffer is full. Wait for room instead of spinning.
+				if (!socket_wait_writable(s))
+					return -1;
+				continue;
+			}
+			return -1;
+		}
+		total += rc;
+		// move past what was sent
+		while (msg.msg_iovlen > 0 && (size_t)rc >= msg.msg_iov[0].iov_len) {
+			rc -= msg.msg_iov[0].iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov[0].iov_base = (char*)msg.msg_iov[0].iov_base + rc;
+			msg.msg_iov[0].iov_len -= rc;
+		}
+	}
+	return total;
+}
+
 int socket_open4() {
 	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -203,13 +426,13 @@ ssize_t socket_write_size(int s, unsigned long size, int flags) {
 	char* data = (char*)&conv;
 	int left = sizeof(conv);
 	ssize_t rc;
-	int retries_left = 100;
 	do {
 		rc = send(s, data, left, flags);
 		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
 			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-				retries_left--;
-				if (retries_left <= 0)
+				if (!socket_wait_writable(s))
 					break;
 			} else {
 				return -1;
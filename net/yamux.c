@@ -0,0 +1,689 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include "varint.h"
+#include "libp2p/net/p2pnet.h"
+#include "libp2p/net/yamux.h"
+#include "libp2p/secio/secio.h"
+#include "libp2p/utils/logger.h"
+
+/***
+ * A yamux stream multiplexer. See https://github.com/hashicorp/yamux/blob/master/spec.md
+ */
+
+// how long a writer waits for the other side to open the window
+int yamux_window_timeout = 5;
+
+/***
+ * Find the channel that a stream belongs to
+ * @param stream_context the channel's context
+ * @returns the channel, or NULL
+ */
+static struct YamuxChannel* libp2p_yamux_channel_get(void* stream_context) {
+	struct SessionContext* context = (struct SessionContext*)stream_context;
+	if (context == NULL || context->default_stream == NULL)
+		return NULL;
+	return (struct YamuxChannel*)context->default_stream->socket_descriptor;
+}
+
+/***
+ * Find a channel by its id
+ * @param yamux the session
+ * @param id the channel id
+ * @returns the channel, or NULL
+ */
+static struct YamuxChannel* libp2p_yamux_channel_find(struct YamuxSession* yamux, uint32_t id) {
+	struct YamuxChannel* current = yamux->channels;
+	while (current != NULL) {
+		if (current->id == id)
+			return current;
+		current = current->next;
+	}
+	return NULL;
+}
+
+/***
+ * Find the socket under a connection without secio
+ * @param parent the connection
+ * @returns the socket descriptor, or -1
+ */
+static int libp2p_yamux_socket(struct SessionContext* parent) {
+	if (parent->insecure_stream == NULL || parent->insecure_stream->socket_descriptor == NULL)
+		return -1;
+	return *((int*)parent->insecure_stream->socket_descriptor);
+}
+
+/***
+ * Send one frame over the connection
+ * @param yamux the session
+ * @param type the frame type
+ * @param flags the flags
+ * @param id the channel id (0 for the session itself)
+ * @param length the length field (the data size for data frames)
+ * @param data the data (data frames only)
+ * @param data_size the number of bytes of data
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_yamux_send(struct YamuxSession* yamux, enum YamuxFrameType type, uint16_t flags, uint32_t id, uint32_t length, const unsigned char* data, size_t data_size) {
+	struct SessionContext* parent = yamux->parent;
+	int retVal = 0;
+	if (yamux->failed || parent->default_stream == NULL)
+		return 0;
+	// leave room to build a secio frame around it, so there is only one copy
+	int secure = parent->secure_stream != NULL;
+	size_t headroom = secure ? SECIO_FRAME_HEADROOM : 0;
+	unsigned char* buffer = malloc(headroom + YAMUX_HEADER_SIZE + data_size + (secure ? SECIO_FRAME_TAILROOM : 0));
+	if (buffer == NULL)
+		return 0;
+	unsigned char* header = &buffer[headroom];
+	uint16_t net_flags = htons(flags);
+	uint32_t net_id = htonl(id);
+	uint32_t net_length = htonl(length);
+	header[0] = YAMUX_VERSION;
+	header[1] = type;
+	memcpy(&header[2], &net_flags, 2);
+	memcpy(&header[4], &net_id, 4);
+	memcpy(&header[8], &net_length, 4);
+	if (data_size > 0)
+		memcpy(&header[YAMUX_HEADER_SIZE], data, data_size);
+	if (secure) {
+		size_t frame_size = 0;
+		if (!libp2p_secio_frame_in_place(parent, buffer, YAMUX_HEADER_SIZE + data_size, &frame_size))
+			goto exit;
+		if (!libp2p_secio_write_frame(parent, buffer, frame_size))
+			goto exit;
+	} else {
+		// the frame as it is, without the varint prefix multistream would add
+		struct iovec iov;
+		iov.iov_base = header;
+		iov.iov_len = YAMUX_HEADER_SIZE + data_size;
+		int socket_fd = libp2p_yamux_socket(parent);
+		if (socket_fd < 0 || socket_writev(socket_fd, &iov, 1, 0) != YAMUX_HEADER_SIZE + data_size)
+			goto exit;
+	}
+	retVal = 1;
+	exit:
+	if (!retVal) {
+		libp2p_logger_error("yamux", "Unable to send a frame on channel %u.\n", id);
+		yamux->failed = 1;
+	}
+	free(buffer);
+	return retVal;
+}
+
+/***
+ * Make sure the other side may send at least target bytes on a channel
+ * @param channel the channel
+ * @param target the number of bytes
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_yamux_channel_grant(struct YamuxChannel* channel, uint32_t target) {
+	if (channel->recv_window >= target || channel->remote_closed || channel->reset)
+		return 1;
+	uint32_t delta = target - channel->recv_window;
+	if (!libp2p_yamux_send(channel->yamux, YAMUX_TYPE_WINDOW_UPDATE, 0, channel->id, delta, NULL, 0))
+		return 0;
+	channel->recv_window += delta;
+	return 1;
+}
+
+/***
+ * Remove a channel from its session, and free it. Its context is left alone.
+ * @param channel the channel
+ */
+static void libp2p_yamux_channel_free(struct YamuxChannel* channel) {
+	struct YamuxSession* yamux = channel->yamux;
+	struct YamuxChannel** current = &yamux->channels;
+	while (*current != NULL) {
+		if (*current == channel) {
+			*current = channel->next;
+			yamux->num_channels--;
+			break;
+		}
+		current = &(*current)->next;
+	}
+	if (channel->buffer != NULL)
+		free(channel->buffer);
+	free(channel);
+}
+
+/***
+ * Read one message from a channel
+ * @param stream_context the channel's context
+ * @param results where to put the message. NOTE: this memory is allocated
+ * @param results_size the size of the message
+ * @param timeout_secs the seconds to wait for data
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_yamux_channel_read(void* stream_context, unsigned char** results, size_t* results_size, int timeout_secs) {
+	struct YamuxChannel* channel = libp2p_yamux_channel_get(stream_context);
+	if (channel == NULL)
+		return 0;
+	while (1) {
+		// is a whole message here?
+		size_t message_size = 0, varint_size = 0;
+		for(size_t i = 0; i < channel->buffer_size && i < 10; i++) {
+			if (channel->buffer[i] >> 7 == 0) {
+				varint_size = i + 1;
+				message_size = varint_decode(channel->buffer, varint_size, NULL);
+				break;
+			}
+		}
+		if (varint_size == 0 && channel->buffer_size >= 10) {
+			libp2p_logger_error("yamux", "Invalid varint on channel %u.\n", channel->id);
+			return 0;
+		}
+		if (varint_size > 0 && message_size > YAMUX_MAX_MESSAGE_SIZE) {
+			libp2p_logger_error("yamux", "Channel %u announced a message of %lu bytes.\n", channel->id, (unsigned long)message_size);
+			return 0;
+		}
+		size_t needed = varint_size == 0 ? 1 : varint_size + message_size;
+		if (varint_size > 0 && channel->buffer_size >= needed) {
+			*results = malloc(message_size);
+			if (*results == NULL)
+				return 0;
+			memcpy(*results, &channel->buffer[varint_size], message_size);
+			*results_size = message_size;
+			channel->buffer_size -= needed;
+			memmove(channel->buffer, &channel->buffer[needed], channel->buffer_size);
+			// let the sender continue once half the window is used. What is still
+			// buffered counts against the window, so a slow reader holds it closed.
+			if (channel->buffer_size < YAMUX_INITIAL_WINDOW) {
+				uint32_t target = YAMUX_INITIAL_WINDOW - channel->buffer_size;
+				if (channel->recv_window <= target / 2)
+					libp2p_yamux_channel_grant(channel, target);
+			}
+			return 1;
+		}
+		if (channel->remote_closed || channel->reset || channel->yamux->failed)
+			return 0;
+		// a message bigger than the window could never arrive otherwise
+		if (needed - channel->buffer_size > channel->recv_window) {
+			if (!libp2p_yamux_channel_grant(channel, needed - channel->buffer_size))
+				return 0;
+		}
+		if (!libp2p_yamux_process(channel->yamux, timeout_secs))
+			return 0;
+		// the channel may have been closed while processing
+		channel = libp2p_yamux_channel_get(stream_context);
+		if (channel == NULL)
+			return 0;
+	}
+}
+
+/***
+ * Send one message on a channel. Waits for the other side to open the window if needed.
+ * @param stream_context the channel's context
+ * @param data the message
+ * @param data_size the size of the message
+ * @returns the number of bytes written, or 0 on error
+ */
+int libp2p_yamux_channel_write(void* stream_context, const unsigned char* data, size_t data_size) {
+	struct YamuxChannel* channel = libp2p_yamux_channel_get(stream_context);
+	unsigned char varint[12];
+	size_t varint_size = 0, sent = 0;
+	if (channel == NULL || channel->local_closed || channel->reset)
+		return 0;
+	// the other side would not read it
+	if (data_size > YAMUX_MAX_MESSAGE_SIZE)
+		return 0;
+	varint_encode(data_size, &varint[0], 12, &varint_size);
+	size_t total = varint_size + data_size;
+	unsigned char* chunk = malloc(total < YAMUX_MAX_FRAME_DATA ? total : YAMUX_MAX_FRAME_DATA);
+	if (chunk == NULL)
+		return 0;
+	while (sent < total) {
+		while (channel->send_window == 0) {
+			if (channel->reset || !libp2p_yamux_process(channel->yamux, yamux_window_timeout)) {
+				free(chunk);
+				return 0;
+			}
+			channel = libp2p_yamux_channel_get(stream_context);
+			if (channel == NULL) {
+				free(chunk);
+				return 0;
+			}
+		}
+		size_t chunk_size = total - sent;
+		if (chunk_size > channel->send_window)
+			chunk_size = channel->send_window;
+		if (chunk_size > YAMUX_MAX_FRAME_DATA)
+			chunk_size = YAMUX_MAX_FRAME_DATA;
+		// gather the prefix and the data
+		for(size_t filled = 0; filled < chunk_size; ) {
+			size_t position = sent + filled;
+			if (position < varint_size) {
+				chunk[filled++] = varint[position];
+			} else {
+				size_t amount = chunk_size - filled;
+				memcpy(&chunk[filled], &data[position - varint_size], amount);
+				filled += amount;
+			}
+		}
+		if (!libp2p_yamux_send(channel->yamux, YAMUX_TYPE_DATA, 0, channel->id, chunk_size, chunk, chunk_size)) {
+			free(chunk);
+			return 0;
+		}
+		channel->send_window -= chunk_size;
+		sent += chunk_size;
+	}
+	free(chunk);
+	return data_size;
+}
+
+/***
+ * Close a channel. The other side is told, and the Stream is freed.
+ * @param stream_context the channel's context
+ * @returns true(1)
+ */
+int libp2p_yamux_channel_close(void* stream_context) {
+	struct SessionContext* context = (struct SessionContext*)stream_context;
+	struct YamuxChannel* channel = libp2p_yamux_channel_get(stream_context);
+	if (channel != NULL) {
+		if (!channel->local_closed && !channel->reset)
+			libp2p_yamux_send(channel->yamux, YAMUX_TYPE_WINDOW_UPDATE, YAMUX_FLAG_FIN, channel->id, 0, NULL, 0);
+		libp2p_yamux_channel_free(channel);
+	}
+	if (context->default_stream != NULL)
+		free(context->default_stream);
+	context->default_stream = NULL;
+	return 1;
+}
+
+/***
+ * See how much can be read from a channel without waiting
+ * @param stream_context the channel's context
+ * @returns the number of bytes, or -1 on error
+ */
+int libp2p_yamux_channel_peek(void* stream_context) {
+	struct YamuxChannel* channel = libp2p_yamux_channel_get(stream_context);
+	if (channel == NULL)
+		return -1;
+	return channel->buffer_size;
+}
+
+/***
+ * Build a channel and the context that is handed out for it
+ * @param yamux the session
+ * @param id the channel id
+ * @returns the channel, or NULL on error
+ */
+static struct YamuxChannel* libp2p_yamux_channel_new(struct YamuxSession* yamux, uint32_t id) {
+	struct YamuxChannel* channel = (struct YamuxChannel*) malloc(sizeof(struct YamuxChannel));
+	if (channel == NULL)
+		return NULL;
+	memset(channel, 0, sizeof(struct YamuxChannel));
+	channel->yamux = yamux;
+	channel->id = id;
+	channel->send_window = YAMUX_INITIAL_WINDOW;
+	channel->recv_window = YAMUX_INITIAL_WINDOW;
+	channel->context = libp2p_session_context_new();
+	struct Stream* stream = (struct Stream*) malloc(sizeof(struct Stream));
+	if (channel->context == NULL || stream == NULL) {
+		if (channel->context != NULL)
+			libp2p_session_context_free(channel->context);
+		if (stream != NULL)
+			free(stream);
+		free(channel);
+		return NULL;
+	}
+	memset(stream, 0, sizeof(struct Stream));
+	stream->socket_descriptor = channel;
+	stream->read = libp2p_yamux_channel_read;
+	stream->write = libp2p_yamux_channel_write;
+	stream->close = libp2p_yamux_channel_close;
+	stream->peek = libp2p_yamux_channel_peek;
+	channel->context->default_stream = stream;
+	channel->context->datastore = yamux->parent->datastore;
+	channel->context->filestore = yamux->parent->filestore;
+	channel->context->traffic_type = yamux->parent->traffic_type;
+	channel->context->port = yamux->parent->port;
+	channel->next = yamux->channels;
+	yamux->channels = channel;
+	yamux->num_channels++;
+	return channel;
+}
+
+/***
+ * Act on one frame
+ * @param yamux the session
+ * @param header the frame header
+ * @param data the data that follows (data frames only)
+ * @returns true(1) on success, false(0) if the other side broke the protocol
+ */
+static int libp2p_yamux_handle_frame(struct YamuxSession* yamux, const unsigned char* header, const unsigned char* data) {
+	uint16_t flags;
+	uint32_t id, length;
+	memcpy(&flags, &header[2], 2);
+	memcpy(&id, &header[4], 4);
+	memcpy(&length, &header[8], 4);
+	flags = ntohs(flags);
+	id = ntohl(id);
+	length = ntohl(length);
+
+	if (header[1] == YAMUX_TYPE_PING) {
+		if (flags & YAMUX_FLAG_SYN)
+			return libp2p_yamux_send(yamux, YAMUX_TYPE_PING, YAMUX_FLAG_ACK, 0, length, NULL, 0);
+		return 1;
+	}
+	if (header[1] == YAMUX_TYPE_GO_AWAY) {
+		yamux->go_away = 1;
+		return 1;
+	}
+
+	struct YamuxChannel* channel = libp2p_yamux_channel_find(yamux, id);
+	if (flags & YAMUX_FLAG_SYN) {
+		if (channel != NULL || id == 0 || (id & 1) == (yamux->next_id & 1)) {
+			libp2p_logger_error("yamux", "Invalid new channel %u.\n", id);
+			return 0;
+		}
+		channel = libp2p_yamux_channel_new(yamux, id);
+		if (channel == NULL)
+			return 0;
+		if (!libp2p_yamux_send(yamux, YAMUX_TYPE_WINDOW_UPDATE, YAMUX_FLAG_ACK, id, 0, NULL, 0))
+			return 0;
+	}
+	if (channel == NULL) {
+		// we closed it already
+		return 1;
+	}
+	if (header[1] == YAMUX_TYPE_WINDOW_UPDATE) {
+		channel->send_window += length;
+	} else if (header[1] == YAMUX_TYPE_DATA) {
+		// libp2p_yamux_frame_allowed kept it within the window
+		if (channel->buffer_capacity - channel->buffer_size < length) {
+			size_t new_capacity = channel->buffer_capacity * 2;
+			if (new_capacity < channel->buffer_size + length)
+				new_capacity = channel->buffer_size + length;
+			unsigned char* tmp = realloc(channel->buffer, new_capacity);
+			if (tmp == NULL)
+				return 0;
+			channel->buffer = tmp;
+			channel->buffer_capacity = new_capacity;
+		}
+		memcpy(&channel->buffer[channel->buffer_size], data, length);
+		channel->buffer_size += length;
+		channel->recv_window -= length;
+	} else {
+		libp2p_logger_error("yamux", "Unknown frame type %d.\n", header[1]);
+		return 0;
+	}
+	if (flags & YAMUX_FLAG_FIN)
+		channel->remote_closed = 1;
+	if (flags & YAMUX_FLAG_RST)
+		channel->reset = 1;
+	return 1;
+}
+
+/***
+ * See if the other side was allowed to send a frame, before any of its data is kept
+ * @param yamux the session
+ * @param header the frame header
+ * @returns true(1) if it was, false(0) if the other side broke the protocol
+ */
+static int libp2p_yamux_frame_allowed(struct YamuxSession* yamux, const unsigned char* header) {
+	uint16_t flags;
+	uint32_t id, length;
+	if (header[1] != YAMUX_TYPE_DATA)
+		return 1;
+	memcpy(&flags, &header[2], 2);
+	memcpy(&id, &header[4], 4);
+	memcpy(&length, &header[8], 4);
+	flags = ntohs(flags);
+	id = ntohl(id);
+	length = ntohl(length);
+	struct YamuxChannel* channel = libp2p_yamux_channel_find(yamux, id);
+	// a new channel starts with the initial window. So does one we closed already, as
+	// whatever it sends is dropped.
+	uint32_t window = YAMUX_INITIAL_WINDOW;
+	if (channel != NULL && !(flags & YAMUX_FLAG_SYN))
+		window = channel->recv_window;
+	if (length > window) {
+		libp2p_logger_error("yamux", "Channel %u sent %u bytes with a window of %u.\n", id, length, window);
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Make room for bytes that do not make a whole frame yet
+ * @param yamux the session
+ * @param needed the total number of bytes to hold
+ * @returns true(1) on success, false(0) if out of memory
+ */
+static int libp2p_yamux_input_reserve(struct YamuxSession* yamux, size_t needed) {
+	if (yamux->input_capacity >= needed)
+		return 1;
+	unsigned char* tmp = realloc(yamux->input, needed);
+	if (tmp == NULL)
+		return 0;
+	yamux->input = tmp;
+	yamux->input_capacity = needed;
+	return 1;
+}
+
+/***
+ * Deliver bytes that arrived on the connection. For callers that read the
+ * connection themselves (i.e. an event loop).
+ * @param yamux the session
+ * @param bytes the bytes
+ * @param bytes_size the number of bytes
+ * @returns true(1) on success, false(0) if the other side broke the protocol
+ */
+int libp2p_yamux_handle_bytes(struct YamuxSession* yamux, const unsigned char* bytes, size_t bytes_size) {
+	const unsigned char* current = bytes;
+	size_t remaining = bytes_size;
+	int joined = yamux->input_size > 0;
+
+	if (joined) {
+		// finish the frame that started in an earlier read
+		if (!libp2p_yamux_input_reserve(yamux, yamux->input_size + bytes_size))
+			return 0;
+		memcpy(&yamux->input[yamux->input_size], bytes, bytes_size);
+		current = yamux->input;
+		remaining = yamux->input_size + bytes_size;
+	}
+
+	while (remaining >= YAMUX_HEADER_SIZE) {
+		// checked before the frame is gathered, so the length cannot make us hold any more
+		if (!libp2p_yamux_frame_allowed(yamux, current))
+			return 0;
+		size_t frame_size = YAMUX_HEADER_SIZE;
+		if (current[1] == YAMUX_TYPE_DATA) {
+			uint32_t length;
+			memcpy(&length, &current[8], 4);
+			frame_size += ntohl(length);
+		}
+		if (frame_size > remaining)
+			break;
+		if (!libp2p_yamux_handle_frame(yamux, current, &current[YAMUX_HEADER_SIZE]))
+			return 0;
+		current += frame_size;
+		remaining -= frame_size;
+	}
+
+	// keep the start of the next frame
+	if (remaining > 0) {
+		if (joined) {
+			memmove(yamux->input, current, remaining);
+		} else {
+			if (!libp2p_yamux_input_reserve(yamux, remaining))
+				return 0;
+			memcpy(yamux->input, current, remaining);
+		}
+	}
+	yamux->input_size = remaining;
+	return 1;
+}
+
+/***
+ * Read once from the connection, and deliver the frames that arrived
+ * @param yamux the session
+ * @param timeout_secs the seconds to wait
+ * @returns true(1) on success, false(0) on timeout or error
+ */
+int libp2p_yamux_process(struct YamuxSession* yamux, int timeout_secs) {
+	struct SessionContext* parent = yamux->parent;
+	unsigned char* bytes = NULL;
+	size_t bytes_size = 0;
+	if (yamux->failed || parent->default_stream == NULL)
+		return 0;
+	if (parent->secure_stream != NULL) {
+		// one secio frame holds whatever was sent with it
+		if (!parent->default_stream->read(parent, &bytes, &bytes_size, timeout_secs))
+			return 0;
+	} else {
+		// the frames come straight off the socket, and may start in what negotiation left behind
+		int socket_fd = libp2p_yamux_socket(parent);
+		if (socket_fd < 0)
+			return 0;
+		struct RingBuffer* buffer = parent->insecure_stream->read_buffer;
+		if (buffer != NULL) {
+			if (libp2p_utils_ring_buffer_size(buffer) == 0 && socket_fill_buffer(socket_fd, buffer, 0, timeout_secs) <= 0)
+				return 0;
+			bytes_size = libp2p_utils_ring_buffer_size(buffer);
+			bytes = malloc(bytes_size);
+			if (bytes == NULL)
+				return 0;
+			libp2p_utils_ring_buffer_read(buffer, bytes, bytes_size);
+		} else {
+			bytes = malloc(YAMUX_HEADER_SIZE + YAMUX_MAX_FRAME_DATA);
+			if (bytes == NULL)
+				return 0;
+			ssize_t received = socket_read(socket_fd, (char*)bytes, YAMUX_HEADER_SIZE + YAMUX_MAX_FRAME_DATA, 0, timeout_secs);
+			if (received <= 0) {
+				free(bytes);
+				return 0;
+			}
+			bytes_size = received;
+		}
+	}
+	int retVal = libp2p_yamux_handle_bytes(yamux, bytes, bytes_size);
+	free(bytes);
+	if (!retVal)
+		yamux->failed = 1;
+	return retVal;
+}
+
+/***
+ * Start multiplexing a connection
+ * @param parent the connection. It must stay open until the session is freed
+ * @param initiator true(1) if we opened the connection. This keeps channel ids from colliding
+ * @returns the session, or NULL on error
+ */
+struct YamuxSession* libp2p_yamux_session_new(struct SessionContext* parent, int initiator) {
+	struct YamuxSession* yamux = (struct YamuxSession*) malloc(sizeof(struct YamuxSession));
+	if (yamux != NULL) {
+		yamux->parent = parent;
+		yamux->next_id = initiator ? 1 : 2;
+		yamux->channels = NULL;
+		yamux->num_channels = 0;
+		yamux->input = NULL;
+		yamux->input_size = 0;
+		yamux->input_capacity = 0;
+		yamux->go_away = 0;
+		yamux->failed = 0;
+	}
+	return yamux;
+}
+
+/***
+ * Close all channels and free the session. The connection itself is left open.
+ * NOTE: channel contexts handed out by the session are freed too
+ * @param yamux the session
+ */
+void libp2p_yamux_session_free(struct YamuxSession* yamux) {
+	if (yamux == NULL)
+		return;
+	if (!yamux->failed)
+		libp2p_yamux_send(yamux, YAMUX_TYPE_GO_AWAY, 0, 0, 0, NULL, 0);
+	// nothing more goes out
+	yamux->failed = 1;
+	while (yamux->channels != NULL)
+		libp2p_session_context_free(yamux->channels->context);
+	if (yamux->input != NULL)
+		free(yamux->input);
+	free(yamux);
+}
+
+/***
+ * Open a new channel
+ * @param yamux the session
+ * @returns the channel's context, or NULL on error. Free it with libp2p_session_context_free
+ */
+struct SessionContext* libp2p_yamux_open(struct YamuxSession* yamux) {
+	if (yamux->failed || yamux->go_away)
+		return NULL;
+	struct YamuxChannel* channel = libp2p_yamux_channel_new(yamux, yamux->next_id);
+	if (channel == NULL)
+		return NULL;
+	yamux->next_id += 2;
+	channel->accepted = 1;
+	struct SessionContext* context = channel->context;
+	if (!libp2p_yamux_send(yamux, YAMUX_TYPE_WINDOW_UPDATE, YAMUX_FLAG_SYN, channel->id, 0, NULL, 0)) {
+		libp2p_session_context_free(context);
+		return NULL;
+	}
+	return context;
+}
+
+/***
+ * Wait for the other side to open a channel
+ * @param yamux the session
+ * @param timeout_secs the seconds to wait
+ * @returns the channel's context, or NULL on timeout or error. Free it with libp2p_session_context_free
+ */
+struct SessionContext* libp2p_yamux_accept(struct YamuxSession* yamux, int timeout_secs) {
+	while (1) {
+		// the oldest is at the end of the list
+		struct YamuxChannel* found = NULL;
+		for(struct YamuxChannel* current = yamux->channels; current != NULL; current = current->next) {
+			if (!current->accepted)
+				found = current;
+		}
+		if (found != NULL) {
+			found->accepted = 1;
+			return found->context;
+		}
+		if (!libp2p_yamux_process(yamux, timeout_secs))
+			return NULL;
+	}
+}
+
+/***
+ * Negotiate yamux on a connection (client side)
+ * @param context the connection
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_yamux_upgrade_stream(struct SessionContext* context) {
+	int retVal = 0;
+	char* protocol = "/yamux/1.0.0\n";
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+	if (!context->default_stream->write(context, (unsigned char*)protocol, strlen(protocol)))
+		goto exit;
+	if (!context->default_stream->read(context, &results, &results_size, 5))
+		goto exit;
+	if (results_size != strlen(protocol))
+		goto exit;
+	if (strncmp((char*)results, protocol, results_size) != 0)
+		goto exit;
+	retVal = 1;
+	exit:
+	if (results != NULL) {
+		free(results);
+		results = NULL;
+	}
+	return retVal;
+}
+
+/***
+ * Answer a request to use yamux (server side)
+ * @param context the connection
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_yamux_handshake(struct SessionContext* context) {
+	char* protocol = "/yamux/1.0.0\n";
+	return context->default_stream->write(context, (unsigned char*)protocol, strlen(protocol));
+}
@@ -3,6 +3,7 @@
 
 #include "multiaddr/multiaddr.h"
 #include "protobuf.h"
+#include "libp2p/conn/dialer.h"
 #include "libp2p/net/multistream.h"
 #include "libp2p/peer/peer.h"
 #include "libp2p/secio/secio.h"
@@ -21,6 +22,7 @@ struct Libp2pPeer* libp2p_peer_new() {
 		out->addr_head = NULL;
 		out->connection_type = CONNECTION_TYPE_NOT_CONNECTED;
 		out->sessionContext = NULL;
+		out->dialer = NULL;
 		out->is_local = 0;
 	}
 	return out;
@@ -58,7 +60,11 @@ void libp2p_peer_free(struct Libp2pPeer* in) {
 		}
 		if (in->id != NULL)
 			free(in->id);
-		if (in->sessionContext != NULL) {
+		if (in->sessionContext != NULL && in->dialer != NULL) {
+			// hand it back, so the dialer may close it
+			libp2p_conn_dialer_release_session(in->dialer, in->sessionContext);
+			in->sessionContext = NULL;
+		} else if (in->sessionContext != NULL) {
 			libp2p_session_context_free(in->sessionContext);
 			//libp2p_net_multistream_stream_free(in->connection);
 			in->sessionContext = NULL;
@@ -82,51 +88,85 @@ void libp2p_peer_free(struct Libp2pPeer* in) {
  */
 int libp2p_peer_handle_connection_error(struct Libp2pPeer* peer) {
 	peer->connection_type = CONNECTION_TYPE_NOT_CONNECTED;
-	libp2p_session_context_free(peer->sessionContext);
+	if (peer->dialer != NULL)
+		libp2p_conn_dialer_close_session(peer->dialer, peer->sessionContext);
+	else
+		libp2p_session_context_free(peer->sessionContext);
 	peer->sessionContext = NULL;
+	peer->dialer = NULL;
 	return 1;
 }
 
 /**
  * Attempt to connect to the peer, setting connection_type correctly
- * NOTE: If successful, this will set peer->connection to the stream
+ * NOTE: If successful, this will set peer->sessionContext. With a dialer, the
+ * session belongs to the dialer's connections. The peer borrows it until it is
+ * freed, or connects again.
  *
- * @param privateKey the local private key to use
+ * @param privateKey the local private key to use (with a dialer, NULL does not secure the connection)
  * @param peer the peer to connect to
  * @param peerstore if connection is successfull, will add peer to peerstore
+ * @param timeout seconds to keep trying addresses
+ * @param dialer reuses an open connection to the peer if it has one (NULL to always dial)
  * @returns true(1) on success, false(0) if we could not connect
  */
-int libp2p_peer_connect(struct RsaPrivateKey* privateKey, struct Libp2pPeer* peer, struct Peerstore* peerstore, int timeout) {
+int libp2p_peer_connect(struct RsaPrivateKey* privateKey, struct Libp2pPeer* peer, struct Peerstore* peerstore, int timeout, struct Dialer* dialer) {
 	time_t now, prev = time(NULL);
+	char* peer_id = NULL;
+	if (peer->dialer != NULL) {
+		// the other side may have hung up since, so ask again
+		libp2p_conn_dialer_release_session(peer->dialer, peer->sessionContext);
+		peer->sessionContext = NULL;
+		peer->dialer = NULL;
+		peer->connection_type = CONNECTION_TYPE_NOT_CONNECTED;
+	}
+	if (dialer != NULL && peer->id_size > 0) {
+		peer_id = malloc(peer->id_size + 1);
+		if (peer_id == NULL)
+			return 0;
+		memcpy(peer_id, peer->id, peer->id_size);
+		peer_id[peer->id_size] = 0;
+	}
 	// find an appropriate address
 	struct Libp2pLinkedList* current_address = peer->addr_head;
 	while (current_address != NULL && peer->connection_type != CONNECTION_TYPE_CONNECTED) {
 		struct MultiAddress *ma = (struct MultiAddress*)current_address->item;
-		if (multiaddress_is_ip(ma)) {
-			char* ip = NULL;
-			if (!multiaddress_get_ip_address(ma, &ip))
-				continue;
-			int port = multiaddress_get_ip_port(ma);
-			peer->sessionContext = libp2p_session_context_new();
-			peer->sessionContext->insecure_stream = libp2p_net_multistream_connect(ip, port);
-			if (peer->sessionContext->insecure_stream == NULL) {
-				free(ip);
-				return 0;
-			}
-			if (peer->sessionContext->insecure_stream != NULL) {
-				peer->sessionContext->default_stream = peer->sessionContext->insecure_stream;
+		if (dialer != NULL && multiaddress_is_ip(ma)) {
+			struct SessionContext* session = libp2p_conn_dialer_get_session(dialer, peer_id, ma, privateKey, peerstore);
+			// if this is the peerstore's copy of the peer, the dialer has already lent it the session
+			if (session != NULL && peer->sessionContext == session && peer->dialer == dialer)
+				libp2p_conn_dialer_release_session(dialer, session);
+			if (session != NULL) {
+				peer->sessionContext = session;
+				peer->dialer = dialer;
 				peer->connection_type = CONNECTION_TYPE_CONNECTED;
 			}
-			if (libp2p_secio_initiate_handshake(peer->sessionContext, privateKey, peerstore) <= 0) {
-				free(ip);
-				return 0;
+		} else if (multiaddress_is_ip(ma)) {
+			char* ip = NULL;
+			struct SessionContext* session = NULL;
+			if (multiaddress_get_ip_address(ma, &ip))
+				session = libp2p_session_context_new();
+			if (session != NULL) {
+				session->insecure_stream = libp2p_net_multistream_connect(ip, multiaddress_get_ip_port(ma));
+				session->default_stream = session->insecure_stream;
+				if (session->insecure_stream != NULL && libp2p_secio_initiate_handshake(session, privateKey, peerstore) > 0) {
+					peer->sessionContext = session;
+					peer->connection_type = CONNECTION_TYPE_CONNECTED;
+				} else {
+					libp2p_logger_debug("peer", "Unable to connect to %s.\n", ma->string);
+					libp2p_session_context_free(session);
+				}
 			}
-			free(ip);
+			if (ip != NULL)
+				free(ip);
 		} // is IP
 		now = time(NULL);
 		if (now >= (prev + timeout))
 			break;
+		current_address = current_address->next;
 	} // trying to connect
+	if (peer_id != NULL)
+		free(peer_id);
 	return peer->connection_type == CONNECTION_TYPE_CONNECTED;
 }
 
@@ -166,6 +206,13 @@ struct Libp2pPeer* libp2p_peer_copy(const struct Libp2pPeer* in) {
 			current_in = current_in->next;
 		}
 		out->sessionContext = in->sessionContext;
+		out->dialer = in->dialer;
+		// the copy borrows the dialer's session too
+		if (out->dialer != NULL && !libp2p_conn_dialer_retain_session(out->dialer, out->sessionContext)) {
+			out->sessionContext = NULL;
+			out->dialer = NULL;
+			out->connection_type = CONNECTION_TYPE_NOT_CONNECTED;
+		}
 	}
 	return out;
 }
@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "libp2p/peer/peerstore.h"
+#include "libp2p/crypto/sha256.h"
 #include "libp2p/utils/logger.h"
 
 /***
@@ -40,10 +42,243 @@ struct PeerEntry* libp2p_peer_entry_copy(struct PeerEntry* in) {
 			free(out);
 			return NULL;
 		}
+		memcpy(out->kademlia_id, in->kademlia_id, 32);
 	}
 	return out;
 }
 
+// the number of slots the index starts with. Always a power of 2
+#define PEERSTORE_INDEX_INITIAL_CAPACITY 64
+
+/***
+ * Hash a peer id (FNV-1a)
+ * @param peer_id the peer id
+ * @param peer_id_size the size of peer_id
+ * @returns the hash
+ */
+static size_t libp2p_peerstore_hash(const unsigned char* peer_id, size_t peer_id_size) {
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < peer_id_size; i++) {
+		hash ^= peer_id[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/***
+ * Put an entry in a free slot of the index. The index must have room.
+ * @param index the index
+ * @param capacity the number of slots
+ * @param entry the entry
+ */
+static void libp2p_peerstore_index_put(struct PeerEntry** index, size_t capacity, struct PeerEntry* entry) {
+	size_t pos = libp2p_peerstore_hash((unsigned char*)entry->peer->id, entry->peer->id_size) & (capacity - 1);
+	while (index[pos] != NULL)
+		pos = (pos + 1) & (capacity - 1);
+	index[pos] = entry;
+}
+
+/***
+ * Add an entry to the index, growing it to keep it at most half full
+ * @param peerstore the peerstore
+ * @param entry the entry
+ * @returns true(1) on success, false(0) if out of memory
+ */
+static int libp2p_peerstore_index_add(struct Peerstore* peerstore, struct PeerEntry* entry) {
+	if ((peerstore->num_entries + 1) * 2 > peerstore->index_capacity) {
+		size_t new_capacity = peerstore->index_capacity == 0 ? PEERSTORE_INDEX_INITIAL_CAPACITY : peerstore->index_capacity * 2;
+		struct PeerEntry** new_index = (struct PeerEntry**) calloc(new_capacity, sizeof(struct PeerEntry*));
+		if (new_index == NULL)
+			return 0;
+		for(size_t i = 0; i < peerstore->index_capacity; i++) {
+			if (peerstore->index[i] != NULL)
+				libp2p_peerstore_index_put(new_index, new_capacity, peerstore->index[i]);
+		}
+		free(peerstore->index);
+		peerstore->index = new_index;
+		peerstore->index_capacity = new_capacity;
+	}
+	libp2p_peerstore_index_put(peerstore->index, peerstore->index_capacity, entry);
+	peerstore->num_entries++;
+	return 1;
+}
+
+/***
+ * Build an empty leaf for the kademlia index
+ * @returns the node, or NULL if out of memory
+ */
+static struct PeerstoreKademliaNode* libp2p_peerstore_kademlia_node_new() {
+	struct PeerstoreKademliaNode* out = (struct PeerstoreKademliaNode*) malloc(sizeof(struct PeerstoreKademliaNode));
+	if (out != NULL) {
+		out->children[0] = NULL;
+		out->children[1] = NULL;
+		out->entries = NULL;
+		out->num_entries = 0;
+		out->entries_capacity = 0;
+	}
+	return out;
+}
+
+/***
+ * Free a node of the kademlia index, and everything under it. The entries are left alone.
+ * @param node the node
+ */
+static void libp2p_peerstore_kademlia_node_free(struct PeerstoreKademliaNode* node) {
+	if (node != NULL) {
+		libp2p_peerstore_kademlia_node_free(node->children[0]);
+		libp2p_peerstore_kademlia_node_free(node->children[1]);
+		if (node->entries != NULL)
+			free(node->entries);
+		free(node);
+	}
+}
+
+/***
+ * Retrieve one bit of a kademlia id
+ * @param id the id (32 bytes)
+ * @param position the bit, counting from the most significant
+ * @returns 0 or 1
+ */
+static int libp2p_peerstore_kademlia_bit(const unsigned char* id, int position) {
+	return (id[position / 8] >> (7 - (position % 8))) & 1;
+}
+
+/***
+ * Add an entry to a leaf
+ * @param node the leaf
+ * @param entry the entry
+ * @returns true(1) on success, false(0) if out of memory
+ */
+static int libp2p_peerstore_kademlia_leaf_add(struct PeerstoreKademliaNode* node, struct PeerEntry* entry) {
+	if (node->num_entries == node->entries_capacity) {
+		int new_capacity = node->entries_capacity == 0 ? PEERSTORE_KADEMLIA_LEAF_SIZE + 1 : node->entries_capacity * 2;
+		struct PeerEntry** tmp = (struct PeerEntry**) realloc(node->entries, new_capacity * sizeof(struct PeerEntry*));
+		if (tmp == NULL)
+			return 0;
+		node->entries = tmp;
+		node->entries_capacity = new_capacity;
+	}
+	node->entries[node->num_entries++] = entry;
+	return 1;
+}
+
+/***
+ * Add an entry to the kademlia index, splitting leaves that get too big
+ * @param peerstore the peerstore
+ * @param entry the entry, with kademlia_id set
+ * @returns true(1) on success, false(0) if out of memory
+ */
+static int libp2p_peerstore_kademlia_add(struct Peerstore* peerstore, struct PeerEntry* entry) {
+	if (peerstore->kademlia_index == NULL) {
+		peerstore->kademlia_index = libp2p_peerstore_kademlia_node_new();
+		if (peerstore->kademlia_index == NULL)
+			return 0;
+	}
+	struct PeerstoreKademliaNode* node = peerstore->kademlia_index;
+	int depth = 0;
+	while (node->children[0] != NULL) {
+		node = node->children[libp2p_peerstore_kademlia_bit(entry->kademlia_id, depth)];
+		depth++;
+	}
+	if (!libp2p_peerstore_kademlia_leaf_add(node, entry))
+		return 0;
+	// identical ids can not be told apart, so the last leaf just grows
+	if (node->num_entries <= PEERSTORE_KADEMLIA_LEAF_SIZE || depth >= 256)
+		return 1;
+	struct PeerstoreKademliaNode* zero = libp2p_peerstore_kademlia_node_new();
+	struct PeerstoreKademliaNode* one = libp2p_peerstore_kademlia_node_new();
+	if (zero == NULL || one == NULL) {
+		// it still works as a big leaf
+		libp2p_peerstore_kademlia_node_free(zero);
+		libp2p_peerstore_kademlia_node_free(one);
+		return 1;
+	}
+	for(int i = 0; i < node->num_entries; i++) {
+		struct PeerstoreKademliaNode* child = libp2p_peerstore_kademlia_bit(node->entries[i]->kademlia_id, depth) ? one : zero;
+		if (!libp2p_peerstore_kademlia_leaf_add(child, node->entries[i])) {
+			libp2p_peerstore_kademlia_node_free(zero);
+			libp2p_peerstore_kademlia_node_free(one);
+			return 1;
+		}
+	}
+	free(node->entries);
+	node->entries = NULL;
+	node->num_entries = 0;
+	node->entries_capacity = 0;
+	node->children[0] = zero;
+	node->children[1] = one;
+	return 1;
+}
+
+/***
+ * Compare the XOR distance of two ids to a target
+ * @param a the first id
+ * @param b the second id
+ * @param target the target
+ * @returns less than 0 if a is closer, more than 0 if b is closer, 0 if the same
+ */
+static int libp2p_peerstore_kademlia_compare(const unsigned char* a, const unsigned char* b, const unsigned char* target) {
+	for(int i = 0; i < 32; i++) {
+		unsigned char distance_a = a[i] ^ target[i];
+		unsigned char distance_b = b[i] ^ target[i];
+		if (distance_a != distance_b)
+			return distance_a < distance_b ? -1 : 1;
+	}
+	return 0;
+}
+
+/***
+ * Gather entries from the index, closest first. Everything under the child
+ * that matches the target's bit is closer than everything under the other.
+ * @param node where to start
+ * @param depth the depth of node
+ * @param target the kademlia id to measure from
+ * @param results where to put the peers
+ * @param num_results the number of peers found so far
+ * @param max_results the most peers to find
+ * @returns the number of peers found so far
+ */
+static int libp2p_peerstore_kademlia_collect(struct PeerstoreKademliaNode* node, int depth, const unsigned char* target,
+		struct Libp2pPeer** results, int num_results, int max_results) {
+	if (node == NULL || num_results >= max_results)
+		return num_results;
+	if (node->children[0] != NULL) {
+		int bit = libp2p_peerstore_kademlia_bit(target, depth);
+		num_results = libp2p_peerstore_kademlia_collect(node->children[bit], depth + 1, target, results, num_results, max_results);
+		return libp2p_peerstore_kademlia_collect(node->children[!bit], depth + 1, target, results, num_results, max_results);
+	}
+	// a leaf is small, so sort it in place
+	for(int i = 1; i < node->num_entries; i++) {
+		struct PeerEntry* current = node->entries[i];
+		int j = i - 1;
+		while (j >= 0 && libp2p_peerstore_kademlia_compare(node->entries[j]->kademlia_id, current->kademlia_id, target) > 0) {
+			node->entries[j + 1] = node->entries[j];
+			j--;
+		}
+		node->entries[j + 1] = current;
+	}
+	for(int i = 0; i < node->num_entries && num_results < max_results; i++)
+		results[num_results++] = node->entries[i]->peer;
+	return num_results;
+}
+
+/***
+ * Find the peers closest to a key by XOR distance (of the sha256 of each)
+ * @param peerstore the peerstore
+ * @param key the key (a peer id or a hash)
+ * @param key_size the size of the key
+ * @param results where to put the peers, closest first. They belong to the peerstore
+ * @param max_results the most peers to find
+ * @returns the number of peers put in results
+ */
+int libp2p_peerstore_get_closest_peers(struct Peerstore* peerstore, const unsigned char* key, size_t key_size, struct Libp2pPeer** results, int max_results) {
+	unsigned char target[32];
+	if (peerstore == NULL || key == NULL || key_size == 0 || max_results <= 0)
+		return 0;
+	libp2p_crypto_hashing_sha256(key, key_size, target);
+	return libp2p_peerstore_kademlia_collect(peerstore->kademlia_index, 0, target, results, 0, max_results);
+}
+
 /**
  * Creates a new empty peerstore
  * @param peer_id the peer id as a null terminated string
@@ -54,6 +289,10 @@ struct Peerstore* libp2p_peerstore_new(const struct Libp2pPeer* local_peer) {
 	if (out != NULL) {
 		out->head_entry = NULL;
 		out->last_entry = NULL;
+		out->num_entries = 0;
+		out->index = NULL;
+		out->index_capacity = 0;
+		out->kademlia_index = NULL;
 		// now add this peer as the first entry
 		libp2p_peerstore_add_peer(out, local_peer);
 	}
@@ -78,6 +317,8 @@ int libp2p_peerstore_free(struct Peerstore* in) {
 		}
 		// now free the linked list entries
 		libp2p_utils_linked_list_free(in->head_entry);
+		free(in->index);
+		libp2p_peerstore_kademlia_node_free(in->kademlia_index);
 		// and finally the peerstore itself
 		free(in);
 	}
@@ -98,6 +339,17 @@ int libp2p_peerstore_add_peer_entry(struct Peerstore* peerstore, struct PeerEntr
 	if (new_item == NULL)
 		return 0;
 
+	// entries without an id can not be looked up, so they are only in the list
+	if (peer_entry->peer != NULL && peer_entry->peer->id_size > 0) {
+		if (!libp2p_peerstore_index_add(peerstore, peer_entry)) {
+			libp2p_utils_linked_list_free(new_item);
+			return 0;
+		}
+		libp2p_crypto_hashing_sha256((unsigned char*)peer_entry->peer->id, peer_entry->peer->id_size, peer_entry->kademlia_id);
+		if (!libp2p_peerstore_kademlia_add(peerstore, peer_entry))
+			libp2p_logger_error("peerstore", "Unable to add peer to the kademlia index.\n");
+	}
+
 	new_item->item = peer_entry;
 	if (peerstore->head_entry == NULL) {
 		peerstore->head_entry = new_item;
@@ -160,15 +412,15 @@ struct PeerEntry* libp2p_peerstore_get_peer_entry(struct Peerstore* peerstore, c
 	if (peer_id_size == 0 || peer_id == NULL)
 		return NULL;
 
-	struct Libp2pLinkedList* current = peerstore->head_entry;
-	while(current != NULL) {
-		struct Libp2pPeer* peer = ((struct PeerEntry*)current->item)->peer;
-		if (peer->id_size == peer_id_size) {
-			if (memcmp(peer_id, peer->id, peer->id_size) == 0) {
-				return (struct PeerEntry*)current->item;
-			}
-		}
-		current = current->next;
+	if (peerstore->index_capacity == 0)
+		return NULL;
+
+	size_t pos = libp2p_peerstore_hash(peer_id, peer_id_size) & (peerstore->index_capacity - 1);
+	while (peerstore->index[pos] != NULL) {
+		struct Libp2pPeer* peer = peerstore->index[pos]->peer;
+		if (peer->id_size == peer_id_size && memcmp(peer_id, peer->id, peer->id_size) == 0)
+			return peerstore->index[pos];
+		pos = (pos + 1) & (peerstore->index_capacity - 1);
 	}
 	return NULL;
 }
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "libp2p/peer/providerstore.h"
@@ -9,6 +10,26 @@
  * Stores hashes, and peers where you can possibly get them
  */
 
+// the number of buckets the table starts with. Always a power of 2
+#define PROVIDERSTORE_INITIAL_BUCKETS 64
+// how many buckets each add looks at for old announcements
+#define PROVIDERSTORE_EXPIRE_STEP 4
+
+/***
+ * Hash a key (FNV-1a)
+ * @param hash the key
+ * @param hash_size the size of the key
+ * @returns the bucket hash
+ */
+static size_t libp2p_providerstore_hash(const unsigned char* hash, int hash_size) {
+	uint32_t out = 2166136261u;
+	for(int i = 0; i < hash_size; i++) {
+		out ^= hash[i];
+		out *= 16777619u;
+	}
+	return out;
+}
+
 /**
  * Create a new ProviderStore
  * @param datastore the datastore (required in order to look for the file locally)
@@ -20,17 +41,27 @@ struct ProviderStore* libp2p_providerstore_new(const struct Datastore* datastore
 	if (out != NULL) {
 		out->datastore = datastore;
 		out->local_peer = local_peer;
-		out->provider_entries = libp2p_utils_vector_new(4);
+		out->num_buckets = PROVIDERSTORE_INITIAL_BUCKETS;
+		out->num_keys = 0;
+		out->num_entries = 0;
+		out->ttl_secs = PROVIDERSTORE_DEFAULT_TTL_SECS;
+		out->max_per_key = PROVIDERSTORE_DEFAULT_MAX_PER_KEY;
+		out->expire_position = 0;
+		out->buckets = (struct ProviderKey**) calloc(out->num_buckets, sizeof(struct ProviderKey*));
+		if (out->buckets == NULL) {
+			free(out);
+			return NULL;
+		}
 	}
 	return out;
 }
 
+/***
+ * Free a ProviderEntry
+ * @param in the entry
+ */
 void libp2p_providerstore_entry_free(struct ProviderEntry* in) {
 	if (in != NULL) {
-		if (in->hash != NULL) {
-			free(in->hash);
-			in->hash_size = 0;
-		}
 		if (in->peer_id != NULL) {
 			free(in->peer_id);
 			in->peer_id_size = 0;
@@ -39,22 +70,174 @@ void libp2p_providerstore_entry_free(struct ProviderEntry* in) {
 	}
 }
 
+/***
+ * Build a ProviderEntry
+ * @param peer_id the peer id
+ * @param peer_id_size the length of the peer id
+ * @param timestamp when it was announced
+ * @returns the entry, or NULL on error
+ */
+static struct ProviderEntry* libp2p_providerstore_entry_new(const unsigned char* peer_id, int peer_id_size, time_t timestamp) {
+	struct ProviderEntry* out = (struct ProviderEntry*)malloc(sizeof(struct ProviderEntry));
+	if (out != NULL) {
+		out->peer_id = malloc(peer_id_size);
+		if (out->peer_id == NULL) {
+			free(out);
+			return NULL;
+		}
+		memcpy(out->peer_id, peer_id, peer_id_size);
+		out->peer_id_size = peer_id_size;
+		out->timestamp = timestamp;
+	}
+	return out;
+}
+
+/***
+ * Free a key and its providers
+ * @param in the key
+ */
+static void libp2p_providerstore_key_free(struct ProviderKey* in) {
+	if (in != NULL) {
+		if (in->providers != NULL) {
+			for(int i = 0; i < in->providers->total; i++)
+				libp2p_providerstore_entry_free((struct ProviderEntry*) libp2p_utils_vector_get(in->providers, i));
+			libp2p_utils_vector_free(in->providers);
+		}
+		if (in->hash != NULL)
+			free(in->hash);
+		free(in);
+	}
+}
+
 /***
  * Clean resources used by a ProviderStore
  * @param in the ProviderStore to clean up
  */
 void libp2p_providerstore_free(struct ProviderStore* in) {
 	if (in != NULL) {
-		for(int i = 0; i < in->provider_entries->total; i++) {
-			struct ProviderEntry* entry = (struct ProviderEntry*) libp2p_utils_vector_get(in->provider_entries, i);
-			libp2p_providerstore_entry_free(entry);
+		for(size_t i = 0; i < in->num_buckets; i++) {
+			struct ProviderKey* current = in->buckets[i];
+			while (current != NULL) {
+				struct ProviderKey* next = current->next;
+				libp2p_providerstore_key_free(current);
+				current = next;
+			}
 		}
-		libp2p_utils_vector_free(in->provider_entries);
+		free(in->buckets);
 		free(in);
 		in = NULL;
 	}
 }
 
+/***
+ * Find a key in the table
+ * @param store the ProviderStore
+ * @param hash the key
+ * @param hash_size the size of the key
+ * @returns the key, or NULL if nobody announced it
+ */
+static struct ProviderKey* libp2p_providerstore_find_key(struct ProviderStore* store, const unsigned char* hash, int hash_size) {
+	struct ProviderKey* current = store->buckets[libp2p_providerstore_hash(hash, hash_size) & (store->num_buckets - 1)];
+	while (current != NULL) {
+		if (current->hash_size == hash_size && memcmp(current->hash, hash, hash_size) == 0)
+			return current;
+		current = current->next;
+	}
+	return NULL;
+}
+
+/***
+ * Double the number of buckets
+ * @param store the ProviderStore
+ * @returns true(1) on success, false(0) if out of memory
+ */
+static int libp2p_providerstore_grow(struct ProviderStore* store) {
+	size_t new_size = store->num_buckets * 2;
+	struct ProviderKey** new_buckets = (struct ProviderKey**) calloc(new_size, sizeof(struct ProviderKey*));
+	if (new_buckets == NULL)
+		return 0;
+	for(size_t i = 0; i < store->num_buckets; i++) {
+		struct ProviderKey* current = store->buckets[i];
+		while (current != NULL) {
+			struct ProviderKey* next = current->next;
+			size_t pos = libp2p_providerstore_hash(current->hash, current->hash_size) & (new_size - 1);
+			current->next = new_buckets[pos];
+			new_buckets[pos] = current;
+			current = next;
+		}
+	}
+	free(store->buckets);
+	store->buckets = new_buckets;
+	store->num_buckets = new_size;
+	store->expire_position = 0;
+	return 1;
+}
+
+/***
+ * Drop a key's announcements that are older than ttl_secs
+ * @param store the ProviderStore
+ * @param key the key
+ * @param now the current time
+ * @returns the number of announcements dropped
+ */
+static int libp2p_providerstore_expire_key(struct ProviderStore* store, struct ProviderKey* key, time_t now) {
+	// oldest first, so only the front needs to be looked at
+	int expired = 0;
+	while (expired < key->providers->total) {
+		struct ProviderEntry* entry = (struct ProviderEntry*) libp2p_utils_vector_get(key->providers, expired);
+		if (now - entry->timestamp < store->ttl_secs)
+			break;
+		libp2p_providerstore_entry_free(entry);
+		expired++;
+	}
+	if (expired > 0) {
+		int remaining = key->providers->total - expired;
+		memmove(&key->providers->items[0], &key->providers->items[expired], remaining * sizeof(void*));
+		key->providers->total = remaining;
+		store->num_entries -= expired;
+	}
+	return expired;
+}
+
+/***
+ * Drop announcements older than ttl_secs, a few buckets at a time.
+ * Each call continues where the last one stopped.
+ * @param store the ProviderStore
+ * @param max_buckets the most buckets to look at
+ * @returns the number of announcements dropped
+ */
+int libp2p_providerstore_expire(struct ProviderStore* store, size_t max_buckets) {
+	int expired = 0;
+	time_t now = time(NULL);
+	if (max_buckets > store->num_buckets)
+		max_buckets = store->num_buckets;
+	for(size_t i = 0; i < max_buckets; i++) {
+		struct ProviderKey** current = &store->buckets[store->expire_position];
+		while (*current != NULL) {
+			struct ProviderKey* key = *current;
+			expired += libp2p_providerstore_expire_key(store, key, now);
+			if (key->providers->total == 0) {
+				*current = key->next;
+				libp2p_providerstore_key_free(key);
+				store->num_keys--;
+			} else {
+				current = &key->next;
+			}
+		}
+		store->expire_position = (store->expire_position + 1) & (store->num_buckets - 1);
+	}
+	return expired;
+}
+
+/***
+ * Remember that a peer can provide a hash. If the peer already announced it, only the time is updated.
+ * @param store the ProviderStore
+ * @param hash the hash
+ * @param hash_size the length of the hash
+ * @param peer_id the peer id
+ * @param peer_id_size the length of the peer id
+ * @returns true(1) on success, false(0) otherwise
+ */
 int libp2p_providerstore_add(struct ProviderStore* store, const unsigned char* hash, int hash_size, const unsigned char* peer_id, int peer_id_size) {
 	char hash_str[hash_size + 1];
 	memcpy(hash_str, hash, hash_size);
@@ -63,17 +246,87 @@ int libp2p_providerstore_add(struct ProviderStore* store, const unsigned char* h
 	memcpy(peer_str, peer_id, peer_id_size);
 	peer_str[peer_id_size] = 0;
 	libp2p_logger_debug("providerstore", "Adding hash %s to providerstore. It can be retrieved from %s\n", hash_str, peer_str);
-	struct ProviderEntry* entry = (struct ProviderEntry*)malloc(sizeof(struct ProviderEntry));
-	entry->hash = malloc(hash_size);
-	memcpy(entry->hash, hash, hash_size);
-	entry->hash_size = hash_size;
-	entry->peer_id = malloc(peer_id_size);
-	memcpy(entry->peer_id, peer_id, peer_id_size);
-	entry->peer_id_size = peer_id_size;
-	libp2p_utils_vector_add(store->provider_entries, entry);
+
+	libp2p_providerstore_expire(store, PROVIDERSTORE_EXPIRE_STEP);
+
+	struct ProviderKey* key = libp2p_providerstore_find_key(store, hash, hash_size);
+	if (key == NULL) {
+		if (store->num_keys >= store->num_buckets && !libp2p_providerstore_grow(store))
+			return 0;
+		key = (struct ProviderKey*) malloc(sizeof(struct ProviderKey));
+		if (key == NULL)
+			return 0;
+		key->hash = malloc(hash_size);
+		key->hash_size = hash_size;
+		key->providers = libp2p_utils_vector_new(4);
+		if (key->hash == NULL || key->providers == NULL) {
+			libp2p_providerstore_key_free(key);
+			return 0;
+		}
+		memcpy(key->hash, hash, hash_size);
+		size_t pos = libp2p_providerstore_hash(hash, hash_size) & (store->num_buckets - 1);
+		key->next = store->buckets[pos];
+		store->buckets[pos] = key;
+		store->num_keys++;
+	}
+
+	// an announcement we have already moves to the back with a new time
+	struct ProviderEntry* entry = NULL;
+	for(int i = 0; i < key->providers->total; i++) {
+		struct ProviderEntry* current = (struct ProviderEntry*) libp2p_utils_vector_get(key->providers, i);
+		if (current->peer_id_size == peer_id_size && memcmp(current->peer_id, peer_id, peer_id_size) == 0) {
+			entry = current;
+			libp2p_utils_vector_delete(key->providers, i);
+			store->num_entries--;
+			break;
+		}
+	}
+	if (entry == NULL) {
+		entry = libp2p_providerstore_entry_new(peer_id, peer_id_size, 0);
+		if (entry == NULL)
+			return 0;
+		// make room by dropping the oldest
+		if (store->max_per_key > 0 && key->providers->total >= store->max_per_key) {
+			libp2p_providerstore_entry_free((struct ProviderEntry*) libp2p_utils_vector_get(key->providers, 0));
+			libp2p_utils_vector_delete(key->providers, 0);
+			store->num_entries--;
+		}
+	}
+	entry->timestamp = time(NULL);
+	libp2p_utils_vector_add(key->providers, entry);
+	store->num_entries++;
 	return 1;
 }
 
+/***
+ * Retrieve the peers that announced a hash, most recent first
+ * NOTE: this does not look in the datastore
+ * @param store the ProviderStore
+ * @param hash what we're looking for
+ * @param hash_size the length of the hash
+ * @param max_results the most peers to return
+ * @param results a new vector of ProviderEntry structs. Free each with libp2p_providerstore_entry_free
+ * @returns the number of peers found
+ */
+int libp2p_providerstore_get_providers(struct ProviderStore* store, const unsigned char* hash, int hash_size, int max_results, struct Libp2pVector** results) {
+	*results = libp2p_utils_vector_new(4);
+	if (*results == NULL)
+		return 0;
+	struct ProviderKey* key = libp2p_providerstore_find_key(store, hash, hash_size);
+	if (key == NULL)
+		return 0;
+	libp2p_providerstore_expire_key(store, key, time(NULL));
+	for(int i = key->providers->total - 1; i >= 0 && (*results)->total < max_results; i--) {
+		struct ProviderEntry* current = (struct ProviderEntry*) libp2p_utils_vector_get(key->providers, i);
+		struct ProviderEntry* copy = libp2p_providerstore_entry_new(current->peer_id, current->peer_id_size, current->timestamp);
+		if (copy == NULL)
+			break;
+		libp2p_utils_vector_add(*results, copy);
+	}
+	// an empty key is removed by the next expire pass over its bucket
+	return (*results)->total;
+}
+
 /**
  * See if someone has announced a key. If so, pass the peer_id
  * NOTE: This will check to see if I can provide it from my datastore
@@ -86,11 +339,8 @@ int libp2p_providerstore_add(struct ProviderStore* store, const unsigned char* h
  * @returns true(1) if we found something, false(0) if not.
  */
 int libp2p_providerstore_get(struct ProviderStore* store, const unsigned char* hash, int hash_size, unsigned char** peer_id, int *peer_id_size) {
-	struct ProviderEntry* current = NULL;
 	// can I provide it locally?
-	size_t results_size = 65535;
-	unsigned char results[results_size];
-	if (store->datastore->datastore_get((const char*)hash, hash_size, &results[0], results_size, &results_size, store->datastore)) {
+	if (libp2p_datastore_has(store->datastore, hash, hash_size)) {
 		// we found it locally. Let them know
 		*peer_id = malloc(store->local_peer->id_size);
 		if (*peer_id == NULL)
@@ -99,15 +349,18 @@ int libp2p_providerstore_get(struct ProviderStore* store, const unsigned char* h
 		memcpy(*peer_id, store->local_peer->id, *peer_id_size);
 		return 1;
 	}
-	// skip index 0, as we checked above...
-	for (int i = 0; i < store->provider_entries->total; i++) {
-		current = (struct ProviderEntry*)libp2p_utils_vector_get(store->provider_entries, i);
-		if (current->hash_size == hash_size && memcmp(current->hash, hash, hash_size) == 0) {
-			*peer_id = malloc(current->peer_id_size);
-			memcpy(*peer_id, current->peer_id, current->peer_id_size);
-			*peer_id_size = current->peer_id_size;
-			return 1;
-		}
-	}
-	return 0;
+	// the most recent announcement
+	struct ProviderKey* key = libp2p_providerstore_find_key(store, hash, hash_size);
+	if (key == NULL)
+		return 0;
+	libp2p_providerstore_expire_key(store, key, time(NULL));
+	if (key->providers->total == 0)
+		return 0;
+	struct ProviderEntry* current = (struct ProviderEntry*)libp2p_utils_vector_get(key->providers, key->providers->total - 1);
+	*peer_id = malloc(current->peer_id_size);
+	if (*peer_id == NULL)
+		return 0;
+	memcpy(*peer_id, current->peer_id, current->peer_id_size);
+	*peer_id_size = current->peer_id_size;
+	return 1;
 }
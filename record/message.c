@@ -44,6 +44,8 @@ void libp2p_message_free(struct Libp2pMessage* in) {
 			struct Libp2pPeer* peer = (struct Libp2pPeer*)current->item;
 			libp2p_peer_free(peer);
 			current->item = NULL;
+			// free just this one, the loop gets to the rest
+			current->next = NULL;
 			libp2p_utils_linked_list_free(current);
 			current = next;
 		}
@@ -55,6 +57,8 @@ void libp2p_message_free(struct Libp2pMessage* in) {
 			struct Libp2pPeer* peer = (struct Libp2pPeer*)current->item;
 			libp2p_peer_free(peer);
 			current->item = NULL;
+			// free just this one, the loop gets to the rest
+			current->next = NULL;
 			libp2p_utils_linked_list_free(current);
 			current = next;
 		}
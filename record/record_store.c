@@ -0,0 +1,581 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libp2p/crypto/rsa.h"
+#include "libp2p/crypto/sha256.h"
+#include "libp2p/record/record_store.h"
+#include "libp2p/utils/logger.h"
+#include "varint.h"
+
+// the largest RSA signature we expect (8192 bit keys)
+#define RECORD_STORE_MAX_SIGNATURE_SIZE 1024
+
+/***
+ * FNV-1a, to find a key's bucket
+ */
+static size_t libp2p_record_store_hash(const unsigned char* key, size_t key_size) {
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < key_size; i++) {
+		hash ^= key[i];
+		hash *= 1099511628211ULL;
+	}
+	return (size_t)hash;
+}
+
+/***
+ * Copy a field of a record
+ * @param source the bytes
+ * @param source_size the number of bytes
+ * @param destination where to put the copy. A 0 is added after the bytes
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_record_store_copy_field(const void* source, size_t source_size, void** destination) {
+	*destination = NULL;
+	if (source == NULL)
+		return 1;
+	unsigned char* copy = malloc(source_size + 1);
+	if (copy == NULL)
+		return 0;
+	memcpy(copy, source, source_size);
+	copy[source_size] = 0;
+	*destination = copy;
+	return 1;
+}
+
+/***
+ * Copy the parts of a record that are stored
+ * @param in the record
+ * @returns a new record, or NULL on error
+ */
+static struct Libp2pRecord* libp2p_record_store_copy(const struct Libp2pRecord* in) {
+	struct Libp2pRecord* out = libp2p_record_new();
+	if (out == NULL)
+		return NULL;
+	out->key_size = in->key_size;
+	out->value_size = in->value_size;
+	out->author_size = in->author_size;
+	out->signature_size = in->signature_size;
+	if (!libp2p_record_store_copy_field(in->key, in->key_size, (void**)&out->key)
+			|| !libp2p_record_store_copy_field(in->value, in->value_size, (void**)&out->value)
+			|| !libp2p_record_store_copy_field(in->author, in->author_size, (void**)&out->author)
+			|| !libp2p_record_store_copy_field(in->signature, in->signature_size, (void**)&out->signature)) {
+		libp2p_record_free(out);
+		return NULL;
+	}
+	return out;
+}
+
+/***
+ * Build the datastore key for a record
+ * @param key the record's key
+ * @param key_size the size of the key
+ * @param datastore_key_size the size of the results
+ * @returns the datastore key, or NULL on error
+ */
+static unsigned char* libp2p_record_store_datastore_key(const unsigned char* key, size_t key_size, size_t* datastore_key_size) {
+	size_t prefix_size = strlen(RECORD_STORE_KEY_PREFIX);
+	unsigned char* results = malloc(prefix_size + key_size);
+	if (results == NULL)
+		return NULL;
+	memcpy(results, RECORD_STORE_KEY_PREFIX, prefix_size);
+	memcpy(&results[prefix_size], key, key_size);
+	*datastore_key_size = prefix_size + key_size;
+	return results;
+}
+
+/***
+ * Build a new record store
+ * @param datastore where the records are kept
+ * @param max_cached the number of records to keep decoded in memory (0 for none)
+ * @returns the record store, or NULL on error
+ */
+struct RecordStore* libp2p_record_store_new(struct Datastore* datastore, size_t max_cached) {
+	struct RecordStore* store = (struct RecordStore*) malloc(sizeof(struct RecordStore));
+	if (store == NULL)
+		return NULL;
+	store->datastore = datastore;
+	store->lru_head = NULL;
+	store->lru_tail = NULL;
+	store->num_cached = 0;
+	store->max_cached = max_cached;
+	store->ttl_secs = RECORD_STORE_DEFAULT_TTL_SECS;
+	store->cache_hits = 0;
+	store->cache_misses = 0;
+	// keep the buckets at most half full
+	store->num_buckets = 16;
+	while (store->num_buckets < max_cached * 2)
+		store->num_buckets *= 2;
+	store->buckets = (struct RecordStoreEntry**) calloc(store->num_buckets, sizeof(struct RecordStoreEntry*));
+	if (store->buckets == NULL) {
+		free(store);
+		return NULL;
+	}
+	return store;
+}
+
+/***
+ * Take an entry out of the cache, and free it
+ * @param store the record store
+ * @param entry the entry
+ */
+static void libp2p_record_store_remove(struct RecordStore* store, struct RecordStoreEntry* entry) {
+	size_t bucket = libp2p_record_store_hash((unsigned char*)entry->record->key, entry->record->key_size) & (store->num_buckets - 1);
+	struct RecordStoreEntry** current = &store->buckets[bucket];
+	while (*current != NULL && *current != entry)
+		current = &(*current)->bucket_next;
+	if (*current != NULL)
+		*current = entry->bucket_next;
+	if (entry->lru_prev != NULL)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		store->lru_head = entry->lru_next;
+	if (entry->lru_next != NULL)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		store->lru_tail = entry->lru_prev;
+	store->num_cached--;
+	libp2p_record_free(entry->record);
+	free(entry);
+}
+
+/***
+ * Free the record store. The datastore is left alone.
+ * @param store the record store
+ */
+void libp2p_record_store_free(struct RecordStore* store) {
+	if (store != NULL) {
+		while (store->lru_head != NULL)
+			libp2p_record_store_remove(store, store->lru_head);
+		free(store->buckets);
+		free(store);
+	}
+}
+
+/***
+ * Find a record in the cache
+ * @param store the record store
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns the entry, or NULL if it is not cached
+ */
+static struct RecordStoreEntry* libp2p_record_store_find(struct RecordStore* store, const unsigned char* key, size_t key_size) {
+	size_t bucket = libp2p_record_store_hash(key, key_size) & (store->num_buckets - 1);
+	struct RecordStoreEntry* current = store->buckets[bucket];
+	while (current != NULL) {
+		if (current->record->key_size == key_size && memcmp(current->record->key, key, key_size) == 0)
+			return current;
+		current = current->bucket_next;
+	}
+	return NULL;
+}
+
+/***
+ * Move an entry to the front of the LRU list
+ * @param store the record store
+ * @param entry the entry
+ */
+static void libp2p_record_store_touch(struct RecordStore* store, struct RecordStoreEntry* entry) {
+	if (store->lru_head == entry)
+		return;
+	// unlink
+	entry->lru_prev->lru_next = entry->lru_next;
+	if (entry->lru_next != NULL)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		store->lru_tail = entry->lru_prev;
+	// put it first
+	entry->lru_prev = NULL;
+	entry->lru_next = store->lru_head;
+	store->lru_head->lru_prev = entry;
+	store->lru_head = entry;
+}
+
+/***
+ * Keep a record in the cache, replacing what was there for the same key
+ * @param store the record store
+ * @param record the record. The cache takes ownership of it
+ * @param received when it was received
+ */
+static void libp2p_record_store_cache(struct RecordStore* store, struct Libp2pRecord* record, time_t received) {
+	if (store->max_cached == 0) {
+		libp2p_record_free(record);
+		return;
+	}
+	struct RecordStoreEntry* entry = libp2p_record_store_find(store, (unsigned char*)record->key, record->key_size);
+	if (entry != NULL)
+		libp2p_record_store_remove(store, entry);
+	if (store->num_cached >= store->max_cached)
+		libp2p_record_store_remove(store, store->lru_tail);
+	entry = (struct RecordStoreEntry*) malloc(sizeof(struct RecordStoreEntry));
+	if (entry == NULL) {
+		libp2p_record_free(record);
+		return;
+	}
+	entry->record = record;
+	entry->received = received;
+	size_t bucket = libp2p_record_store_hash((unsigned char*)record->key, record->key_size) & (store->num_buckets - 1);
+	entry->bucket_next = store->buckets[bucket];
+	store->buckets[bucket] = entry;
+	entry->lru_prev = NULL;
+	entry->lru_next = store->lru_head;
+	if (store->lru_head != NULL)
+		store->lru_head->lru_prev = entry;
+	else
+		store->lru_tail = entry;
+	store->lru_head = entry;
+	store->num_cached++;
+}
+
+/***
+ * Check that a record was signed by the holder of a public key
+ * @param record the record
+ * @param public_key the author's public key
+ * @returns true(1) if the author is the hash of the key, and the signature is good, false(0) otherwise
+ */
+int libp2p_record_store_validate(const struct Libp2pRecord* record, const struct PublicKey* public_key) {
+	int retVal = 0;
+	unsigned char hash[32];
+	unsigned char* signed_bytes = NULL;
+	size_t signed_bytes_size = 0;
+	unsigned char signature[RECORD_STORE_MAX_SIGNATURE_SIZE];
+
+	if (record == NULL || public_key == NULL || public_key->type != KEYTYPE_RSA || public_key->data == NULL)
+		return 0;
+	if (record->key == NULL || record->author == NULL || record->signature == NULL)
+		return 0;
+	if (record->signature_size == 0 || record->signature_size > RECORD_STORE_MAX_SIGNATURE_SIZE)
+		return 0;
+
+	// the author is the hash of the key that signed it
+	if (!libp2p_crypto_hashing_sha256(public_key->data, public_key->data_size, hash))
+		return 0;
+	if (record->author_size != 32 || memcmp(record->author, hash, 32) != 0) {
+		libp2p_logger_debug("record_store", "Record author does not match the public key.\n");
+		return 0;
+	}
+
+	// key + value + author, as libp2p_record_make_put_record signs it
+	signed_bytes_size = record->key_size + record->value_size + record->author_size;
+	signed_bytes = malloc(signed_bytes_size);
+	if (signed_bytes == NULL)
+		goto exit;
+	memcpy(signed_bytes, record->key, record->key_size);
+	if (record->value_size > 0)
+		memcpy(&signed_bytes[record->key_size], record->value, record->value_size);
+	memcpy(&signed_bytes[record->key_size + record->value_size], record->author, record->author_size);
+
+	// the verifier reads as many bytes as the key is long, so do not let it read past a short signature
+	memset(signature, 0, RECORD_STORE_MAX_SIGNATURE_SIZE);
+	memcpy(signature, record->signature, record->signature_size);
+	struct RsaPublicKey rsa_key;
+	rsa_key.der = (char*)public_key->data;
+	rsa_key.der_length = public_key->data_size;
+	if (!libp2p_crypto_rsa_verify(&rsa_key, signed_bytes, signed_bytes_size, signature)) {
+		libp2p_logger_debug("record_store", "Record signature is not valid.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (signed_bytes != NULL)
+		free(signed_bytes);
+	return retVal;
+}
+
+/***
+ * The number of bytes libp2p_record_store_encode needs
+ * @param record the record
+ * @returns the maximum size of the encoded record
+ */
+size_t libp2p_record_store_encode_size(const struct Libp2pRecord* record) {
+	// version, time, and 4 fields with a varint length of at most 10 bytes each
+	return 1 + 8 + 40 + record->key_size + record->value_size + record->author_size + record->signature_size;
+}
+
+/***
+ * Encode a record for the datastore. This is the version byte, the time received
+ * (8 bytes, big endian), then the key, value, author and signature, each as a varint
+ * length followed by its bytes.
+ * @param record the record
+ * @param received when the record was received
+ * @param buffer where to put the results
+ * @param max_buffer_size the size of buffer
+ * @param bytes_written the number of bytes used
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_record_store_encode(const struct Libp2pRecord* record, time_t received, unsigned char* buffer, size_t max_buffer_size, size_t* bytes_written) {
+	const unsigned char* fields[] = { (unsigned char*)record->key, record->value, (unsigned char*)record->author, record->signature };
+	size_t field_sizes[] = { record->key_size, record->value_size, record->author_size, record->signature_size };
+	size_t position = 0;
+
+	if (max_buffer_size < 9)
+		return 0;
+	buffer[position++] = RECORD_STORE_ENCODING_VERSION;
+	uint64_t time = (uint64_t)received;
+	for(int i = 7; i >= 0; i--)
+		buffer[position++] = (time >> (i * 8)) & 0xff;
+	for(int i = 0; i < 4; i++) {
+		size_t varint_length = 0;
+		if (max_buffer_size - position < (size_t)varint_size(field_sizes[i]) + field_sizes[i])
+			return 0;
+		varint_encode(field_sizes[i], &buffer[position], max_buffer_size - position, &varint_length);
+		position += varint_length;
+		if (field_sizes[i] > 0) {
+			memcpy(&buffer[position], fields[i], field_sizes[i]);
+			position += field_sizes[i];
+		}
+	}
+	*bytes_written = position;
+	return 1;
+}
+
+/***
+ * Decode a record encoded by libp2p_record_store_encode
+ * @param buffer the encoded record
+ * @param buffer_size the size of buffer
+ * @param record the new record
+ * @param received when the record was received
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_record_store_decode(const unsigned char* buffer, size_t buffer_size, struct Libp2pRecord** record, time_t* received) {
+	size_t position = 0;
+	void* fields[4] = { NULL, NULL, NULL, NULL };
+	size_t field_sizes[4] = { 0, 0, 0, 0 };
+
+	if (buffer_size < 9 || buffer[0] != RECORD_STORE_ENCODING_VERSION)
+		return 0;
+	position++;
+	uint64_t time = 0;
+	for(int i = 0; i < 8; i++)
+		time = (time << 8) | buffer[position++];
+	for(int i = 0; i < 4; i++) {
+		size_t varint_length = 0;
+		if (position >= buffer_size)
+			goto error;
+		unsigned long long size = varint_decode(&buffer[position], buffer_size - position, &varint_length);
+		position += varint_length;
+		if (varint_length == 0 || size > buffer_size - position)
+			goto error;
+		if (!libp2p_record_store_copy_field(&buffer[position], size, &fields[i]))
+			goto error;
+		field_sizes[i] = size;
+		position += size;
+	}
+	*record = libp2p_record_new();
+	if (*record == NULL)
+		goto error;
+	(*record)->key = fields[0];
+	(*record)->key_size = field_sizes[0];
+	(*record)->value = fields[1];
+	(*record)->value_size = field_sizes[1];
+	(*record)->author = fields[2];
+	(*record)->author_size = field_sizes[2];
+	(*record)->signature = fields[3];
+	(*record)->signature_size = field_sizes[3];
+	*received = (time_t)time;
+	return 1;
+	error:
+	for(int i = 0; i < 4; i++) {
+		if (fields[i] != NULL)
+			free(fields[i]);
+	}
+	return 0;
+}
+
+/***
+ * Read a record from the datastore
+ * @param store the record store
+ * @param key the key
+ * @param key_size the size of the key
+ * @param record the decoded record. Free it with libp2p_record_free
+ * @param received when it was received
+ * @returns true(1) if found, false(0) otherwise
+ */
+static int libp2p_record_store_load(struct RecordStore* store, const unsigned char* key, size_t key_size, struct Libp2pRecord** record, time_t* received) {
+	int retVal = 0;
+	unsigned char* encoded = NULL;
+	size_t encoded_size = 0;
+	unsigned char* datastore_key = NULL;
+	size_t datastore_key_size = 0;
+
+	if (store->datastore == NULL || store->datastore->datastore_get == NULL)
+		return 0;
+	datastore_key = libp2p_record_store_datastore_key(key, key_size, &datastore_key_size);
+	if (datastore_key == NULL)
+		goto exit;
+	if (!libp2p_datastore_may_have(store->datastore, datastore_key, datastore_key_size))
+		goto exit;
+	encoded = malloc(RECORD_STORE_MAX_ENCODED_SIZE);
+	if (encoded == NULL)
+		goto exit;
+	if (!store->datastore->datastore_get((char*)datastore_key, datastore_key_size, encoded, RECORD_STORE_MAX_ENCODED_SIZE, &encoded_size, store->datastore))
+		goto exit;
+	// it was validated before it was stored
+	if (!libp2p_record_store_decode(encoded, encoded_size, record, received)) {
+		libp2p_logger_error("record_store", "Unable to decode stored record.\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (encoded != NULL)
+		free(encoded);
+	if (datastore_key != NULL)
+		free(datastore_key);
+	return retVal;
+}
+
+/***
+ * See if there may be a record in the datastore, without reading it. Most keys that
+ * are put are new, and this keeps them from costing a full read.
+ * @param store the record store
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns false(0) if the datastore is sure it does not have the key, true(1) otherwise
+ */
+static int libp2p_record_store_stored(struct RecordStore* store, const unsigned char* key, size_t key_size) {
+	// without datastore_has, libp2p_datastore_has reads into a buffer smaller than the largest record
+	if (store->datastore == NULL || store->datastore->datastore_has == NULL)
+		return 1;
+	size_t datastore_key_size = 0;
+	unsigned char* datastore_key = libp2p_record_store_datastore_key(key, key_size, &datastore_key_size);
+	if (datastore_key == NULL)
+		return 1;
+	int retVal = libp2p_datastore_has(store->datastore, datastore_key, datastore_key_size);
+	free(datastore_key);
+	return retVal;
+}
+
+/***
+ * Check that a record may take the place of what is stored under its key. Only the
+ * author of a record that has not expired may replace it.
+ * @param store the record store
+ * @param record the new record (already validated)
+ * @param now the current time
+ * @returns true(1) if there is nothing stored, or it is by the same author, false(0) otherwise
+ */
+static int libp2p_record_store_may_replace(struct RecordStore* store, const struct Libp2pRecord* record, time_t now) {
+	const struct Libp2pRecord* existing = NULL;
+	struct Libp2pRecord* found = NULL;
+	time_t received = 0;
+	int retVal = 1;
+
+	struct RecordStoreEntry* entry = libp2p_record_store_find(store, (unsigned char*)record->key, record->key_size);
+	if (entry != NULL) {
+		existing = entry->record;
+		received = entry->received;
+	} else if (libp2p_record_store_stored(store, (unsigned char*)record->key, record->key_size)
+			&& libp2p_record_store_load(store, (unsigned char*)record->key, record->key_size, &found, &received)) {
+		existing = found;
+	}
+	if (existing != NULL && now - received <= store->ttl_secs) {
+		if (existing->author_size != record->author_size || memcmp(existing->author, record->author, record->author_size) != 0) {
+			libp2p_logger_debug("record_store", "Refusing to replace a record by another author.\n");
+			retVal = 0;
+		}
+	}
+	if (found != NULL)
+		libp2p_record_free(found);
+	return retVal;
+}
+
+/***
+ * Validate a record, and store it. A record that has not expired is only
+ * replaced by one from the same author.
+ * @param store the record store
+ * @param record the record. It is copied
+ * @param public_key the author's public key
+ * @returns true(1) on success, false(0) if the record is not valid or could not be stored
+ */
+int libp2p_record_store_put(struct RecordStore* store, const struct Libp2pRecord* record, const struct PublicKey* public_key) {
+	int retVal = 0;
+	unsigned char* encoded = NULL;
+	size_t encoded_size = 0;
+	unsigned char* datastore_key = NULL;
+	size_t datastore_key_size = 0;
+	struct Libp2pRecord* copy = NULL;
+	time_t now = time(NULL);
+
+	if (store == NULL || !libp2p_record_store_validate(record, public_key))
+		return 0;
+	if (!libp2p_record_store_may_replace(store, record, now))
+		return 0;
+
+	encoded_size = libp2p_record_store_encode_size(record);
+	if (encoded_size > RECORD_STORE_MAX_ENCODED_SIZE) {
+		libp2p_logger_debug("record_store", "Record of %lu bytes is too large to store.\n", (unsigned long)encoded_size);
+		goto exit;
+	}
+	encoded = malloc(encoded_size);
+	if (encoded == NULL)
+		goto exit;
+	if (!libp2p_record_store_encode(record, now, encoded, encoded_size, &encoded_size))
+		goto exit;
+	datastore_key = libp2p_record_store_datastore_key((unsigned char*)record->key, record->key_size, &datastore_key_size);
+	if (datastore_key == NULL)
+		goto exit;
+	if (!libp2p_datastore_put(store->datastore, datastore_key, datastore_key_size, encoded, encoded_size)) {
+		libp2p_logger_error("record_store", "Unable to put record in the datastore.\n");
+		goto exit;
+	}
+
+	// it is likely to be asked for soon
+	copy = libp2p_record_store_copy(record);
+	if (copy != NULL)
+		libp2p_record_store_cache(store, copy, now);
+
+	retVal = 1;
+	exit:
+	if (encoded != NULL)
+		free(encoded);
+	if (datastore_key != NULL)
+		free(datastore_key);
+	return retVal;
+}
+
+/***
+ * Retrieve a record that has not expired
+ * NOTE: expired records are dropped from the cache, but stay in the datastore until replaced
+ * @param store the record store
+ * @param key the key
+ * @param key_size the size of the key
+ * @param record a new copy of the record. Free it with libp2p_record_free
+ * @returns true(1) if found, false(0) otherwise
+ */
+int libp2p_record_store_get(struct RecordStore* store, const unsigned char* key, size_t key_size, struct Libp2pRecord** record) {
+	struct Libp2pRecord* found = NULL;
+	time_t received = 0;
+	time_t now = time(NULL);
+
+	if (store == NULL)
+		return 0;
+
+	struct RecordStoreEntry* entry = libp2p_record_store_find(store, key, key_size);
+	if (entry != NULL) {
+		if (now - entry->received > store->ttl_secs) {
+			libp2p_record_store_remove(store, entry);
+			return 0;
+		}
+		store->cache_hits++;
+		libp2p_record_store_touch(store, entry);
+		*record = libp2p_record_store_copy(entry->record);
+		return *record != NULL;
+	}
+	store->cache_misses++;
+
+	// not cached, so look in the datastore
+	if (!libp2p_record_store_load(store, key, key_size, &found, &received))
+		return 0;
+	if (now - received > store->ttl_secs) {
+		libp2p_record_free(found);
+		return 0;
+	}
+	*record = libp2p_record_store_copy(found);
+	if (*record == NULL) {
+		libp2p_record_free(found);
+		return 0;
+	}
+	libp2p_record_store_cache(store, found, received);
+	return 1;
+}
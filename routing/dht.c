@@ -166,18 +166,33 @@ struct node {
     time_t reply_time;          /* time of last correct reply received */
     time_t pinged_time;         /* time of last request */
     int pinged;                 /* how many requests we sent since last reply */
-    struct node *next;
 };
 
+/* The number of nodes a bucket holds. */
+#define BUCKET_NODES 8
+
+/* One more than the number of bits in an id, so that the deepest bucket
+   can still be split. */
+#define MAX_BUCKETS 161
+
 struct bucket {
     int af;
-    unsigned char first[20];
+    int depth;                  /* bits in common with myid, see below */
     int count;                  /* number of nodes */
     time_t time;                /* time of last reply in this bucket */
-    struct node *nodes;
+    struct node nodes[BUCKET_NODES]; /* unordered, the first count are used */
     struct sockaddr_storage cached;  /* the address of a likely candidate */
     int cachedlen;
-    struct bucket *next;
+};
+
+/* The routing table is an array of buckets indexed by how many leading
+   bits a node id has in common with myid.  Bucket i holds the nodes that
+   share exactly i bits with us, except for the last one, which holds all
+   the nodes that are at least that close.  Only the last bucket is ever
+   split, so finding a node's bucket is a single common_bits. */
+struct table {
+    struct bucket *buckets[MAX_BUCKETS];
+    int numbuckets;
 };
 
 struct search_node {
@@ -191,6 +206,9 @@ struct search_node {
     int token_len;
     int replied;                /* whether we have received a reply */
     int acked;                  /* whether they acked our announcement */
+    struct search *sr;          /* the search this node is part of */
+    /* The other search nodes with the same id hash. */
+    struct search_node *id_next, **id_pprev;
 };
 
 /* When performing a search, we search for up to SEARCH_NODES closest nodes
@@ -208,6 +226,9 @@ struct search {
     struct search_node nodes[SEARCH_NODES];
     int numnodes;
     struct search *next;
+    struct search *tid_next;    /* with the same tid hash */
+    struct search *id_next;     /* with the same target hash */
+    struct search *done_prev, *done_next; /* done searches, oldest first */
 };
 
 struct peer {
@@ -224,13 +245,20 @@ struct peer {
 
 /* The maximum number of hashes we're willing to track. */
 #ifndef DHT_MAX_HASHES
-#define DHT_MAX_HASHES 16384
+#define DHT_MAX_HASHES 262144
+#endif
+
+/* Stored peers are looked at for expiry about this often (in seconds). */
+#ifndef DHT_STORAGE_SWEEP_TIME
+#define DHT_STORAGE_SWEEP_TIME (4 * 60)
 #endif
 
 /* The maximum number of searches we keep data about. */
 #ifndef DHT_MAX_SEARCHES
-#define DHT_MAX_SEARCHES 1024
+#define DHT_MAX_SEARCHES 4096
 #endif
+#define SEARCH_HASH_SIZE (2 * DHT_MAX_SEARCHES)
+#define SEARCH_NODE_HASH_SIZE (8 * DHT_MAX_SEARCHES)
 
 /* The time after which we consider a search to be expirable. */
 #ifndef DHT_SEARCH_EXPIRE_TIME
@@ -241,11 +269,13 @@ struct storage {
     unsigned char id[20];
     int numpeers, maxpeers;
     struct peer *peers;
-    struct storage *next;
+    /* An open addressing index of peers, -1 for an empty slot. */
+    int *slots;
+    int numslots;
 };
 
 static struct storage * find_storage(const unsigned char *id);
-static void flush_search_node(struct search_node *n, struct search *sr);
+static void flush_search_nodes(const unsigned char *id);
 
 static int send_ping(const struct sockaddr *sa, int salen,
                      const unsigned char *tid, int tid_len);
@@ -314,6 +344,25 @@ static const unsigned char v4prefix[16] = {
 static int dht_socket = -1;
 static int dht_socket6 = -1;
 
+/* When sends are queued, dht_send copies packets here, and dht_flush
+   sends them all at once. */
+#ifndef DHT_SEND_QUEUE
+#define DHT_SEND_QUEUE 64
+#endif
+#define DHT_MAX_PACKET 2048
+
+struct queued_packet {
+    int s;
+    int flags;
+    struct sockaddr_storage ss;
+    int sslen;
+    size_t len;
+    char buf[DHT_MAX_PACKET];
+};
+static struct queued_packet send_queue[DHT_SEND_QUEUE];
+static int numqueued;
+static int queue_sends;
+
 static time_t search_time;
 static time_t confirm_nodes_time;
 static time_t rotate_secrets_time;
@@ -324,22 +373,46 @@ static unsigned char my_v[9];
 static unsigned char secret[8];
 static unsigned char oldsecret[8];
 
-static struct bucket *buckets = NULL;
-static struct bucket *buckets6 = NULL;
-static struct storage *storage;
+static struct table *buckets = NULL;
+static struct table *buckets6 = NULL;
+/* The storage is an open addressing hash table, keyed by info hash,
+   with NULL for an empty slot.  storage_size is a power of two. */
+static struct storage **storage;
+static int storage_size;
 static int numstorage;
+static int storage_expire_next;
+static time_t storage_expire_time;
 
 static struct search *searches = NULL;
 static int numsearches;
 static unsigned short search_id;
+/* Searches by tid and by target, and the nodes of all searches by id. */
+static struct search *search_tids[SEARCH_HASH_SIZE];
+static struct search *search_ids[SEARCH_HASH_SIZE];
+static struct search_node *search_nodes[SEARCH_NODE_HASH_SIZE];
+static struct search *done_first, *done_last;
 
-/* The maximum number of nodes that we snub.  There is probably little
-   reason to increase this value. */
+/* The maximum number of nodes that we snub. */
 #ifndef DHT_MAX_BLACKLISTED
-#define DHT_MAX_BLACKLISTED 10
+#define DHT_MAX_BLACKLISTED 4096
 #endif
-static struct sockaddr_storage blacklist[DHT_MAX_BLACKLISTED];
-int next_blacklisted;
+#define BLACKLIST_HASH_SIZE (2 * DHT_MAX_BLACKLISTED)
+
+/* A blacklisted address.  IPv4-mapped IPv6 addresses are kept as IPv4. */
+struct blacklisted {
+    unsigned char ip[16];
+    unsigned short len;
+    unsigned short port;
+    int next;                   /* in the same hash chain, -1 at the end */
+    int lru_prev, lru_next;     /* most recently used first, -1 at the ends */
+};
+static struct blacklisted blacklist[DHT_MAX_BLACKLISTED];
+static int blacklist_hash[BLACKLIST_HASH_SIZE];
+static int numblacklisted;
+static int blacklist_first, blacklist_last;
+
+/* Keeps our hashes secret, so that other nodes cannot make them collide. */
+static unsigned int hash_salt;
 
 static struct timeval now;
 static time_t mybucket_grow_time, mybucket6_grow_time;
@@ -422,23 +495,24 @@ id_cmp(const unsigned char *restrict id1, const unsigned char *restrict id2)
     return memcmp(id1, id2, 20);
 }
 
-/* Find the lowest 1 bit in an id. */
-static int
-lowbit(const unsigned char *id)
+/* FNV-1a, starting from h. */
+static unsigned int
+hash_bytes(const unsigned char *data, int len, unsigned int h)
 {
-    int i, j;
-    for(i = 19; i >= 0; i--)
-        if(id[i] != 0)
-            break;
-
-    if(i < 0)
-        return -1;
-
-    for(j = 7; j >= 0; j--)
-        if((id[i] & (0x80 >> j)) != 0)
-            break;
+    int i;
+    for(i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 16777619U;
+    }
+    return h;
+}
 
-    return 8 * i + j;
+/* The hash of an address, as kept in storage and in the blacklist. */
+static unsigned int
+peer_hash(const unsigned char *ip, int len, unsigned short port)
+{
+    unsigned int h = hash_bytes(ip, len, 2166136261U ^ hash_salt);
+    return hash_bytes((const unsigned char*)&port, 2, h);
 }
 
 /* Find how many bits two ids have in common. */
@@ -486,64 +560,58 @@ xorcmp(const unsigned char *id1, const unsigned char *id2,
     return 0;
 }
 
-/* We keep buckets in a sorted linked list.  A bucket b ranges from
-   b->first inclusive up to b->next->first exclusive. */
+static struct bucket *
+find_bucket(unsigned const char *id, int af)
+{
+    struct table *t = af == AF_INET ? buckets : buckets6;
+
+    if(t == NULL)
+        return NULL;
+
+    return t->buckets[MIN(common_bits(id, myid), t->numbuckets - 1)];
+}
+
 static int
 in_bucket(const unsigned char *id, struct bucket *b)
 {
-    return id_cmp(b->first, id) <= 0 &&
-        (b->next == NULL || id_cmp(id, b->next->first) < 0);
+    return find_bucket(id, b->af) == b;
 }
 
+/* The neighbours of a bucket are the ones one bit further from us
+   (previous) and one bit closer to us (next). */
 static struct bucket *
-find_bucket(unsigned const char *id, int af)
+previous_bucket(struct bucket *b)
 {
-    struct bucket *b = af == AF_INET ? buckets : buckets6;
+    struct table *t = b->af == AF_INET ? buckets : buckets6;
 
-    if(b == NULL)
+    if(b->depth == 0)
         return NULL;
-
-    while(1) {
-        if(b->next == NULL)
-            return b;
-        if(id_cmp(id, b->next->first) < 0)
-            return b;
-        b = b->next;
-    }
+    return t->buckets[b->depth - 1];
 }
 
 static struct bucket *
-previous_bucket(struct bucket *b)
+next_bucket(struct bucket *b)
 {
-    struct bucket *p = b->af == AF_INET ? buckets : buckets6;
+    struct table *t = b->af == AF_INET ? buckets : buckets6;
 
-    if(b == p)
+    if(b->depth + 1 >= t->numbuckets)
         return NULL;
-
-    while(1) {
-        if(p->next == NULL)
-            return NULL;
-        if(p->next == b)
-            return p;
-        p = p->next;
-    }
+    return t->buckets[b->depth + 1];
 }
 
-/* Every bucket contains an unordered list of nodes. */
+/* Every bucket contains an unordered array of nodes. */
 static struct node *
 find_node(const unsigned char *id, int af)
 {
     struct bucket *b = find_bucket(id, af);
-    struct node *n;
+    int i;
 
     if(b == NULL)
         return NULL;
 
-    n = b->nodes;
-    while(n) {
-        if(id_cmp(n->id, id) == 0)
-            return n;
-        n = n->next;
+    for(i = 0; i < b->count; i++) {
+        if(id_cmp(b->nodes[i].id, id) == 0)
+            return &b->nodes[i];
     }
     return NULL;
 }
@@ -552,54 +620,34 @@ find_node(const unsigned char *id, int af)
 static struct node *
 random_node(struct bucket *b)
 {
-    struct node *n;
-    int nn;
-
     if(b->count == 0)
         return NULL;
 
-    nn = random() % b->count;
-    n = b->nodes;
-    while(nn > 0 && n) {
-        n = n->next;
-        nn--;
-    }
-    return n;
-}
-
-/* Return the middle id of a bucket. */
-static int
-bucket_middle(struct bucket *b, unsigned char *id_return)
-{
-    int bit1 = lowbit(b->first);
-    int bit2 = b->next ? lowbit(b->next->first) : -1;
-    int bit = MAX(bit1, bit2) + 1;
-
-    if(bit >= 160)
-        return -1;
-
-    memcpy(id_return, b->first, 20);
-    id_return[bit / 8] |= (0x80 >> (bit % 8));
-    return 1;
+    return &b->nodes[random() % b->count];
 }
 
 /* Return a random id within a bucket. */
 static int
 bucket_random(struct bucket *b, unsigned char *id_return)
 {
-    int bit1 = lowbit(b->first);
-    int bit2 = b->next ? lowbit(b->next->first) : -1;
-    int bit = MAX(bit1, bit2) + 1;
+    /* The bits that are the same for every id in the bucket: the ones we
+       share with myid and, except in the last bucket, the next one, which
+       is the other way round. */
+    int bit = b->depth;
     int i;
+    unsigned char mask;
 
-    if(bit >= 160) {
-        memcpy(id_return, b->first, 20);
-        return 1;
+    memcpy(id_return, myid, 20);
+    if(next_bucket(b) != NULL) {
+        id_return[bit / 8] ^= 0x80 >> (bit % 8);
+        bit++;
     }
 
-    memcpy(id_return, b->first, bit / 8);
-    id_return[bit / 8] = b->first[bit / 8] & (0xFF00 >> (bit % 8));
-    id_return[bit / 8] |= random() & 0xFF >> (bit % 8);
+    if(bit >= 160)
+        return 1;
+
+    mask = 0xFF >> (bit % 8);
+    id_return[bit / 8] = (id_return[bit / 8] & ~mask) | (random() & mask);
     for(i = bit / 8 + 1; i < 20; i++)
         id_return[i] = random() & 0xFF;
     return 1;
@@ -611,13 +659,20 @@ insert_node(struct node *node)
 {
     struct bucket *b = find_bucket(node->id, node->ss.ss_family);
 
-    if(b == NULL)
+    if(b == NULL || b->count >= BUCKET_NODES)
         return NULL;
 
-    node->next = b->nodes;
-    b->nodes = node;
-    b->count++;
-    return node;
+    b->nodes[b->count] = *node;
+    return &b->nodes[b->count++];
+}
+
+/* Take a node out of its bucket.  The last node takes its place. */
+static void
+remove_node(struct bucket *b, int i)
+{
+    b->count--;
+    if(i < b->count)
+        b->nodes[i] = b->nodes[b->count];
 }
 
 /* This is our definition of a known-good node. */
@@ -684,17 +739,102 @@ pinged(struct node *n, struct bucket *b)
 }
 
 /* The internal blacklist is an LRU cache of nodes that have sent
-   incorrect messages. */
+   incorrect messages.  It is looked up on every packet, so it is a hash
+   table of addresses, with the entries also on a list in order of use. */
+
+static void
+reset_blacklist(void)
+{
+    int i;
+    for(i = 0; i < BLACKLIST_HASH_SIZE; i++)
+        blacklist_hash[i] = -1;
+    numblacklisted = 0;
+    blacklist_first = blacklist_last = -1;
+}
+
+/* Reduce an address to the bytes that matter. */
+static int
+blacklist_key(const struct sockaddr *sa, unsigned char *ip_return,
+              unsigned short *len_return, unsigned short *port_return)
+{
+    if(sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+        memcpy(ip_return, &sin->sin_addr, 4);
+        *len_return = 4;
+        *port_return = sin->sin_port;
+    } else if(sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+        const unsigned char *address = (const unsigned char*)&sin6->sin6_addr;
+        if(memcmp(address, v4prefix, 12) == 0) {
+            memcpy(ip_return, address + 12, 4);
+            *len_return = 4;
+        } else {
+            memcpy(ip_return, address, 16);
+            *len_return = 16;
+        }
+        *port_return = sin6->sin6_port;
+    } else {
+        return -1;
+    }
+    return 1;
+}
+
+static int
+blacklist_bucket(const unsigned char *ip, unsigned short len,
+                 unsigned short port)
+{
+    return peer_hash(ip, len, port) % BLACKLIST_HASH_SIZE;
+}
+
+static int
+find_blacklisted(const unsigned char *ip, unsigned short len,
+                 unsigned short port)
+{
+    int i = blacklist_hash[blacklist_bucket(ip, len, port)];
+    while(i >= 0) {
+        struct blacklisted *e = &blacklist[i];
+        if(e->port == port && e->len == len && memcmp(e->ip, ip, len) == 0)
+            return i;
+        i = e->next;
+    }
+    return -1;
+}
+
+/* Move an entry to the front of the list, or put it there. */
+static void
+blacklist_use(int i, int linked)
+{
+    struct blacklisted *e = &blacklist[i];
+
+    if(linked) {
+        if(blacklist_first == i)
+            return;
+        blacklist[e->lru_prev].lru_next = e->lru_next;
+        if(e->lru_next >= 0)
+            blacklist[e->lru_next].lru_prev = e->lru_prev;
+        else
+            blacklist_last = e->lru_prev;
+    }
+    e->lru_prev = -1;
+    e->lru_next = blacklist_first;
+    if(blacklist_first >= 0)
+        blacklist[blacklist_first].lru_prev = i;
+    else
+        blacklist_last = i;
+    blacklist_first = i;
+}
+
 static void
 blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
 {
     int i;
+    unsigned char ip[16];
+    unsigned short len, port;
 
     debugf("Blacklisting broken node.\n");
 
     if(id) {
         struct node *n;
-        struct search *sr;
         /* Make the node easy to discard. */
         n = find_node(id, sa->sa_family);
         if(n) {
@@ -702,23 +842,47 @@ blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
             pinged(n, NULL);
         }
         /* Discard it from any searches in progress. */
-        sr = searches;
-        while(sr) {
-            for(i = 0; i < sr->numnodes; i++)
-                if(id_cmp(sr->nodes[i].id, id) == 0)
-                    flush_search_node(&sr->nodes[i], sr);
-            sr = sr->next;
-        }
+        flush_search_nodes(id);
     }
     /* And make sure we don't hear from it again. */
-    memcpy(&blacklist[next_blacklisted], sa, salen);
-    next_blacklisted = (next_blacklisted + 1) % DHT_MAX_BLACKLISTED;
+    if(blacklist_key(sa, ip, &len, &port) < 0)
+        return;
+    i = find_blacklisted(ip, len, port);
+    if(i >= 0) {
+        blacklist_use(i, 1);
+        return;
+    }
+    if(numblacklisted < DHT_MAX_BLACKLISTED) {
+        i = numblacklisted++;
+    } else {
+        /* Full, so forget the one we have not heard from in longest. */
+        int *p;
+        i = blacklist_last;
+        blacklist_last = blacklist[i].lru_prev;
+        if(blacklist_last >= 0)
+            blacklist[blacklist_last].lru_next = -1;
+        else
+            blacklist_first = -1;
+        p = &blacklist_hash[blacklist_bucket(blacklist[i].ip, blacklist[i].len,
+                                             blacklist[i].port)];
+        while(*p != i)
+            p = &blacklist[*p].next;
+        *p = blacklist[i].next;
+    }
+    memcpy(blacklist[i].ip, ip, len);
+    blacklist[i].len = len;
+    blacklist[i].port = port;
+    blacklist[i].next = blacklist_hash[blacklist_bucket(ip, len, port)];
+    blacklist_hash[blacklist_bucket(ip, len, port)] = i;
+    blacklist_use(i, 0);
 }
 
 static int
 node_blacklisted(const struct sockaddr *sa, int salen)
 {
     int i;
+    unsigned char ip[16];
+    unsigned short len, port;
 
     if((unsigned)salen > sizeof(struct sockaddr_storage))
         abort();
@@ -726,25 +890,27 @@ node_blacklisted(const struct sockaddr *sa, int salen)
     if(dht_blacklisted(sa, salen))
         return 1;
 
-    for(i = 0; i < DHT_MAX_BLACKLISTED; i++) {
-        if(memcmp(&blacklist[i], sa, salen) == 0)
-            return 1;
-    }
+    if(numblacklisted == 0 || blacklist_key(sa, ip, &len, &port) < 0)
+        return 0;
 
-    return 0;
+    i = find_blacklisted(ip, len, port);
+    if(i < 0)
+        return 0;
+    /* Still misbehaving, so keep it a while longer. */
+    blacklist_use(i, 1);
+    return 1;
 }
 
-/* Split a bucket into two equal parts. */
+/* Split the last bucket in two: the nodes that share one more bit with
+   myid go to a new last bucket. */
 static struct bucket *
 split_bucket(struct bucket *b)
 {
+    struct table *t = b->af == AF_INET ? buckets : buckets6;
     struct bucket *new;
-    struct node *nodes;
-    int rc;
-    unsigned char new_id[20];
+    int i;
 
-    rc = bucket_middle(b, new_id);
-    if(rc < 0)
+    if(b->depth + 1 >= MAX_BUCKETS || b->depth != t->numbuckets - 1)
         return NULL;
 
     new = calloc(1, sizeof(struct bucket));
@@ -752,22 +918,21 @@ split_bucket(struct bucket *b)
         return NULL;
 
     new->af = b->af;
+    new->depth = b->depth + 1;
 
     send_cached_ping(b);
 
-    memcpy(new->first, new_id, 20);
     new->time = b->time;
+    t->buckets[t->numbuckets++] = new;
 
-    nodes = b->nodes;
-    b->nodes = NULL;
-    b->count = 0;
-    new->next = b->next;
-    b->next = new;
-    while(nodes) {
-        struct node *n;
-        n = nodes;
-        nodes = nodes->next;
-        insert_node(n);
+    i = 0;
+    while(i < b->count) {
+        if(common_bits(b->nodes[i].id, myid) > b->depth) {
+            insert_node(&b->nodes[i]);
+            remove_node(b, i);
+        } else {
+            i++;
+        }
     }
     return b;
 }
@@ -780,7 +945,7 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
 {
     struct bucket *b = find_bucket(id, sa->sa_family);
     struct node *n;
-    int mybucket, split;
+    int i, mybucket, split;
 
     if(b == NULL)
         return NULL;
@@ -796,8 +961,8 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
     if(confirm == 2)
         b->time = now.tv_sec;
 
-    n = b->nodes;
-    while(n) {
+    for(i = 0; i < b->count; i++) {
+        n = &b->nodes[i];
         if(id_cmp(n->id, id) == 0) {
             if(confirm || n->time < now.tv_sec - 15 * 60) {
                 /* Known node.  Update stuff. */
@@ -812,7 +977,6 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
             }
             return n;
         }
-        n = n->next;
     }
 
     /* New node. */
@@ -825,8 +989,8 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
     }
 
     /* First, try to get rid of a known-bad node. */
-    n = b->nodes;
-    while(n) {
+    for(i = 0; i < b->count; i++) {
+        n = &b->nodes[i];
         if(n->pinged >= 3 && n->pinged_time < now.tv_sec - 15) {
             memcpy(n->id, id, 20);
             memcpy((struct sockaddr*)&n->ss, sa, salen);
@@ -836,14 +1000,13 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
             n->pinged = 0;
             return n;
         }
-        n = n->next;
     }
 
-    if(b->count >= 8) {
+    if(b->count >= BUCKET_NODES) {
         /* Bucket full.  Ping a dubious node */
         int dubious = 0;
-        n = b->nodes;
-        while(n) {
+        for(i = 0; i < b->count; i++) {
+            n = &b->nodes[i];
             /* Pick the first dubious node that we haven't pinged in the
                last 15 seconds.  This gives nodes the time to reply, but
                tends to concentrate on the same nodes, so that we get rid
@@ -861,7 +1024,6 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
                     break;
                 }
             }
-            n = n->next;
         }
 
         split = 0;
@@ -870,16 +1032,16 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
                 split = 1;
             /* If there's only one bucket, split eagerly.  This is
                incorrect unless there's more than 8 nodes in the DHT. */
-            else if(b->af == AF_INET && buckets->next == NULL)
+            else if(b->af == AF_INET && buckets->numbuckets == 1)
                 split = 1;
-            else if(b->af == AF_INET6 && buckets6->next == NULL)
+            else if(b->af == AF_INET6 && buckets6->numbuckets == 1)
                 split = 1;
         }
 
         if(split) {
             debugf("Splitting.\n");
-            b = split_bucket(b);
-            return new_node(id, sa, salen, confirm);
+            if(split_bucket(b) != NULL)
+                return new_node(id, sa, salen, confirm);
         }
 
         /* No space for this node.  Cache it away for later. */
@@ -892,17 +1054,13 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
     }
 
     /* Create a new node. */
-    n = calloc(1, sizeof(struct node));
-    if(n == NULL)
-        return NULL;
+    n = &b->nodes[b->count++];
+    memset(n, 0, sizeof(struct node));
     memcpy(n->id, id, 20);
     memcpy(&n->ss, sa, salen);
     n->sslen = salen;
     n->time = confirm ? now.tv_sec : 0;
     n->reply_time = confirm >= 2 ? now.tv_sec : 0;
-    n->next = b->nodes;
-    b->nodes = n;
-    b->count++;
     return n;
 }
 
@@ -910,36 +1068,26 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
    conservative here: broken nodes in the table don't do much harm, we'll
    recover as soon as we find better ones. */
 static int
-expire_buckets(struct bucket *b)
+expire_buckets(struct table *t)
 {
-    while(b) {
-        struct node *n, *p;
-        int changed = 0;
+    int i, j;
 
-        while(b->nodes && b->nodes->pinged >= 4) {
-            n = b->nodes;
-            b->nodes = n->next;
-            b->count--;
-            changed = 1;
-            free(n);
-        }
+    for(i = 0; t && i < t->numbuckets; i++) {
+        struct bucket *b = t->buckets[i];
+        int changed = 0;
 
-        p = b->nodes;
-        while(p) {
-            while(p->next && p->next->pinged >= 4) {
-                n = p->next;
-                p->next = n->next;
-                b->count--;
+        j = 0;
+        while(j < b->count) {
+            if(b->nodes[j].pinged >= 4) {
+                remove_node(b, j);
                 changed = 1;
-                free(n);
+            } else {
+                j++;
             }
-            p = p->next;
         }
 
         if(changed)
             send_cached_ping(b);
-
-        b = b->next;
     }
     expire_stuff_time = now.tv_sec + 120 + random() % 240;
     return 1;
@@ -953,15 +1101,133 @@ expire_buckets(struct bucket *b)
 static struct search *
 find_search(unsigned short tid, int af)
 {
-    struct search *sr = searches;
+    struct search *sr = search_tids[tid % SEARCH_HASH_SIZE];
     while(sr) {
         if(sr->tid == tid && sr->af == af)
             return sr;
-        sr = sr->next;
+        sr = sr->tid_next;
     }
     return NULL;
 }
 
+static int
+search_id_bucket(const unsigned char *id)
+{
+    return hash_bytes(id, 20, 2166136261U ^ hash_salt) % SEARCH_HASH_SIZE;
+}
+
+static struct search *
+find_search_id(const unsigned char *id, int af)
+{
+    struct search *sr = search_ids[search_id_bucket(id)];
+    while(sr) {
+        if(sr->af == af && id_cmp(sr->id, id) == 0)
+            return sr;
+        sr = sr->id_next;
+    }
+    return NULL;
+}
+
+/* Put a search in the tid and target tables, once both are set. */
+static void
+link_search(struct search *sr)
+{
+    struct search **p = &search_tids[sr->tid % SEARCH_HASH_SIZE];
+    sr->tid_next = *p;
+    *p = sr;
+    p = &search_ids[search_id_bucket(sr->id)];
+    sr->id_next = *p;
+    *p = sr;
+}
+
+static void
+search_set_done(struct search *sr, int done)
+{
+    if(done && !sr->done) {
+        sr->done_prev = done_last;
+        sr->done_next = NULL;
+        if(done_last)
+            done_last->done_next = sr;
+        else
+            done_first = sr;
+        done_last = sr;
+    } else if(!done && sr->done) {
+        if(sr->done_prev)
+            sr->done_prev->done_next = sr->done_next;
+        else
+            done_first = sr->done_next;
+        if(sr->done_next)
+            sr->done_next->done_prev = sr->done_prev;
+        else
+            done_last = sr->done_prev;
+    }
+    sr->done = done;
+}
+
+/* Every search node is also in a hash table by id, so that a node can be
+   found in all searches at once.  The nodes of a search move around in
+   its array, and the table must follow them. */
+
+static int
+search_node_bucket(const unsigned char *id)
+{
+    return hash_bytes(id, 20, 2166136261U ^ hash_salt) % SEARCH_NODE_HASH_SIZE;
+}
+
+static void
+link_search_node(struct search_node *n, struct search *sr)
+{
+    struct search_node **p = &search_nodes[search_node_bucket(n->id)];
+    n->sr = sr;
+    n->id_next = *p;
+    if(*p)
+        (*p)->id_pprev = &n->id_next;
+    n->id_pprev = p;
+    *p = n;
+}
+
+static void
+unlink_search_node(struct search_node *n)
+{
+    *n->id_pprev = n->id_next;
+    if(n->id_next)
+        n->id_next->id_pprev = n->id_pprev;
+}
+
+/* A search node has just been copied to n. */
+static void
+relink_search_node(struct search_node *n)
+{
+    *n->id_pprev = n;
+    if(n->id_next)
+        n->id_next->id_pprev = &n->id_next;
+}
+
+/* Take a search out of all the tables, before it is freed or reused. */
+static void
+unlink_search(struct search *sr)
+{
+    struct search **p;
+    int i;
+
+    for(i = 0; i < sr->numnodes; i++)
+        unlink_search_node(&sr->nodes[i]);
+    sr->numnodes = 0;
+
+    p = &search_tids[sr->tid % SEARCH_HASH_SIZE];
+    while(*p && *p != sr)
+        p = &(*p)->tid_next;
+    if(*p)
+        *p = sr->tid_next;
+    p = &search_ids[search_id_bucket(sr->id)];
+    while(*p && *p != sr)
+        p = &(*p)->id_next;
+    if(*p)
+        *p = sr->id_next;
+
+    search_set_done(sr, 0);
+}
+
 /* A search contains a list of nodes, sorted by decreasing distance to the
    target.  We just got a new candidate, insert it at the right spot or
    discard it. */
@@ -994,15 +1260,20 @@ insert_search_node(unsigned char *id,
 
     if(sr->numnodes < SEARCH_NODES)
         sr->numnodes++;
+    else
+        /* The farthest node falls off the end. */
+        unlink_search_node(&sr->nodes[SEARCH_NODES - 1]);
 
     for(j = sr->numnodes - 1; j > i; j--) {
         sr->nodes[j] = sr->nodes[j - 1];
+        relink_search_node(&sr->nodes[j]);
     }
 
     n = &sr->nodes[i];
 
     memset(n, 0, sizeof(struct search_node));
     memcpy(n->id, id, 20);
+    link_search_node(n, sr);
 
 found:
     memcpy(&n->ss, sa, salen);
@@ -1030,11 +1301,35 @@ static void
 flush_search_node(struct search_node *n, struct search *sr)
 {
     int i = n - sr->nodes, j;
-    for(j = i; j < sr->numnodes - 1; j++)
+    unlink_search_node(n);
+    for(j = i; j < sr->numnodes - 1; j++) {
         sr->nodes[j] = sr->nodes[j + 1];
+        relink_search_node(&sr->nodes[j]);
+    }
     sr->numnodes--;
 }
 
+/* Flush a node from every search it is part of. */
+static void
+flush_search_nodes(const unsigned char *id)
+{
+    struct search_node **head = &search_nodes[search_node_bucket(id)];
+    struct search_node *prev = NULL, *n = *head;
+
+    while(n) {
+        if(id_cmp(n->id, id) == 0) {
+            /* Flushing moves the nodes of this search that come after n
+               down by one, and prev may be one of them. */
+            if(prev && prev->sr == n->sr && prev > n)
+                prev--;
+            flush_search_node(n, n->sr);
+        } else {
+            prev = n;
+        }
+        n = prev ? prev->id_next : *head;
+    }
+}
+
 static void
 expire_searches(void)
 {
@@ -1047,6 +1342,7 @@ expire_searches(void)
                 previous->next = next;
             else
                 searches = next;
+            unlink_search(sr);
             free(sr);
             numsearches--;
         } else {
@@ -1164,7 +1460,7 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
     return;
 
  done:
-    sr->done = 1;
+    search_set_done(sr, 1);
     if(callback)
         (*callback)(closure,
                     sr->af == AF_INET ?
@@ -1173,23 +1469,21 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
     sr->step_time = now.tv_sec;
 }
 
+/* Returns a search that is in none of the tables. */
 static struct search *
 new_search(void)
 {
-    struct search *sr, *oldest = NULL;
+    struct search *sr, *oldest;
 
-    /* Find the oldest done search */
-    sr = searches;
-    while(sr) {
-        if(sr->done &&
-           (oldest == NULL || oldest->step_time > sr->step_time))
-            oldest = sr;
-        sr = sr->next;
-    }
+    /* Searches are put on the done list as they finish, so the first one
+       is the oldest. */
+    oldest = done_first;
 
     /* The oldest slot is expired. */
-    if(oldest && oldest->step_time < now.tv_sec - DHT_SEARCH_EXPIRE_TIME)
+    if(oldest && oldest->step_time < now.tv_sec - DHT_SEARCH_EXPIRE_TIME) {
+        unlink_search(oldest);
         return oldest;
+    }
 
     /* Allocate a new slot. */
     if(numsearches < DHT_MAX_SEARCHES) {
@@ -1203,6 +1497,8 @@ new_search(void)
     }
 
     /* Oh, well, never mind.  Reuse the oldest slot. */
+    if(oldest)
+        unlink_search(oldest);
     return oldest;
 }
 
@@ -1210,12 +1506,11 @@ new_search(void)
 static void
 insert_search_bucket(struct bucket *b, struct search *sr)
 {
-    struct node *n;
-    n = b->nodes;
-    while(n) {
+    int i;
+    for(i = 0; i < b->count; i++) {
+        struct node *n = &b->nodes[i];
         insert_search_node(n->id, (struct sockaddr*)&n->ss, n->sslen,
                            sr, 0, NULL, 0);
-        n = n->next;
     }
 }
 
@@ -1271,18 +1566,13 @@ int dht_search(const unsigned char *id, int port, int af,
         }
     }
 
-    sr = searches;
-    while(sr) {
-        if(sr->af == af && id_cmp(sr->id, id) == 0)
-            break;
-        sr = sr->next;
-    }
+    sr = find_search_id(id, af);
 
     if(sr) {
         /* We're reusing data from an old search.  Reusing the same tid
            means that we can merge replies for both searches. */
         int i;
-        sr->done = 0;
+        search_set_done(sr, 0);
     again:
         for(i = 0; i < sr->numnodes; i++) {
             struct search_node *n;
@@ -1309,6 +1599,7 @@ int dht_search(const unsigned char *id, int port, int af,
         memcpy(sr->id, id, 20);
         sr->done = 0;
         sr->numnodes = 0;
+        link_search(sr);
     }
 
     sr->port = port;
@@ -1317,8 +1608,9 @@ int dht_search(const unsigned char *id, int port, int af,
 
     if(sr->numnodes < SEARCH_NODES) {
         struct bucket *p = previous_bucket(b);
-        if(b->next)
-            insert_search_bucket(b->next, sr);
+        struct bucket *q = next_bucket(b);
+        if(q)
+            insert_search_bucket(q, sr);
         if(p)
             insert_search_bucket(p, sr);
     }
@@ -1333,17 +1625,152 @@ int dht_search(const unsigned char *id, int port, int af,
 /* A struct storage stores all the stored peer addresses for a given info
    hash. */
 
+static unsigned int
+storage_hash(const unsigned char *id)
+{
+    return hash_bytes(id, 20, 2166136261U ^ hash_salt);
+}
+
+/* Whether the entry at slot j, which belongs at slot home, can move back
+   to slot i when i is emptied.  It can unless home is in (i, j]. */
+static int
+can_shift_back(int i, int j, int home)
+{
+    if(i <= j)
+        return home <= i || home > j;
+    else
+        return home <= i && home > j;
+}
+
+/* The slot where id is, or where it would go. */
+static int
+storage_slot(const unsigned char *id)
+{
+    int i = storage_hash(id) & (storage_size - 1);
+    while(storage[i] && id_cmp(storage[i]->id, id) != 0)
+        i = (i + 1) & (storage_size - 1);
+    return i;
+}
+
 static struct storage *
 find_storage(const unsigned char *id)
 {
-    struct storage *st = storage;
+    if(storage == NULL)
+        return NULL;
+    return storage[storage_slot(id)];
+}
+
+/* Make room for more hashes, keeping the table at most half full. */
+static int
+grow_storage(void)
+{
+    struct storage **old = storage;
+    int oldsize = storage_size, i;
 
-    while(st) {
-        if(id_cmp(id, st->id) == 0)
+    storage_size = oldsize == 0 ? 64 : 2 * oldsize;
+    storage = calloc(storage_size, sizeof(struct storage*));
+    if(storage == NULL) {
+        storage = old;
+        storage_size = oldsize;
+        return -1;
+    }
+    for(i = 0; i < oldsize; i++) {
+        if(old[i])
+            storage[storage_slot(old[i]->id)] = old[i];
+    }
+    free(old);
+    storage_expire_next = 0;
+    return 1;
+}
+
+/* Free the storage at slot i, and close the gap. */
+static void
+remove_storage(int i)
+{
+    int j = i, mask = storage_size - 1;
+
+    free(storage[i]->peers);
+    free(storage[i]->slots);
+    free(storage[i]);
+    numstorage--;
+
+    while(1) {
+        j = (j + 1) & mask;
+        if(storage[j] == NULL)
             break;
-        st = st->next;
+        if(can_shift_back(i, j, storage_hash(storage[j]->id) & mask)) {
+            storage[i] = storage[j];
+            i = j;
+        }
+    }
+    storage[i] = NULL;
+}
+
+/* The slot in st->slots where a peer is, or where it would go. */
+static int
+peer_slot(struct storage *st, const unsigned char *ip, int len,
+          unsigned short port)
+{
+    int i = peer_hash(ip, len, port) & (st->numslots - 1);
+    while(st->slots[i] >= 0) {
+        struct peer *p = &st->peers[st->slots[i]];
+        if(p->port == port && p->len == len && memcmp(p->ip, ip, len) == 0)
+            break;
+        i = (i + 1) & (st->numslots - 1);
+    }
+    return i;
+}
+
+/* Rebuild the index of a storage, with room for at least maxpeers. */
+static int
+index_peers(struct storage *st)
+{
+    int i, n = 1;
+    int *slots;
+
+    while(n < 2 * st->maxpeers)
+        n *= 2;
+    slots = malloc(n * sizeof(int));
+    if(slots == NULL)
+        return -1;
+    free(st->slots);
+    st->slots = slots;
+    st->numslots = n;
+    for(i = 0; i < n; i++)
+        st->slots[i] = -1;
+    for(i = 0; i < st->numpeers; i++) {
+        struct peer *p = &st->peers[i];
+        st->slots[peer_slot(st, p->ip, p->len, p->port)] = i;
+    }
+    return 1;
+}
+
+/* Forget peer i.  The last peer takes its place. */
+static void
+remove_peer(struct storage *st, int i)
+{
+    struct peer *p = &st->peers[i];
+    int mask = st->numslots - 1;
+    int k = peer_slot(st, p->ip, p->len, p->port), j = k;
+
+    while(1) {
+        j = (j + 1) & mask;
+        if(st->slots[j] < 0)
+            break;
+        p = &st->peers[st->slots[j]];
+        if(can_shift_back(k, j, peer_hash(p->ip, p->len, p->port) & mask)) {
+            st->slots[k] = st->slots[j];
+            k = j;
+        }
+    }
+    st->slots[k] = -1;
+
+    st->numpeers--;
+    if(i < st->numpeers) {
+        p = &st->peers[st->numpeers];
+        st->slots[peer_slot(st, p->ip, p->len, p->port)] = i;
+        st->peers[i] = *p;
     }
-    return st;
 }
 
 static int
@@ -1371,27 +1798,28 @@ storage_store(const unsigned char *id,
     if(st == NULL) {
         if(numstorage >= DHT_MAX_HASHES)
             return -1;
+        if(2 * (numstorage + 1) > storage_size && grow_storage() < 0)
+            return -1;
         st = calloc(1, sizeof(struct storage));
         if(st == NULL) return -1;
         memcpy(st->id, id, 20);
-        st->next = storage;
-        storage = st;
+        if(index_peers(st) < 0) {
+            free(st);
+            return -1;
+        }
+        storage[storage_slot(id)] = st;
         numstorage++;
     }
 
-    for(i = 0; i < st->numpeers; i++) {
-        if(st->peers[i].port == port && st->peers[i].len == len &&
-           memcmp(st->peers[i].ip, ip, len) == 0)
-            break;
-    }
+    i = peer_slot(st, ip, len, port);
 
-    if(i < st->numpeers) {
+    if(st->slots[i] >= 0) {
         /* Already there, only need to refresh */
-        st->peers[i].time = now.tv_sec;
+        st->peers[st->slots[i]].time = now.tv_sec;
         return 0;
     } else {
         struct peer *p;
-        if(i >= st->maxpeers) {
+        if(st->numpeers >= st->maxpeers) {
             /* Need to expand the array. */
             struct peer *new_peers;
             int n;
@@ -1404,7 +1832,11 @@ storage_store(const unsigned char *id,
                 return -1;
             st->peers = new_peers;
             st->maxpeers = n;
+            if(index_peers(st) < 0)
+                return -1;
+            i = peer_slot(st, ip, len, port);
         }
+        st->slots[i] = st->numpeers;
         p = &st->peers[st->numpeers++];
         p->time = now.tv_sec;
         p->len = len;
@@ -1414,42 +1846,43 @@ storage_store(const unsigned char *id,
     }
 }
 
+/* Peers are forgotten 32 minutes after they last announced.  The table is
+   looked at a slice at a time, sized so that all of it is looked at every
+   DHT_STORAGE_SWEEP_TIME seconds, so that a large table never holds up
+   dht_periodic for long. */
 static int
 expire_storage(void)
 {
-    struct storage *st = storage, *previous = NULL;
-    while(st) {
-        int i = 0;
-        while(i < st->numpeers) {
-            if(st->peers[i].time < now.tv_sec - 32 * 60) {
-                if(i != st->numpeers - 1)
-                    st->peers[i] = st->peers[st->numpeers - 1];
-                st->numpeers--;
-            } else {
-                i++;
+    long long todo;
+
+    if(storage == NULL)
+        return 0;
+
+    todo = 32 + (long long)storage_size *
+        (now.tv_sec - storage_expire_time) / DHT_STORAGE_SWEEP_TIME;
+    if(todo > storage_size)
+        todo = storage_size;
+    storage_expire_time = now.tv_sec;
+
+    while(todo-- > 0) {
+        struct storage *st = storage[storage_expire_next];
+        if(st) {
+            int i = 0;
+            while(i < st->numpeers) {
+                if(st->peers[i].time < now.tv_sec - 32 * 60)
+                    remove_peer(st, i);
+                else
+                    i++;
             }
-        }
 
-        if(st->numpeers == 0) {
-            free(st->peers);
-            if(previous)
-                previous->next = st->next;
-            else
-                storage = st->next;
-            free(st);
-            if(previous)
-                st = previous->next;
-            else
-                st = storage;
-            numstorage--;
-            if(numstorage < 0) {
-                debugf("Eek... numstorage became negative.\n");
-                numstorage = 0;
+            if(st->numpeers == 0) {
+                /* Something else may move into this slot, so look at
+                   it again. */
+                remove_storage(storage_expire_next);
+                continue;
             }
-        } else {
-            previous = st;
-            st = st->next;
         }
+        storage_expire_next = (storage_expire_next + 1) & (storage_size - 1);
     }
     return 1;
 }
@@ -1520,11 +1953,13 @@ dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
           int *incoming_return)
 {
     int good = 0, dubious = 0, cached = 0, incoming = 0;
-    struct bucket *b = af == AF_INET ? buckets : buckets6;
+    struct table *t = af == AF_INET ? buckets : buckets6;
+    int i, j;
 
-    while(b) {
-        struct node *n = b->nodes;
-        while(n) {
+    for(i = 0; t && i < t->numbuckets; i++) {
+        struct bucket *b = t->buckets[i];
+        for(j = 0; j < b->count; j++) {
+            struct node *n = &b->nodes[j];
             if(node_good(n)) {
                 good++;
                 if(n->time > n->reply_time)
@@ -1532,11 +1967,9 @@ dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
             } else {
                 dubious++;
             }
-            n = n->next;
         }
         if(b->cached.ss_family > 0)
             cached++;
-        b = b->next;
     }
     if(good_return)
         *good_return = good;
@@ -1552,14 +1985,13 @@ dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
 static void
 dump_bucket(FILE *f, struct bucket *b)
 {
-    struct node *n = b->nodes;
-    fprintf(f, "Bucket ");
-    print_hex(f, b->first, 20);
-    fprintf(f, " count %d age %d%s%s:\n",
-            b->count, (int)(now.tv_sec - b->time),
+    int i;
+    fprintf(f, "Bucket %d count %d age %d%s%s:\n",
+            b->depth, b->count, (int)(now.tv_sec - b->time),
             in_bucket(myid, b) ? " (mine)" : "",
             b->cached.ss_family ? " (cached)" : "");
-    while(n) {
+    for(i = 0; i < b->count; i++) {
+        struct node *n = &b->nodes[i];
         char buf[512];
         unsigned short port;
         fprintf(f, "    Node ");
@@ -1592,7 +2024,6 @@ dump_bucket(FILE *f, struct bucket *b)
         if(node_good(n))
             fprintf(f, " (good)");
         fprintf(f, "\n");
-        n = n->next;
     }
 
 }
@@ -1600,28 +2031,20 @@ dump_bucket(FILE *f, struct bucket *b)
 void
 dht_dump_tables(FILE *f)
 {
-    int i;
-    struct bucket *b;
-    struct storage *st = storage;
+    int i, j;
     struct search *sr = searches;
 
     fprintf(f, "My id ");
     print_hex(f, myid, 20);
     fprintf(f, "\n");
 
-    b = buckets;
-    while(b) {
-        dump_bucket(f, b);
-        b = b->next;
-    }
+    for(i = 0; buckets && i < buckets->numbuckets; i++)
+        dump_bucket(f, buckets->buckets[i]);
 
     fprintf(f, "\n");
 
-    b = buckets6;
-    while(b) {
-        dump_bucket(f, b);
-        b = b->next;
-    }
+    for(i = 0; buckets6 && i < buckets6->numbuckets; i++)
+        dump_bucket(f, buckets6->buckets[i]);
 
     while(sr) {
         fprintf(f, "\nSearch%s id ", sr->af == AF_INET6 ? " (IPv6)" : "");
@@ -1645,7 +2068,10 @@ dht_dump_tables(FILE *f)
         sr = sr->next;
     }
 
-    while(st) {
+    for(j = 0; j < storage_size; j++) {
+        struct storage *st = storage[j];
+        if(st == NULL)
+            continue;
         fprintf(f, "\nStorage ");
         print_hex(f, st->id, 20);
         fprintf(f, " %d/%d nodes:", st->numpeers, st->maxpeers);
@@ -1664,13 +2090,39 @@ dht_dump_tables(FILE *f)
                     buf, st->peers[i].port,
                     (long)(now.tv_sec - st->peers[i].time));
         }
-        st = st->next;
     }
 
     fprintf(f, "\n\n");
     fflush(f);
 }
 
+static struct table *
+new_table(int af)
+{
+    struct table *t = calloc(1, sizeof(struct table));
+    if(t == NULL)
+        return NULL;
+    t->buckets[0] = calloc(1, sizeof(struct bucket));
+    if(t->buckets[0] == NULL) {
+        free(t);
+        return NULL;
+    }
+    t->buckets[0]->af = af;
+    t->numbuckets = 1;
+    return t;
+}
+
+static void
+free_table(struct table *t)
+{
+    int i;
+    if(t == NULL)
+        return;
+    for(i = 0; i < t->numbuckets; i++)
+        free(t->buckets[i]);
+    free(t);
+}
+
 int
 dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
 {
@@ -1683,15 +2135,20 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
 
     searches = NULL;
     numsearches = 0;
+    memset(search_tids, 0, sizeof(search_tids));
+    memset(search_ids, 0, sizeof(search_ids));
+    memset(search_nodes, 0, sizeof(search_nodes));
+    done_first = done_last = NULL;
 
     storage = NULL;
+    storage_size = 0;
     numstorage = 0;
+    storage_expire_next = 0;
 
     if(s >= 0) {
-        buckets = calloc(sizeof(struct bucket), 1);
+        buckets = new_table(AF_INET);
         if(buckets == NULL)
             return -1;
-        buckets->af = AF_INET;
 
         rc = set_nonblocking(s, 1);
         if(rc < 0)
@@ -1699,10 +2156,9 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     }
 
     if(s6 >= 0) {
-        buckets6 = calloc(sizeof(struct bucket), 1);
+        buckets6 = new_table(AF_INET6);
         if(buckets6 == NULL)
-            return -1;
-        buckets6->af = AF_INET6;
+            goto fail;
 
         rc = set_nonblocking(s6, 1);
         if(rc < 0)
@@ -1727,7 +2183,7 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     search_id = random() & 0xFFFF;
     search_time = 0;
 
-    next_blacklisted = 0;
+    reset_blacklist();
 
     token_bucket_time = now.tv_sec;
     token_bucket_tokens = MAX_TOKEN_BUCKET_TOKENS;
@@ -1737,8 +2193,15 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     if(rc < 0)
         goto fail;
 
+    rc = dht_random_bytes(&hash_salt, sizeof(hash_salt));
+    if(rc < 0)
+        goto fail;
+    storage_expire_time = now.tv_sec;
+
     dht_socket = s;
     dht_socket6 = s6;
+    numqueued = 0;
+    queue_sends = 0;
 
     expire_buckets(buckets);
     expire_buckets(buckets6);
@@ -1746,9 +2209,9 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     return 1;
 
  fail:
-    free(buckets);
+    free_table(buckets);
     buckets = NULL;
-    free(buckets6);
+    free_table(buckets6);
     buckets6 = NULL;
     return -1;
 }
@@ -1756,6 +2219,8 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
 int
 dht_uninit()
 {
+    int i;
+
     if(dht_socket < 0 && dht_socket6 < 0) {
         errno = EINVAL;
         return -1;
@@ -1763,39 +2228,31 @@ dht_uninit()
 
     dht_socket = -1;
     dht_socket6 = -1;
+    /* The sockets may be gone already, so drop what is queued. */
+    numqueued = 0;
+    queue_sends = 0;
 
-    while(buckets) {
-        struct bucket *b = buckets;
-        buckets = b->next;
-        while(b->nodes) {
-            struct node *n = b->nodes;
-            b->nodes = n->next;
-            free(n);
-        }
-        free(b);
-    }
+    free_table(buckets);
+    buckets = NULL;
+    free_table(buckets6);
+    buckets6 = NULL;
 
-    while(buckets6) {
-        struct bucket *b = buckets6;
-        buckets6 = b->next;
-        while(b->nodes) {
-            struct node *n = b->nodes;
-            b->nodes = n->next;
-            free(n);
+    for(i = 0; i < storage_size; i++) {
+        if(storage[i]) {
+            free(storage[i]->peers);
+            free(storage[i]->slots);
+            free(storage[i]);
         }
-        free(b);
-    }
-
-    while(storage) {
-        struct storage *st = storage;
-        storage = storage->next;
-        free(st->peers);
-        free(st);
     }
+    free(storage);
+    storage = NULL;
+    storage_size = 0;
+    numstorage = 0;
 
     while(searches) {
         struct search *sr = searches;
         searches = searches->next;
+        unlink_search(sr);
         free(sr);
     }
 
@@ -1834,8 +2291,8 @@ neighbourhood_maintenance(int af)
     memcpy(id, myid, 20);
     id[19] = random() & 0xFF;
     q = b;
-    if(q->next && (q->count == 0 || (random() & 7) == 0))
-        q = b->next;
+    if(next_bucket(q) && (q->count == 0 || (random() & 7) == 0))
+        q = next_bucket(b);
     if(q->count == 0 || (random() & 7) == 0) {
         struct bucket *r;
         r = previous_bucket(b);
@@ -1866,11 +2323,11 @@ neighbourhood_maintenance(int af)
 static int
 bucket_maintenance(int af)
 {
-    struct bucket *b;
-
-    b = af == AF_INET ? buckets : buckets6;
+    struct table *t = af == AF_INET ? buckets : buckets6;
+    int i;
 
-    while(b) {
+    for(i = 0; t && i < t->numbuckets; i++) {
+        struct bucket *b = t->buckets[i];
         struct bucket *q;
         if(b->time < now.tv_sec - 600) {
             /* This bucket hasn't seen any positive confirmation for a long
@@ -1882,14 +2339,14 @@ bucket_maintenance(int af)
 
             rc = bucket_random(b, id);
             if(rc < 0)
-                memcpy(id, b->first, 20);
+                memcpy(id, myid, 20);
 
             q = b;
             /* If the bucket is empty, we try to fill it from a neighbour.
                We also sometimes do it gratuitiously to recover from
                buckets full of broken nodes. */
-            if(q->next && (q->count == 0 || (random() & 7) == 0))
-                q = b->next;
+            if(next_bucket(q) && (q->count == 0 || (random() & 7) == 0))
+                q = next_bucket(b);
             if(q->count == 0 || (random() & 7) == 0) {
                 struct bucket *r;
                 r = previous_bucket(b);
@@ -1932,7 +2389,6 @@ bucket_maintenance(int af)
                 }
             }
         }
-        b = b->next;
     }
     return 0;
 }
@@ -2204,10 +2660,11 @@ int dht_periodic(const void *buf, size_t buflen, const struct sockaddr *from, in
     if(now.tv_sec >= expire_stuff_time) {
         expire_buckets(buckets);
         expire_buckets(buckets6);
-        expire_storage();
         expire_searches();
     }
 
+    expire_storage();
+
     if(search_time > 0 && now.tv_sec >= search_time) {
         struct search *sr;
         sr = searches;
@@ -2269,13 +2726,26 @@ int dht_periodic(const void *buf, size_t buflen, const struct sockaddr *from, in
     return 1;
 }
 
+/* Copy the good nodes of a bucket. */
+static int
+bucket_good_nodes(struct bucket *b, int sslen, void *addresses, int i, int num)
+{
+    int j;
+    for(j = 0; j < b->count && i < num; j++) {
+        if(node_good(&b->nodes[j])) {
+            memcpy((char*)addresses + i * sslen, &b->nodes[j].ss, sslen);
+            i++;
+        }
+    }
+    return i;
+}
+
 int
 dht_get_nodes(struct sockaddr_in *sin, int *num,
               struct sockaddr_in6 *sin6, int *num6)
 {
-    int i, j;
+    int i, j, k;
     struct bucket *b;
-    struct node *n;
 
     i = 0;
 
@@ -2285,28 +2755,11 @@ dht_get_nodes(struct sockaddr_in *sin, int *num,
     if(b == NULL)
         goto no_ipv4;
 
-    n = b->nodes;
-    while(n && i < *num) {
-        if(node_good(n)) {
-            sin[i] = *(struct sockaddr_in*)&n->ss;
-            i++;
-        }
-        n = n->next;
-    }
-
-    b = buckets;
-    while(b && i < *num) {
-        if(!in_bucket(myid, b)) {
-            n = b->nodes;
-            while(n && i < *num) {
-                if(node_good(n)) {
-                    sin[i] = *(struct sockaddr_in*)&n->ss;
-                    i++;
-                }
-                n = n->next;
-            }
-        }
-        b = b->next;
+    i = bucket_good_nodes(b, sizeof(struct sockaddr_in), sin, i, *num);
+    for(k = 0; k < buckets->numbuckets && i < *num; k++) {
+        if(buckets->buckets[k] != b)
+            i = bucket_good_nodes(buckets->buckets[k],
+                                  sizeof(struct sockaddr_in), sin, i, *num);
     }
 
  no_ipv4:
@@ -2317,28 +2770,11 @@ dht_get_nodes(struct sockaddr_in *sin, int *num,
     if(b == NULL)
         goto no_ipv6;
 
-    n = b->nodes;
-    while(n && j < *num6) {
-        if(node_good(n)) {
-            sin6[j] = *(struct sockaddr_in6*)&n->ss;
-            j++;
-        }
-        n = n->next;
-    }
-
-    b = buckets6;
-    while(b && j < *num6) {
-        if(!in_bucket(myid, b)) {
-            n = b->nodes;
-            while(n && j < *num6) {
-                if(node_good(n)) {
-                    sin6[j] = *(struct sockaddr_in6*)&n->ss;
-                    j++;
-                }
-                n = n->next;
-            }
-        }
-        b = b->next;
+    j = bucket_good_nodes(b, sizeof(struct sockaddr_in6), sin6, j, *num6);
+    for(k = 0; k < buckets6->numbuckets && j < *num6; k++) {
+        if(buckets6->buckets[k] != b)
+            j = bucket_good_nodes(buckets6->buckets[k],
+                                  sizeof(struct sockaddr_in6), sin6, j, *num6);
     }
 
  no_ipv6:
@@ -2428,9 +2864,108 @@ dht_send(const void *buf, size_t len, int flags,
         return -1;
     }
 
+    if(queue_sends) {
+        struct queued_packet *p;
+        if(len > DHT_MAX_PACKET || (unsigned)salen > sizeof(p->ss)) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if(numqueued >= DHT_SEND_QUEUE)
+            dht_flush();
+        p = &send_queue[numqueued++];
+        p->s = s;
+        p->flags = flags;
+        memcpy(&p->ss, sa, salen);
+        p->sslen = salen;
+        memcpy(p->buf, buf, len);
+        p->len = len;
+        return len;
+    }
+
     return sendto(s, buf, len, flags, sa, salen);
 }
 
+/* Send a run of queued packets that share a socket and flags. */
+static int
+send_queued(struct queued_packet *packets, int count)
+{
+    int i, sent = 0;
+#ifdef __linux__
+    struct mmsghdr msgs[DHT_SEND_QUEUE];
+    struct iovec iov[DHT_SEND_QUEUE];
+
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+    for(i = 0; i < count; i++) {
+        iov[i].iov_base = packets[i].buf;
+        iov[i].iov_len = packets[i].len;
+        msgs[i].msg_hdr.msg_name = &packets[i].ss;
+        msgs[i].msg_hdr.msg_namelen = packets[i].sslen;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    i = 0;
+    while(i < count) {
+        int rc = sendmmsg(packets[0].s, msgs + i, count - i, packets[0].flags);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0) {
+            /* sendmmsg stops at the first packet that fails.  Drop it,
+               as sendto would have, and carry on with the rest. */
+            debugf("sendmmsg: %s\n", strerror(errno));
+            i++;
+        } else {
+            i += rc;
+            sent += rc;
+        }
+    }
+#else
+    for(i = 0; i < count; i++) {
+        if(sendto(packets[i].s, packets[i].buf, packets[i].len,
+                  packets[i].flags, (struct sockaddr*)&packets[i].ss,
+                  packets[i].sslen) >= 0)
+            sent++;
+    }
+#endif
+    return sent;
+}
+
+/**
+ * Send everything that dht_send has queued
+ * @returns the number of packets sent
+ **/
+int
+dht_flush(void)
+{
+    int i = 0, sent = 0;
+
+    while(i < numqueued) {
+        int j = i + 1;
+        while(j < numqueued && send_queue[j].s == send_queue[i].s &&
+              send_queue[j].flags == send_queue[i].flags)
+            j++;
+        sent += send_queued(&send_queue[i], j - i);
+        i = j;
+    }
+    numqueued = 0;
+    return sent;
+}
+
+/**
+ * Queue packets instead of sending them one by one
+ * @param enable 1 to queue until dht_flush, 0 to send right away (the
+ *        default).  Anything queued is sent when queueing is turned off.
+ * @returns 1
+ **/
+int
+dht_queue_sends(int enable)
+{
+    if(!enable)
+        dht_flush();
+    queue_sends = enable;
+    return 1;
+}
+
 int
 send_ping(const struct sockaddr *sa, int salen,
           const unsigned char *tid, int tid_len)
@@ -2617,11 +3152,10 @@ static int
 buffer_closest_nodes(unsigned char *nodes, int numnodes,
                      const unsigned char *id, struct bucket *b)
 {
-    struct node *n = b->nodes;
-    while(n) {
-        if(node_good(n))
-            numnodes = insert_closest_node(nodes, numnodes, id, n);
-        n = n->next;
+    int i;
+    for(i = 0; i < b->count; i++) {
+        if(node_good(&b->nodes[i]))
+            numnodes = insert_closest_node(nodes, numnodes, id, &b->nodes[i]);
     }
     return numnodes;
 }
@@ -2645,8 +3179,9 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
         b = find_bucket(id, AF_INET);
         if(b) {
             numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
-            if(b->next)
-                numnodes = buffer_closest_nodes(nodes, numnodes, id, b->next);
+            if(next_bucket(b))
+                numnodes = buffer_closest_nodes(nodes, numnodes, id,
+                                                next_bucket(b));
             b = previous_bucket(b);
             if(b)
                 numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
@@ -2657,9 +3192,10 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
         b = find_bucket(id, AF_INET6);
         if(b) {
             numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
-            if(b->next)
+            if(next_bucket(b))
                 numnodes6 =
-                    buffer_closest_nodes(nodes6, numnodes6, id, b->next);
+                    buffer_closest_nodes(nodes6, numnodes6, id,
+                                         next_bucket(b));
             b = previous_bucket(b);
             if(b)
                 numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
@@ -0,0 +1,631 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "libp2p/conn/dialer.h"
+#include "libp2p/crypto/sha256.h"
+#include "libp2p/routing/dht_lookup.h"
+#include "libp2p/routing/dht_protocol.h"
+#include "libp2p/utils/linked_list.h"
+#include "libp2p/utils/logger.h"
+
+/***
+ * A query sent to one peer. It lives until its response (or the session's failure)
+ * comes back, even if the lookup has given up on it or gone away by then.
+ */
+struct DhtLookupQuery {
+	// NULL once the lookup no longer waits for this query
+	struct DhtLookup* lookup;
+	struct DhtLookupPeer* candidate;
+	unsigned long long deadline_ms;
+	// where it was sent, so that it can be given up on
+	struct SessionContext* session;
+	struct DhtAsyncRequest* request;
+};
+
+static unsigned long long libp2p_routing_dht_lookup_now_ms() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (unsigned long long)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/***
+ * Build a new lookup engine
+ * @param peerstore where lookups start
+ * @param loop the event loop the sessions are in
+ * @param session_for_peer finds a session to a peer
+ * @param session_for_peer_context handed to session_for_peer
+ * @returns the engine, or NULL on error
+ */
+struct DhtLookupEngine* libp2p_routing_dht_lookup_engine_new(struct Peerstore* peerstore, struct Libp2pEventLoop* loop,
+		struct SessionContext* (*session_for_peer)(struct Libp2pPeer* peer, void* context), void* session_for_peer_context) {
+	struct DhtLookupEngine* engine = (struct DhtLookupEngine*) malloc(sizeof(struct DhtLookupEngine));
+	if (engine == NULL)
+		return NULL;
+	if (pthread_mutex_init(&engine->lock, NULL) != 0) {
+		free(engine);
+		return NULL;
+	}
+	if (pthread_cond_init(&engine->done_condition, NULL) != 0) {
+		pthread_mutex_destroy(&engine->lock);
+		free(engine);
+		return NULL;
+	}
+	engine->pending = NULL;
+	engine->running = NULL;
+	engine->num_running = 0;
+	engine->alpha = DHT_LOOKUP_ALPHA;
+	engine->k = DHT_LOOKUP_K;
+	engine->query_timeout_ms = DHT_LOOKUP_QUERY_TIMEOUT_MS;
+	engine->peerstore = peerstore;
+	engine->loop = loop;
+	engine->session_for_peer = session_for_peer;
+	engine->session_for_peer_context = session_for_peer_context;
+	return engine;
+}
+
+/***
+ * Stop waiting for a query. Its response is thrown away when it comes.
+ * @param candidate the peer the query went to
+ */
+static void libp2p_routing_dht_lookup_detach_query(struct DhtLookupPeer* candidate) {
+	if (candidate->query != NULL) {
+		candidate->query->lookup = NULL;
+		candidate->query->candidate = NULL;
+		candidate->query = NULL;
+	}
+}
+
+/***
+ * End a lookup
+ * @param lookup the lookup
+ * @param notify true(1) to call the callback
+ */
+static void libp2p_routing_dht_lookup_finish(struct DhtLookup* lookup, int notify) {
+	struct DhtLookupEngine* engine = lookup->engine;
+	if (lookup->done)
+		return;
+	for(int i = 0; i < lookup->num_candidates; i++)
+		libp2p_routing_dht_lookup_detach_query(lookup->candidates[i]);
+	lookup->outstanding = 0;
+	// take it off the running list
+	struct DhtLookup** current = &engine->running;
+	while (*current != NULL && *current != lookup)
+		current = &(*current)->next;
+	if (*current != NULL) {
+		*current = lookup->next;
+		engine->num_running--;
+	}
+	lookup->next = NULL;
+	libp2p_logger_debug("dht_lookup", "Lookup done after %d queries, %d responses and %d timeouts. Success: %d\n",
+			lookup->num_queries, lookup->num_responses, lookup->num_timeouts, lookup->succeeded);
+	if (notify && lookup->callback != NULL)
+		lookup->callback(lookup, lookup->user_data);
+	// after the callback, as a waiter may free the lookup as soon as it sees this
+	pthread_mutex_lock(&engine->lock);
+	lookup->done = 1;
+	pthread_cond_broadcast(&engine->done_condition);
+	pthread_mutex_unlock(&engine->lock);
+}
+
+/***
+ * Finish all lookups (unsuccessfully), and free the engine. The lookups themselves
+ * still belong to whoever started them.
+ * NOTE: call this from the event loop thread
+ * @param engine the engine
+ */
+void libp2p_routing_dht_lookup_engine_free(struct DhtLookupEngine* engine) {
+	if (engine == NULL)
+		return;
+	pthread_mutex_lock(&engine->lock);
+	struct DhtLookup* pending = engine->pending;
+	engine->pending = NULL;
+	pthread_mutex_unlock(&engine->lock);
+	while (pending != NULL) {
+		struct DhtLookup* next = pending->next;
+		pending->next = NULL;
+		libp2p_routing_dht_lookup_finish(pending, 1);
+		pending = next;
+	}
+	while (engine->running != NULL)
+		libp2p_routing_dht_lookup_finish(engine->running, 1);
+	pthread_cond_destroy(&engine->done_condition);
+	pthread_mutex_destroy(&engine->lock);
+	free(engine);
+}
+
+/***
+ * Find a peer a lookup already knows about
+ * @param lookup the lookup
+ * @param peer the peer
+ * @returns the candidate, or NULL if the peer is not one
+ */
+static struct DhtLookupPeer* libp2p_routing_dht_lookup_find_candidate(struct DhtLookup* lookup, const struct Libp2pPeer* peer) {
+	for(int i = 0; i < lookup->num_candidates; i++) {
+		struct Libp2pPeer* current = lookup->candidates[i]->peer;
+		if (current->id_size == peer->id_size && memcmp(current->id, peer->id, peer->id_size) == 0)
+			return lookup->candidates[i];
+	}
+	return NULL;
+}
+
+/***
+ * Add a peer to a lookup, in order of distance
+ * @param lookup the lookup
+ * @param peer the peer. It is copied
+ * @returns the new candidate, or NULL if it was not added
+ */
+static struct DhtLookupPeer* libp2p_routing_dht_lookup_add_candidate(struct DhtLookup* lookup, const struct Libp2pPeer* peer) {
+	unsigned char distance[32];
+	int position = 0;
+
+	if (peer == NULL || peer->id == NULL || peer->id_size == 0)
+		return NULL;
+	struct Libp2pPeer* local_peer = libp2p_peerstore_get_local_peer(lookup->engine->peerstore);
+	if (local_peer != NULL && local_peer->id_size == peer->id_size && memcmp(local_peer->id, peer->id, peer->id_size) == 0)
+		return NULL;
+	if (libp2p_routing_dht_lookup_find_candidate(lookup, peer) != NULL)
+		return NULL;
+	libp2p_crypto_hashing_sha256((unsigned char*)peer->id, peer->id_size, distance);
+	for(int i = 0; i < 32; i++)
+		distance[i] ^= lookup->target[i];
+	while (position < lookup->num_candidates && memcmp(lookup->candidates[position]->distance, distance, 32) < 0)
+		position++;
+
+	if (lookup->num_candidates >= DHT_LOOKUP_MAX_CANDIDATES) {
+		// make room by dropping the farthest peer that is not being asked
+		int farthest = lookup->num_candidates - 1;
+		while (farthest >= position && lookup->candidates[farthest]->state == DHT_LOOKUP_PEER_QUERYING)
+			farthest--;
+		if (farthest < position)
+			return NULL;
+		libp2p_peer_free(lookup->candidates[farthest]->peer);
+		free(lookup->candidates[farthest]);
+		memmove(&lookup->candidates[farthest], &lookup->candidates[farthest + 1], (lookup->num_candidates - farthest - 1) * sizeof(struct DhtLookupPeer*));
+		lookup->num_candidates--;
+	}
+
+	struct DhtLookupPeer* candidate = (struct DhtLookupPeer*) malloc(sizeof(struct DhtLookupPeer));
+	if (candidate == NULL)
+		return NULL;
+	candidate->peer = libp2p_peer_copy(peer);
+	if (candidate->peer == NULL) {
+		free(candidate);
+		return NULL;
+	}
+	// the copy does not keep the session
+	if (candidate->peer->dialer != NULL)
+		libp2p_conn_dialer_release_session(candidate->peer->dialer, candidate->peer->sessionContext);
+	candidate->peer->dialer = NULL;
+	candidate->peer->sessionContext = NULL;
+	memcpy(candidate->distance, distance, 32);
+	candidate->state = DHT_LOOKUP_PEER_NEW;
+	candidate->query = NULL;
+	memmove(&lookup->candidates[position + 1], &lookup->candidates[position], (lookup->num_candidates - position) * sizeof(struct DhtLookupPeer*));
+	lookup->candidates[position] = candidate;
+	lookup->num_candidates++;
+	return candidate;
+}
+
+static void libp2p_routing_dht_lookup_response(struct SessionContext* session, struct Libp2pMessage* response, void* user_data);
+
+/***
+ * Ask a peer about the key
+ * @param lookup the lookup
+ * @param candidate the peer to ask
+ * @returns true(1) if the query was sent, false(0) otherwise
+ */
+static int libp2p_routing_dht_lookup_send(struct DhtLookup* lookup, struct DhtLookupPeer* candidate) {
+	struct DhtLookupEngine* engine = lookup->engine;
+	struct DhtLookupQuery* query = NULL;
+	struct Libp2pMessage* message = NULL;
+	int retVal = 0;
+
+	struct SessionContext* session = engine->session_for_peer(candidate->peer, engine->session_for_peer_context);
+	if (session == NULL)
+		goto exit;
+	query = (struct DhtLookupQuery*) malloc(sizeof(struct DhtLookupQuery));
+	message = libp2p_message_new();
+	if (query == NULL || message == NULL)
+		goto exit;
+	message->message_type = lookup->message_type;
+	message->key = malloc(lookup->key_size);
+	if (message->key == NULL)
+		goto exit;
+	memcpy(message->key, lookup->key, lookup->key_size);
+	message->key_size = lookup->key_size;
+	query->lookup = lookup;
+	query->candidate = candidate;
+	query->deadline_ms = libp2p_routing_dht_lookup_now_ms() + engine->query_timeout_ms;
+	query->session = session;
+	query->request = NULL;
+	if (!libp2p_routing_dht_send_message_async(session, message, libp2p_routing_dht_lookup_response, query, &query->request))
+		goto exit;
+	// the response owns it now
+	candidate->query = query;
+	query = NULL;
+	candidate->state = DHT_LOOKUP_PEER_QUERYING;
+	lookup->outstanding++;
+	lookup->num_queries++;
+	if (lookup->outstanding > lookup->max_outstanding)
+		lookup->max_outstanding = lookup->outstanding;
+	retVal = 1;
+	exit:
+	if (query != NULL)
+		free(query);
+	if (message != NULL)
+		libp2p_message_free(message);
+	return retVal;
+}
+
+/***
+ * Send queries while there is room, and see if the lookup is over
+ * @param lookup the lookup
+ */
+static void libp2p_routing_dht_lookup_advance(struct DhtLookup* lookup) {
+	struct DhtLookupEngine* engine = lookup->engine;
+	int closest = 0;
+
+	if (lookup->done)
+		return;
+	if (lookup->succeeded) {
+		libp2p_routing_dht_lookup_finish(lookup, 1);
+		return;
+	}
+	// only the k closest peers that have not failed matter
+	for(int i = 0; i < lookup->num_candidates && closest < engine->k; i++) {
+		struct DhtLookupPeer* candidate = lookup->candidates[i];
+		if (candidate->state == DHT_LOOKUP_PEER_NEW) {
+			if (lookup->outstanding >= engine->alpha) {
+				closest++;
+				continue;
+			}
+			if (!libp2p_routing_dht_lookup_send(lookup, candidate)) {
+				candidate->state = DHT_LOOKUP_PEER_FAILED;
+				continue;
+			}
+		}
+		if (candidate->state != DHT_LOOKUP_PEER_FAILED)
+			closest++;
+	}
+	// nobody left to ask
+	if (lookup->outstanding == 0)
+		libp2p_routing_dht_lookup_finish(lookup, 1);
+}
+
+/***
+ * Keep what a peer sent back
+ * @param lookup the lookup
+ * @param response the response
+ */
+static void libp2p_routing_dht_lookup_merge(struct DhtLookup* lookup, struct Libp2pMessage* response) {
+	struct Libp2pLinkedList* current = response->closer_peer_head;
+	while (current != NULL) {
+		struct Libp2pPeer* peer = (struct Libp2pPeer*)current->item;
+		struct DhtLookupPeer* candidate = libp2p_routing_dht_lookup_add_candidate(lookup, peer);
+		// later lookups can start from here
+		if (candidate != NULL)
+			libp2p_peerstore_add_peer(lookup->engine->peerstore, candidate->peer);
+		else
+			candidate = libp2p_routing_dht_lookup_find_candidate(lookup, peer);
+		if (candidate != NULL && lookup->message_type == MESSAGE_TYPE_FIND_NODE && lookup->found_peer == NULL
+				&& peer->id_size == lookup->key_size && memcmp(peer->id, lookup->key, lookup->key_size) == 0) {
+			lookup->found_peer = candidate->peer;
+			lookup->succeeded = 1;
+		}
+		current = current->next;
+	}
+	current = response->provider_peer_head;
+	while (current != NULL) {
+		struct Libp2pPeer* peer = (struct Libp2pPeer*)current->item;
+		int known = 0;
+		for(int i = 0; i < lookup->providers->total && peer != NULL; i++) {
+			struct Libp2pPeer* provider = (struct Libp2pPeer*)libp2p_utils_vector_get(lookup->providers, i);
+			if (provider->id_size == peer->id_size && memcmp(provider->id, peer->id, peer->id_size) == 0)
+				known = 1;
+		}
+		if (peer != NULL && !known) {
+			struct Libp2pPeer* copy = libp2p_peer_copy(peer);
+			if (copy != NULL) {
+				copy->sessionContext = NULL;
+				libp2p_utils_vector_add(lookup->providers, copy);
+			}
+		}
+		current = current->next;
+	}
+	if (lookup->message_type == MESSAGE_TYPE_GET_PROVIDERS && lookup->providers->total > 0)
+		lookup->succeeded = 1;
+	if (lookup->message_type == MESSAGE_TYPE_GET_VALUE && lookup->record == NULL && response->record != NULL) {
+		lookup->record = response->record;
+		response->record = NULL;
+		lookup->succeeded = 1;
+	}
+}
+
+/***
+ * A peer has answered a query (or its session failed)
+ */
+static void libp2p_routing_dht_lookup_response(struct SessionContext* session, struct Libp2pMessage* response, void* user_data) {
+	struct DhtLookupQuery* query = (struct DhtLookupQuery*)user_data;
+	struct DhtLookup* lookup = query->lookup;
+	if (lookup != NULL) {
+		struct DhtLookupPeer* candidate = query->candidate;
+		candidate->query = NULL;
+		lookup->outstanding--;
+		if (response == NULL) {
+			candidate->state = DHT_LOOKUP_PEER_FAILED;
+		} else {
+			candidate->state = DHT_LOOKUP_PEER_RESPONDED;
+			lookup->num_responses++;
+			libp2p_routing_dht_lookup_merge(lookup, response);
+		}
+		libp2p_routing_dht_lookup_advance(lookup);
+	}
+	if (response != NULL)
+		libp2p_message_free(response);
+	free(query);
+}
+
+/***
+ * Start a lookup: seed it from the peerstore, and send the first queries
+ * @param lookup the lookup
+ */
+static void libp2p_routing_dht_lookup_begin(struct DhtLookup* lookup) {
+	struct DhtLookupEngine* engine = lookup->engine;
+	struct Libp2pPeer* closest[DHT_LOOKUP_MAX_CANDIDATES];
+	int max = engine->k < DHT_LOOKUP_MAX_CANDIDATES ? engine->k : DHT_LOOKUP_MAX_CANDIDATES;
+
+	int found = libp2p_peerstore_get_closest_peers(engine->peerstore, (unsigned char*)lookup->key, lookup->key_size, closest, max);
+	for(int i = 0; i < found; i++)
+		libp2p_routing_dht_lookup_add_candidate(lookup, closest[i]);
+	lookup->next = engine->running;
+	engine->running = lookup;
+	engine->num_running++;
+	libp2p_routing_dht_lookup_advance(lookup);
+}
+
+/***
+ * Start the lookups that are waiting, handle queries that have timed out, and send
+ * queries where there is room. Call this from the event loop thread, after each
+ * libp2p_net_event_loop_run_once.
+ * @param engine the engine
+ * @returns the number of lookups running
+ */
+int libp2p_routing_dht_lookup_engine_process(struct DhtLookupEngine* engine) {
+	pthread_mutex_lock(&engine->lock);
+	struct DhtLookup* pending = engine->pending;
+	engine->pending = NULL;
+	pthread_mutex_unlock(&engine->lock);
+	while (pending != NULL) {
+		struct DhtLookup* next = pending->next;
+		libp2p_routing_dht_lookup_begin(pending);
+		pending = next;
+	}
+
+	unsigned long long now = libp2p_routing_dht_lookup_now_ms();
+	struct DhtLookup* lookup = engine->running;
+	while (lookup != NULL) {
+		// advancing can take this lookup off the list
+		struct DhtLookup* next = lookup->next;
+		int timed_out = 0;
+		for(int i = 0; i < lookup->num_candidates; i++) {
+			struct DhtLookupPeer* candidate = lookup->candidates[i];
+			if (candidate->query != NULL && candidate->query->deadline_ms <= now) {
+				struct DhtLookupQuery* query = candidate->query;
+				libp2p_routing_dht_lookup_detach_query(candidate);
+				// stop waiting for the answer, so a late one is not matched against this lookup
+				if (libp2p_routing_dht_cancel_message_async(query->session, query->request))
+					free(query);
+				candidate->state = DHT_LOOKUP_PEER_FAILED;
+				lookup->outstanding--;
+				lookup->num_timeouts++;
+				timed_out = 1;
+			}
+		}
+		if (timed_out)
+			libp2p_routing_dht_lookup_advance(lookup);
+		lookup = next;
+	}
+	return engine->num_running;
+}
+
+/***
+ * Start a lookup. Safe to call from any thread.
+ * @param engine the engine
+ * @param message_type MESSAGE_TYPE_FIND_NODE, MESSAGE_TYPE_GET_PROVIDERS or MESSAGE_TYPE_GET_VALUE
+ * @param key the peer id or key to look for
+ * @param key_size the size of the key
+ * @param callback called when the lookup is over (may be NULL)
+ * @param user_data handed to the callback
+ * @returns the lookup (free it with libp2p_routing_dht_lookup_free), or NULL on error
+ */
+struct DhtLookup* libp2p_routing_dht_lookup_start(struct DhtLookupEngine* engine, enum MessageType message_type,
+		const char* key, size_t key_size, void (*callback)(struct DhtLookup* lookup, void* user_data), void* user_data) {
+	if (engine == NULL || key == NULL || key_size == 0)
+		return NULL;
+	if (message_type != MESSAGE_TYPE_FIND_NODE && message_type != MESSAGE_TYPE_GET_PROVIDERS && message_type != MESSAGE_TYPE_GET_VALUE)
+		return NULL;
+	struct DhtLookup* lookup = (struct DhtLookup*) malloc(sizeof(struct DhtLookup));
+	if (lookup == NULL)
+		return NULL;
+	memset(lookup, 0, sizeof(struct DhtLookup));
+	lookup->engine = engine;
+	lookup->message_type = message_type;
+	lookup->key = malloc(key_size);
+	lookup->candidates = (struct DhtLookupPeer**) malloc(DHT_LOOKUP_MAX_CANDIDATES * sizeof(struct DhtLookupPeer*));
+	lookup->providers = libp2p_utils_vector_new(1);
+	if (lookup->key == NULL || lookup->candidates == NULL || lookup->providers == NULL) {
+		libp2p_routing_dht_lookup_free(lookup);
+		return NULL;
+	}
+	memcpy(lookup->key, key, key_size);
+	lookup->key_size = key_size;
+	libp2p_crypto_hashing_sha256((unsigned char*)key, key_size, lookup->target);
+	lookup->callback = callback;
+	lookup->user_data = user_data;
+
+	// the event loop thread picks it up
+	pthread_mutex_lock(&engine->lock);
+	lookup->next = engine->pending;
+	engine->pending = lookup;
+	pthread_mutex_unlock(&engine->lock);
+	return lookup;
+}
+
+/***
+ * Wait for a lookup to finish, while another thread runs the event loop
+ * @param lookup the lookup
+ * @param timeout_ms the most milliseconds to wait
+ * @returns true(1) if the lookup is over, false(0) on timeout
+ */
+int libp2p_routing_dht_lookup_wait(struct DhtLookup* lookup, int timeout_ms) {
+	struct DhtLookupEngine* engine = lookup->engine;
+	struct timeval now;
+	struct timespec until;
+	int done = 0;
+
+	gettimeofday(&now, NULL);
+	unsigned long long nsecs = (unsigned long long)now.tv_usec * 1000 + (unsigned long long)(timeout_ms % 1000) * 1000000;
+	until.tv_sec = now.tv_sec + timeout_ms / 1000 + nsecs / 1000000000;
+	until.tv_nsec = nsecs % 1000000000;
+	pthread_mutex_lock(&engine->lock);
+	while (!lookup->done) {
+		if (pthread_cond_timedwait(&engine->done_condition, &engine->lock, &until) == ETIMEDOUT)
+			break;
+	}
+	done = lookup->done;
+	pthread_mutex_unlock(&engine->lock);
+	return done;
+}
+
+/***
+ * Run the event loop until a lookup is over. For callers that have no
+ * other thread running the loop.
+ * @param lookup the lookup
+ * @param timeout_ms the most milliseconds to run. The lookup is ended if it is not over by then
+ * @returns true(1) if the lookup succeeded, false(0) otherwise
+ */
+int libp2p_routing_dht_lookup_run(struct DhtLookup* lookup, int timeout_ms) {
+	struct DhtLookupEngine* engine = lookup->engine;
+	unsigned long long deadline = libp2p_routing_dht_lookup_now_ms() + timeout_ms;
+
+	libp2p_routing_dht_lookup_engine_process(engine);
+	while (!lookup->done) {
+		unsigned long long now = libp2p_routing_dht_lookup_now_ms();
+		if (now >= deadline) {
+			libp2p_routing_dht_lookup_finish(lookup, 1);
+			break;
+		}
+		// wake up in time to notice queries that time out
+		unsigned long long wait = deadline - now;
+		if (wait > 50)
+			wait = 50;
+		if (libp2p_net_event_loop_run_once(engine->loop, (int)wait) < 0)
+			libp2p_logger_error("dht_lookup", "The event loop failed while running a lookup.\n");
+		libp2p_routing_dht_lookup_engine_process(engine);
+	}
+	return lookup->succeeded;
+}
+
+/***
+ * The closest peers that answered a lookup
+ * @param lookup the lookup
+ * @param results where to put the peers, closest first. They belong to the lookup
+ * @param max_results the most peers to return
+ * @returns the number of peers put in results
+ */
+int libp2p_routing_dht_lookup_closest_peers(struct DhtLookup* lookup, struct Libp2pPeer** results, int max_results) {
+	int found = 0;
+	for(int i = 0; i < lookup->num_candidates && found < max_results; i++) {
+		if (lookup->candidates[i]->state == DHT_LOOKUP_PEER_RESPONDED)
+			results[found++] = lookup->candidates[i]->peer;
+	}
+	return found;
+}
+
+/***
+ * Free a lookup. If it is still running, it is ended first (without its callback).
+ * NOTE: a lookup that is still running must be freed from the event loop thread
+ * @param lookup the lookup
+ */
+void libp2p_routing_dht_lookup_free(struct DhtLookup* lookup) {
+	if (lookup == NULL)
+		return;
+	struct DhtLookupEngine* engine = lookup->engine;
+	// it may not have been picked up yet
+	pthread_mutex_lock(&engine->lock);
+	struct DhtLookup** current = &engine->pending;
+	while (*current != NULL && *current != lookup)
+		current = &(*current)->next;
+	if (*current != NULL)
+		*current = lookup->next;
+	pthread_mutex_unlock(&engine->lock);
+	libp2p_routing_dht_lookup_finish(lookup, 0);
+
+	if (lookup->candidates != NULL) {
+		for(int i = 0; i < lookup->num_candidates; i++) {
+			libp2p_peer_free(lookup->candidates[i]->peer);
+			free(lookup->candidates[i]);
+		}
+		free(lookup->candidates);
+	}
+	if (lookup->providers != NULL) {
+		for(int i = 0; i < lookup->providers->total; i++)
+			libp2p_peer_free((struct Libp2pPeer*)libp2p_utils_vector_get(lookup->providers, i));
+		libp2p_utils_vector_free(lookup->providers);
+	}
+	if (lookup->record != NULL)
+		libp2p_record_free(lookup->record);
+	if (lookup->key != NULL)
+		free(lookup->key);
+	free(lookup);
+}
+
+/***
+ * The event loop is done with a session from the dialer
+ * @param session the session
+ * @param user_data the dialer
+ */
+static void libp2p_routing_dht_lookup_dial_closed(struct SessionContext* session, void* user_data) {
+	// it either failed, or the loop is going away. Either way it is not to be used again
+	libp2p_conn_dialer_close_session((struct Dialer*)user_data, session);
+}
+
+/***
+ * A session_for_peer that dials peers through a dialer, so a session is
+ * opened once and reused by every lookup that asks the peer.
+ * NOTE: dialing a peer that is not connected yet blocks (and so stalls the
+ * event loop) for up to timeout_secs
+ * @param peer the peer
+ * @param context a struct DhtLookupDialer
+ * @returns the session, in the loop, or NULL if the peer cannot be reached
+ */
+struct SessionContext* libp2p_routing_dht_lookup_dial(struct Libp2pPeer* peer, void* context) {
+	struct DhtLookupDialer* dial = (struct DhtLookupDialer*)context;
+	// the peerstore's copy holds on to the session between lookups
+	struct Libp2pPeer* known = libp2p_peerstore_get_or_add_peer(dial->peerstore, peer);
+	if (known == NULL)
+		return NULL;
+	struct SessionContext* session = known->sessionContext;
+	if (known->dialer == dial->dialer && session != NULL && session->insecure_stream != NULL
+			&& session->insecure_stream->event_loop == dial->loop)
+		return session;
+	if (!libp2p_peer_connect(dial->private_key, known, dial->peerstore, dial->timeout_secs, dial->dialer))
+		return NULL;
+	session = known->sessionContext;
+	if (session->insecure_stream->event_loop == dial->loop)
+		return session;
+	if (session->insecure_stream->event_loop != NULL) {
+		libp2p_logger_error("dht_lookup", "The session to the peer is in another event loop.\n");
+		return NULL;
+	}
+	// the loop borrows the session too, until it closes
+	if (!libp2p_conn_dialer_retain_session(dial->dialer, session))
+		return NULL;
+	if (!libp2p_net_event_loop_add_borrowed_session(dial->loop, session, libp2p_routing_dht_lookup_dial_closed, dial->dialer)) {
+		libp2p_conn_dialer_release_session(dial->dialer, session);
+		return NULL;
+	}
+	return session;
+}
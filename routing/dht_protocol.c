@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "libp2p/net/stream.h"
+#include "libp2p/net/event_loop.h"
 #include "libp2p/routing/dht_protocol.h"
 #include "libp2p/record/message.h"
 #include "libp2p/utils/linked_list.h"
@@ -13,18 +14,22 @@
  * This is where kademlia and dht talk to the outside world
  */
 
+// the most providers sent back for one key
+#define DHT_MAX_PROVIDERS 20
+// the number of closer peers sent back (the k of kademlia)
+#define DHT_CLOSER_PEERS 20
+
 struct DhtContext {
 	struct Peerstore* peer_store;
 	struct ProviderStore* provider_store;
+	struct RecordStore* record_store;
 };
 
 int libp2p_routing_dht_can_handle(const uint8_t* incoming, size_t incoming_size) {
-	if (incoming_size < 8)
+	// messages from the loop are not null terminated
+	if (incoming_size < 9)
 		return 0;
-	char* result = strstr((char*)incoming, "/ipfs/kad");
-	if (result != NULL && result == (char*)incoming)
-		return 1;
-	return 0;
+	return memcmp(incoming, "/ipfs/kad", 9) == 0;
 }
 
 int libp2p_routing_dht_shutdown(void* context) {
@@ -32,20 +37,30 @@ int libp2p_routing_dht_shutdown(void* context) {
 	return 1;
 }
 
+static void libp2p_routing_dht_request_received(void* stream_context, unsigned char* buffer, size_t buffer_size, int status, void* user_data);
+
 int libp2p_routing_dht_handle_msg(const uint8_t* incoming, size_t incoming_size, struct SessionContext* session_context, void* context) {
 	libp2p_logger_debug("dht_protocol", "Handling incoming dht routing request.\n");
 	struct DhtContext* ctx = (struct DhtContext*)context;
+	struct Libp2pEventLoop* loop = session_context->insecure_stream->event_loop;
 	if (!libp2p_routing_dht_handshake(session_context))
 		return -1;
-	return (libp2p_routing_dht_handle_message(session_context, ctx->peer_store, ctx->provider_store) == 0) ? -1 : 1;
+	if (loop != NULL) {
+		// the loop thread can not wait for the request, so ask for it instead
+		if (!libp2p_net_event_loop_read(loop, session_context, libp2p_routing_dht_request_received, ctx))
+			return -1;
+		return 1;
+	}
+	return (libp2p_routing_dht_handle_message(session_context, ctx->peer_store, ctx->provider_store, ctx->record_store) == 0) ? -1 : 1;
 }
 
-struct Libp2pProtocolHandler* libp2p_routing_dht_build_protocol_handler(struct Peerstore* peer_store, struct ProviderStore* provider_store) {
+struct Libp2pProtocolHandler* libp2p_routing_dht_build_protocol_handler(struct Peerstore* peer_store, struct ProviderStore* provider_store, struct RecordStore* record_store) {
 	struct Libp2pProtocolHandler* handler = (struct Libp2pProtocolHandler*) malloc(sizeof(struct Libp2pProtocolHandler));
 	if (handler != NULL) {
 		struct DhtContext* ctx = (struct DhtContext*) malloc(sizeof(struct DhtContext));
 		ctx->peer_store = peer_store;
 		ctx->provider_store = provider_store;
+		ctx->record_store = record_store;
 		handler->context = ctx;
 		handler->CanHandle = libp2p_routing_dht_can_handle;
 		handler->HandleMessage = libp2p_routing_dht_handle_msg;
@@ -98,6 +113,7 @@ int libp2p_routing_dht_upgrade_stream(struct SessionContext* context) {
 		libp2p_logger_error("dht_protocol", "Expected %s but received %s.\n", protocol, results);
 		goto exit;
 	}
+	context->dht_upgraded = 1;
 	retVal = 1;
 	exit:
 	if (results != NULL) {
@@ -107,6 +123,184 @@ int libp2p_routing_dht_upgrade_stream(struct SessionContext* context) {
 	return retVal;
 }
 
+/***
+ * See if a message that arrived is the remote agreeing to speak the DHT protocol
+ */
+static int libp2p_routing_dht_upgrade_matches(const unsigned char* buffer, size_t buffer_size, void* user_data) {
+	const char* protocol = (const char*)user_data;
+	return buffer_size == strlen(protocol) && memcmp(buffer, protocol, buffer_size) == 0;
+}
+
+/***
+ * The remote agreed to speak the DHT protocol (or the session has failed)
+ */
+static void libp2p_routing_dht_upgrade_received(void* stream_context, unsigned char* buffer, size_t buffer_size, int status, void* user_data) {
+	if (buffer != NULL)
+		free(buffer);
+}
+
+/***
+ * Upgrade a session in an event loop to the DHT protocol without waiting for the answer.
+ * Requests can be sent right behind the upgrade, as the remote answers in order. The
+ * answer is taken off the session when it comes, so that it is not mistaken for a request.
+ * @param session the session
+ * @returns true(1) on success, otherwise false(0)
+ */
+static int libp2p_routing_dht_upgrade_stream_async(struct SessionContext* session) {
+	char* protocol = "/ipfs/kad/1.0.0\n";
+	struct Stream* stream = session->default_stream;
+	if (session->dht_upgraded)
+		return 1;
+	if (!stream->write_async(session, (unsigned char*)protocol, strlen(protocol), NULL, NULL)) {
+		libp2p_logger_error("dht_protocol", "Unable to queue an upgrade to the DHT protocol.\n");
+		return 0;
+	}
+	if (!libp2p_net_event_loop_read_matching(stream->event_loop, session, libp2p_routing_dht_upgrade_matches,
+			libp2p_routing_dht_upgrade_received, protocol))
+		return 0;
+	session->dht_upgraded = 1;
+	return 1;
+}
+
+/***
+ * What is needed to finish an asynchronous request
+ */
+struct DhtAsyncRequest {
+	void (*callback)(struct SessionContext* session, struct Libp2pMessage* response, void* user_data);
+	void* user_data;
+	// a response has the type and key of its request
+	enum MessageType message_type;
+	char* key;
+	size_t key_size;
+	// the response, once it has been recognized
+	struct Libp2pMessage* response;
+};
+
+static void libp2p_routing_dht_async_request_free(struct DhtAsyncRequest* request) {
+	if (request->key != NULL)
+		free(request->key);
+	if (request->response != NULL)
+		libp2p_message_free(request->response);
+	free(request);
+}
+
+/***
+ * See if a message that arrived is the response to an asynchronous request
+ */
+static int libp2p_routing_dht_response_matches(const unsigned char* buffer, size_t buffer_size, void* user_data) {
+	struct DhtAsyncRequest* request = (struct DhtAsyncRequest*)user_data;
+	struct Libp2pMessage* response = NULL;
+	if (!libp2p_message_protobuf_decode((unsigned char*)buffer, buffer_size, &response))
+		return 0;
+	if (response->message_type != request->message_type || response->key_size != request->key_size
+			|| (request->key_size > 0 && memcmp(response->key, request->key, request->key_size) != 0)) {
+		libp2p_message_free(response);
+		return 0;
+	}
+	// hold on to it, so that it is not decoded again
+	if (request->response != NULL)
+		libp2p_message_free(request->response);
+	request->response = response;
+	return 1;
+}
+
+/***
+ * The response to an asynchronous request has arrived (or the session has failed)
+ */
+static void libp2p_routing_dht_response_received(void* stream_context, unsigned char* buffer, size_t buffer_size, int status, void* user_data) {
+	struct DhtAsyncRequest* request = (struct DhtAsyncRequest*)user_data;
+	struct Libp2pMessage* response = NULL;
+	if (status) {
+		response = request->response;
+		request->response = NULL;
+	}
+	if (buffer != NULL)
+		free(buffer);
+	request->callback((struct SessionContext*)stream_context, response, request->user_data);
+	libp2p_routing_dht_async_request_free(request);
+}
+
+/***
+ * Send a message to a peer, and have its response handed to a callback. This returns at
+ * once, so many requests (to one peer or many) can be outstanding. A response goes to the
+ * oldest outstanding request with the same message type and key, so other messages from
+ * the peer are not mistaken for it. The session must be in an event loop. It is upgraded
+ * to the DHT protocol with the first request.
+ * @param session the session
+ * @param message the message to send
+ * @param callback called with the response, or with NULL if there was an error. The callback owns the response
+ * @param user_data handed to the callback
+ * @param handle where to put what libp2p_routing_dht_cancel_message_async needs (may be NULL)
+ * @returns true(1) if the request was sent, false(0) otherwise
+ */
+int libp2p_routing_dht_send_message_async(struct SessionContext* session, struct Libp2pMessage* message,
+		void (*callback)(struct SessionContext* session, struct Libp2pMessage* response, void* user_data), void* user_data,
+		struct DhtAsyncRequest** handle) {
+	int retVal = 0;
+	unsigned char* buffer = NULL;
+	size_t buffer_size = 0;
+	struct DhtAsyncRequest* request = NULL;
+	struct Stream* stream = session->default_stream;
+
+	if (stream == NULL || stream->event_loop == NULL || stream->write_async == NULL)
+		goto exit;
+	if (!libp2p_routing_dht_upgrade_stream_async(session))
+		goto exit;
+	if (!libp2p_routing_dht_protobuf_message(message, &buffer, &buffer_size))
+		goto exit;
+	request = (struct DhtAsyncRequest*) malloc(sizeof(struct DhtAsyncRequest));
+	if (request == NULL)
+		goto exit;
+	request->callback = callback;
+	request->user_data = user_data;
+	request->message_type = message->message_type;
+	request->key = NULL;
+	request->key_size = message->key_size;
+	request->response = NULL;
+	if (message->key_size > 0) {
+		request->key = malloc(message->key_size);
+		if (request->key == NULL)
+			goto exit;
+		memcpy(request->key, message->key, message->key_size);
+	}
+	if (!stream->write_async(session, buffer, buffer_size, NULL, NULL)) {
+		libp2p_logger_error("dht_protocol", "Unable to queue an asynchronous request.\n");
+		goto exit;
+	}
+	if (!libp2p_net_event_loop_read_matching(stream->event_loop, session, libp2p_routing_dht_response_matches,
+			libp2p_routing_dht_response_received, request))
+		goto exit;
+	// the read owns it now
+	if (handle != NULL)
+		*handle = request;
+	request = NULL;
+	retVal = 1;
+	exit:
+	if (buffer != NULL)
+		free(buffer);
+	if (request != NULL)
+		libp2p_routing_dht_async_request_free(request);
+	return retVal;
+}
+
+/***
+ * Give up on an asynchronous request, i.e. when the peer takes too long. Its callback is
+ * not called. A response that comes after this is left to the protocol handlers.
+ * NOTE: only while the request is outstanding, as the handle is freed when its callback is called
+ * @param session the session the request was sent on
+ * @param handle the handle from libp2p_routing_dht_send_message_async
+ * @returns true(1) if the request was given up on, false(0) otherwise
+ */
+int libp2p_routing_dht_cancel_message_async(struct SessionContext* session, struct DhtAsyncRequest* handle) {
+	struct Stream* stream = session->insecure_stream;
+	if (stream == NULL || stream->event_loop == NULL || handle == NULL)
+		return 0;
+	if (!libp2p_net_event_loop_read_cancel(stream->event_loop, session, libp2p_routing_dht_response_received, handle))
+		return 0;
+	libp2p_routing_dht_async_request_free(handle);
+	return 1;
+}
+
 /**
  * Handle a client requesting an upgrade to the DHT protocol
  * @param context the context
@@ -129,6 +323,49 @@ int libp2p_routing_dht_handle_ping(struct Libp2pMessage* message, unsigned char*
 	return libp2p_routing_dht_protobuf_message(message, buffer, buffer_size);
 }
 
+/***
+ * Fill in the closer peers of a response with the peers we know that are closest to the key
+ * NOTE: we are left out (the caller knows about us), and so is the caller
+ * @param session the context
+ * @param message the message. Its key is what peers should be close to
+ * @param peerstore the list of peers
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_routing_dht_add_closer_peers(struct SessionContext* session, struct Libp2pMessage* message, struct Peerstore* peerstore) {
+	// room for us and the caller, who are skipped
+	struct Libp2pPeer* closest[DHT_CLOSER_PEERS + 2];
+	struct Libp2pPeer* local_peer = libp2p_peerstore_get_local_peer(peerstore);
+	struct Libp2pLinkedList* last = message->closer_peer_head;
+	int added = 0;
+
+	while (last != NULL && last->next != NULL)
+		last = last->next;
+	int found = libp2p_peerstore_get_closest_peers(peerstore, (unsigned char*)message->key, message->key_size, closest, DHT_CLOSER_PEERS + 2);
+	for(int i = 0; i < found && added < DHT_CLOSER_PEERS; i++) {
+		struct Libp2pPeer* peer = closest[i];
+		if (peer == local_peer)
+			continue;
+		if (session->remote_peer_id != NULL && peer->id_size == strlen(session->remote_peer_id)
+				&& memcmp(peer->id, session->remote_peer_id, peer->id_size) == 0)
+			continue;
+		// they can only be dialed with an address
+		if (peer->addr_head == NULL)
+			continue;
+		struct Libp2pLinkedList* item = libp2p_utils_linked_list_new();
+		if (item == NULL)
+			return 0;
+		item->item = libp2p_peer_copy(peer);
+		if (last == NULL)
+			message->closer_peer_head = item;
+		else
+			last->next = item;
+		last = item;
+		added++;
+	}
+	libp2p_logger_debug("dht_protocol", "Sending %d closer peer(s).\n", added);
+	return 1;
+}
+
 /**
  * See if we have information as to who can provide this item
  * @param session the context
@@ -139,54 +376,54 @@ int libp2p_routing_dht_handle_ping(struct Libp2pMessage* message, unsigned char*
  */
 int libp2p_routing_dht_handle_get_providers(struct SessionContext* session, struct Libp2pMessage* message, struct Peerstore* peerstore,
 		struct ProviderStore* providerstore, unsigned char** results, size_t* results_size) {
-	unsigned char* peer_id = NULL;
-	int peer_id_size = 0;
+	struct Libp2pVector* providers = NULL;
+	struct Libp2pPeer* local_peer = NULL;
 
 	// This shouldn't be needed, but just in case:
 	message->provider_peer_head = NULL;
 
 	// Can I provide it locally?
-	unsigned char buf[65535];
-	size_t buf_size = 65535;
-	if (session->datastore->datastore_get(message->key, message->key_size, &buf[0], buf_size, &buf_size, session->datastore)) {
+	if (libp2p_datastore_has(session->datastore, (unsigned char*)message->key, message->key_size)) {
 		// we can provide this hash from our datastore
 		libp2p_logger_debug("dht_protocol", "I can provide myself as a provider for this key.\n");
+		local_peer = libp2p_peerstore_get_local_peer(peerstore);
 		message->provider_peer_head = libp2p_utils_linked_list_new();
-		message->provider_peer_head->item = libp2p_peer_copy(libp2p_peerstore_get_local_peer(peerstore));
-	} else if (libp2p_providerstore_get(providerstore, (unsigned char*)message->key, message->key_size, &peer_id, &peer_id_size)) {
-		// Can I provide it because someone announced it earlier?
-		libp2p_logger_debug("dht_protocol", "I can provide a provider for this key.\n");
-		// we have a peer id, convert it to a peer object
-		struct Libp2pPeer* peer = libp2p_peerstore_get_peer(peerstore, peer_id, peer_id_size);
-		if (peer != NULL) {
+		message->provider_peer_head->item = libp2p_peer_copy(local_peer);
+	}
+	// Can I provide it because others announced it earlier?
+	if (libp2p_providerstore_get_providers(providerstore, (unsigned char*)message->key, message->key_size, DHT_MAX_PROVIDERS, &providers) > 0) {
+		libp2p_logger_debug("dht_protocol", "I can provide %d provider(s) for this key.\n", providers->total);
+		struct Libp2pLinkedList* last = message->provider_peer_head;
+		for(int i = 0; i < providers->total; i++) {
+			struct ProviderEntry* entry = (struct ProviderEntry*)libp2p_utils_vector_get(providers, i);
+			// we have a peer id, convert it to a peer object
+			struct Libp2pPeer* peer = libp2p_peerstore_get_peer(peerstore, entry->peer_id, entry->peer_id_size);
+			if (peer == NULL || peer == local_peer)
+				continue;
 			// add it to the message
-			if (message->provider_peer_head == NULL) {
-				message->provider_peer_head = libp2p_utils_linked_list_new();
-				message->provider_peer_head->item = libp2p_peer_copy(peer);
-			} else {
-				struct Libp2pLinkedList* current = message->provider_peer_head;
-				// find the last one in the list
-				while (current->next != NULL) {
-					current = current->next;
-				}
-				// add to the list
-				current->next = libp2p_utils_linked_list_new();
-				current->next->item = peer;
-			}
+			struct Libp2pLinkedList* item = libp2p_utils_linked_list_new();
+			if (item == NULL)
+				break;
+			item->item = libp2p_peer_copy(peer);
+			if (last == NULL)
+				message->provider_peer_head = item;
+			else
+				last->next = item;
+			last = item;
 		}
-	} else {
-		libp2p_logger_debug("dht_protocol", "I cannot provide a provider for this key.\n");
 	}
-	if (peer_id != NULL)
-		free(peer_id);
-	// TODO: find closer peers
-	/*
 	if (message->provider_peer_head == NULL) {
-		// Who else can provide it?
-		//while ()
+		libp2p_logger_debug("dht_protocol", "I cannot provide a provider for this key.\n");
 	}
-	*/
-	if (message->provider_peer_head != NULL) {
+	if (providers != NULL) {
+		for(int i = 0; i < providers->total; i++)
+			libp2p_providerstore_entry_free((struct ProviderEntry*)libp2p_utils_vector_get(providers, i));
+		libp2p_utils_vector_free(providers);
+	}
+	// Who else may know?
+	message->closer_peer_head = NULL;
+	libp2p_routing_dht_add_closer_peers(session, message, peerstore);
+	if (message->provider_peer_head != NULL || message->closer_peer_head != NULL) {
 		libp2p_logger_debug("dht_protocol", "GetProviders: We have a peer. Sending it back\n");
 		// protobuf it and send it back
 		if (!libp2p_routing_dht_protobuf_message(message, results, results_size)) {
@@ -305,40 +542,71 @@ int libp2p_routing_dht_handle_add_provider(struct SessionContext* session, struc
 	return retVal;
 }
 
+/***
+ * Answer a GET_VALUE for a key we do not have with the peers closest to it
+ * @param session the session context
+ * @param message the message
+ * @param peerstore the peerstore
+ * @param result_buffer the results
+ * @param result_buffer_size the size of the results
+ * @returns true(1) if there is something to send back, otherwise false(0)
+ */
+static int libp2p_routing_dht_handle_get_value_miss(struct SessionContext* session, struct Libp2pMessage* message,
+		struct Peerstore* peerstore, unsigned char** result_buffer, size_t *result_buffer_size) {
+	message->closer_peer_head = NULL;
+	libp2p_routing_dht_add_closer_peers(session, message, peerstore);
+	if (message->closer_peer_head == NULL)
+		return 0;
+	return libp2p_routing_dht_protobuf_message(message, result_buffer, result_buffer_size);
+}
+
 /**
  * Retrieve something from the dht datastore
  * @param session the session context
  * @param message the message
  * @param peerstore the peerstore
  * @param providerstore the providerstore
+ * @param record_store the records put by other peers (may be NULL)
  * @param result_buffer the results
  * @param result_buffer_size the size of the results
  * @returns true(1) on success, otherwise false(0)
  */
 int libp2p_routing_dht_handle_get_value(struct SessionContext* session, struct Libp2pMessage* message,
-		struct Peerstore* peerstore, struct ProviderStore* providerstore, unsigned char** result_buffer, size_t *result_buffer_size) {
+		struct Peerstore* peerstore, struct ProviderStore* providerstore, struct RecordStore* record_store,
+		unsigned char** result_buffer, size_t *result_buffer_size) {
 
 	struct Datastore* datastore = session->datastore;
 	struct Filestore* filestore = session->filestore;
 	size_t data_size = 0;
 	unsigned char* data = NULL;
+	struct Libp2pRecord *record = NULL;
 
-	// We need to get the data from the disk
-	if(!filestore->node_get((unsigned char*)message->key, message->key_size, (void**)&data, &data_size, filestore)) {
-		libp2p_logger_debug("dht_protocol", "handle_get_value: Unable to get key from filestore\n");
-	}
+	// a record that was put by a peer
+	if (libp2p_record_store_get(record_store, (unsigned char*)message->key, message->key_size, &record)) {
+		libp2p_logger_debug("dht_protocol", "handle_get_value: record retrieved from the record store\n");
+	} else {
+		// We need to get the data from the disk, unless the bloom filter knows it is not there
+		if (filestore == NULL || !libp2p_datastore_may_have(datastore, (unsigned char*)message->key, message->key_size)) {
+			libp2p_logger_debug("dht_protocol", "handle_get_value: Key is not in the datastore\n");
+			return libp2p_routing_dht_handle_get_value_miss(session, message, peerstore, result_buffer, result_buffer_size);
+		}
+		if(!filestore->node_get((unsigned char*)message->key, message->key_size, (void**)&data, &data_size, filestore)) {
+			libp2p_logger_debug("dht_protocol", "handle_get_value: Unable to get key from filestore\n");
+			return libp2p_routing_dht_handle_get_value_miss(session, message, peerstore, result_buffer, result_buffer_size);
+		}
 
-	libp2p_logger_debug("dht_protocol", "handle_get_value: value retrieved from the datastore\n");
+		libp2p_logger_debug("dht_protocol", "handle_get_value: value retrieved from the datastore\n");
 
-	struct Libp2pRecord *record = libp2p_record_new();
-	record->key_size = message->key_size;
-	record->key = malloc(record->key_size);
-	memcpy(record->key, message->key, record->key_size);
-	record->value_size = data_size;
-	record->value = malloc(record->value_size);
-	memcpy(record->value, data, record->value_size);
+		record = libp2p_record_new();
+		record->key_size = message->key_size;
+		record->key = malloc(record->key_size);
+		memcpy(record->key, message->key, record->key_size);
+		record->value_size = data_size;
+		record->value = malloc(record->value_size);
+		memcpy(record->value, data, record->value_size);
+		free(data);
+	}
 	message->record = record;
-	free(data);
 
 	if (!libp2p_routing_dht_protobuf_message(message, result_buffer, result_buffer_size)) {
 		libp2p_record_free(record);
@@ -351,18 +619,35 @@ int libp2p_routing_dht_handle_get_value(struct SessionContext* session, struct L
 
 /**
  * Put something in the dht datastore
+ * NOTE: the record must be signed by the peer that sent it
  * @param session the session context
  * @param message the message
  * @param peerstore the peerstore
  * @param providerstore the providerstore
+ * @param record_store where the record is kept
  * @param result_buffer the results
  * @param result_buffer_size the size of the results
  * @returns true(1) on success, otherwise false(0)
  */
 int libp2p_routing_dht_handle_put_value(struct SessionContext* session, struct Libp2pMessage* message,
-		struct Peerstore* peerstore, struct ProviderStore* providerstore, unsigned char** result_buffer, size_t *result_buffer_size) {
-	//TODO: implement this
-	return 0;
+		struct Peerstore* peerstore, struct ProviderStore* providerstore, struct RecordStore* record_store,
+		unsigned char** result_buffer, size_t *result_buffer_size) {
+	struct Libp2pRecord* record = message->record;
+
+	if (record_store == NULL || record == NULL)
+		return 0;
+	if (record->key_size != message->key_size || memcmp(record->key, message->key, message->key_size) != 0) {
+		libp2p_logger_debug("dht_protocol", "handle_put_value: The record is not for the key in the message\n");
+		return 0;
+	}
+	if (!libp2p_record_store_put(record_store, record, &session->remote_key)) {
+		libp2p_logger_debug("dht_protocol", "handle_put_value: Record was not stored\n");
+		return 0;
+	}
+	// the caller is told it worked by getting its message back
+	if (!libp2p_routing_dht_protobuf_message(message, result_buffer, result_buffer_size))
+		return 0;
+	return 1;
 }
 
 /**
@@ -382,63 +667,120 @@ int libp2p_routing_dht_handle_find_node(struct SessionContext* session, struct L
 	if (peer != NULL) {
 		message->provider_peer_head = libp2p_utils_linked_list_new();
 		message->provider_peer_head->item = libp2p_peer_copy(peer);
-		if (!libp2p_routing_dht_protobuf_message(message, result_buffer, result_buffer_size)) {
-			return 0;
-		}
-		return 1;
 	}
-	return 0;
+	// and who is closest to it
+	message->closer_peer_head = NULL;
+	libp2p_routing_dht_add_closer_peers(session, message, peerstore);
+	if (message->provider_peer_head == NULL && message->closer_peer_head == NULL)
+		return 0;
+	if (!libp2p_routing_dht_protobuf_message(message, result_buffer, result_buffer_size)) {
+		return 0;
+	}
+	return 1;
 }
 
 /***
- * Handle the incoming message. Handshake should have already
- * been done. We should expect  that the next read contains
- * a protobuf'd kademlia message.
+ * Decode a request, and work out the response
  * @param session the context
+ * @param buffer the protobuf'd kademlia message
+ * @param buffer_size the size of the buffer
  * @param peerstore a list of peers
+ * @param providerstore who provides what
+ * @param record_store the records for PUT_VALUE and GET_VALUE (may be NULL)
+ * @param result_buffer where to put the response. It is left NULL if there is nothing to send back
+ * @param result_buffer_size the size of the response
  * @returns true(1) on success, otherwise false(0)
  */
-int libp2p_routing_dht_handle_message(struct SessionContext* session, struct Peerstore* peerstore, struct ProviderStore* providerstore) {
-	unsigned char* buffer = NULL, *result_buffer = NULL;
-	size_t buffer_size = 0, result_buffer_size = 0;
-	int retVal = 0;
+static int libp2p_routing_dht_answer(struct SessionContext* session, unsigned char* buffer, size_t buffer_size,
+		struct Peerstore* peerstore, struct ProviderStore* providerstore, struct RecordStore* record_store,
+		unsigned char** result_buffer, size_t* result_buffer_size) {
 	struct Libp2pMessage* message = NULL;
 
-	// read from stream
-	if (!session->default_stream->read(session, &buffer, &buffer_size, 5))
-		goto exit;
+	*result_buffer = NULL;
+	*result_buffer_size = 0;
 	// unprotobuf
 	if (!libp2p_message_protobuf_decode(buffer, buffer_size, &message))
-		goto exit;
+		return 0;
 
 	// handle message
 	switch(message->message_type) {
 		case(MESSAGE_TYPE_PUT_VALUE): // store a value in local storage
-				libp2p_routing_dht_handle_put_value(session, message, peerstore, providerstore, &result_buffer, &result_buffer_size);
+				libp2p_routing_dht_handle_put_value(session, message, peerstore, providerstore, record_store, result_buffer, result_buffer_size);
 				break;
 		case(MESSAGE_TYPE_GET_VALUE): // get a value from local storage
-				libp2p_routing_dht_handle_get_value(session, message, peerstore, providerstore, &result_buffer, &result_buffer_size);
+				libp2p_routing_dht_handle_get_value(session, message, peerstore, providerstore, record_store, result_buffer, result_buffer_size);
 				break;
 		case(MESSAGE_TYPE_ADD_PROVIDER): // client wants us to know he can provide something
-				libp2p_routing_dht_handle_add_provider(session, message, peerstore, providerstore, &result_buffer, &result_buffer_size);
+				libp2p_routing_dht_handle_add_provider(session, message, peerstore, providerstore, result_buffer, result_buffer_size);
 				break;
 		case(MESSAGE_TYPE_GET_PROVIDERS): // see if we can help, and send closer peers
-				libp2p_routing_dht_handle_get_providers(session, message, peerstore, providerstore, &result_buffer, &result_buffer_size);
+				libp2p_routing_dht_handle_get_providers(session, message, peerstore, providerstore, result_buffer, result_buffer_size);
 				break;
 		case(MESSAGE_TYPE_FIND_NODE): // find peers
-				libp2p_routing_dht_handle_find_node(session, message, peerstore, providerstore, &result_buffer, &result_buffer_size);
+				libp2p_routing_dht_handle_find_node(session, message, peerstore, providerstore, result_buffer, result_buffer_size);
 				break;
 		case(MESSAGE_TYPE_PING):
-				libp2p_routing_dht_handle_ping(message, &result_buffer, &result_buffer_size);
+				libp2p_routing_dht_handle_ping(message, result_buffer, result_buffer_size);
 				break;
 	}
+	if (*result_buffer != NULL)
+		libp2p_logger_debug("dht_protocol", "Sending message back to caller. Message type: %d\n", message->message_type);
+	else
+		libp2p_logger_debug("dht_protocol", "DhtHandleMessage: Nothing to send back. Kademlia call has been handled. Message type: %d\n", message->message_type);
+	libp2p_message_free(message);
+	return 1;
+}
+
+/***
+ * A request has arrived on a session in an event loop that was upgraded to the DHT
+ * protocol. It is answered through the loop, and the session stays upgraded, so the
+ * next message on it is taken as a request too.
+ */
+static void libp2p_routing_dht_request_received(void* stream_context, unsigned char* buffer, size_t buffer_size, int status, void* user_data) {
+	struct SessionContext* session = (struct SessionContext*)stream_context;
+	struct DhtContext* ctx = (struct DhtContext*)user_data;
+	struct Libp2pEventLoop* loop = session->insecure_stream->event_loop;
+	unsigned char* result_buffer = NULL;
+	size_t result_buffer_size = 0;
+
+	if (!status)
+		return; // the session is closing
+	if (!libp2p_routing_dht_answer(session, buffer, buffer_size, ctx->peer_store, ctx->provider_store, ctx->record_store, &result_buffer, &result_buffer_size)) {
+		// not for us, so it is left to the protocol handlers (who will close the session)
+		libp2p_logger_error("dht_protocol", "Unable to decode a request from an upgraded session.\n");
+		free(buffer);
+		return;
+	}
+	free(buffer);
+	if (result_buffer != NULL) {
+		libp2p_net_event_loop_queue_write(loop, session, result_buffer, result_buffer_size);
+		free(result_buffer);
+	}
+	libp2p_net_event_loop_read(loop, session, libp2p_routing_dht_request_received, ctx);
+}
+
+/***
+ * Handle the incoming message. Handshake should have already
+ * been done. We should expect  that the next read contains
+ * a protobuf'd kademlia message.
+ * @param session the context
+ * @param peerstore a list of peers
+ * @returns true(1) on success, otherwise false(0)
+ */
+int libp2p_routing_dht_handle_message(struct SessionContext* session, struct Peerstore* peerstore, struct ProviderStore* providerstore, struct RecordStore* record_store) {
+	unsigned char* buffer = NULL, *result_buffer = NULL;
+	size_t buffer_size = 0, result_buffer_size = 0;
+	int retVal = 0;
+
+	// read from stream
+	if (!session->default_stream->read(session, &buffer, &buffer_size, 5))
+		goto exit;
+	if (!libp2p_routing_dht_answer(session, buffer, buffer_size, peerstore, providerstore, record_store, &result_buffer, &result_buffer_size))
+		goto exit;
 	// if we have something to send, send it.
 	if (result_buffer != NULL) {
-		libp2p_logger_debug("dht_protocol", "Sending message back to caller. Message type: %d\n", message->message_type);
 		if (!session->default_stream->write(session, result_buffer, result_buffer_size))
 			goto exit;
-	} else {
-		libp2p_logger_debug("dht_protocol", "DhtHandleMessage: Nothing to send back. Kademlia call has been handled. Message type: %d\n", message->message_type);
 	}
 	retVal = 1;
 	exit:
@@ -446,7 +788,5 @@ int libp2p_routing_dht_handle_message(struct SessionContext* session, struct Pee
 		free(buffer);
 	if (result_buffer != NULL)
 		free(result_buffer);
-	if (message != NULL)
-		libp2p_message_free(message);
 	return retVal;
 }
@@ -11,6 +11,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <sys/signal.h>
 #include <pthread.h>
@@ -35,15 +36,54 @@ pthread_t pth_kademlia, pth_announce;
 time_t tosleep = 0;
 int kfd = -1;
 int net_family = 0;
-volatile int8_t searching = 0; // search lock, -1 to busy, 0 to free, 1 to running.
-volatile char hash[20];     // hash to be search or announce.
-volatile uint16_t announce_port = 0;
 volatile int8_t closing = 0;
 
+#define KADEMLIA_HASH_SIZE 20
+// how long search_kademlia waits before asking again when a search finds nothing
+#define SEARCH_RETRY_TIME 2
+
+/*
+ * Searches and pings are queued here by any thread, and started by kademlia_thread,
+ * which is the only thread that calls into dht.c. The callback (also on kademlia_thread)
+ * puts what comes back in the search_struct for the hash, and wakes whoever waits.
+ * kademlia_lock protects the queues, announce_list and search_result.
+ */
+static pthread_mutex_t kademlia_lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled when a search gets values or is done
+static pthread_cond_t search_condition = PTHREAD_COND_INITIALIZER;
+// signalled when announce_list changes or we are closing
+static pthread_cond_t announce_condition = PTHREAD_COND_INITIALIZER;
+// written to so kademlia_thread leaves select() when a search is queued
+static int wake_fds[2] = { -1, -1 };
+
+// the most datagrams kademlia_thread reads with one system call, and how large they can be
+#define KADEMLIA_RECV_BATCH 32
+#define KADEMLIA_RECV_SIZE 4096
+
+// where kademlia_thread reads datagrams to
+static char recv_buffers[KADEMLIA_RECV_BATCH][KADEMLIA_RECV_SIZE];
+static int recv_sizes[KADEMLIA_RECV_BATCH];
+static struct sockaddr_storage recv_from[KADEMLIA_RECV_BATCH];
+static socklen_t recv_fromlen[KADEMLIA_RECV_BATCH];
+
+struct search_request {
+    unsigned char hash[KADEMLIA_HASH_SIZE];
+    uint16_t port;
+    struct search_request *next;
+};
+static struct search_request *pending_head = NULL, *pending_tail = NULL;
+
+struct ping_request {
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    struct ping_request *next;
+};
+static struct ping_request *ping_head = NULL, *ping_tail = NULL;
+
 #define ANNOUNCE_WAIT_TIME		(28 * 60) // Wait 28 minutes.
 #define ANNOUNCE_WAIT_TOLERANCE		60
 struct announce_struct {
-    unsigned char hash[sizeof hash];
+    unsigned char hash[KADEMLIA_HASH_SIZE];
     uint16_t port;
     unsigned int time;
     struct announce_struct *next;
@@ -63,7 +103,9 @@ struct ipv6_struct {
 };
 
 struct search_struct {
-    unsigned char hash[sizeof hash];
+    unsigned char hash[KADEMLIA_HASH_SIZE];
+    // the number of searches for this hash that have finished
+    unsigned int done_count;
     uint8_t ipv4_count;
     uint8_t ipv6_count;
     struct ipv4_struct ipv4[DHT_MAX_IPV4];
@@ -71,10 +113,35 @@ struct search_struct {
     struct search_struct *next;
 } *search_result = NULL;
 
+/***
+ * Find the results of the searches for a hash, adding them if needed
+ * NOTE: kademlia_lock must be held
+ * @param id the hash
+ * @returns the results, or NULL if out of memory
+ */
+static struct search_struct *get_search_result(const unsigned char *id)
+{
+    struct search_struct *rp;
+
+    for (rp = search_result ; rp ; rp = rp->next) {
+        if (memcmp(rp->hash, id, KADEMLIA_HASH_SIZE) == 0) {
+            return rp;
+        }
+    }
+    rp = malloc(sizeof(struct search_struct));
+    if (!rp) return NULL; // Abort, out of memory.
+    memset(rp, 0, sizeof(struct search_struct));
+    memcpy(rp->hash, id, KADEMLIA_HASH_SIZE);
+    rp->next = search_result; // Insert in the list.
+    search_result = rp;
+    return rp;
+}
+
 /***
  * The call-back function is called by the DHT whenever something
  * interesting happens.  Right now, it only happens when we get a new value or
  * when a search completes, but this may be extended in future versions.
+ * NOTE: this is only called from kademlia_thread
  * @param closure
  * @param event the event
  * @param info_hash the hash to work with
@@ -82,7 +149,21 @@ struct search_struct {
  * @param data_len the length of the data
  */
 static void callback(void *closure, int event, const unsigned char *info_hash, const void *data, size_t data_len) {
-    struct search_struct *sp, *rp = NULL; // struct pointer and result pointer
+    struct search_struct *rp; // result pointer
+    int i;
+
+    if (event != DHT_EVENT_VALUES && event != DHT_EVENT_VALUES6 &&
+        event != DHT_EVENT_SEARCH_DONE && event != DHT_EVENT_SEARCH_DONE6) {
+        return;
+    }
+
+    pthread_mutex_lock(&kademlia_lock);
+    // Values can come before the search is done, so the results are kept either way.
+    rp = get_search_result(info_hash);
+    if (!rp) {
+        pthread_mutex_unlock(&kademlia_lock);
+        return;
+    }
 
     switch (event) {
         case DHT_EVENT_VALUES:
@@ -90,79 +171,114 @@ static void callback(void *closure, int event, const unsigned char *info_hash, c
             if (dht_debug) {
                 fprintf(dht_debug, "Received %d values.\n", (int)(data_len / 6));
             }
-            // Find the item in the list.
-            for (rp = search_result ; rp ; rp = rp->next) {
-                if (memcmp(rp->hash, info_hash, sizeof hash) == 0) { // Found.
-                    int i;
-                    if (event == DHT_EVENT_VALUES) { // IPv4
-                        struct ipv4_struct ipv4;
-                        if (rp->ipv4_count == DHT_MAX_IPV4) { // Full
-                            return;
-                        }
-                        // Make sure the data is in struct format.
-                        memcpy(&ipv4.ip, data, 4);
-                        memcpy(&ipv4.port, data+4, 2);
-                        ipv4.port = ntohs(ipv4.port);
-                        for (i = 0 ; i < rp->ipv4_count ; i++) {
-                            if (memcmp(&rp->ipv4[i], &ipv4, sizeof ipv4) == 0) {
-                                return; // Alread in the list.
-                            }
-                        }
-                        // Not in the list, then add.
-                        memcpy(&rp->ipv4[rp->ipv4_count], &ipv4, sizeof ipv4);
-                        rp->ipv4_count++;
-                    } else { // IPv6
-                        struct ipv6_struct ipv6;
-                        if (rp->ipv6_count == DHT_MAX_IPV6) { // Full
-                            return;
-                        }
-                        // Make sure the data is in struct format.
-                        memcpy(&ipv6.ip, data, 16);
-                        memcpy(&ipv6.port, data+16, 2);
-                        for (i = 0 ; i < rp->ipv6_count ; i++) {
-                            if (memcmp(&rp->ipv6[i], &ipv6, sizeof ipv6) == 0) {
-                                return; // Alread in the list.
-                            }
-                        }
-                        // Not in the list, then add.
-                        memcpy(&rp->ipv6[rp->ipv6_count], &ipv6, sizeof ipv6);
-                        rp->ipv6_count++;
+            if (event == DHT_EVENT_VALUES) { // IPv4
+                struct ipv4_struct ipv4;
+                if (rp->ipv4_count == DHT_MAX_IPV4) { // Full
+                    break;
+                }
+                // Make sure the data is in struct format.
+                memset(&ipv4, 0, sizeof ipv4);
+                memcpy(&ipv4.ip, data, 4);
+                memcpy(&ipv4.port, data+4, 2);
+                ipv4.port = ntohs(ipv4.port);
+                for (i = 0 ; i < rp->ipv4_count ; i++) {
+                    if (memcmp(&rp->ipv4[i], &ipv4, sizeof ipv4) == 0) {
+                        break; // Alread in the list.
+                    }
+                }
+                if (i == rp->ipv4_count) {
+                    // Not in the list, then add.
+                    memcpy(&rp->ipv4[rp->ipv4_count], &ipv4, sizeof ipv4);
+                    rp->ipv4_count++;
+                }
+            } else { // IPv6
+                struct ipv6_struct ipv6;
+                if (rp->ipv6_count == DHT_MAX_IPV6) { // Full
+                    break;
+                }
+                // Make sure the data is in struct format.
+                memset(&ipv6, 0, sizeof ipv6);
+                memcpy(&ipv6.ip, data, 16);
+                memcpy(&ipv6.port, data+16, 2);
+                ipv6.port = ntohs(ipv6.port);
+                for (i = 0 ; i < rp->ipv6_count ; i++) {
+                    if (memcmp(&rp->ipv6[i], &ipv6, sizeof ipv6) == 0) {
+                        break; // Alread in the list.
                     }
-                    return;
+                }
+                if (i == rp->ipv6_count) {
+                    // Not in the list, then add.
+                    memcpy(&rp->ipv6[rp->ipv6_count], &ipv6, sizeof ipv6);
+                    rp->ipv6_count++;
                 }
             }
-            break; // Not found, how can EVENT_VALUE may occur before SEARCH_DONE?
+            break;
         case DHT_EVENT_SEARCH_DONE:
         case DHT_EVENT_SEARCH_DONE6:
             if (dht_debug) {
                 fprintf(dht_debug, "Search done.\n");
             }
-            if (search_result) {
-                // Try to find the item in the list.
-                for (sp = search_result ; sp->next ; sp = sp->next) {
-                    if (memcmp(sp->hash, info_hash, sizeof hash) == 0) { // Found.
-                        rp = sp;
-                        break;
-                    }
-                }
-                if (!rp) {
-                    rp = malloc(sizeof(struct search_struct));
-                    if (!rp) return; // Abort, out of memory.
-                    memset(rp, 0, sizeof(struct search_struct));
-                    memcpy(rp->hash, info_hash, sizeof hash);
-                    sp->next = rp; // Insert in the list.
-                }
-            } else {
-                rp = malloc(sizeof(struct search_struct));
-                if (!rp) return; // Abort, out of memory.
-                memset(rp, 0, sizeof(struct search_struct));
-                memcpy(rp->hash, info_hash, sizeof hash);
-                search_result = rp; // Insert first item in the list.
-            }
-            break;
-        default:
+            rp->done_count++;
             break;
     }
+
+    pthread_cond_broadcast(&search_condition);
+    pthread_mutex_unlock(&kademlia_lock);
+}
+
+/***
+ * Get kademlia_thread out of select(), so it starts what was queued right away
+ */
+static void wake_kademlia(void)
+{
+    if (wake_fds[1] != -1) {
+        if (write(wake_fds[1], "", 1) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("kademlia:write");
+        }
+    }
+}
+
+/***
+ * Queue a search for kademlia_thread to start
+ * NOTE: kademlia_lock must be held
+ * @param id the hash to search for
+ * @param port if non-zero, announce that we have the hash on this port
+ * @returns true(1) on success, false(0) if out of memory
+ */
+static int queue_search(const unsigned char *id, uint16_t port)
+{
+    struct search_request *request = malloc(sizeof(struct search_request));
+    if (!request) {
+        return 0;
+    }
+    memcpy(request->hash, id, KADEMLIA_HASH_SIZE);
+    request->port = port;
+    request->next = NULL;
+    if (pending_tail) {
+        pending_tail->next = request;
+    } else {
+        pending_head = request;
+    }
+    pending_tail = request;
+
+    wake_kademlia();
+    return 1;
+}
+
+/***
+ * Turn a number of milliseconds from now into an absolute time for pthread_cond_timedwait
+ * @param ms milliseconds from now
+ * @param ts the results
+ */
+static void deadline_from_now(long long ms, struct timespec *ts)
+{
+    struct timeval now;
+    long long usec;
+
+    gettimeofday(&now, NULL);
+    usec = (long long)now.tv_usec + (ms % 1000) * 1000;
+    ts->tv_sec = now.tv_sec + ms / 1000 + usec / 1000000;
+    ts->tv_nsec = (usec % 1000000) * 1000;
 }
 
 int start_kademlia_multiaddress(struct MultiAddress* address, char* peer_id, int timeout, struct Libp2pVector* bootstrap_addresses) {
@@ -190,7 +306,7 @@ int start_kademlia_multiaddress(struct MultiAddress* address, char* peer_id, int
 int start_kademlia(int net_fd, int family, char* peer_id, int timeout, struct Libp2pVector* bootstrap_addresses)
 {
     int rc, i, len;
-    unsigned char id[sizeof hash];
+    unsigned char id[KADEMLIA_HASH_SIZE];
     struct sockaddr_in sa;
 
     dht_debug = stderr;
@@ -262,9 +378,16 @@ int start_kademlia(int net_fd, int family, char* peer_id, int timeout, struct Li
 
     // TODO: Read cache nodes from file and load using dht_insert_node.
 
+    if (pipe(wake_fds) != 0) {
+        return -1;
+    }
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+
     kfd = net_fd;
     net_family = family;
     tosleep = timeout;
+    closing = 0;
 
     rc = pthread_create(&pth_kademlia, NULL, kademlia_thread, NULL);
     if (rc) {
@@ -276,11 +399,21 @@ int start_kademlia(int net_fd, int family, char* peer_id, int timeout, struct Li
 
 void stop_kademlia (void)
 {
+    struct search_request *request;
+    struct ping_request *ping;
+
     if (kfd != -1) {
+        pthread_mutex_lock(&kademlia_lock);
         closing = 1;
+        pthread_cond_broadcast(&announce_condition);
+        pthread_cond_broadcast(&search_condition);
+        pthread_mutex_unlock(&kademlia_lock);
+        // wake kademlia_thread
+        if (write(wake_fds[1], "", 1) < 0) {
+            perror("kademlia:write");
+        }
 
-        pthread_cancel(pth_announce);
-
+        pthread_join(pth_announce, NULL);
         // Wait kademlia_thread finish.
         pthread_join(pth_kademlia, NULL);
 
@@ -288,25 +421,94 @@ void stop_kademlia (void)
 
         close (kfd);
         kfd = -1;
+
+        // Searches and pings that were never started.
+        pthread_mutex_lock(&kademlia_lock);
+        // ping_kademlia writes to wake_fds[1] with the lock held
+        close (wake_fds[0]);
+        close (wake_fds[1]);
+        wake_fds[0] = wake_fds[1] = -1;
+        while (pending_head) {
+            request = pending_head;
+            pending_head = request->next;
+            free (request);
+        }
+        pending_tail = NULL;
+        while (ping_head) {
+            ping = ping_head;
+            ping_head = ping->next;
+            free (ping);
+        }
+        ping_tail = NULL;
+        pthread_mutex_unlock(&kademlia_lock);
+    }
+}
+
+/***
+ * Read the datagrams waiting on the socket, into recv_buffers
+ * NOTE: this is only called from kademlia_thread
+ * @returns the number of datagrams read (at most KADEMLIA_RECV_BATCH), or -1 on error
+ */
+static int kademlia_receive(void)
+{
+    int i, rc;
+#ifdef __linux__
+    struct mmsghdr msgs[KADEMLIA_RECV_BATCH];
+    struct iovec iov[KADEMLIA_RECV_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < KADEMLIA_RECV_BATCH; i++) {
+        iov[i].iov_base = recv_buffers[i];
+        // leave room for the '\0' dht_periodic wants after the message
+        iov[i].iov_len = KADEMLIA_RECV_SIZE - 1;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &recv_from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(recv_from[i]);
     }
+    rc = recvmmsg(kfd, msgs, KADEMLIA_RECV_BATCH, MSG_DONTWAIT, NULL);
+    for (i = 0; i < rc; i++) {
+        recv_sizes[i] = msgs[i].msg_len;
+        recv_fromlen[i] = msgs[i].msg_hdr.msg_namelen;
+    }
+#else
+    recv_fromlen[0] = sizeof(recv_from[0]);
+    rc = recvfrom(kfd, recv_buffers[0], KADEMLIA_RECV_SIZE - 1, MSG_DONTWAIT,
+                  (struct sockaddr*)&recv_from[0], &recv_fromlen[0]);
+    if (rc >= 0) {
+        recv_sizes[0] = rc;
+        rc = 1;
+    }
+#endif
+    for (i = 0; i < rc; i++)
+        recv_buffers[i][recv_sizes[i]] = '\0';
+    return rc;
 }
 
 void *kademlia_thread (void *ptr)
 {
-    int rc;
+    int rc, maxfd, i, received;
     struct timeval tv;
     fd_set readfds;
-    char buf[4096];
-    struct sockaddr from;
-    socklen_t fromlen;
+    char buf[64];
+    struct search_request *request, *next;
+    struct ping_request *ping, *next_ping;
+
+    maxfd = kfd > wake_fds[0] ? kfd : wake_fds[0];
+
+    // what dht.c sends in one pass of the loop goes out together, before select()
+    dht_queue_sends(1);
 
     for(;;) {
+        dht_flush();
+
         tv.tv_sec = tosleep;
         tv.tv_usec = random() % 1000000;
 
         FD_ZERO(&readfds);
         FD_SET(kfd, &readfds);
-        rc = select(kfd + 1, &readfds, NULL, NULL, &tv);
+        FD_SET(wake_fds[0], &readfds);
+        rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
         if(rc < 0) {
             if(errno != EINTR) {
                 perror("select");
@@ -314,21 +516,28 @@ void *kademlia_thread (void *ptr)
             }
         }
 
+        if(rc > 0 && FD_ISSET(wake_fds[0], &readfds)) {
+            // Empty the pipe, the queue is handled below.
+            while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+
         if(rc > 0 && FD_ISSET(kfd, &readfds)) {
-            fromlen = sizeof(from);
-            rc = recvfrom(kfd, buf, sizeof(buf) - 1, 0,
-                          (struct sockaddr*)&from, &fromlen);
-            if (rc < 0) {
-            	if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            		continue;
-            	} else {
-            		fprintf(stderr, "kademlia_thread:recvfrom failed with %d\n", errno);
-            		continue;
-            	}
+            // One batch per pass, so searches and timers are not starved
+            // when the socket is busy. select() returns at once if there is more.
+            received = kademlia_receive();
+            if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "kademlia_thread:recvmmsg failed with %d\n", errno);
+            for (i = 0; i < received; i++) {
+                rc = dht_periodic(recv_buffers[i], recv_sizes[i],
+                                  (struct sockaddr*)&recv_from[i], recv_fromlen[i],
+                                  &tosleep, callback, NULL);
+                if (rc < 0 && errno != EINTR) {
+                    perror("dht_periodic");
+                    tosleep = 1;
+                }
             }
-            buf[rc] = '\0';
-            rc = dht_periodic(buf, rc, (struct sockaddr*)&from, fromlen,
-                              &tosleep, callback, NULL);
+            rc = 0;
         } else {
             rc = dht_periodic(NULL, 0, NULL, 0, &tosleep, callback, NULL);
         }
@@ -343,107 +552,110 @@ void *kademlia_thread (void *ptr)
             }
         }
 
+        if(closing) {
+            // TODO: Create a routine to save the cache nodes in the file sometimes and before closing.
+            return 0; // end thread.
+        }
+
         /* This is how you trigger a search for a torrent hash.  If port
            (the second argument) is non-zero, it also performs an announce.
            Since peers expire announced data after 30 minutes, it's a good
-           idea to reannounce every 28 minutes or so. */
-        if(searching > 0) {
-            unsigned char h[sizeof hash];
-            int i;
-            for (i = 0 ; i < sizeof hash ; i++) {
-                h[i] = hash[i]; // Copy hash array to new array so can call
-                                // dht_search without volatile variable.
-            }
-            dht_search(h, announce_port, net_family, callback, NULL);
-            searching = 0;
+           idea to reannounce every 28 minutes or so.
+           Take everything that is queued at once, so the lock is not held
+           while dht_search calls back. */
+        pthread_mutex_lock(&kademlia_lock);
+        request = pending_head;
+        pending_head = pending_tail = NULL;
+        ping = ping_head;
+        ping_head = ping_tail = NULL;
+        pthread_mutex_unlock(&kademlia_lock);
+        for ( ; ping ; ping = next_ping) {
+            next_ping = ping->next;
+            dht_ping_node((struct sockaddr*)&ping->sa, ping->salen);
+            free (ping);
         }
-        if(closing) {
-            // TODO: Create a routine to save the cache nodes in the file sometimes and before closing.
-            return 0; // end thread.
+        for ( ; request ; request = next) {
+            next = request->next;
+            if (dht_search(request->hash, request->port, net_family, callback, NULL) < 0) {
+                perror("dht_search");
+            }
+            free (request);
         }
     }
     return (void*)1;
 }
 
 /**
- * Search for a hash
+ * Queue a search for a hash
  * @param id the hash to look for
  * @param port the port if it is available
  * @param to the time out
- * @returns the time left
+ * @returns the time left, or 0 if the search could not be queued
  */
 int search_kademlia_internal (unsigned char* id, int port, int to)
 {
-    int i;
+    int queued;
 
-    while (searching != 0) {
-        i = random() % 100000;
-        if (i > to) {
-            return 0; // timeout waiting a chance
-        }
-        usleep(i);
-        to -= i;
-    }
-
-    searching = -1; // lock.
-
-    for (i = 0 ; i < sizeof hash ; i++) {
-        hash[i] = id[i];
-    }
-
-    announce_port = port;
+    pthread_mutex_lock(&kademlia_lock);
+    queued = queue_search(id, port);
+    pthread_mutex_unlock(&kademlia_lock);
 
-    searching = 1; // search.
-
-    return to;
+    return queued ? to : 0;
 }
 
 void *announce_thread (void *ptr)
 {
-    unsigned int wait;
     struct announce_struct *n, *p;
-
-    for(;;) {
-        if (announce_list) {
-            unsigned int now, minus_time = ((unsigned int) -1);
-
-            p = NULL;
-            // find max wait value.
-            for (n = announce_list ; n ; n = n->next) {
-                if (n->time < minus_time) {
-                    minus_time = n->time;
-                    p = n;
-                }
-            }
-            if (p) {
-                now = time(NULL);
-                if ((minus_time + ANNOUNCE_WAIT_TIME) > (now + ANNOUNCE_WAIT_TOLERANCE)) {
-                    wait = ANNOUNCE_WAIT_TIME - (now - minus_time);
-                    sleep (wait);
-                } else {
-                    if (p) {
-                        search_kademlia_internal (p->hash, p->port, ANNOUNCE_WAIT_TOLERANCE * 1000000);
-                        p->time = time(NULL);
-                    }
-                }
-                continue;
+    struct timespec ts;
+    unsigned int now;
+
+    pthread_mutex_lock(&kademlia_lock);
+    while (!closing) {
+        p = NULL;
+        // find the one announced longest ago.
+        for (n = announce_list ; n ; n = n->next) {
+            if (!p || n->time < p->time) {
+                p = n;
             }
         }
-        // Empty list, just wait.
-        sleep (ANNOUNCE_WAIT_TIME);
+        if (!p) {
+            // Empty list, just wait.
+            pthread_cond_wait(&announce_condition, &kademlia_lock);
+            continue;
+        }
+        now = time(NULL);
+        if ((p->time + ANNOUNCE_WAIT_TIME) > (now + ANNOUNCE_WAIT_TOLERANCE)) {
+            deadline_from_now((long long)(p->time + ANNOUNCE_WAIT_TIME - now) * 1000, &ts);
+            pthread_cond_timedwait(&announce_condition, &kademlia_lock, &ts);
+        } else {
+            queue_search (p->hash, p->port);
+            p->time = now;
+        }
     }
+    pthread_mutex_unlock(&kademlia_lock);
     return (void*)1;
 }
 
 int announce_kademlia (char* peer_id, uint16_t port)
 {
-    unsigned char id[sizeof hash];
+    unsigned char id[KADEMLIA_HASH_SIZE];
     struct announce_struct *n, *p;
 
     dht_hash (id, sizeof(id), peer_id, strlen(peer_id), NULL, 0, NULL, 0);
 
+    if ((p = malloc (sizeof(struct announce_struct))) == NULL) {
+        return 0; // Fail to alloc.
+    }
+    memcpy(p->hash, id, sizeof id);
+    p->port = port;
+    p->next = NULL;
+    p->time = time(NULL);
+
+    pthread_mutex_lock(&kademlia_lock);
     for (n = announce_list ; n ; n = n->next) {
         if (memcmp(n->hash, id, sizeof id) == 0) {
+            pthread_mutex_unlock(&kademlia_lock);
+            free (p);
             return 0; // Already on the list.
         }
         if (! (n->next)) {
@@ -451,126 +663,148 @@ int announce_kademlia (char* peer_id, uint16_t port)
         }
     }
 
-
-    if ((p = malloc (sizeof(struct announce_struct))) == NULL) {
-        return 0; // Fail to alloc.
-    }
-
-    search_kademlia_internal (id, port, ANNOUNCE_WAIT_TOLERANCE * 1000000);
-
-    memcpy(p->hash, id, sizeof id);
-    p->port = port;
-    p->next = NULL;
-    p->time = time(NULL);
+    queue_search (id, port);
 
     if (!announce_list) {
         announce_list = p;
     } else {
         n->next = p;
     }
+    pthread_cond_signal(&announce_condition);
+    pthread_mutex_unlock(&kademlia_lock);
 
     return 1; // Announced and added to the list.
 }
 
 struct MultiAddress** search_kademlia(char* peer_id, int timeout)
 {
-    unsigned char id[sizeof hash];
-    int i, to = timeout * 1000000;
-    struct search_struct *rp; // result pointer
+    unsigned char id[KADEMLIA_HASH_SIZE];
+    int i, rc = 0, c = 0;
+    unsigned int done_count;
+    struct search_struct *rp, result; // result pointer, and a copy to work from without the lock
     struct MultiAddress **ret;
+    struct timespec deadline, retry;
+    char ipstr[INET6_ADDRSTRLEN + 1];
+    char str[sizeof ipstr + 16];
 
     if (kfd == -1) {
         return NULL; // start thread first.
     }
 
     dht_hash (id, sizeof(id), peer_id, strlen(peer_id), NULL, 0, NULL, 0);
-
-    //TODO: Is this the right place to ask the net?
-    dht_search((unsigned char*)peer_id, 0, AF_INET, NULL, NULL);
-    to = search_kademlia_internal (id, 0, to);
-    if (to == 0) return NULL; // time out.
-
-    // Wait for search completion.
-    for(;;) {
-        i = random() % 100000;
-        if (i > to) {
-            return NULL; // timeout.
+    deadline_from_now((long long)timeout * 1000, &deadline);
+
+    pthread_mutex_lock(&kademlia_lock);
+    rp = get_search_result(id);
+    // Search until there is a result or time is up.
+    while (rp && !closing && rc != ETIMEDOUT &&
+           rp->ipv4_count == 0 && rp->ipv6_count == 0) {
+        done_count = rp->done_count;
+        if (!queue_search(id, 0)) {
+            break;
         }
-        usleep(i);
-        for (rp = search_result ; rp ; rp = rp->next) {
-            if (memcmp(rp->hash, id, sizeof hash) == 0) { // Found.
-                char ipstr[INET6_ADDRSTRLEN + 1];
-                char str[sizeof ipstr + 16];
-                int c = 0;
-
-                // Wait for result or time out.
-                while (to > 0 &&
-                       search_result->ipv4_count == 0 &&
-                       search_result->ipv6_count == 0) {
-                         to = search_kademlia_internal (id, 0, to); // Repeat search to collect result.
-                         usleep(2000000); // Wait a few seconds for the result.
-                         to -= 2000000;
-                }
+        // Wait for the search to finish.
+        while (rc != ETIMEDOUT && !closing && rp->done_count == done_count &&
+               rp->ipv4_count == 0 && rp->ipv6_count == 0) {
+            rc = pthread_cond_timedwait(&search_condition, &kademlia_lock, &deadline);
+        }
+        if (rc == ETIMEDOUT || closing || rp->ipv4_count > 0 || rp->ipv6_count > 0) {
+            break;
+        }
+        // Nothing found. Values may still come, so wait a while before asking again.
+        deadline_from_now(SEARCH_RETRY_TIME * 1000, &retry);
+        if (retry.tv_sec >= deadline.tv_sec) {
+            retry = deadline;
+        }
+        while (rc != ETIMEDOUT && !closing && rp->ipv4_count == 0 && rp->ipv6_count == 0) {
+            rc = pthread_cond_timedwait(&search_condition, &kademlia_lock, &retry);
+        }
+        if (rc == ETIMEDOUT && retry.tv_sec != deadline.tv_sec) {
+            rc = 0; // only the retry wait is over
+        }
+    }
+    if (rp) {
+        memcpy(&result, rp, sizeof result);
+    }
+    pthread_mutex_unlock(&kademlia_lock);
 
-                if (search_result->ipv4_count == 0 ||
-                    search_result->ipv6_count == 0) return NULL; // no result.
+    if (!rp || (result.ipv4_count == 0 && result.ipv6_count == 0)) {
+        return NULL; // no result.
+    }
 
-                ret = calloc(search_result->ipv4_count + search_result->ipv6_count + 1, // IPv4 + IPv6 itens and a NULL terminator.
-                             sizeof (struct MultiAddress*)); // array of pointer.
-                if (!ret) {
-                    return NULL;
-                }
+    ret = calloc(result.ipv4_count + result.ipv6_count + 1, // IPv4 + IPv6 itens and a NULL terminator.
+                 sizeof (struct MultiAddress*)); // array of pointer.
+    if (!ret) {
+        return NULL;
+    }
 
-                for (i = 0 ; i < search_result->ipv4_count ; i++) {
-                    if (inet_ntop(AF_INET, &search_result->ipv4[i].ip, ipstr, sizeof ipstr)) {
-                        snprintf (str, sizeof str, "/ip4/%s/tcp/%d", ipstr, search_result->ipv4[i].port);
-                        if (dht_debug) {
-                            fprintf(dht_debug, "SEARCH %s (%d) = %s\n", peer_id, c, str);
-                        }
-                        ret[c] = multiaddress_new_from_string (str);
-                        if (ret[c] > 0) { // Sucess.
-                            c++;
-                        }
-                    }
-                }
-                for (i = 0 ; i < search_result->ipv6_count ; i++) {
-                    if (inet_ntop(AF_INET6, search_result->ipv6[i].ip, ipstr, sizeof ipstr)) {
-                        snprintf (str, sizeof str, "/ip6/%s/tcp/%d", ipstr, search_result->ipv6[i].port);
-                        if (dht_debug) {
-                            fprintf(dht_debug, "SEARCH %s (%d) = %s\n", peer_id, c, str);
-                        }
-                        ret[c] = multiaddress_new_from_string (str);
-                        if (ret[c] > 0) { // Sucess.
-                            c++;
-                        }
-                    }
-                }
-                ret[c] = NULL; // NULL terminator.
-                return ret;
+    for (i = 0 ; i < result.ipv4_count ; i++) {
+        if (inet_ntop(AF_INET, &result.ipv4[i].ip, ipstr, sizeof ipstr)) {
+            snprintf (str, sizeof str, "/ip4/%s/tcp/%d", ipstr, result.ipv4[i].port);
+            if (dht_debug) {
+                fprintf(dht_debug, "SEARCH %s (%d) = %s\n", peer_id, c, str);
+            }
+            ret[c] = multiaddress_new_from_string (str);
+            if (ret[c]) { // Sucess.
+                c++;
             }
         }
-        to -= i;
     }
-
-    return NULL;
+    for (i = 0 ; i < result.ipv6_count ; i++) {
+        if (inet_ntop(AF_INET6, result.ipv6[i].ip, ipstr, sizeof ipstr)) {
+            snprintf (str, sizeof str, "/ip6/%s/tcp/%d", ipstr, result.ipv6[i].port);
+            if (dht_debug) {
+                fprintf(dht_debug, "SEARCH %s (%d) = %s\n", peer_id, c, str);
+            }
+            ret[c] = multiaddress_new_from_string (str);
+            if (ret[c]) { // Sucess.
+                c++;
+            }
+        }
+    }
+    ret[c] = NULL; // NULL terminator.
+    return ret;
 }
 
+/***
+ * Ping a node, so it can be added to the routing table. Safe to call from any thread:
+ * the ping is queued, and sent by kademlia_thread (once it is started).
+ * @param ip the node's address
+ * @param port the node's port
+ * @returns true(1) if the ping was queued, false(0) if the address could not be parsed or out of memory
+ */
 int ping_kademlia (char *ip, uint16_t port)
 {
-    struct sockaddr_in sa;
-
-    if (inet_pton(AF_INET6, ip, &(sa.sin_addr.s_addr)) == 1) {
-        sa.sin_family = AF_INET6;
-    } if (inet_pton(AF_INET, ip, &(sa.sin_addr.s_addr)) == 1) {
-        sa.sin_family = AF_INET;
+    struct ping_request *ping = malloc(sizeof(struct ping_request));
+    if (!ping) {
+        return 0;
+    }
+    memset(ping, 0, sizeof(struct ping_request));
+
+    struct sockaddr_in *sa4 = (struct sockaddr_in*)&ping->sa;
+    struct sockaddr_in6 *sa6 = (struct sockaddr_in6*)&ping->sa;
+    if (inet_pton(AF_INET6, ip, &sa6->sin6_addr) == 1) {
+        sa6->sin6_family = AF_INET6;
+        sa6->sin6_port = htons (port);
+        ping->salen = sizeof(struct sockaddr_in6);
+    } else if (inet_pton(AF_INET, ip, &sa4->sin_addr) == 1) {
+        sa4->sin_family = AF_INET;
+        sa4->sin_port = htons (port);
+        ping->salen = sizeof(struct sockaddr_in);
     } else {
+        free (ping);
         return 0;
     }
 
-    sa.sin_port = htons (port);
-
-    dht_ping_node((struct sockaddr*)&sa, sizeof sa);
-    //usleep(random() % 100000);
+    pthread_mutex_lock(&kademlia_lock);
+    if (ping_tail) {
+        ping_tail->next = ping;
+    } else {
+        ping_head = ping;
+    }
+    ping_tail = ping;
+    wake_kademlia();
+    pthread_mutex_unlock(&kademlia_lock);
 
     return 1;
 }
@@ -15,6 +15,7 @@
 #include "libp2p/secio/propose.h"
 #include "libp2p/secio/exchange.h"
 #include "libp2p/net/multistream.h"
+#include "libp2p/net/event_loop.h"
 #include "libp2p/net/p2pnet.h"
 #include "libp2p/crypto/ephemeral.h"
 #include "libp2p/crypto/sha1.h"
@@ -24,6 +25,7 @@
 #include "libp2p/utils/vector.h"
 #include "libp2p/utils/logger.h"
 #include "libp2p/net/protocol.h"
+#include "libp2p/conn/dialer.h"
 #include "mbedtls/md.h"
 #include "mbedtls/cipher.h"
 #include "mbedtls/md_internal.h"
@@ -59,6 +61,11 @@ int libp2p_secio_can_handle(const uint8_t* incoming, size_t incoming_size) {
 int libp2p_secio_handle_message(const uint8_t* incoming, size_t incoming_size, struct SessionContext* session_context, void* protocol_context) {
 	libp2p_logger_debug("secio", "Handling incoming secio message.\n");
 	struct SecioContext* ctx = (struct SecioContext*)protocol_context;
+	if (session_context->insecure_stream->event_loop != NULL) {
+		// the handshake waits on each step, which would stall the loop
+		libp2p_logger_error("secio", "Secio must be negotiated before the session is added to an event loop.\n");
+		return -1;
+	}
 	int retVal = libp2p_secio_handshake(session_context, ctx->private_key, ctx->peer_store);
 	if (retVal)
 		return 0;
@@ -476,6 +483,15 @@ int libp2p_secio_stretch_keys(char* cipherType, char* hashType, unsigned char* s
 	return retVal;
 }
 
+/***
+ * Prepare the keyed cipher and mac contexts for one direction of the session.
+ * The local stretched key drives the encode contexts, the remote stretched key
+ * the decode contexts. This is done once per session, so that encrypting or
+ * decrypting a frame does not re-run the key schedule.
+ * @param session the session
+ * @param stretched_key either session->local_stretched_key or session->remote_stretched_key
+ * @returns true(1) on success, false(0) otherwise
+ */
 int libp2p_secio_make_mac_and_cipher(struct SessionContext* session, struct StretchedKey* stretched_key) {
 	// mac
 	if (strcmp(session->chosen_hash, "SHA1") == 0) {
@@ -495,7 +511,7 @@ int libp2p_secio_make_mac_and_cipher(struct SessionContext* session, struct Stre
 	*/
 
 	// block cipher
-	if (strcmp(session->chosen_cipher, "AES-128") || strcmp(session->chosen_cipher, "AES-256") == 0) {
+	if (strcmp(session->chosen_cipher, "AES-128") == 0 || strcmp(session->chosen_cipher, "AES-256") == 0) {
 		//we already have the key
 	} else if (strcmp(session->chosen_cipher, "Blowfish") == 0) {
 		//TODO: Implement blowfish
@@ -504,10 +520,56 @@ int libp2p_secio_make_mac_and_cipher(struct SessionContext* session, struct Stre
 		return 0;
 	}
 
-	//TODO: set up the encrypted streams
+	// set up the keyed contexts. If local and remote are the same key (i.e. loopback), both get done.
+	//TODO make this more generic to use more than SHA256
+	if (stretched_key == session->local_stretched_key) {
+		mbedtls_aes_free(&session->aes_encode_context);
+		mbedtls_aes_init(&session->aes_encode_context);
+		if (mbedtls_aes_setkey_enc(&session->aes_encode_context, stretched_key->cipher_key, stretched_key->cipher_size * 8)) {
+			libp2p_logger_error("secio", "Unable to set key for encode cipher.\n");
+			return 0;
+		}
+		mbedtls_md_free(&session->mac_encode_context);
+		mbedtls_md_init(&session->mac_encode_context);
+		if (mbedtls_md_setup(&session->mac_encode_context, &mbedtls_sha256_info, 1)
+				|| mbedtls_md_hmac_starts(&session->mac_encode_context, stretched_key->mac_key, stretched_key->mac_size)) {
+			libp2p_logger_error("secio", "Unable to set up encode mac.\n");
+			return 0;
+		}
+	}
+	if (stretched_key == session->remote_stretched_key) {
+		mbedtls_aes_free(&session->aes_decode_context);
+		mbedtls_aes_init(&session->aes_decode_context);
+		// CTR mode uses the encrypt key schedule in both directions
+		if (mbedtls_aes_setkey_enc(&session->aes_decode_context, stretched_key->cipher_key, stretched_key->cipher_size * 8)) {
+			libp2p_logger_error("secio", "Unable to set key for decode cipher.\n");
+			return 0;
+		}
+		mbedtls_md_free(&session->mac_decode_context);
+		mbedtls_md_init(&session->mac_decode_context);
+		if (mbedtls_md_setup(&session->mac_decode_context, &mbedtls_sha256_info, 1)
+				|| mbedtls_md_hmac_starts(&session->mac_decode_context, stretched_key->mac_key, stretched_key->mac_size)) {
+			libp2p_logger_error("secio", "Unable to set up decode mac.\n");
+			return 0;
+		}
+	}
 	return 1;
 }
 
+/***
+ * Write a buffer completely to the session's default stream
+ * @param session the session information
+ * @param bytes the bytes to write
+ * @param bytes_size the number of bytes to write
+ * @returns true(1) if all bytes were written, false(0) otherwise
+ */
+int libp2p_secio_write_frame(struct SessionContext* session, const unsigned char* bytes, size_t bytes_size) {
+	struct iovec iov[1];
+	iov[0].iov_base = (void*)bytes;
+	iov[0].iov_len = bytes_size;
+	return socket_writev(*((int*)session->default_stream->socket_descriptor), iov, 1, 0) == (ssize_t)bytes_size;
+}
+
 /***
  * Write bytes to an unencrypted stream
  * @param session the session information
@@ -519,46 +581,68 @@ int libp2p_secio_unencrypted_write(struct SessionContext* session, unsigned char
 	int num_bytes = 0;
 
 	if (data_length > 0) { // only do this is if there is something to send
-		// first send the size
+		// the size and the data leave together
 		uint32_t size = htonl(data_length);
-		char* size_as_char = (char*)&size;
-		int left = 4;
-		int written = 0;
-		int written_this_time = 0;
-		do {
-			written_this_time = socket_write(*((int*)session->default_stream->socket_descriptor), &size_as_char[written], left, 0);
-			if (written_this_time < 0) {
-				written_this_time = 0;
-				if ( (errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-					// TODO: use epoll or select to wait for socket to be writable
-				} else {
-					return 0;
-				}
-			}
-			left = left - written_this_time;
-		} while (left > 0);
-		// then send the actual data
-		left = data_length;
-		written = 0;
-		do {
-			written_this_time = socket_write(*((int*)session->default_stream->socket_descriptor), (char*)&bytes[written], left, 0);
-			if (written_this_time < 0) {
-				written_this_time = 0;
-				if ( (errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-					// TODO: use epoll or select to wait for socket to be writable
-				} else {
-					return 0;
-				}
-			}
-			left = left - written_this_time;
-			written += written_this_time;
-		} while (left > 0);
-		num_bytes = written;
+		struct iovec iov[2];
+		iov[0].iov_base = &size;
+		iov[0].iov_len = 4;
+		iov[1].iov_base = bytes;
+		iov[1].iov_len = data_length;
+		if (socket_writev(*((int*)session->default_stream->socket_descriptor), iov, 2, 0) != (ssize_t)(data_length + 4))
+			return 0;
+		num_bytes = data_length;
 	} // there was something to send
 
 	return num_bytes;
 }
 
+/***
+ * Read the 4 byte length prefix of the next frame
+ * @param session the session information
+ * @param frame_size where to put the size of the frame that follows
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_secio_read_frame_size(struct SessionContext* session, uint32_t* frame_size, int timeout_secs) {
+	uint32_t buffer_size;
+	int socket_fd = *((int*)session->insecure_stream->socket_descriptor);
+	struct RingBuffer* read_buffer = session->insecure_stream->read_buffer;
+
+	// With a read buffer, this usually costs no system call.
+	char* size = (char*)&buffer_size;
+	do {
+		if (socket_read_buffered(socket_fd, read_buffer, &size[0], 1, 0, timeout_secs) != 1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				libp2p_logger_error("secio", "Error in libp2p_secio_unencrypted_read: %s\n", strerror(errno));
+			return 0;
+		}
+		// skip a spurious \n
+	} while (size[0] == 10);
+	if (socket_read_buffered(socket_fd, read_buffer, &size[1], 3, 0, timeout_secs) != 3) {
+		libp2p_logger_error("secio", "Unable to read frame size in libp2p_secio_unencrypted_read.\n");
+		return 0;
+	}
+	*frame_size = ntohl(buffer_size);
+	return *frame_size != 0;
+}
+
+/***
+ * Read the body of a frame
+ * @param session the session information
+ * @param buffer where to put it
+ * @param frame_size the number of bytes to read
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+static int libp2p_secio_read_frame_body(struct SessionContext* session, unsigned char* buffer, uint32_t frame_size, int timeout_secs) {
+	int socket_fd = *((int*)session->insecure_stream->socket_descriptor);
+	if (socket_read_buffered(socket_fd, session->insecure_stream->read_buffer, (char*)buffer, frame_size, 0, timeout_secs) != frame_size) {
+		libp2p_logger_error("secio", "Unable to read %u byte frame in libp2p_secio_unencrypted_read.\n", frame_size);
+		return 0;
+	}
+	return 1;
+}
+
 /***
  * Read bytes from the incoming stream
  * @param session the session information
@@ -570,52 +654,18 @@ int libp2p_secio_unencrypted_read(struct SessionContext* session, unsigned char*
 	uint32_t buffer_size;
 
 	// first read the 4 byte integer
-	char* size = (char*)&buffer_size;
-	int left = 4;
-	int read = 0;
-	int read_this_time = 0;
-	do {
-		read_this_time = socket_read(*((int*)session->insecure_stream->socket_descriptor), &size[read], 1, 0, timeout_secs);
-		if (read_this_time < 0) {
-			read_this_time = 0;
-			if ( (errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-				// TODO: use epoll or select to wait for socket to be writable
-				return 0;
-			} else {
-				libp2p_logger_error("secio", "Error in libp2p_secio_unencrypted_read: %s\n", strerror(errno));
-				return 0;
-			}
-		}
-		if (read == 0 && size[0] == 10) {
-			// a spurious \n
-			// write over this value by not adding it
-		} else {
-			left = left - read_this_time;
-			read += read_this_time;
-		}
-	} while (left > 0);
-	buffer_size = ntohl(buffer_size);
-	if (buffer_size == 0)
+	if (!libp2p_secio_read_frame_size(session, &buffer_size, timeout_secs))
 		return 0;
 
-	// now read the number of bytes we've found, minus the 4 that we just read
-	left = buffer_size;
-	read = 0;
-	read_this_time = 0;
-	*results = malloc(left);
-	unsigned char* ptr = *results;
-	do {
-		read_this_time = socket_read(*((int*)session->insecure_stream->socket_descriptor), (char*)&ptr[read], left, 0, timeout_secs);
-		if (read_this_time < 0) {
-			read_this_time = 0;
-			if ( (errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-				// TODO: use epoll or select to wait for socket to be writable
-			} else {
-				return 0;
-			}
-		}
-		left = left - read_this_time;
-	} while (left > 0);
+	// now read the number of bytes we've found
+	*results = malloc(buffer_size);
+	if (*results == NULL)
+		return 0;
+	if (!libp2p_secio_read_frame_body(session, *results, buffer_size, timeout_secs)) {
+		free(*results);
+		*results = NULL;
+		return 0;
+	}
 
 	*results_size = buffer_size;
 	return buffer_size;
@@ -634,6 +684,50 @@ int libp2p_secio_initialize_crypto(struct SessionContext* session) {
 	return 1;
 }
 
+/***
+ * Encrypt data in place, and append the MAC
+ * @param session the session information
+ * @param buffer the data to encrypt, followed by SECIO_FRAME_TAILROOM bytes for the MAC
+ * @param data_size the number of bytes of data (not including the tailroom)
+ * @returns true(1) on success, otherwise false(0)
+ */
+int libp2p_secio_encrypt_in_place(struct SessionContext* session, unsigned char* buffer, size_t data_size) {
+	//TODO switch between ciphers
+	// the cipher context was keyed in libp2p_secio_make_mac_and_cipher. CTR mode can work in place.
+	if (mbedtls_aes_crypt_ctr(&session->aes_encode_context, data_size, &session->aes_encode_nonce_offset, session->local_stretched_key->iv, session->aes_encode_stream_block, buffer, buffer)) {
+		libp2p_logger_error("secio", "Unable to update cipher.\n");
+		return 0;
+	}
+
+	// mac the data. The reset reuses the inner and outer pads computed at setup.
+	if (mbedtls_md_hmac_reset(&session->mac_encode_context)
+			|| mbedtls_md_hmac_update(&session->mac_encode_context, buffer, data_size)
+			// this will tack the mac onto the end of the buffer
+			|| mbedtls_md_hmac_finish(&session->mac_encode_context, &buffer[data_size])) {
+		libp2p_logger_error("secio", "Unable to compute mac.\n");
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Turn a buffer into a complete secio frame, in place. The buffer must be laid out as
+ * SECIO_FRAME_HEADROOM bytes, then the data, then SECIO_FRAME_TAILROOM bytes.
+ * @param session the session information
+ * @param frame the beginning of the buffer (the data starts at frame + SECIO_FRAME_HEADROOM)
+ * @param data_size the number of bytes of data
+ * @param frame_size the total size of the frame, ready to be written to the wire
+ * @returns true(1) on success, otherwise false(0)
+ */
+int libp2p_secio_frame_in_place(struct SessionContext* session, unsigned char* frame, size_t data_size, size_t* frame_size) {
+	if (!libp2p_secio_encrypt_in_place(session, &frame[SECIO_FRAME_HEADROOM], data_size))
+		return 0;
+	uint32_t size = htonl(data_size + SECIO_FRAME_TAILROOM);
+	memcpy(frame, &size, SECIO_FRAME_HEADROOM);
+	*frame_size = SECIO_FRAME_HEADROOM + data_size + SECIO_FRAME_TAILROOM;
+	return 1;
+}
+
 /**
  * Encrypt data before being sent out an insecure stream
  * @param session the session information
@@ -644,49 +738,16 @@ int libp2p_secio_initialize_crypto(struct SessionContext* session) {
  * @returns true(1) on success, otherwise false(0)
  */
 int libp2p_secio_encrypt(struct SessionContext* session, const unsigned char* incoming, size_t incoming_size, unsigned char** outgoing, size_t* outgoing_size) {
-	unsigned char* buffer = NULL;
-	size_t buffer_size = 0, original_buffer_size = 0;
-
-	//TODO switch between ciphers
-	mbedtls_aes_context cipher_ctx;
-	mbedtls_aes_init(&cipher_ctx);
-	if (mbedtls_aes_setkey_enc(&cipher_ctx, session->local_stretched_key->cipher_key, session->local_stretched_key->cipher_size * 8)) {
-		fprintf(stderr, "Unable to set key for cipher\n");
+	unsigned char* buffer = malloc(incoming_size + SECIO_FRAME_TAILROOM);
+	if (buffer == NULL)
 		return 0;
-	}
-
-	original_buffer_size = incoming_size;
-	original_buffer_size += 32;
-	buffer_size = original_buffer_size;
-	buffer = malloc(original_buffer_size);
-	memset(buffer, 0, original_buffer_size);
-
-	if (mbedtls_aes_crypt_ctr(&cipher_ctx, incoming_size, &session->aes_encode_nonce_offset, session->local_stretched_key->iv, session->aes_encode_stream_block, incoming, buffer)) {
-		fprintf(stderr, "Unable to update cipher\n");
+	memcpy(buffer, incoming, incoming_size);
+	if (!libp2p_secio_encrypt_in_place(session, buffer, incoming_size)) {
+		free(buffer);
 		return 0;
 	}
-	buffer_size = incoming_size;
-
-	// Now, buffer size may be set differently than original_buffer_size
-	// The "incoming" is now encrypted, and is in the first part of the buffer
-	mbedtls_aes_free(&cipher_ctx);
-
-	// mac the data
-	mbedtls_md_context_t ctx;
-	mbedtls_md_setup(&ctx, &mbedtls_sha256_info, 1);
-	mbedtls_md_hmac_starts(&ctx, session->local_stretched_key->mac_key, session->local_stretched_key->mac_size);
-	mbedtls_md_hmac_update(&ctx, buffer, buffer_size);
-	// this will tack the mac onto the end of the buffer
-	mbedtls_md_hmac_finish(&ctx, &buffer[buffer_size]);
-	mbedtls_md_free(&ctx);
-
-	// put it all in outgoing
-	*outgoing_size = original_buffer_size;
-	*outgoing = malloc(*outgoing_size);
-	memset(*outgoing, 0, *outgoing_size);
-	memcpy(*outgoing, buffer, original_buffer_size);
-
-	free(buffer);
+	*outgoing = buffer;
+	*outgoing_size = incoming_size + SECIO_FRAME_TAILROOM;
 	return 1;
 }
 
@@ -699,77 +760,97 @@ int libp2p_secio_encrypt(struct SessionContext* session, const unsigned char* in
  */
 int libp2p_secio_encrypted_write(void* stream_context, const unsigned char* bytes, size_t num_bytes) {
 	struct SessionContext* session = (struct SessionContext*) stream_context;
+	int retVal = 0;
+	size_t frame_size = 0;
+	if (session->insecure_stream->event_loop != NULL) {
+		// the loop encrypts as it queues, which keeps the counter in the order frames go out
+		if (!libp2p_net_event_loop_queue_write(session->insecure_stream->event_loop, session, bytes, num_bytes))
+			return 0;
+		return num_bytes;
+	}
 	// writer uses the local cipher and mac
-	unsigned char* buffer = NULL;
-	size_t buffer_size = 0;
-	if (!libp2p_secio_encrypt(session, bytes, num_bytes, &buffer, &buffer_size)) {
-		libp2p_logger_error("secio", "secio_encrypt returned false.\n");
+	// the only copy is the caller's bytes into the frame, everything else is done in place
+	unsigned char* frame = malloc(SECIO_FRAME_HEADROOM + num_bytes + SECIO_FRAME_TAILROOM);
+	if (frame == NULL)
 		return 0;
+	memcpy(&frame[SECIO_FRAME_HEADROOM], bytes, num_bytes);
+	if (!libp2p_secio_frame_in_place(session, frame, num_bytes, &frame_size)) {
+		libp2p_logger_error("secio", "secio_frame_in_place returned false.\n");
+		goto exit;
 	}
-	int retVal = libp2p_secio_unencrypted_write(session, buffer, buffer_size);
-	if (!retVal) {
-		libp2p_logger_error("secio", "secio_unencrypted_write returned false\n");
+	if (!libp2p_secio_write_frame(session, frame, frame_size)) {
+		libp2p_logger_error("secio", "secio_write_frame returned false\n");
+		goto exit;
 	}
-	free(buffer);
+	retVal = frame_size - SECIO_FRAME_HEADROOM;
+	exit:
+	free(frame);
 	return retVal;
 }
 
-/**
- * Unencrypt data that was read from the stream
+/***
+ * Verify the MAC and decrypt a frame in place
  * @param session the session information
- * @param incoming the incoming bytes
- * @param incoming_size the number of incoming bytes
- * @param outgoing where to put the results
- * @param outgoing_size the amount of memory allocated for the results
- * @returns number of unencrypted bytes
+ * @param buffer the frame (without the length prefix). The plain text will be left at the start of it
+ * @param buffer_size the size of the frame, including the MAC
+ * @param data_size the number of plain text bytes
+ * @returns true(1) on success, otherwise false(0)
  */
-int libp2p_secio_decrypt(struct SessionContext* session, const unsigned char* incoming, size_t incoming_size, unsigned char** outgoing, size_t* outgoing_size) {
-	size_t data_section_size = incoming_size - 32;
-	*outgoing_size = 0;
-	unsigned char* buffer;
+int libp2p_secio_decrypt_in_place(struct SessionContext* session, unsigned char* buffer, size_t buffer_size, size_t* data_size) {
+	*data_size = 0;
+	if (buffer_size < SECIO_FRAME_TAILROOM) {
+		libp2p_logger_error("secio", "libp2p_secio_decrypt: Frame too small to contain a MAC.\n");
+		return 0;
+	}
+	size_t data_section_size = buffer_size - SECIO_FRAME_TAILROOM;
 
 	// verify MAC
 	//TODO make this more generic to use more than SHA256
-	mbedtls_md_context_t ctx;
-	mbedtls_md_setup(&ctx, &mbedtls_sha256_info, 1);
-	mbedtls_md_hmac_starts(&ctx, session->remote_stretched_key->mac_key, session->remote_stretched_key->mac_size);
-	mbedtls_md_hmac_update(&ctx, incoming, data_section_size);
 	unsigned char generated_mac[32];
-	mbedtls_md_hmac_finish(&ctx, generated_mac);
-	mbedtls_md_free(&ctx);
+	if (mbedtls_md_hmac_reset(&session->mac_decode_context)
+			|| mbedtls_md_hmac_update(&session->mac_decode_context, buffer, data_section_size)
+			|| mbedtls_md_hmac_finish(&session->mac_decode_context, generated_mac)) {
+		libp2p_logger_error("secio", "libp2p_secio_decrypt: Unable to compute mac.\n");
+		return 0;
+	}
 	// 2. check the mac to see if it is the same
-	int retVal = memcmp(&incoming[data_section_size], generated_mac, 32);
-	if (retVal != 0) {
+	if (memcmp(&buffer[data_section_size], generated_mac, 32) != 0) {
 		// MAC verification failed
 		libp2p_logger_error("secio", "libp2p_secio_decrypt: MAC verification failed.\n");
-		// copy the raw bytes into outgoing for further analysis
-		*outgoing = (unsigned char*)malloc(incoming_size);
-		*outgoing_size = incoming_size;
-		memcpy(*outgoing, incoming, incoming_size);
 		return 0;
 	}
 
 	// The MAC checks out. Now decipher the data section
-
-	mbedtls_aes_context cipher_ctx;
-	mbedtls_aes_init(&cipher_ctx);
-	if (mbedtls_aes_setkey_enc(&cipher_ctx, session->remote_stretched_key->cipher_key, session->remote_stretched_key->cipher_size * 8)) {
-		libp2p_logger_error("secio", "Unable to set key for cipher.\n");
+	if (mbedtls_aes_crypt_ctr(&session->aes_decode_context, data_section_size, &session->aes_decode_nonce_offset, session->remote_stretched_key->iv, session->aes_decode_stream_block, buffer, buffer)) {
+		libp2p_logger_error("secio", "Unable to update cipher.\n");
 		return 0;
 	}
+	*data_size = data_section_size;
+	return 1;
+}
 
-	buffer = malloc(data_section_size);
-	if (mbedtls_aes_crypt_ctr(&cipher_ctx, data_section_size, &session->aes_decode_nonce_offset, session->remote_stretched_key->iv, session->aes_decode_stream_block, incoming, buffer)) {
-		libp2p_logger_error("secio", "Unable to update cipher.\n");
+/**
+ * Unencrypt data that was read from the stream
+ * @param session the session information
+ * @param incoming the incoming bytes
+ * @param incoming_size the number of incoming bytes
+ * @param outgoing where to put the results
+ * @param outgoing_size the amount of memory allocated for the results
+ * @returns number of unencrypted bytes
+ */
+int libp2p_secio_decrypt(struct SessionContext* session, const unsigned char* incoming, size_t incoming_size, unsigned char** outgoing, size_t* outgoing_size) {
+	*outgoing_size = 0;
+	unsigned char* buffer = malloc(incoming_size);
+	if (buffer == NULL)
+		return 0;
+	memcpy(buffer, incoming, incoming_size);
+	if (!libp2p_secio_decrypt_in_place(session, buffer, incoming_size, outgoing_size)) {
+		// hand back the raw bytes for further analysis
+		*outgoing = buffer;
+		*outgoing_size = incoming_size;
 		return 0;
 	}
-
-	mbedtls_aes_free(&cipher_ctx);
-	*outgoing = malloc(data_section_size);
-	*outgoing_size = data_section_size;
-	memcpy(*outgoing, buffer, data_section_size);
-	free(buffer);
-
+	*outgoing = buffer;
 	return *outgoing_size;
 }
 
@@ -783,6 +864,11 @@ int libp2p_secio_decrypt(struct SessionContext* session, const unsigned char* in
 int libp2p_secio_encrypted_read(void* stream_context, unsigned char** bytes, size_t* num_bytes, int timeout_secs) {
 	int retVal = 0;
 	struct SessionContext* session = (struct SessionContext*)stream_context;
+	if (session->insecure_stream->event_loop != NULL) {
+		// the loop decrypts frames as they arrive, so there is nothing here to read
+		libp2p_logger_error("secio", "Blocking read on a session in an event loop. Use read_async.\n");
+		return 0;
+	}
 	// reader uses the remote cipher and mac
 	// read the data
 	unsigned char* incoming = NULL;
@@ -791,15 +877,129 @@ int libp2p_secio_encrypted_read(void* stream_context, unsigned char** bytes, siz
 		libp2p_logger_error("secio", "Unencrypted_read returned false.\n");
 		goto exit;
 	}
-	retVal = libp2p_secio_decrypt(session, incoming, incoming_size, bytes, num_bytes);
-	if (!retVal)
+	// decrypt where it sits, and hand the same buffer to the caller
+	if (!libp2p_secio_decrypt_in_place(session, incoming, incoming_size, num_bytes)) {
 		libp2p_logger_error("secio", "Decrypting incoming stream returned false.\n");
+		goto exit;
+	}
+	*bytes = incoming;
+	incoming = NULL;
+	retVal = *num_bytes;
 	exit:
 	if (incoming != NULL)
 		free(incoming);
 	return retVal;
 }
 
+/***
+ * Check whether a whole frame is sitting in the stream's read buffer, so that reading
+ * it will not wait on the socket
+ * @param session the session
+ * @returns 1 if a frame can be read without waiting, 0 if not yet, -1 if the frame is
+ * too big for the read buffer (its prefix has arrived, but it must be gathered elsewhere)
+ */
+int libp2p_secio_frame_ready(struct SessionContext* session) {
+	struct RingBuffer* read_buffer = session->insecure_stream->read_buffer;
+	unsigned char prefix[16];
+	uint32_t frame_size;
+	size_t skip = 0;
+
+	if (read_buffer == NULL)
+		return 0;
+	size_t available = libp2p_utils_ring_buffer_peek(read_buffer, prefix, sizeof(prefix));
+	// skip spurious \n
+	while (skip < available && prefix[skip] == 10)
+		skip++;
+	if (available - skip < 4)
+		return 0;
+	memcpy(&frame_size, &prefix[skip], 4);
+	frame_size = ntohl(frame_size);
+	if (skip + 4 + frame_size > read_buffer->capacity)
+		return -1;
+	return libp2p_utils_ring_buffer_size(read_buffer) >= skip + 4 + frame_size;
+}
+
+/***
+ * Decrypt the next frame if all of it has arrived, without waiting on the socket. A frame
+ * too big for the read buffer is gathered over as many calls as it takes.
+ * @param session the session
+ * @param results the plain text. NOTE: this memory is allocated
+ * @param num_bytes the number of plain text bytes
+ * @returns 1 if a frame was decrypted, 0 if it has not all arrived yet, -1 on error
+ */
+int libp2p_secio_try_read_frame(struct SessionContext* session, unsigned char** results, size_t* num_bytes) {
+	struct Stream* stream = session->insecure_stream;
+	unsigned char* frame = NULL;
+	size_t frame_size = 0;
+	uint32_t size = 0;
+
+	if (stream->large == NULL) {
+		int rc = libp2p_secio_frame_ready(session);
+		if (rc == 0)
+			return 0;
+		// what is read here is already in the read buffer, so the timeout never comes into play
+		if (!libp2p_secio_read_frame_size(session, &size, 1))
+			return -1;
+		if (rc < 0) {
+			if (!libp2p_net_multistream_gather_start(stream, size))
+				return -1;
+		} else {
+			frame = malloc(size);
+			if (frame == NULL)
+				return -1;
+			if (!libp2p_secio_read_frame_body(session, frame, size, 1)) {
+				free(frame);
+				return -1;
+			}
+			frame_size = size;
+		}
+	}
+	if (frame == NULL && !libp2p_net_multistream_gather(stream, &frame, &frame_size))
+		return 0;
+	if (!libp2p_secio_decrypt_in_place(session, frame, frame_size, num_bytes)) {
+		libp2p_logger_error("secio", "Unable to decrypt frame.\n");
+		free(frame);
+		return -1;
+	}
+	*results = frame;
+	return 1;
+}
+
+/***
+ * Read and decrypt the next frame into memory the caller already has. If the frame
+ * does not fit, it is read into newly allocated memory instead.
+ * @param session the session
+ * @param buffer where to put the frame. Needs room for the data plus SECIO_FRAME_TAILROOM
+ * @param buffer_size the room available in buffer
+ * @param allocated NULL if the frame went into buffer, otherwise the memory it went into (the caller frees it)
+ * @param num_bytes the number of plain text bytes
+ * @param timeout_secs the seconds before a timeout
+ * @returns true(1) on success, false(0) otherwise
+ */
+int libp2p_secio_encrypted_read_into(struct SessionContext* session, unsigned char* buffer, size_t buffer_size, unsigned char** allocated, size_t* num_bytes, int timeout_secs) {
+	uint32_t frame_size = 0;
+	unsigned char* frame = buffer;
+
+	*allocated = NULL;
+	if (!libp2p_secio_read_frame_size(session, &frame_size, timeout_secs))
+		return 0;
+	if (frame_size > buffer_size || buffer == NULL) {
+		frame = malloc(frame_size);
+		if (frame == NULL)
+			return 0;
+	}
+	if (!libp2p_secio_read_frame_body(session, frame, frame_size, timeout_secs)
+			|| !libp2p_secio_decrypt_in_place(session, frame, frame_size, num_bytes)) {
+		libp2p_logger_error("secio", "Unable to read encrypted frame.\n");
+		if (frame != buffer)
+			free(frame);
+		return 0;
+	}
+	if (frame != buffer)
+		*allocated = frame;
+	return 1;
+}
+
 /***
  * performs initial communication over an insecure channel to share
  * keys, IDs, and initiate connection. This is a framed messaging system
@@ -831,6 +1031,7 @@ int libp2p_secio_handshake(struct SessionContext* local_session, struct RsaPriva
 	struct PrivateKey* priv = NULL;
 	struct PublicKey pub_key = {0};
 	struct Libp2pPeer* remote_peer = NULL;
+	int new_peer = 0;
 
 	//TODO: make sure we're not talking to ourself
 
@@ -910,7 +1111,6 @@ int libp2p_secio_handshake(struct SessionContext* local_session, struct RsaPriva
 	libp2p_crypto_public_key_to_peer_id(public_key, &local_session->remote_peer_id);
 
 	// see if we already have this peer
-	int new_peer = 0;
 	remote_peer = libp2p_peerstore_get_peer(peerstore, (unsigned char*)local_session->remote_peer_id, strlen(local_session->remote_peer_id));
 	if (remote_peer == NULL) {
 		remote_peer = libp2p_peer_new();
@@ -929,8 +1129,12 @@ int libp2p_secio_handshake(struct SessionContext* local_session, struct RsaPriva
 		if (remote_peer->sessionContext != local_session) {
 			// clean up old session context
 			libp2p_logger_debug("secio", "Same remote connected. Replacing SessionContext.\n");
-			libp2p_session_context_free(remote_peer->sessionContext);
+			if (remote_peer->dialer != NULL)
+				libp2p_conn_dialer_release_session(remote_peer->dialer, remote_peer->sessionContext);
+			else
+				libp2p_session_context_free(remote_peer->sessionContext);
 			remote_peer->sessionContext = local_session;
+			remote_peer->dialer = NULL;
 		}
 	}
 	remote_peer->connection_type = CONNECTION_TYPE_CONNECTED;
@@ -1004,7 +1208,6 @@ int libp2p_secio_handshake(struct SessionContext* local_session, struct RsaPriva
 	bytes_written = libp2p_secio_unencrypted_read(local_session, &results, &results_size, 10);
 	if (bytes_written == 0) {
 		libp2p_logger_error("secio", "unable to read exchange packet.\n");
-		libp2p_peer_handle_connection_error(remote_peer);
 		goto exit;
 	}
 	libp2p_secio_exchange_protobuf_decode(results, results_size, &exchange_in);
@@ -1034,6 +1237,15 @@ int libp2p_secio_handshake(struct SessionContext* local_session, struct RsaPriva
 	}
 	free(char_buffer);
 	char_buffer = NULL;
+	// keep their public key, so what they sign later (i.e. dht records) can be checked
+	if (local_session->remote_key.data != NULL)
+		free(local_session->remote_key.data);
+	local_session->remote_key.data = malloc(public_key->data_size);
+	if (local_session->remote_key.data == NULL)
+		goto exit;
+	memcpy(local_session->remote_key.data, public_key->data, public_key->data_size);
+	local_session->remote_key.data_size = public_key->data_size;
+	local_session->remote_key.type = public_key->type;
 
 	// 2.2 generate shared key
 	if (!libp2p_crypto_ephemeral_generate_shared_secret(local_session->ephemeral_private_key, local_session->remote_ephemeral_public_key, local_session->remote_ephemeral_public_key_size)) {
@@ -1072,10 +1284,12 @@ int libp2p_secio_handshake(struct SessionContext* local_session, struct RsaPriva
 		goto exit;
 	}
 
-	// this doesn't do much. It is here to match the GO code and maybe eventually remind us
-	// that there is more work to do for compatibility to GO
-	libp2p_secio_make_mac_and_cipher(local_session, local_session->local_stretched_key);
-	libp2p_secio_make_mac_and_cipher(local_session, local_session->remote_stretched_key);
+	// key the per-session cipher and mac contexts used by encrypt and decrypt
+	if (!libp2p_secio_make_mac_and_cipher(local_session, local_session->local_stretched_key)
+			|| !libp2p_secio_make_mac_and_cipher(local_session, local_session->remote_stretched_key)) {
+		libp2p_logger_error("secio", "Unable to set up cipher and mac.\n");
+		goto exit;
+	}
 
 	// now we actually start encrypting things...
 
@@ -1141,6 +1355,14 @@ int libp2p_secio_handshake(struct SessionContext* local_session, struct RsaPriva
 	libp2p_secio_propose_free(propose_out);
 	libp2p_secio_propose_free(propose_in);
 
+	if (retVal != 1 && remote_peer != NULL && remote_peer->sessionContext == local_session) {
+		// the caller frees the session, so the peer must not keep it
+		remote_peer->sessionContext = NULL;
+		remote_peer->connection_type = CONNECTION_TYPE_NOT_CONNECTED;
+		if (new_peer)
+			libp2p_peer_free(remote_peer);
+	}
+
 	if (retVal == 1) {
 		libp2p_logger_log("secio", LOGLEVEL_DEBUG, "Handshake success!\n");
 	} else {
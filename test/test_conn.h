@@ -1,4 +1,10 @@
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "libp2p/conn/dialer.h"
 #include "libp2p/net/stream.h"
@@ -104,13 +110,254 @@ int test_dialer_dial_multistream() {
 		free(result);
 	free(peer_id);
 	multiaddress_free(destination_address);
+	// the dialer owns the stream
 	libp2p_conn_dialer_free(dialer);
 	libp2p_crypto_private_key_free(private_key);
-	if (stream != NULL) {
-		struct SessionContext session_context;
-		session_context.insecure_stream = stream;
-		stream->close(&session_context);
-		libp2p_net_multistream_stream_free(stream);
+	return retVal;
+}
+
+/***
+ * Accept connections, and do the server side of the multistream handshake on each.
+ * The connections are held open until the other side closes them.
+ * @param listener the listening socket
+ * @param count the number of connections to accept
+ */
+void test_dialer_multistream_server(int listener, int count) {
+	char* protocol = "/multistream/1.0.0\n";
+	unsigned char hello[32];
+	int fds[8];
+	hello[0] = strlen(protocol);
+	memcpy(&hello[1], protocol, hello[0]);
+	for(int i = 0; i < count; i++) {
+		fds[i] = accept(listener, NULL, NULL);
+		if (fds[i] < 0)
+			_exit(1);
+		if (write(fds[i], hello, hello[0] + 1) != hello[0] + 1)
+			_exit(2);
+		if (read(fds[i], hello, sizeof(hello)) <= 0)
+			_exit(3);
+		hello[0] = strlen(protocol);
+		memcpy(&hello[1], protocol, hello[0]);
+	}
+	for(int i = 0; i < count; i++) {
+		while (read(fds[i], hello, sizeof(hello)) > 0)
+			;
+		close(fds[i]);
+	}
+	_exit(0);
+}
+
+/***
+ * A second request to the same peer reuses the connection, and borrowed connections stay open
+ */
+int test_dialer_connection_pool() {
+	int retVal = 0;
+	int listener = -1;
+	pid_t child = -1;
+	int status = 0;
+	char address_string[64];
+	struct sockaddr_in address;
+	socklen_t address_size = sizeof(address);
+	struct PrivateKey* private_key = libp2p_crypto_private_key_new();
+	struct Dialer* dialer = NULL;
+	struct MultiAddress* first_address = NULL;
+	struct MultiAddress* second_address = NULL;
+	struct SessionContext* first = NULL;
+	struct SessionContext* session = NULL;
+	struct Stream* stream = NULL;
+	struct RsaPrivateKey rsa_key;
+	struct Libp2pPeer* peer = NULL;
+	struct Libp2pPeer* copy = NULL;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 4) != 0)
+		goto exit;
+	if (getsockname(listener, (struct sockaddr*)&address, &address_size) != 0)
+		goto exit;
+	child = fork();
+	if (child < 0)
+		goto exit;
+	if (child == 0)
+		test_dialer_multistream_server(listener, 2);
+	close(listener);
+	listener = -1;
+
+	// the same host and port, written two ways so that they are different keys
+	sprintf(address_string, "/ip4/127.0.0.1/tcp/%d", ntohs(address.sin_port));
+	first_address = multiaddress_new_from_string(address_string);
+	sprintf(address_string, "/ip4/127.0.0.1/tcp/%d/", ntohs(address.sin_port));
+	second_address = multiaddress_new_from_string(address_string);
+	dialer = libp2p_conn_dialer_new("QmQSDGgxSVTkHmtT25rTzQtc5C1Yg8SpGK3BTws8YsJ4x3", private_key);
+	if (first_address == NULL || second_address == NULL || dialer == NULL)
+		goto exit;
+
+	first = libp2p_conn_dialer_get_session(dialer, "QmPeerOne", first_address, NULL, NULL);
+	if (first == NULL || dialer->connection_misses != 1 || dialer->num_connections != 1)
+		goto exit;
+	// by peer id
+	session = libp2p_conn_dialer_get_session(dialer, "QmPeerOne", first_address, NULL, NULL);
+	if (session != first || dialer->connection_hits != 1)
+		goto exit;
+	libp2p_conn_dialer_release_session(dialer, session);
+	// by address
+	session = libp2p_conn_dialer_get_session(dialer, NULL, first_address, NULL, NULL);
+	if (session != first || dialer->connection_hits != 2)
+		goto exit;
+	libp2p_conn_dialer_release_session(dialer, session);
+	// streams and peer connections come from the same place
+	stream = libp2p_conn_dialer_get_stream(dialer, first_address, "multistream");
+	if (stream != first->default_stream || dialer->connection_hits != 3 || !libp2p_conn_dialer_release_stream(dialer, stream))
+		goto exit;
+	// a secured session is never the insecure one
+	memset(&rsa_key, 0, sizeof(rsa_key));
+	if (libp2p_conn_dialer_get_session(dialer, "QmPeerOne", NULL, &rsa_key, NULL) != NULL || dialer->connection_hits != 3)
+		goto exit;
+	peer = libp2p_peer_new_from_multiaddress(first_address);
+	if (peer == NULL || !libp2p_peer_connect(NULL, peer, NULL, 5, dialer))
+		goto exit;
+	if (peer->sessionContext != first || dialer->connection_hits != 4 || dialer->num_connections != 1)
+		goto exit;
+	// copies borrow it too, and the peers hand it back when they are freed
+	copy = libp2p_peer_copy(peer);
+	if (copy == NULL || copy->sessionContext != first || copy->dialer != dialer)
+		goto exit;
+	if (((struct DialerConnection*)dialer->connections->item)->borrowers != 3)
+		goto exit;
+	libp2p_peer_free(peer);
+	peer = NULL;
+	libp2p_peer_free(copy);
+	copy = NULL;
+	if (((struct DialerConnection*)dialer->connections->item)->borrowers != 1)
+		goto exit;
+	// a full pool does not close a session that is borrowed
+	dialer->max_connections = 1;
+	session = libp2p_conn_dialer_get_session(dialer, "QmPeerTwo", second_address, NULL, NULL);
+	if (session == NULL || session == first || dialer->num_connections != 2 || dialer->connection_misses != 3)
+		goto exit;
+	if (libp2p_conn_dialer_get_session(dialer, NULL, first_address, NULL, NULL) != first)
+		goto exit;
+	libp2p_conn_dialer_release_session(dialer, first);
+	libp2p_conn_dialer_release_session(dialer, first);
+	// a failed session is not handed out again, and is closed when the last borrower is done
+	if (!libp2p_conn_dialer_retain_session(dialer, session) || !libp2p_conn_dialer_close_session(dialer, session))
+		goto exit;
+	if (dialer->num_connections != 2 || libp2p_conn_dialer_get_session(dialer, "QmPeerTwo", NULL, NULL, NULL) != NULL)
+		goto exit;
+	if (libp2p_conn_dialer_retain_session(dialer, session))
+		goto exit;
+	libp2p_conn_dialer_release_session(dialer, session);
+	if (dialer->num_connections != 1)
+		goto exit;
+	// idle connections are closed
+	dialer->idle_timeout_secs = 0;
+	if (libp2p_conn_dialer_evict_idle(dialer) != 1 || dialer->num_connections != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (listener >= 0)
+		close(listener);
+	libp2p_peer_free(peer);
+	libp2p_peer_free(copy);
+	multiaddress_free(first_address);
+	multiaddress_free(second_address);
+	libp2p_conn_dialer_free(dialer);
+	libp2p_crypto_private_key_free(private_key);
+	if (child > 0) {
+		waitpid(child, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			retVal = 0;
+	}
+	return retVal;
+}
+
+/***
+ * A peer that can not be connected to is left as it was found
+ */
+int test_peer_connect_failure() {
+	int retVal = 0;
+	int listener = -1;
+	int closed_port = -1;
+	pid_t child = -1;
+	int status = 0;
+	char address_string[64];
+	struct sockaddr_in address;
+	socklen_t address_size = sizeof(address);
+	struct RsaPrivateKey* private_key = NULL;
+	struct Libp2pPeer* peer = NULL;
+
+	private_key = libp2p_crypto_rsa_rsa_private_key_new();
+	if (private_key == NULL || !libp2p_crypto_rsa_generate_keypair(private_key, 2048))
+		goto exit;
+	// a port no one listens on
+	closed_port = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (closed_port < 0 || bind(closed_port, (struct sockaddr*)&address, sizeof(address)) != 0
+			|| getsockname(closed_port, (struct sockaddr*)&address, &address_size) != 0)
+		goto exit;
+	peer = libp2p_peer_new();
+	sprintf(address_string, "/ip4/127.0.0.1/tcp/%d", ntohs(address.sin_port));
+	peer->addr_head = libp2p_utils_linked_list_new();
+	peer->addr_head->item = multiaddress_new_from_string(address_string);
+
+	// and one that speaks multistream, then hangs up before secio is done
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	address.sin_port = 0;
+	address_size = sizeof(address);
+	if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 1) != 0
+			|| getsockname(listener, (struct sockaddr*)&address, &address_size) != 0)
+		goto exit;
+	sprintf(address_string, "/ip4/127.0.0.1/tcp/%d", ntohs(address.sin_port));
+	peer->addr_head->next = libp2p_utils_linked_list_new();
+	peer->addr_head->next->item = multiaddress_new_from_string(address_string);
+	child = fork();
+	if (child < 0)
+		goto exit;
+	if (child == 0) {
+		char* protocol = "/multistream/1.0.0\n";
+		unsigned char buffer[1024];
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0)
+			_exit(1);
+		buffer[0] = strlen(protocol);
+		memcpy(&buffer[1], protocol, buffer[0]);
+		if (write(fd, buffer, buffer[0] + 1) != buffer[0] + 1)
+			_exit(2);
+		if (read(fd, buffer, sizeof(buffer)) <= 0)
+			_exit(3);
+		shutdown(fd, SHUT_WR);
+		while (read(fd, buffer, sizeof(buffer)) > 0)
+			;
+		_exit(0);
+	}
+	close(listener);
+	listener = -1;
+
+	// both addresses are tried, and neither works
+	if (libp2p_peer_connect(private_key, peer, NULL, 10, NULL))
+		goto exit;
+	if (peer->connection_type != CONNECTION_TYPE_NOT_CONNECTED || peer->sessionContext != NULL)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (listener >= 0)
+		close(listener);
+	if (closed_port >= 0)
+		close(closed_port);
+	libp2p_peer_free(peer);
+	if (private_key != NULL)
+		libp2p_crypto_rsa_rsa_private_key_free(private_key);
+	if (child > 0) {
+		waitpid(child, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			retVal = 0;
 	}
 	return retVal;
 }
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libp2p/db/datastore.h"
+
+/***
+ * A datastore that keeps a few keys in memory, and counts how often it is asked
+ */
+#define TEST_DATASTORE_MAX_KEYS 4096
+
+struct TestDatastore {
+	char* keys[TEST_DATASTORE_MAX_KEYS];
+	unsigned char* values[TEST_DATASTORE_MAX_KEYS];
+	size_t value_sizes[TEST_DATASTORE_MAX_KEYS];
+	int num_keys;
+	int cursor_position;
+	int gets;
+	int has_calls;
+};
+
+struct TestDatastore test_datastore_backend;
+
+int test_datastore_backend_find(const unsigned char* key, size_t key_size) {
+	for(int i = 0; i < test_datastore_backend.num_keys; i++) {
+		if (strlen(test_datastore_backend.keys[i]) == key_size && memcmp(test_datastore_backend.keys[i], key, key_size) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int test_datastore_backend_put(const unsigned char* key, size_t key_size, unsigned char* data, size_t data_length, const struct Datastore* datastore) {
+	int position = test_datastore_backend_find(key, key_size);
+	if (position < 0) {
+		if (test_datastore_backend.num_keys >= TEST_DATASTORE_MAX_KEYS)
+			return 0;
+		position = test_datastore_backend.num_keys++;
+		char* copy = malloc(key_size + 1);
+		memcpy(copy, key, key_size);
+		copy[key_size] = 0;
+		test_datastore_backend.keys[position] = copy;
+	} else {
+		free(test_datastore_backend.values[position]);
+	}
+	test_datastore_backend.values[position] = malloc(data_length);
+	memcpy(test_datastore_backend.values[position], data, data_length);
+	test_datastore_backend.value_sizes[position] = data_length;
+	return 1;
+}
+
+int test_datastore_backend_get(const char* key, size_t key_size, unsigned char* data, size_t max_data_length, size_t* data_length, const struct Datastore* datastore) {
+	test_datastore_backend.gets++;
+	int position = test_datastore_backend_find((unsigned char*)key, key_size);
+	if (position < 0 || test_datastore_backend.value_sizes[position] > max_data_length)
+		return 0;
+	memcpy(data, test_datastore_backend.values[position], test_datastore_backend.value_sizes[position]);
+	*data_length = test_datastore_backend.value_sizes[position];
+	return 1;
+}
+
+/***
+ * Forget everything the in memory backend holds
+ */
+void test_datastore_backend_clear() {
+	for(int i = 0; i < test_datastore_backend.num_keys; i++) {
+		free(test_datastore_backend.keys[i]);
+		free(test_datastore_backend.values[i]);
+	}
+	memset(&test_datastore_backend, 0, sizeof(struct TestDatastore));
+}
+
+int test_datastore_backend_has(const unsigned char* key, size_t key_size, const struct Datastore* datastore) {
+	test_datastore_backend.has_calls++;
+	return test_datastore_backend_find(key, key_size) >= 0;
+}
+
+int test_datastore_backend_cursor_open(struct Datastore* datastore) {
+	test_datastore_backend.cursor_position = 0;
+	return 1;
+}
+
+int test_datastore_backend_cursor_close(struct Datastore* datastore) {
+	return 1;
+}
+
+int test_datastore_backend_cursor_get(unsigned char** key, int* key_length, unsigned char** value, int* value_length, enum DatastoreCursorOp op, struct Datastore* datastore) {
+	if (op == CURSOR_FIRST)
+		test_datastore_backend.cursor_position = 0;
+	if (test_datastore_backend.cursor_position >= test_datastore_backend.num_keys)
+		return 0;
+	int position = test_datastore_backend.cursor_position++;
+	char* current = test_datastore_backend.keys[position];
+	*key_length = strlen(current);
+	*key = malloc(*key_length);
+	memcpy(*key, current, *key_length);
+	*value_length = test_datastore_backend.value_sizes[position];
+	*value = malloc(*value_length);
+	memcpy(*value, test_datastore_backend.values[position], *value_length);
+	return 1;
+}
+
+int test_datastore_backend_open(int argc, char** argv, struct Datastore* datastore) {
+	return 1;
+}
+
+/***
+ * Build a datastore on top of the in memory backend
+ * @param with_has true(1) to give it a datastore_has
+ * @returns the datastore
+ */
+struct Datastore* test_datastore_new(int with_has) {
+	struct Datastore* datastore = NULL;
+	test_datastore_backend_clear();
+	if (!libp2p_datastore_new(&datastore))
+		return NULL;
+	datastore->datastore_open = test_datastore_backend_open;
+	datastore->datastore_put = test_datastore_backend_put;
+	datastore->datastore_get = test_datastore_backend_get;
+	datastore->datastore_cursor_open = test_datastore_backend_cursor_open;
+	datastore->datastore_cursor_close = test_datastore_backend_cursor_close;
+	datastore->datastore_cursor_get = test_datastore_backend_cursor_get;
+	if (with_has)
+		datastore->datastore_has = test_datastore_backend_has;
+	return datastore;
+}
+
+/***
+ * Presence checks use datastore_has, and the bloom filter keeps
+ * most misses from reaching the backend
+ */
+int test_datastore_has() {
+	int retVal = 0;
+	struct Datastore* datastore = NULL;
+	char* stored[] = { "QmKeyOne", "QmKeyTwo", "QmKeyThree" };
+	char missing[16];
+
+	// without datastore_has, the value is retrieved
+	datastore = test_datastore_new(0);
+	if (datastore == NULL)
+		goto exit;
+	if (!libp2p_datastore_put(datastore, (unsigned char*)stored[0], strlen(stored[0]), (unsigned char*)"x", 1))
+		goto exit;
+	if (!libp2p_datastore_has(datastore, (unsigned char*)stored[0], strlen(stored[0])) || test_datastore_backend.gets != 1)
+		goto exit;
+	libp2p_datastore_free(datastore);
+
+	// with it, nothing is retrieved
+	datastore = test_datastore_new(1);
+	if (datastore == NULL)
+		goto exit;
+	for(int i = 0; i < 3; i++)
+		libp2p_datastore_put(datastore, (unsigned char*)stored[i], strlen(stored[i]), (unsigned char*)"x", 1);
+	if (!libp2p_datastore_has(datastore, (unsigned char*)stored[1], strlen(stored[1])))
+		goto exit;
+	if (libp2p_datastore_has(datastore, (unsigned char*)"QmNotHere", 9))
+		goto exit;
+	if (test_datastore_backend.gets != 0 || test_datastore_backend.has_calls != 2)
+		goto exit;
+
+	// with a bloom filter built from what is stored, misses stay out of the backend
+	datastore->bloom_filter_size = 4096;
+	if (!libp2p_datastore_bloom_filter_build(datastore) || datastore->bloom_filter == NULL)
+		goto exit;
+	if (datastore->bloom_filter->num_keys != 3)
+		goto exit;
+	test_datastore_backend.has_calls = 0;
+	for(int i = 0; i < 100; i++) {
+		sprintf(missing, "QmMissing%d", i);
+		if (libp2p_datastore_has(datastore, (unsigned char*)missing, strlen(missing)))
+			goto exit;
+	}
+	if (test_datastore_backend.has_calls > 5)
+		goto exit;
+	for(int i = 0; i < 3; i++) {
+		if (!libp2p_datastore_has(datastore, (unsigned char*)stored[i], strlen(stored[i])))
+			goto exit;
+	}
+	// a put keeps the filter current
+	if (!libp2p_datastore_put(datastore, (unsigned char*)"QmKeyFour", 9, (unsigned char*)"x", 1))
+		goto exit;
+	if (!libp2p_datastore_has(datastore, (unsigned char*)"QmKeyFour", 9))
+		goto exit;
+
+	retVal = 1;
+	exit:
+	libp2p_datastore_free(datastore);
+	test_datastore_backend_clear();
+	return retVal;
+}
+
+/***
+ * The bloom filter is built when the datastore is opened, kept current by
+ * datastore_put, and answers datastore_get for most keys that are not there
+ */
+int test_datastore_bloom_filter() {
+	int retVal = 0;
+	struct Datastore* datastore = NULL;
+	unsigned char data[16];
+	size_t data_size = 0;
+	char key[16];
+
+	// a session without a datastore has no filter to ask
+	if (!libp2p_datastore_may_have(NULL, (unsigned char*)"QmStored0", 9))
+		goto exit;
+
+	datastore = test_datastore_new(0);
+	if (datastore == NULL)
+		goto exit;
+	// already on disk before the node starts
+	for(int i = 0; i < 10; i++) {
+		sprintf(key, "QmStored%d", i);
+		test_datastore_backend_put((unsigned char*)key, strlen(key), (unsigned char*)"x", 1, datastore);
+	}
+	datastore->bloom_filter_size = 1024;
+	if (!libp2p_datastore_open(datastore, 0, NULL) || datastore->bloom_filter == NULL)
+		goto exit;
+	if (datastore->bloom_filter->num_keys != 10)
+		goto exit;
+
+	// stored keys are found through the filter
+	for(int i = 0; i < 10; i++) {
+		sprintf(key, "QmStored%d", i);
+		if (!datastore->datastore_get(key, strlen(key), data, 16, &data_size, datastore))
+			goto exit;
+	}
+	if (test_datastore_backend.gets != 10)
+		goto exit;
+	// most others never reach the backend
+	for(int i = 0; i < 1000; i++) {
+		sprintf(key, "QmMissing%d", i);
+		if (datastore->datastore_get(key, strlen(key), data, 16, &data_size, datastore))
+			goto exit;
+	}
+	if (test_datastore_backend.gets - 10 != datastore->bloom_filter_false_positives)
+		goto exit;
+	if (datastore->bloom_filter_lookups != 1010 || datastore->bloom_filter_negatives + datastore->bloom_filter_false_positives != 1000)
+		goto exit;
+	if (libp2p_datastore_bloom_filter_false_positive_rate(datastore) > 0.01)
+		goto exit;
+	if (libp2p_utils_bloom_filter_false_positive_rate(datastore->bloom_filter) > 0.01)
+		goto exit;
+
+	// a put straight through the function pointer keeps the filter current
+	if (!datastore->datastore_put((unsigned char*)"QmNew", 5, (unsigned char*)"x", 1, datastore))
+		goto exit;
+	if (!datastore->datastore_get("QmNew", 5, data, 16, &data_size, datastore))
+		goto exit;
+
+	retVal = 1;
+	exit:
+	libp2p_datastore_free(datastore);
+	test_datastore_backend_clear();
+	return retVal;
+}
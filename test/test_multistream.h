@@ -1,10 +1,14 @@
 #include <stdlib.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
 #include "libp2p/net/multistream.h"
+#include "libp2p/net/p2pnet.h"
+#include "libp2p/net/event_loop.h"
+#include "libp2p/net/protocol.h"
 
 int test_multistream_connect() {
 	int retVal = 0;
@@ -71,3 +75,533 @@ int test_multistream_get_list() {
 
 	return retVal > 0;
 }
+
+/***
+ * A raw multistream write should put the varint and the data on the wire together
+ */
+int test_multistream_write_framed() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	char* message = "/multistream/1.0.0\n";
+	size_t message_size = strlen(message);
+	unsigned char received[100];
+	struct Stream stream;
+	struct SessionContext session;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+
+	memset(&stream, 0, sizeof(struct Stream));
+	stream.socket_descriptor = &fds[0];
+	memset(&session, 0, sizeof(struct SessionContext));
+	session.insecure_stream = &stream;
+	session.default_stream = &stream;
+
+	if (libp2p_net_multistream_write(&session, (unsigned char*)message, message_size) != message_size + 1) {
+		fprintf(stderr, "multistream_write did not report the varint and the data\n");
+		goto exit;
+	}
+
+	// everything should be available in one read
+	ssize_t bytes_read = recv(fds[1], received, sizeof(received), 0);
+	if (bytes_read != message_size + 1) {
+		fprintf(stderr, "Expected %lu bytes but read %ld\n", message_size + 1, bytes_read);
+		goto exit;
+	}
+	if (received[0] != message_size || memcmp(&received[1], message, message_size) != 0) {
+		fprintf(stderr, "Frame contents did not match\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	return retVal;
+}
+
+/***
+ * When data is already waiting, a read should cost one system call
+ */
+int test_socket_read_syscalls() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	char buffer[10];
+	struct SocketStatistics stats;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	if (send(fds[0], "0123456789", 10, 0) != 10)
+		goto exit;
+
+	socket_statistics_reset();
+	for(int i = 0; i < 10; i++) {
+		if (socket_read(fds[1], &buffer[i], 1, 0, 5) != 1)
+			goto exit;
+	}
+	socket_statistics_get(&stats);
+	fprintf(stdout, "socket_read: %lu reads took %lu system calls\n", stats.reads, stats.read_syscalls);
+	if (stats.reads != 10 || stats.read_syscalls != 10)
+		goto exit;
+
+	// nothing waiting, so this should time out
+	if (socket_read(fds[1], buffer, 1, 0, 1) >= 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	return retVal;
+}
+
+/***
+ * Several small messages that arrive together should be read with one system call
+ */
+int test_multistream_read_buffered() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	unsigned char wire[] = { 3, 'o', 'n', 'e', 3, 't', 'w', 'o', 5, 't', 'h', 'r', 'e', 'e' };
+	char* expected[] = { "one", "two", "three" };
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+	struct Stream stream;
+	struct SessionContext session;
+	struct SocketStatistics stats;
+
+	memset(&stream, 0, sizeof(struct Stream));
+	stream.read_buffer = libp2p_utils_ring_buffer_new(1024);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	stream.socket_descriptor = &fds[1];
+	memset(&session, 0, sizeof(struct SessionContext));
+	session.insecure_stream = &stream;
+	session.default_stream = &stream;
+
+	if (send(fds[0], wire, sizeof(wire), 0) != sizeof(wire))
+		goto exit;
+
+	socket_statistics_reset();
+	for(int i = 0; i < 3; i++) {
+		if (libp2p_net_multistream_read(&session, &results, &results_size, 5) != strlen(expected[i]))
+			goto exit;
+		if (memcmp(results, expected[i], results_size) != 0)
+			goto exit;
+		free(results);
+		results = NULL;
+	}
+	// nothing else is there
+	if (libp2p_net_multistream_next_message(&stream, &results, &results_size) != 0)
+		goto exit;
+	socket_statistics_get(&stats);
+	if (stats.read_syscalls != 1) {
+		fprintf(stderr, "Reading 3 messages took %lu system calls\n", stats.read_syscalls);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	libp2p_utils_ring_buffer_free(stream.read_buffer);
+	return retVal;
+}
+
+/***
+ * Sizes the other side can not mean are refused before anything is allocated,
+ * with or without a read buffer
+ */
+int test_multistream_read_bad_size() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	unsigned char empty[] = { 0 };
+	// 2^64 - 1
+	unsigned char huge[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 };
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+	struct RingBuffer* read_buffer = libp2p_utils_ring_buffer_new(1024);
+	struct Stream stream;
+	struct SessionContext session;
+
+	memset(&stream, 0, sizeof(struct Stream));
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	stream.socket_descriptor = &fds[1];
+	memset(&session, 0, sizeof(struct SessionContext));
+	session.insecure_stream = &stream;
+	session.default_stream = &stream;
+
+	stream.read_buffer = read_buffer;
+	if (send(fds[0], huge, sizeof(huge), 0) != sizeof(huge))
+		goto exit;
+	if (libp2p_utils_ring_buffer_size(read_buffer) != 0 || socket_fill_buffer(fds[1], read_buffer, 0, 5) != sizeof(huge))
+		goto exit;
+	if (libp2p_net_multistream_next_message(&stream, &results, &results_size) != -1)
+		goto exit;
+	if (libp2p_net_multistream_read(&session, &results, &results_size, 5) != 0 || results != NULL)
+		goto exit;
+	// drop the bad prefix
+	libp2p_utils_ring_buffer_read(read_buffer, huge, sizeof(huge));
+	if (send(fds[0], empty, sizeof(empty), 0) != sizeof(empty))
+		goto exit;
+	if (libp2p_net_multistream_read(&session, &results, &results_size, 5) != 0 || results != NULL)
+		goto exit;
+
+	// a byte at a time
+	stream.read_buffer = NULL;
+	if (send(fds[0], huge, sizeof(huge), 0) != sizeof(huge))
+		goto exit;
+	if (libp2p_net_multistream_read(&session, &results, &results_size, 5) != 0 || results != NULL)
+		goto exit;
+	if (send(fds[0], empty, sizeof(empty), 0) != sizeof(empty))
+		goto exit;
+	if (libp2p_net_multistream_read(&session, &results, &results_size, 5) != 0 || results != NULL)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	libp2p_utils_ring_buffer_free(read_buffer);
+	return retVal;
+}
+
+/***
+ * The context of the protocol handler used by test_multistream_event_loop
+ */
+struct TestEventLoopContext {
+	struct Libp2pEventLoop* loop;
+	int messages;
+};
+
+int test_event_loop_can_handle(const uint8_t* incoming, size_t incoming_size) {
+	return 1;
+}
+
+/***
+ * Echo everything back, until "bye" arrives
+ */
+int test_event_loop_handle_message(const uint8_t* incoming, size_t incoming_size, struct SessionContext* session_context, void* protocol_context) {
+	struct TestEventLoopContext* context = (struct TestEventLoopContext*)protocol_context;
+	if (incoming_size == 3 && memcmp(incoming, "bye", 3) == 0)
+		return 0;
+	context->messages++;
+	if (!libp2p_net_event_loop_queue_write(context->loop, session_context, incoming, incoming_size))
+		return -1;
+	return 1;
+}
+
+int test_event_loop_shutdown(void* protocol_context) {
+	return 1;
+}
+
+/***
+ * Messages that arrive together are dispatched one at a time to the handler, replies
+ * go out through the loop, and the connection is dropped when the handler is done with it
+ */
+int test_multistream_event_loop() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	unsigned char wire[] = { 3, 'o', 'n', 'e', 3, 't', 'w', 'o', 5, 't', 'h', 'r', 'e', 'e' };
+	unsigned char bye[] = { 3, 'b', 'y', 'e' };
+	unsigned char echo[sizeof(wire)];
+	size_t echo_size = 0;
+	struct Libp2pVector* handlers = NULL;
+	struct Libp2pEventLoop* loop = NULL;
+	struct SessionContext* session = NULL;
+	struct TestEventLoopContext context;
+	struct Libp2pProtocolHandler handler;
+
+	context.messages = 0;
+	handler.context = &context;
+	handler.CanHandle = test_event_loop_can_handle;
+	handler.HandleMessage = test_event_loop_handle_message;
+	handler.Shutdown = test_event_loop_shutdown;
+	handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(handlers, &handler);
+	loop = libp2p_net_event_loop_new(handlers);
+	if (loop == NULL)
+		goto exit;
+	context.loop = loop;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	session = libp2p_session_context_new();
+	session->insecure_stream = libp2p_net_multistream_stream_new(fds[1], "127.0.0.1", 4001);
+	session->default_stream = session->insecure_stream;
+	fds[1] = -1;
+	if (!libp2p_net_event_loop_add_session(loop, session))
+		goto exit;
+	// the loop owns it now
+	session = NULL;
+
+	if (send(fds[0], wire, sizeof(wire), 0) != sizeof(wire))
+		goto exit;
+	for(int i = 0; i < 10 && context.messages < 3; i++)
+		libp2p_net_event_loop_run_once(loop, 1000);
+	if (context.messages != 3) {
+		fprintf(stderr, "Expected 3 messages, but %d were dispatched\n", context.messages);
+		goto exit;
+	}
+	// the replies are framed the same way
+	while (echo_size < sizeof(echo)) {
+		ssize_t bytes = socket_read(fds[0], (char*)&echo[echo_size], sizeof(echo) - echo_size, 0, 5);
+		if (bytes <= 0)
+			goto exit;
+		echo_size += bytes;
+	}
+	if (memcmp(echo, wire, sizeof(wire)) != 0)
+		goto exit;
+
+	// the handler is done with the connection after this
+	if (send(fds[0], bye, sizeof(bye), 0) != sizeof(bye))
+		goto exit;
+	for(int i = 0; i < 10 && loop->num_connections > 0; i++)
+		libp2p_net_event_loop_run_once(loop, 1000);
+	if (loop->num_connections != 0)
+		goto exit;
+	// and the other side sees it closed
+	if (socket_read(fds[0], (char*)echo, 1, 0, 5) != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (session != NULL)
+		libp2p_session_context_free(session);
+	libp2p_net_event_loop_free(loop);
+	if (handlers != NULL)
+		libp2p_utils_vector_free(handlers);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	return retVal;
+}
+
+/***
+ * A message too big for the read buffer is gathered as it arrives, without the
+ * loop waiting for the rest of it. One that is too big to gather closes the connection.
+ */
+int test_multistream_event_loop_large() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	size_t big_size = 200000;
+	unsigned char* wire = NULL;
+	size_t wire_size = 0;
+	unsigned char huge[] = { 0x80, 0x80, 0x80, 0x80, 0x04, 'x' }; // 1 GB
+	struct timeval start, end;
+	struct Libp2pVector* handlers = NULL;
+	struct Libp2pEventLoop* loop = NULL;
+	struct SessionContext* session = NULL;
+	struct TestEventLoopContext context;
+	struct Libp2pProtocolHandler handler;
+
+	context.messages = 0;
+	handler.context = &context;
+	handler.CanHandle = test_event_loop_can_handle;
+	handler.HandleMessage = test_event_loop_handle_message;
+	handler.Shutdown = test_event_loop_shutdown;
+	handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(handlers, &handler);
+	loop = libp2p_net_event_loop_new(handlers);
+	if (loop == NULL)
+		goto exit;
+	context.loop = loop;
+
+	wire = malloc(big_size + 10);
+	for(size_t n = big_size; n > 0; n >>= 7)
+		wire[wire_size++] = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+	for(size_t i = 0; i < big_size; i++)
+		wire[wire_size++] = i % 251;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	session = libp2p_session_context_new();
+	session->insecure_stream = libp2p_net_multistream_stream_new(fds[1], "127.0.0.1", 4001);
+	session->default_stream = session->insecure_stream;
+	fds[1] = -1;
+	if (!libp2p_net_event_loop_add_session(loop, session))
+		goto exit;
+	// the loop owns it now
+	session = NULL;
+
+	// half of it, and the loop does not wait for the rest
+	if (send(fds[0], wire, wire_size / 2, 0) != wire_size / 2)
+		goto exit;
+	gettimeofday(&start, NULL);
+	for(int i = 0; i < 10; i++)
+		libp2p_net_event_loop_run_once(loop, 0);
+	gettimeofday(&end, NULL);
+	if (end.tv_sec - start.tv_sec > 1 || context.messages != 0 || loop->num_connections != 1)
+		goto exit;
+
+	if (send(fds[0], &wire[wire_size / 2], wire_size - wire_size / 2, 0) != wire_size - wire_size / 2)
+		goto exit;
+	for(int i = 0; i < 20 && context.messages < 1; i++)
+		libp2p_net_event_loop_run_once(loop, 1000);
+	if (context.messages != 1)
+		goto exit;
+
+	// nothing is set aside for this one
+	if (send(fds[0], huge, sizeof(huge), 0) != sizeof(huge))
+		goto exit;
+	for(int i = 0; i < 10 && loop->num_connections > 0; i++)
+		libp2p_net_event_loop_run_once(loop, 1000);
+	if (loop->num_connections != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (session != NULL)
+		libp2p_session_context_free(session);
+	libp2p_net_event_loop_free(loop);
+	if (handlers != NULL)
+		libp2p_utils_vector_free(handlers);
+	if (wire != NULL)
+		free(wire);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	return retVal;
+}
+
+/***
+ * Collects what the asynchronous calls in test_multistream_async hand back
+ */
+struct TestAsyncResults {
+	int writes;
+	int reads;
+	int failures;
+	char replies[3][10];
+};
+
+void test_async_write_done(void* stream_context, int status, void* user_data) {
+	struct TestAsyncResults* results = (struct TestAsyncResults*)user_data;
+	if (status)
+		results->writes++;
+	else
+		results->failures++;
+}
+
+void test_async_read_done(void* stream_context, unsigned char* buffer, size_t buffer_size, int status, void* user_data) {
+	struct TestAsyncResults* results = (struct TestAsyncResults*)user_data;
+	if (!status) {
+		results->failures++;
+		return;
+	}
+	if (results->reads < 3 && buffer_size < 10) {
+		memcpy(results->replies[results->reads], buffer, buffer_size);
+		results->replies[results->reads][buffer_size] = 0;
+	}
+	results->reads++;
+	free(buffer);
+}
+
+/***
+ * Several requests go out before any reply comes back, and the replies are matched
+ * to the reads in order. Reads still outstanding fail when the session closes.
+ */
+int test_multistream_async() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	char* requests[] = { "one", "two", "three" };
+	struct Libp2pVector* handlers = NULL;
+	struct Libp2pEventLoop* loop = NULL;
+	struct SessionContext* server = NULL;
+	struct SessionContext* client = NULL;
+	struct TestEventLoopContext context;
+	struct TestAsyncResults results;
+	struct Libp2pProtocolHandler handler;
+	struct Stream idle_stream;
+	struct SessionContext idle_session;
+
+	memset(&results, 0, sizeof(struct TestAsyncResults));
+	context.messages = 0;
+	handler.context = &context;
+	handler.CanHandle = test_event_loop_can_handle;
+	handler.HandleMessage = test_event_loop_handle_message;
+	handler.Shutdown = test_event_loop_shutdown;
+	handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(handlers, &handler);
+	loop = libp2p_net_event_loop_new(handlers);
+	if (loop == NULL)
+		goto exit;
+	context.loop = loop;
+
+	// both ends are in the loop. The server echoes, the client uses the asynchronous calls
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	server = libp2p_session_context_new();
+	server->insecure_stream = libp2p_net_multistream_stream_new(fds[1], "127.0.0.1", 4001);
+	server->default_stream = server->insecure_stream;
+	client = libp2p_session_context_new();
+	client->insecure_stream = libp2p_net_multistream_stream_new(fds[0], "127.0.0.1", 4002);
+	client->default_stream = client->insecure_stream;
+	fds[0] = fds[1] = -1;
+	if (!libp2p_net_event_loop_add_session(loop, server))
+		goto exit;
+	server = NULL;
+	if (!libp2p_net_event_loop_add_session(loop, client)) {
+		libp2p_session_context_free(client);
+		goto exit;
+	}
+
+	// not in a loop, so not available
+	memset(&idle_stream, 0, sizeof(struct Stream));
+	memset(&idle_session, 0, sizeof(struct SessionContext));
+	idle_session.insecure_stream = &idle_stream;
+	if (libp2p_net_multistream_read_async(&idle_session, test_async_read_done, &results))
+		goto exit;
+
+	for(int i = 0; i < 3; i++) {
+		if (!client->default_stream->write_async(client, (unsigned char*)requests[i], strlen(requests[i]), test_async_write_done, &results))
+			goto exit;
+		if (!client->default_stream->read_async(client, test_async_read_done, &results))
+			goto exit;
+	}
+	for(int i = 0; i < 20 && results.reads < 3; i++)
+		libp2p_net_event_loop_run_once(loop, 1000);
+	if (results.writes != 3 || results.reads != 3 || results.failures != 0) {
+		fprintf(stderr, "Expected 3 writes and 3 reads, but had %d writes, %d reads and %d failures\n", results.writes, results.reads, results.failures);
+		goto exit;
+	}
+	for(int i = 0; i < 3; i++) {
+		if (strcmp(results.replies[i], requests[i]) != 0)
+			goto exit;
+	}
+
+	// this one never gets an answer
+	if (!client->default_stream->read_async(client, test_async_read_done, &results))
+		goto exit;
+	client = NULL;
+	libp2p_net_event_loop_free(loop);
+	loop = NULL;
+	if (results.failures != 1)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	libp2p_net_event_loop_free(loop);
+	if (server != NULL)
+		libp2p_session_context_free(server);
+	if (handlers != NULL)
+		libp2p_utils_vector_free(handlers);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	return retVal;
+}
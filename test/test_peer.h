@@ -1,8 +1,13 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
 #include "libp2p/peer/peer.h"
 #include "libp2p/peer/peerstore.h"
+#include "libp2p/peer/providerstore.h"
+#include "libp2p/crypto/sha256.h"
 
 /***
  * Includes Libp2pPeer, PeerEntry, Peerstore
@@ -116,3 +121,298 @@ int test_peer_protobuf() {
 		free(protobuf);
 	return retVal;
 }
+
+/***
+ * Build a peer id from a number. The ids are the size of a sha256 multihash.
+ * @param number the number
+ * @param peer_id where to put the id (34 bytes)
+ */
+void test_peerstore_make_id(unsigned long number, char* peer_id) {
+	memset(peer_id, 0, 34);
+	peer_id[0] = 0x12;
+	peer_id[1] = 0x20;
+	memcpy(&peer_id[2], &number, sizeof(number));
+}
+
+/***
+ * Lookups in peerstores of the given sizes, compared to walking the list
+ * @param sizes the number of peers in each peerstore
+ * @param num_sizes the number of sizes
+ * @returns true(1) if every peer was found, false(0) otherwise
+ */
+int test_peerstore_lookup_sizes(const unsigned long* sizes, int num_sizes) {
+	int retVal = 0;
+	int num_lookups = 100000;
+	int num_scans = 100;
+	char peer_id[34];
+	struct timeval start, end;
+	struct Peerstore* peerstore = NULL;
+	struct Libp2pPeer* peer = libp2p_peer_new();
+	peer->id = peer_id;
+	peer->id_size = 34;
+
+	for(int j = 0; j < num_sizes; j++) {
+		unsigned long size = sizes[j];
+		test_peerstore_make_id(0, peer_id);
+		peerstore = libp2p_peerstore_new(peer);
+		if (peerstore == NULL)
+			goto exit;
+		gettimeofday(&start, NULL);
+		for(unsigned long i = 1; i < size; i++) {
+			test_peerstore_make_id(i, peer_id);
+			if (!libp2p_peerstore_add_peer(peerstore, peer))
+				goto exit;
+		}
+		gettimeofday(&end, NULL);
+		double add_usecs = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
+
+		// the local peer stays first
+		struct Libp2pPeer* local = libp2p_peerstore_get_local_peer(peerstore);
+		test_peerstore_make_id(0, peer_id);
+		if (local == NULL || memcmp(local->id, peer_id, 34) != 0)
+			goto exit;
+
+		gettimeofday(&start, NULL);
+		for(int i = 0; i < num_lookups; i++) {
+			unsigned long wanted = ((unsigned long)i * 7919) % size;
+			test_peerstore_make_id(wanted, peer_id);
+			struct Libp2pPeer* found = libp2p_peerstore_get_peer(peerstore, (unsigned char*)peer_id, 34);
+			if (found == NULL || memcmp(found->id, peer_id, 34) != 0) {
+				fprintf(stderr, "Peer %lu was not found\n", wanted);
+				goto exit;
+			}
+		}
+		gettimeofday(&end, NULL);
+		double indexed_ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_usec - start.tv_usec) * 1e3) / num_lookups;
+		// an id that is not there
+		test_peerstore_make_id(size, peer_id);
+		if (libp2p_peerstore_get_peer(peerstore, (unsigned char*)peer_id, 34) != NULL)
+			goto exit;
+
+		// the old way: walk the list
+		gettimeofday(&start, NULL);
+		for(int i = 0; i < num_scans; i++) {
+			unsigned long wanted = ((unsigned long)i * 7919) % size;
+			test_peerstore_make_id(wanted, peer_id);
+			struct Libp2pLinkedList* current = peerstore->head_entry;
+			while (current != NULL) {
+				struct Libp2pPeer* current_peer = ((struct PeerEntry*)current->item)->peer;
+				if (current_peer->id_size == 34 && memcmp(current_peer->id, peer_id, 34) == 0)
+					break;
+				current = current->next;
+			}
+			if (current == NULL)
+				goto exit;
+		}
+		gettimeofday(&end, NULL);
+		double scan_ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_usec - start.tv_usec) * 1e3) / num_scans;
+
+		fprintf(stdout, "peerstore of %lu peers: add %.0f ns, lookup %.0f ns, list walk %.0f ns\n",
+				size, add_usecs * 1e3 / size, indexed_ns, scan_ns);
+		libp2p_peerstore_free(peerstore);
+		peerstore = NULL;
+	}
+
+	retVal = 1;
+	exit:
+	if (peerstore != NULL)
+		libp2p_peerstore_free(peerstore);
+	// the id is on the stack
+	peer->id = NULL;
+	libp2p_peer_free(peer);
+	return retVal;
+}
+
+/***
+ * Lookups in a peerstore of 10k peers, compared to walking the list
+ */
+int test_peerstore_lookup_speed() {
+	unsigned long sizes[] = { 10000 };
+	return test_peerstore_lookup_sizes(sizes, 1);
+}
+
+/***
+ * Lookups in peerstores of 10k, 100k and 1M peers. Only run when asked for by name.
+ */
+int benchmark_peerstore_lookup_speed() {
+	unsigned long sizes[] = { 10000, 100000, 1000000 };
+	return test_peerstore_lookup_sizes(sizes, 3);
+}
+
+/***
+ * A datastore that has nothing in it
+ */
+int test_providerstore_datastore_get(const char* key, size_t key_size, unsigned char* data, size_t max_data_length, size_t* data_length, const struct Datastore* datastore) {
+	return 0;
+}
+
+/***
+ * Free the results of libp2p_providerstore_get_providers
+ */
+void test_providerstore_results_free(struct Libp2pVector* results) {
+	if (results != NULL) {
+		for(int i = 0; i < results->total; i++)
+			libp2p_providerstore_entry_free((struct ProviderEntry*)libp2p_utils_vector_get(results, i));
+		libp2p_utils_vector_free(results);
+	}
+}
+
+/***
+ * Providers are kept once per peer, capped per key, and expire
+ */
+int test_providerstore() {
+	int retVal = 0;
+	struct Datastore datastore;
+	struct ProviderStore* store = NULL;
+	struct Libp2pVector* results = NULL;
+	unsigned char* peer_id = NULL;
+	int peer_id_size = 0;
+	char hash[34];
+	char other_hash[34];
+	char peer[34];
+
+	memset(&datastore, 0, sizeof(struct Datastore));
+	datastore.datastore_get = test_providerstore_datastore_get;
+	store = libp2p_providerstore_new(&datastore, NULL);
+	if (store == NULL)
+		goto exit;
+	store->max_per_key = 10;
+	test_peerstore_make_id(1, hash);
+	test_peerstore_make_id(2, other_hash);
+
+	// the same announcement twice is kept once
+	test_peerstore_make_id(100, peer);
+	if (!libp2p_providerstore_add(store, (unsigned char*)hash, 34, (unsigned char*)peer, 34))
+		goto exit;
+	if (!libp2p_providerstore_add(store, (unsigned char*)hash, 34, (unsigned char*)peer, 34))
+		goto exit;
+	if (store->num_keys != 1 || store->num_entries != 1)
+		goto exit;
+
+	// more than the cap drops the oldest
+	for(int i = 101; i < 115; i++) {
+		test_peerstore_make_id(i, peer);
+		if (!libp2p_providerstore_add(store, (unsigned char*)hash, 34, (unsigned char*)peer, 34))
+			goto exit;
+	}
+	if (store->num_entries != 10)
+		goto exit;
+	if (libp2p_providerstore_get_providers(store, (unsigned char*)hash, 34, 4, &results) != 4)
+		goto exit;
+	// most recent first
+	test_peerstore_make_id(114, peer);
+	if (memcmp(((struct ProviderEntry*)libp2p_utils_vector_get(results, 0))->peer_id, peer, 34) != 0)
+		goto exit;
+	test_providerstore_results_free(results);
+	results = NULL;
+	if (libp2p_providerstore_get_providers(store, (unsigned char*)hash, 34, 20, &results) != 10)
+		goto exit;
+	test_providerstore_results_free(results);
+	results = NULL;
+	if (!libp2p_providerstore_get(store, (unsigned char*)hash, 34, &peer_id, &peer_id_size))
+		goto exit;
+	if (peer_id_size != 34 || memcmp(peer_id, peer, 34) != 0)
+		goto exit;
+	if (libp2p_providerstore_get_providers(store, (unsigned char*)other_hash, 34, 20, &results) != 0)
+		goto exit;
+	test_providerstore_results_free(results);
+	results = NULL;
+
+	// many keys
+	for(int i = 1000; i < 2000; i++) {
+		test_peerstore_make_id(i, other_hash);
+		if (!libp2p_providerstore_add(store, (unsigned char*)other_hash, 34, (unsigned char*)peer, 34))
+			goto exit;
+	}
+	if (store->num_keys != 1001 || store->num_entries != 1010)
+		goto exit;
+	if (libp2p_providerstore_get_providers(store, (unsigned char*)other_hash, 34, 20, &results) != 1)
+		goto exit;
+	test_providerstore_results_free(results);
+	results = NULL;
+
+	// everything is too old now, and goes a few buckets at a time
+	store->ttl_secs = 0;
+	if (libp2p_providerstore_get_providers(store, (unsigned char*)hash, 34, 20, &results) != 0)
+		goto exit;
+	size_t passes = 0;
+	while (store->num_keys > 0 && passes < store->num_buckets) {
+		libp2p_providerstore_expire(store, 4);
+		passes++;
+	}
+	if (store->num_keys != 0 || store->num_entries != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	test_providerstore_results_free(results);
+	if (peer_id != NULL)
+		free(peer_id);
+	libp2p_providerstore_free(store);
+	return retVal;
+}
+
+/***
+ * The closest peers from the index match the closest found by looking at every peer
+ */
+int test_peerstore_closest_peers() {
+	int retVal = 0;
+	int num_peers = 1000;
+	char peer_id[34];
+	char key[34];
+	unsigned char target[32];
+	unsigned char distance[32];
+	unsigned char worst[32];
+	struct Libp2pPeer* closest[20];
+	struct Peerstore* peerstore = NULL;
+	struct Libp2pPeer* peer = libp2p_peer_new();
+	peer->id = peer_id;
+	peer->id_size = 34;
+
+	test_peerstore_make_id(0, peer_id);
+	peerstore = libp2p_peerstore_new(peer);
+	for(int i = 1; i < num_peers; i++) {
+		test_peerstore_make_id(i, peer_id);
+		if (!libp2p_peerstore_add_peer(peerstore, peer))
+			goto exit;
+	}
+
+	for(int k = 0; k < 10; k++) {
+		test_peerstore_make_id(5000 + k, key);
+		if (libp2p_peerstore_get_closest_peers(peerstore, (unsigned char*)key, 34, closest, 20) != 20)
+			goto exit;
+		libp2p_crypto_hashing_sha256((unsigned char*)key, 34, target);
+		// each is no further than the one after it
+		for(int i = 0; i < 20; i++) {
+			struct PeerEntry* entry = libp2p_peerstore_get_peer_entry(peerstore, (unsigned char*)closest[i]->id, closest[i]->id_size);
+			for(int j = 0; j < 32; j++)
+				distance[j] = entry->kademlia_id[j] ^ target[j];
+			if (i > 0 && memcmp(worst, distance, 32) > 0)
+				goto exit;
+			memcpy(worst, distance, 32);
+		}
+		// and no peer that was left out is closer than the furthest one returned
+		int closer = 0;
+		struct Libp2pLinkedList* current = peerstore->head_entry;
+		while (current != NULL) {
+			struct PeerEntry* entry = (struct PeerEntry*)current->item;
+			for(int j = 0; j < 32; j++)
+				distance[j] = entry->kademlia_id[j] ^ target[j];
+			if (memcmp(distance, worst, 32) < 0)
+				closer++;
+			current = current->next;
+		}
+		if (closer != 19)
+			goto exit;
+	}
+	// fewer peers than asked for
+	if (libp2p_peerstore_get_closest_peers(peerstore, (unsigned char*)key, 34, closest, 0) != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	libp2p_peerstore_free(peerstore);
+	peer->id = NULL;
+	libp2p_peer_free(peer);
+	return retVal;
+}
@@ -1,9 +1,14 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
 
+#include "libp2p/crypto/sha256.h"
 #include "libp2p/record/record.h"
+#include "libp2p/record/record_store.h"
 #include "libp2p/record/message.h"
 #include "libp2p/peer/peer.h"
 #include "multiaddr/multiaddr.h"
+#include "test_datastore.h"
 
 int setval(char** result, size_t* result_size, char* in) {
 	*result = malloc(strlen(in) + 1);
@@ -265,3 +270,260 @@ int test_record_message_protobuf() {
 		libp2p_message_free(result);
 	return retVal;
 }
+
+/***
+ * Build a record signed the way libp2p_record_make_put_record signs it
+ * @param private_key the author's key
+ * @param key the key
+ * @param value the value
+ * @returns the record, or NULL on error
+ */
+struct Libp2pRecord* test_record_signed(struct RsaPrivateKey* private_key, const char* key, const char* value) {
+	struct Libp2pRecord* record = libp2p_record_new();
+	char* signed_bytes = NULL;
+	setval(&record->key, &record->key_size, (char*)key);
+	setval((char**)&record->value, &record->value_size, (char*)value);
+	record->author = malloc(32);
+	record->author_size = 32;
+	libp2p_crypto_hashing_sha256((unsigned char*)private_key->public_key_der, private_key->public_key_length, (unsigned char*)record->author);
+	size_t signed_bytes_size = record->key_size + record->value_size + record->author_size;
+	signed_bytes = malloc(signed_bytes_size);
+	memcpy(signed_bytes, record->key, record->key_size);
+	memcpy(&signed_bytes[record->key_size], record->value, record->value_size);
+	memcpy(&signed_bytes[record->key_size + record->value_size], record->author, record->author_size);
+	if (!libp2p_crypto_rsa_sign(private_key, signed_bytes, signed_bytes_size, &record->signature, &record->signature_size)) {
+		libp2p_record_free(record);
+		record = NULL;
+	}
+	free(signed_bytes);
+	return record;
+}
+
+/***
+ * Records are checked when they are put, survive the cache, and expire. Only
+ * the author replaces a record that has not expired.
+ */
+int test_record_store() {
+	int retVal = 0;
+	struct RsaPrivateKey* private_key = NULL;
+	struct RsaPrivateKey* other_private_key = NULL;
+	struct PublicKey public_key;
+	struct PublicKey other_public_key;
+	struct Datastore* datastore = NULL;
+	struct RecordStore* store = NULL;
+	struct Libp2pRecord* records[3] = { NULL, NULL, NULL };
+	struct Libp2pRecord* other_record = NULL;
+	struct Libp2pRecord* results = NULL;
+	char* keys[] = { "/pk/One", "/pk/Two", "/pk/Three" };
+	unsigned char encoded[1024];
+	size_t encoded_size = 0;
+	time_t received = 0;
+
+	private_key = libp2p_crypto_rsa_rsa_private_key_new();
+	if (private_key == NULL || !libp2p_crypto_rsa_generate_keypair(private_key, 2048))
+		goto exit;
+	public_key.type = KEYTYPE_RSA;
+	public_key.data = (unsigned char*)private_key->public_key_der;
+	public_key.data_size = private_key->public_key_length;
+	for(int i = 0; i < 3; i++) {
+		records[i] = test_record_signed(private_key, keys[i], "Record Value");
+		if (records[i] == NULL)
+			goto exit;
+	}
+
+	// the compact encoding
+	if (!libp2p_record_store_encode(records[0], 1234567890, encoded, 1024, &encoded_size))
+		goto exit;
+	if (encoded_size > libp2p_record_store_encode_size(records[0]))
+		goto exit;
+	if (!libp2p_record_store_decode(encoded, encoded_size, &results, &received))
+		goto exit;
+	if (received != 1234567890 || results->key_size != records[0]->key_size || memcmp(results->key, records[0]->key, results->key_size) != 0
+			|| results->signature_size != records[0]->signature_size || memcmp(results->signature, records[0]->signature, results->signature_size) != 0)
+		goto exit;
+	libp2p_record_free(results);
+	results = NULL;
+	if (libp2p_record_store_decode(encoded, encoded_size - 1, &results, &received))
+		goto exit;
+
+	// cache 2 of them
+	datastore = test_datastore_new(1);
+	store = libp2p_record_store_new(datastore, 2);
+	if (datastore == NULL || store == NULL)
+		goto exit;
+	for(int i = 0; i < 3; i++) {
+		if (!libp2p_record_store_put(store, records[i], &public_key))
+			goto exit;
+	}
+	if (store->num_cached != 2 || test_datastore_backend.num_keys != 3)
+		goto exit;
+
+	// a tampered record is turned away
+	records[0]->value[0] = 'X';
+	if (libp2p_record_store_put(store, records[0], &public_key))
+		goto exit;
+	records[0]->value[0] = 'R';
+	// so is one that is not signed by the key it is checked with
+	public_key.data_size--;
+	if (libp2p_record_store_put(store, records[0], &public_key))
+		goto exit;
+	public_key.data_size++;
+
+	// the last one put comes from the cache
+	if (!libp2p_record_store_get(store, (unsigned char*)keys[2], strlen(keys[2]), &results))
+		goto exit;
+	if (results->value_size != 12 || memcmp(results->value, "Record Value", 12) != 0 || store->cache_hits != 1 || test_datastore_backend.gets != 0)
+		goto exit;
+	libp2p_record_free(results);
+	results = NULL;
+	// the first one was pushed out, so it comes from the datastore, and is then cached
+	for(int i = 0; i < 2; i++) {
+		if (!libp2p_record_store_get(store, (unsigned char*)keys[0], strlen(keys[0]), &results))
+			goto exit;
+		if (results->author_size != 32 || memcmp(results->author, records[0]->author, 32) != 0)
+			goto exit;
+		libp2p_record_free(results);
+		results = NULL;
+	}
+	if (test_datastore_backend.gets != 1 || store->cache_hits != 2)
+		goto exit;
+	if (libp2p_record_store_get(store, (unsigned char*)"/pk/Four", 8, &results))
+		goto exit;
+
+	// a new store finds what the old one put
+	libp2p_record_store_free(store);
+	store = libp2p_record_store_new(datastore, 2);
+	if (!libp2p_record_store_get(store, (unsigned char*)keys[1], strlen(keys[1]), &results))
+		goto exit;
+	libp2p_record_free(results);
+	results = NULL;
+
+	// someone else can not replace a record, whether it is cached (keys[1]) or not (keys[0])
+	other_private_key = libp2p_crypto_rsa_rsa_private_key_new();
+	if (other_private_key == NULL || !libp2p_crypto_rsa_generate_keypair(other_private_key, 2048))
+		goto exit;
+	other_public_key.type = KEYTYPE_RSA;
+	other_public_key.data = (unsigned char*)other_private_key->public_key_der;
+	other_public_key.data_size = other_private_key->public_key_length;
+	for(int i = 0; i < 2; i++) {
+		other_record = test_record_signed(other_private_key, keys[i], "Other Value");
+		if (other_record == NULL || libp2p_record_store_put(store, other_record, &other_public_key))
+			goto exit;
+		libp2p_record_free(other_record);
+		other_record = NULL;
+	}
+	if (!libp2p_record_store_get(store, (unsigned char*)keys[0], strlen(keys[0]), &results))
+		goto exit;
+	if (results->value_size != 12 || memcmp(results->value, "Record Value", 12) != 0)
+		goto exit;
+	libp2p_record_free(results);
+	results = NULL;
+	// the author can
+	other_record = test_record_signed(private_key, keys[0], "New Value");
+	if (other_record == NULL || !libp2p_record_store_put(store, other_record, &public_key))
+		goto exit;
+	libp2p_record_free(other_record);
+	other_record = NULL;
+
+	// and nothing is served once it is too old
+	store->ttl_secs = -1;
+	if (libp2p_record_store_get(store, (unsigned char*)keys[1], strlen(keys[1]), &results))
+		goto exit;
+	if (libp2p_record_store_get(store, (unsigned char*)keys[2], strlen(keys[2]), &results))
+		goto exit;
+	if (libp2p_record_store_get(store, (unsigned char*)keys[0], strlen(keys[0]), &results))
+		goto exit;
+	if (store->num_cached != 0)
+		goto exit;
+	// after which anyone may take the key
+	other_record = test_record_signed(other_private_key, keys[1], "Other Value");
+	if (other_record == NULL || !libp2p_record_store_put(store, other_record, &other_public_key))
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		libp2p_record_free(results);
+	for(int i = 0; i < 3; i++)
+		libp2p_record_free(records[i]);
+	if (other_record != NULL)
+		libp2p_record_free(other_record);
+	libp2p_record_store_free(store);
+	libp2p_datastore_free(datastore);
+	test_datastore_backend_clear();
+	if (private_key != NULL)
+		libp2p_crypto_rsa_rsa_private_key_free(private_key);
+	if (other_private_key != NULL)
+		libp2p_crypto_rsa_rsa_private_key_free(other_private_key);
+	return retVal;
+}
+
+/***
+ * How fast GET_VALUE finds a record, with and without the cache
+ */
+int test_record_store_get_value_speed() {
+	int retVal = 0;
+	int num_records = 1000;
+	int num_lookups = 100000;
+	size_t cache_sizes[] = { 0, 100, 1000 };
+	char key[32];
+	unsigned char datastore_key[64];
+	unsigned char encoded[512];
+	size_t encoded_size = 0;
+	struct timeval start, end;
+	struct Datastore* datastore = NULL;
+	struct RecordStore* store = NULL;
+	struct Libp2pRecord* record = test_record_create();
+	struct Libp2pRecord* results = NULL;
+
+	// the records are already on disk, as if they were put before the node restarted
+	datastore = test_datastore_new(1);
+	if (datastore == NULL)
+		goto exit;
+	for(int i = 0; i < num_records; i++) {
+		sprintf(key, "/pk/Record%d", i);
+		free(record->key);
+		setval(&record->key, &record->key_size, key);
+		if (!libp2p_record_store_encode(record, time(NULL), encoded, 512, &encoded_size))
+			goto exit;
+		size_t datastore_key_size = sprintf((char*)datastore_key, "%s%s", RECORD_STORE_KEY_PREFIX, key);
+		if (!libp2p_datastore_put(datastore, datastore_key, datastore_key_size, encoded, encoded_size))
+			goto exit;
+	}
+
+	for(int j = 0; j < 3; j++) {
+		store = libp2p_record_store_new(datastore, cache_sizes[j]);
+		if (store == NULL)
+			goto exit;
+		gettimeofday(&start, NULL);
+		for(int i = 0; i < num_lookups; i++) {
+			// most requests are for a few popular keys
+			int wanted = (i % 10 != 0) ? (i * 7) % 50 : (i * 7919) % num_records;
+			sprintf(key, "/pk/Record%d", wanted);
+			if (!libp2p_record_store_get(store, (unsigned char*)key, strlen(key), &results)) {
+				fprintf(stderr, "Record %d was not found\n", wanted);
+				goto exit;
+			}
+			libp2p_record_free(results);
+			results = NULL;
+		}
+		gettimeofday(&end, NULL);
+		double get_ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_usec - start.tv_usec) * 1e3) / num_lookups;
+		fprintf(stdout, "record store, cache of %lu: GET_VALUE %.0f ns, %lu hits, %lu misses\n",
+				(unsigned long)cache_sizes[j], get_ns, store->cache_hits, store->cache_misses);
+		if (cache_sizes[j] >= (size_t)num_records && store->cache_misses > (unsigned long)num_records)
+			goto exit;
+		libp2p_record_store_free(store);
+		store = NULL;
+	}
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		libp2p_record_free(results);
+	libp2p_record_free(record);
+	libp2p_record_store_free(store);
+	libp2p_datastore_free(datastore);
+	test_datastore_backend_clear();
+	return retVal;
+}
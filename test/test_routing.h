@@ -0,0 +1,1836 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <poll.h>
+
+#include "libp2p/conn/dialer.h"
+#include "libp2p/net/event_loop.h"
+#include "libp2p/net/multistream.h"
+#include "libp2p/net/protocol.h"
+#include "libp2p/peer/peerstore.h"
+#include "libp2p/record/message.h"
+#include "libp2p/routing/dht.h"
+#include "libp2p/routing/dht_lookup.h"
+#include "libp2p/routing/dht_protocol.h"
+#include "libp2p/routing/kademlia.h"
+#include "libp2p/secio/secio.h"
+#include "libp2p/utils/linked_list.h"
+
+/***
+ * A small DHT for the lookup tests. Every peer is a pair of sessions in one event
+ * loop: the client end is what lookups send to, the server end answers. Peer i
+ * knows peers i + 3 and i + 4, so a lookup has to walk the whole chain.
+ */
+#define TEST_LOOKUP_PEERS 12
+
+struct TestLookupNetwork {
+	struct Libp2pEventLoop* loop;
+	struct SessionContext* clients[TEST_LOOKUP_PEERS];
+	struct SessionContext* servers[TEST_LOOKUP_PEERS];
+	char ids[TEST_LOOKUP_PEERS][20];
+	// this peer never answers
+	int silent;
+	// this peer knows who provides the key
+	int provider;
+	int requests;
+	// the most queries a lookup had outstanding when one arrived
+	struct DhtLookup* watched;
+	int watched_outstanding;
+};
+
+struct TestLookupNetwork test_lookup_network;
+
+int test_lookup_can_handle(const uint8_t* incoming, size_t incoming_size) {
+	return 1;
+}
+
+struct Libp2pPeer* test_lookup_peer(const char* id) {
+	struct Libp2pPeer* peer = libp2p_peer_new();
+	peer->id_size = strlen(id);
+	peer->id = malloc(peer->id_size + 1);
+	strcpy(peer->id, id);
+	return peer;
+}
+
+void test_lookup_append_peer(struct Libp2pLinkedList** head, const char* id) {
+	struct Libp2pLinkedList* item = libp2p_utils_linked_list_new();
+	item->item = test_lookup_peer(id);
+	item->next = *head;
+	*head = item;
+}
+
+/***
+ * Answer a DHT request as the peer whose server end it arrived on
+ */
+int test_lookup_handle_message(const uint8_t* incoming, size_t incoming_size, struct SessionContext* session_context, void* protocol_context) {
+	struct TestLookupNetwork* network = (struct TestLookupNetwork*)protocol_context;
+	struct Libp2pMessage* message = NULL;
+	unsigned char* buffer = NULL;
+	size_t buffer_size = 0;
+	int which = -1;
+
+	for(int i = 0; i < TEST_LOOKUP_PEERS; i++) {
+		if (network->servers[i] == session_context)
+			which = i;
+	}
+	if (which < 0)
+		return -1;
+	if (incoming_size > 0 && incoming[0] == '/') {
+		// agree to speak the DHT protocol
+		libp2p_net_event_loop_queue_write(network->loop, session_context, incoming, incoming_size);
+		return 1;
+	}
+	network->requests++;
+	if (network->watched != NULL && network->watched->outstanding > network->watched_outstanding)
+		network->watched_outstanding = network->watched->outstanding;
+	if (which == network->silent)
+		return 1;
+	if (!libp2p_message_protobuf_decode((unsigned char*)incoming, incoming_size, &message))
+		return -1;
+	for(int i = which + 3; i <= which + 4 && i < TEST_LOOKUP_PEERS; i++)
+		test_lookup_append_peer(&message->closer_peer_head, network->ids[i]);
+	if (which == network->provider && message->message_type == MESSAGE_TYPE_GET_PROVIDERS)
+		test_lookup_append_peer(&message->provider_peer_head, "QmProvider");
+	buffer_size = libp2p_message_protobuf_encode_size(message);
+	buffer = malloc(buffer_size);
+	if (libp2p_message_protobuf_encode(message, buffer, buffer_size, &buffer_size))
+		libp2p_net_event_loop_queue_write(network->loop, session_context, buffer, buffer_size);
+	free(buffer);
+	libp2p_message_free(message);
+	return 1;
+}
+
+int test_lookup_shutdown(void* protocol_context) {
+	return 1;
+}
+
+struct SessionContext* test_lookup_session_for_peer(struct Libp2pPeer* peer, void* context) {
+	struct TestLookupNetwork* network = (struct TestLookupNetwork*)context;
+	for(int i = 0; i < TEST_LOOKUP_PEERS; i++) {
+		if (peer->id_size == strlen(network->ids[i]) && memcmp(peer->id, network->ids[i], peer->id_size) == 0)
+			return network->clients[i];
+	}
+	return NULL;
+}
+
+/***
+ * Build the network. The peerstore starts out knowing the first 3 peers.
+ */
+int test_lookup_network_new(struct Libp2pVector* handlers, struct Peerstore** peerstore) {
+	int fds[2];
+	memset(&test_lookup_network, 0, sizeof(struct TestLookupNetwork));
+	test_lookup_network.silent = -1;
+	test_lookup_network.provider = -1;
+	test_lookup_network.loop = libp2p_net_event_loop_new(handlers);
+	if (test_lookup_network.loop == NULL)
+		return 0;
+	for(int i = 0; i < TEST_LOOKUP_PEERS; i++) {
+		sprintf(test_lookup_network.ids[i], "QmLookupPeer%02d", i);
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+			return 0;
+		test_lookup_network.clients[i] = libp2p_session_context_new();
+		test_lookup_network.clients[i]->insecure_stream = libp2p_net_multistream_stream_new(fds[0], "127.0.0.1", 4001);
+		test_lookup_network.clients[i]->default_stream = test_lookup_network.clients[i]->insecure_stream;
+		test_lookup_network.servers[i] = libp2p_session_context_new();
+		test_lookup_network.servers[i]->insecure_stream = libp2p_net_multistream_stream_new(fds[1], "127.0.0.1", 4002);
+		test_lookup_network.servers[i]->default_stream = test_lookup_network.servers[i]->insecure_stream;
+		if (!libp2p_net_event_loop_add_session(test_lookup_network.loop, test_lookup_network.clients[i])
+				|| !libp2p_net_event_loop_add_session(test_lookup_network.loop, test_lookup_network.servers[i]))
+			return 0;
+	}
+	struct Libp2pPeer* local_peer = test_lookup_peer("QmLocalPeer");
+	*peerstore = libp2p_peerstore_new(local_peer);
+	libp2p_peer_free(local_peer);
+	for(int i = 0; i < 3; i++) {
+		struct Libp2pPeer* peer = test_lookup_peer(test_lookup_network.ids[i]);
+		libp2p_peerstore_add_peer(*peerstore, peer);
+		libp2p_peer_free(peer);
+	}
+	return 1;
+}
+
+void test_lookup_done(struct DhtLookup* lookup, void* user_data) {
+	(*(int*)user_data)++;
+}
+
+/***
+ * Lookups ask alpha peers at a time, walk toward the key, get past a peer
+ * that does not answer, and stop early when they find what they are after
+ */
+int test_dht_lookup() {
+	int retVal = 0;
+	struct Libp2pVector* handlers = NULL;
+	struct Libp2pProtocolHandler handler;
+	struct Peerstore* peerstore = NULL;
+	struct DhtLookupEngine* engine = NULL;
+	struct DhtLookup* find_node = NULL;
+	struct DhtLookup* get_providers = NULL;
+	struct Libp2pPeer* closest[DHT_LOOKUP_K];
+	int callbacks = 0;
+
+	handler.context = &test_lookup_network;
+	handler.CanHandle = test_lookup_can_handle;
+	handler.HandleMessage = test_lookup_handle_message;
+	handler.Shutdown = test_lookup_shutdown;
+	handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(handlers, &handler);
+	if (!test_lookup_network_new(handlers, &peerstore))
+		goto exit;
+	test_lookup_network.silent = 4;
+	test_lookup_network.provider = 9;
+	engine = libp2p_routing_dht_lookup_engine_new(peerstore, test_lookup_network.loop, test_lookup_session_for_peer, &test_lookup_network);
+	if (engine == NULL)
+		goto exit;
+	engine->query_timeout_ms = 200;
+
+	// both run at once
+	find_node = libp2p_routing_dht_lookup_start(engine, MESSAGE_TYPE_FIND_NODE, "QmNotThere", 10, test_lookup_done, &callbacks);
+	get_providers = libp2p_routing_dht_lookup_start(engine, MESSAGE_TYPE_GET_PROVIDERS, "QmSomeHash", 10, test_lookup_done, &callbacks);
+	if (find_node == NULL || get_providers == NULL)
+		goto exit;
+	test_lookup_network.watched = find_node;
+	libp2p_routing_dht_lookup_engine_process(engine);
+	if (engine->num_running != 2 || find_node->outstanding != DHT_LOOKUP_ALPHA)
+		goto exit;
+
+	// nobody has the first one, so every peer is asked, and the silent one times out
+	if (libp2p_routing_dht_lookup_run(find_node, 5000))
+		goto exit;
+	if (!find_node->done || find_node->num_queries != TEST_LOOKUP_PEERS || find_node->num_responses != TEST_LOOKUP_PEERS - 1
+			|| find_node->num_timeouts != 1) {
+		fprintf(stderr, "FIND_NODE made %d queries, got %d responses, and %d timeouts\n",
+				find_node->num_queries, find_node->num_responses, find_node->num_timeouts);
+		goto exit;
+	}
+	if (find_node->max_outstanding != DHT_LOOKUP_ALPHA || test_lookup_network.watched_outstanding > DHT_LOOKUP_ALPHA)
+		goto exit;
+	if (libp2p_routing_dht_lookup_closest_peers(find_node, closest, DHT_LOOKUP_K) != TEST_LOOKUP_PEERS - 1)
+		goto exit;
+	for(int i = 1; i < TEST_LOOKUP_PEERS - 1; i++) {
+		if (memcmp(find_node->candidates[i - 1]->distance, find_node->candidates[i]->distance, 32) > 0)
+			goto exit;
+	}
+	// the peers it heard about are in the peerstore now
+	if (libp2p_peerstore_get_peer(peerstore, (unsigned char*)test_lookup_network.ids[11], strlen(test_lookup_network.ids[11])) == NULL)
+		goto exit;
+
+	// the second one stops once it has a provider
+	if (!libp2p_routing_dht_lookup_run(get_providers, 5000))
+		goto exit;
+	if (get_providers->providers->total != 1 || get_providers->outstanding != 0)
+		goto exit;
+	if (memcmp(((struct Libp2pPeer*)libp2p_utils_vector_get(get_providers->providers, 0))->id, "QmProvider", 10) != 0)
+		goto exit;
+	if (callbacks != 2 || engine->num_running != 0)
+		goto exit;
+	// the silent peer's query was given up on, so nothing waits for its answer
+	for(struct Libp2pEventLoopConnection* connection = test_lookup_network.loop->connections; connection != NULL; connection = connection->next) {
+		if (connection->reads != NULL)
+			goto exit;
+	}
+
+	// a lookup for a peer ends as soon as it is found
+	test_lookup_network.watched = NULL;
+	libp2p_routing_dht_lookup_free(find_node);
+	find_node = libp2p_routing_dht_lookup_start(engine, MESSAGE_TYPE_FIND_NODE, test_lookup_network.ids[10], strlen(test_lookup_network.ids[10]), NULL, NULL);
+	if (!libp2p_routing_dht_lookup_run(find_node, 5000) || find_node->found_peer == NULL)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	libp2p_routing_dht_lookup_free(find_node);
+	libp2p_routing_dht_lookup_free(get_providers);
+	libp2p_routing_dht_lookup_engine_free(engine);
+	libp2p_net_event_loop_free(test_lookup_network.loop);
+	libp2p_peerstore_free(peerstore);
+	if (handlers != NULL)
+		libp2p_utils_vector_free(handlers);
+	return retVal;
+}
+
+/***
+ * Runs the event loop for test_dht_lookup_wait
+ */
+struct TestLookupThread {
+	struct DhtLookupEngine* engine;
+	volatile int stop;
+};
+
+void* test_lookup_loop_thread(void* data) {
+	struct TestLookupThread* thread = (struct TestLookupThread*)data;
+	while (!thread->stop) {
+		libp2p_net_event_loop_run_once(thread->engine->loop, 10);
+		libp2p_routing_dht_lookup_engine_process(thread->engine);
+	}
+	return NULL;
+}
+
+/***
+ * Lookups started from other threads are run by the event loop thread, and
+ * their callers are woken when they are done
+ */
+int test_dht_lookup_wait() {
+	int retVal = 0;
+	struct Libp2pVector* handlers = NULL;
+	struct Libp2pProtocolHandler handler;
+	struct Peerstore* peerstore = NULL;
+	struct DhtLookupEngine* engine = NULL;
+	struct DhtLookup* lookups[8];
+	struct TestLookupThread thread;
+	pthread_t loop_thread;
+	int running = 0;
+	char key[16];
+
+	memset(lookups, 0, sizeof(lookups));
+	handler.context = &test_lookup_network;
+	handler.CanHandle = test_lookup_can_handle;
+	handler.HandleMessage = test_lookup_handle_message;
+	handler.Shutdown = test_lookup_shutdown;
+	handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(handlers, &handler);
+	if (!test_lookup_network_new(handlers, &peerstore))
+		goto exit;
+	test_lookup_network.provider = 7;
+	engine = libp2p_routing_dht_lookup_engine_new(peerstore, test_lookup_network.loop, test_lookup_session_for_peer, &test_lookup_network);
+	if (engine == NULL)
+		goto exit;
+	thread.engine = engine;
+	thread.stop = 0;
+	if (pthread_create(&loop_thread, NULL, test_lookup_loop_thread, &thread) != 0)
+		goto exit;
+	running = 1;
+
+	for(int i = 0; i < 8; i++) {
+		sprintf(key, "QmKey%d", i);
+		lookups[i] = libp2p_routing_dht_lookup_start(engine, MESSAGE_TYPE_GET_PROVIDERS, key, strlen(key), NULL, NULL);
+		if (lookups[i] == NULL)
+			goto exit;
+	}
+	for(int i = 0; i < 8; i++) {
+		if (!libp2p_routing_dht_lookup_wait(lookups[i], 5000) || !lookups[i]->succeeded)
+			goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (running) {
+		thread.stop = 1;
+		pthread_join(loop_thread, NULL);
+	}
+	for(int i = 0; i < 8; i++)
+		libp2p_routing_dht_lookup_free(lookups[i]);
+	libp2p_routing_dht_lookup_engine_free(engine);
+	libp2p_net_event_loop_free(test_lookup_network.loop);
+	libp2p_peerstore_free(peerstore);
+	if (handlers != NULL)
+		libp2p_utils_vector_free(handlers);
+	return retVal;
+}
+
+/***
+ * What test_dht_send_message_async saw
+ */
+struct TestAsyncResponses {
+	struct Libp2pMessage* find_node;
+	struct Libp2pMessage* get_providers;
+	int unsolicited;
+};
+
+void test_async_find_node_response(struct SessionContext* session, struct Libp2pMessage* response, void* user_data) {
+	((struct TestAsyncResponses*)user_data)->find_node = response;
+}
+
+void test_async_get_providers_response(struct SessionContext* session, struct Libp2pMessage* response, void* user_data) {
+	((struct TestAsyncResponses*)user_data)->get_providers = response;
+}
+
+int test_async_handle_message(const uint8_t* incoming, size_t incoming_size, struct SessionContext* session_context, void* protocol_context) {
+	((struct TestAsyncResponses*)protocol_context)->unsolicited++;
+	return 1;
+}
+
+/***
+ * Send a DHT message the way the event loop frames it
+ * @param fd where to send it
+ * @param message_type the type
+ * @param key the key
+ * @returns true(1) on success, false(0) otherwise
+ */
+int test_async_send(int fd, enum MessageType message_type, const char* key) {
+	int retVal = 0;
+	struct Libp2pMessage* message = libp2p_message_new();
+	unsigned char buffer[256];
+	size_t buffer_size = 0;
+	message->message_type = message_type;
+	message->key_size = strlen(key);
+	message->key = malloc(message->key_size);
+	memcpy(message->key, key, message->key_size);
+	if (libp2p_message_protobuf_encode_size(message) < sizeof(buffer) - 1
+			&& libp2p_message_protobuf_encode(message, &buffer[1], sizeof(buffer) - 1, &buffer_size) && buffer_size < 128) {
+		buffer[0] = buffer_size;
+		retVal = send(fd, buffer, buffer_size + 1, 0) == buffer_size + 1;
+	}
+	libp2p_message_free(message);
+	return retVal;
+}
+
+/***
+ * Responses go to the request they answer, even when they come back out of order,
+ * and other messages from the peer are not taken for them
+ */
+int test_dht_send_message_async() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	struct Libp2pVector* handlers = NULL;
+	struct Libp2pProtocolHandler handler;
+	struct Libp2pEventLoop* loop = NULL;
+	struct SessionContext* session = NULL;
+	struct Libp2pMessage* find_node = libp2p_message_new();
+	struct Libp2pMessage* get_providers = libp2p_message_new();
+	struct TestAsyncResponses responses;
+
+	memset(&responses, 0, sizeof(responses));
+	handler.context = &responses;
+	handler.CanHandle = test_lookup_can_handle;
+	handler.HandleMessage = test_async_handle_message;
+	handler.Shutdown = test_lookup_shutdown;
+	handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(handlers, &handler);
+	loop = libp2p_net_event_loop_new(handlers);
+	if (loop == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	session = libp2p_session_context_new();
+	session->insecure_stream = libp2p_net_multistream_stream_new(fds[1], "127.0.0.1", 4001);
+	session->default_stream = session->insecure_stream;
+	fds[1] = -1;
+	if (!libp2p_net_event_loop_add_session(loop, session))
+		goto exit;
+
+	find_node->message_type = MESSAGE_TYPE_FIND_NODE;
+	find_node->key = malloc(5);
+	memcpy(find_node->key, "QmOne", 5);
+	find_node->key_size = 5;
+	get_providers->message_type = MESSAGE_TYPE_GET_PROVIDERS;
+	get_providers->key = malloc(5);
+	memcpy(get_providers->key, "QmTwo", 5);
+	get_providers->key_size = 5;
+	if (!libp2p_routing_dht_send_message_async(session, find_node, test_async_find_node_response, &responses, NULL)
+			|| !libp2p_routing_dht_send_message_async(session, get_providers, test_async_get_providers_response, &responses, NULL))
+		goto exit;
+
+	// the peer asks something of its own, then answers the second request first
+	if (!test_async_send(fds[0], MESSAGE_TYPE_FIND_NODE, "QmThree")
+			|| !test_async_send(fds[0], MESSAGE_TYPE_GET_PROVIDERS, "QmTwo")
+			|| !test_async_send(fds[0], MESSAGE_TYPE_FIND_NODE, "QmOne"))
+		goto exit;
+	for(int i = 0; i < 20 && (responses.find_node == NULL || responses.get_providers == NULL); i++)
+		libp2p_net_event_loop_run_once(loop, 100);
+
+	if (responses.unsolicited != 1 || responses.find_node == NULL || responses.get_providers == NULL)
+		goto exit;
+	if (responses.find_node->message_type != MESSAGE_TYPE_FIND_NODE || memcmp(responses.find_node->key, "QmOne", 5) != 0)
+		goto exit;
+	if (responses.get_providers->message_type != MESSAGE_TYPE_GET_PROVIDERS || memcmp(responses.get_providers->key, "QmTwo", 5) != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (responses.find_node != NULL)
+		libp2p_message_free(responses.find_node);
+	if (responses.get_providers != NULL)
+		libp2p_message_free(responses.get_providers);
+	libp2p_message_free(find_node);
+	libp2p_message_free(get_providers);
+	libp2p_net_event_loop_free(loop);
+	if (handlers != NULL)
+		libp2p_utils_vector_free(handlers);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	return retVal;
+}
+
+/***
+ * The client end of test_dht_send_message_async_handler
+ */
+struct TestAsyncHandlerResponses {
+	struct Libp2pMessage* ping;
+	struct Libp2pMessage* find_node;
+};
+
+void test_async_handler_ping_response(struct SessionContext* session, struct Libp2pMessage* response, void* user_data) {
+	((struct TestAsyncHandlerResponses*)user_data)->ping = response;
+}
+
+void test_async_handler_find_node_response(struct SessionContext* session, struct Libp2pMessage* response, void* user_data) {
+	((struct TestAsyncHandlerResponses*)user_data)->find_node = response;
+}
+
+/***
+ * Asynchronous requests to the in-tree DHT handler. The session is upgraded with the
+ * first request, and stays upgraded for the ones after it.
+ */
+int test_dht_send_message_async_handler() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	struct Libp2pPeer* local_peer = test_lookup_peer("QmAsyncServer");
+	struct Libp2pPeer* target = test_lookup_peer("QmAsyncTarget");
+	struct Peerstore* peerstore = NULL;
+	struct Libp2pVector* handlers = NULL;
+	struct Libp2pProtocolHandler* handler = NULL;
+	struct Libp2pEventLoop* loop = NULL;
+	struct SessionContext* client = NULL;
+	struct SessionContext* server = NULL;
+	struct Libp2pMessage* ping = libp2p_message_new();
+	struct Libp2pMessage* find_node = libp2p_message_new();
+	struct TestAsyncHandlerResponses responses;
+
+	memset(&responses, 0, sizeof(responses));
+	peerstore = libp2p_peerstore_new(local_peer);
+	target->addr_head = libp2p_utils_linked_list_new();
+	target->addr_head->item = multiaddress_new_from_string("/ip4/127.0.0.1/tcp/4001");
+	if (!libp2p_peerstore_add_peer(peerstore, target))
+		goto exit;
+	handler = libp2p_routing_dht_build_protocol_handler(peerstore, NULL, NULL);
+	handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(handlers, handler);
+	loop = libp2p_net_event_loop_new(handlers);
+	if (loop == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	client = libp2p_session_context_new();
+	client->insecure_stream = libp2p_net_multistream_stream_new(fds[0], "127.0.0.1", 4001);
+	client->default_stream = client->insecure_stream;
+	fds[0] = -1;
+	server = libp2p_session_context_new();
+	server->insecure_stream = libp2p_net_multistream_stream_new(fds[1], "127.0.0.1", 4002);
+	server->default_stream = server->insecure_stream;
+	fds[1] = -1;
+	if (!libp2p_net_event_loop_add_session(loop, client))
+		goto exit;
+	if (!libp2p_net_event_loop_add_session(loop, server)) {
+		libp2p_session_context_free(server);
+		goto exit;
+	}
+
+	ping->message_type = MESSAGE_TYPE_PING;
+	ping->key = malloc(6);
+	memcpy(ping->key, "QmPing", 6);
+	ping->key_size = 6;
+	find_node->message_type = MESSAGE_TYPE_FIND_NODE;
+	find_node->key = malloc(target->id_size);
+	memcpy(find_node->key, target->id, target->id_size);
+	find_node->key_size = target->id_size;
+	for(int round = 0; round < 2; round++) {
+		if (!libp2p_routing_dht_send_message_async(client, ping, test_async_handler_ping_response, &responses, NULL)
+				|| !libp2p_routing_dht_send_message_async(client, find_node, test_async_handler_find_node_response, &responses, NULL))
+			goto exit;
+		for(int i = 0; i < 20 && (responses.ping == NULL || responses.find_node == NULL); i++)
+			libp2p_net_event_loop_run_once(loop, 100);
+		if (!client->dht_upgraded || loop->num_connections != 2)
+			goto exit;
+		if (responses.ping == NULL || responses.ping->message_type != MESSAGE_TYPE_PING || memcmp(responses.ping->key, "QmPing", 6) != 0)
+			goto exit;
+		if (responses.find_node == NULL || responses.find_node->provider_peer_head == NULL)
+			goto exit;
+		struct Libp2pPeer* found = (struct Libp2pPeer*)responses.find_node->provider_peer_head->item;
+		if (found->id_size != target->id_size || memcmp(found->id, target->id, target->id_size) != 0)
+			goto exit;
+		libp2p_message_free(responses.ping);
+		libp2p_message_free(responses.find_node);
+		responses.ping = NULL;
+		responses.find_node = NULL;
+	}
+
+	retVal = 1;
+	exit:
+	if (responses.ping != NULL)
+		libp2p_message_free(responses.ping);
+	if (responses.find_node != NULL)
+		libp2p_message_free(responses.find_node);
+	libp2p_message_free(ping);
+	libp2p_message_free(find_node);
+	libp2p_net_event_loop_free(loop);
+	if (handlers != NULL)
+		libp2p_utils_vector_free(handlers);
+	if (handler != NULL) {
+		handler->Shutdown(handler->context);
+		free(handler);
+	}
+	libp2p_peerstore_free(peerstore);
+	libp2p_peer_free(target);
+	libp2p_peer_free(local_peer);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	return retVal;
+}
+
+/***
+ * One end of a secio handshake, so that both ends can run at once
+ */
+struct TestSecioHandshake {
+	struct SessionContext* session;
+	struct RsaPrivateKey* private_key;
+	struct Peerstore* peerstore;
+	int succeeded;
+};
+
+void* test_secio_handshake_thread(void* arg) {
+	struct TestSecioHandshake* side = (struct TestSecioHandshake*)arg;
+	side->succeeded = libp2p_secio_handshake(side->session, side->private_key, side->peerstore);
+	return NULL;
+}
+
+/***
+ * Build one end of a secio session over a socket, with its own key and peerstore
+ */
+int test_secio_handshake_side(struct TestSecioHandshake* side, int fd, const char* peer_id) {
+	struct Libp2pPeer* local_peer = test_lookup_peer(peer_id);
+	side->peerstore = libp2p_peerstore_new(local_peer);
+	libp2p_peer_free(local_peer);
+	side->private_key = libp2p_crypto_rsa_rsa_private_key_new();
+	if (side->private_key == NULL || !libp2p_crypto_rsa_generate_keypair(side->private_key, 2048))
+		return 0;
+	side->session = libp2p_session_context_new();
+	side->session->insecure_stream = libp2p_net_multistream_stream_new(fd, "127.0.0.1", 4001);
+	side->session->default_stream = side->session->insecure_stream;
+	return side->session->insecure_stream != NULL;
+}
+
+/***
+ * The peers in a peerstore that secio added share its session, which is freed elsewhere
+ */
+void test_secio_handshake_side_free(struct TestSecioHandshake* side) {
+	if (side->peerstore != NULL) {
+		for(struct Libp2pLinkedList* current = side->peerstore->head_entry; current != NULL; current = current->next)
+			((struct PeerEntry*)current->item)->peer->sessionContext = NULL;
+		libp2p_peerstore_free(side->peerstore);
+	}
+	if (side->private_key != NULL)
+		libp2p_crypto_rsa_rsa_private_key_free(side->private_key);
+}
+
+/***
+ * Send a ping to the DHT, and wait for it to come back
+ * @param session the client end
+ * @param loop the loop the server end is in
+ * @param key the key of the ping
+ * @returns true(1) if the ping came back, false(0) otherwise
+ */
+int test_dht_secio_ping(struct SessionContext* session, struct Libp2pEventLoop* loop, const char* key) {
+	int retVal = 0;
+	struct Libp2pMessage* message = libp2p_message_new();
+	struct Libp2pMessage* response = NULL;
+	unsigned char* buffer = NULL;
+	size_t buffer_size = 0;
+	message->message_type = MESSAGE_TYPE_PING;
+	message->key_size = strlen(key);
+	message->key = malloc(message->key_size);
+	memcpy(message->key, key, message->key_size);
+	buffer_size = libp2p_message_protobuf_encode_size(message);
+	buffer = malloc(buffer_size);
+	if (!libp2p_message_protobuf_encode(message, buffer, buffer_size, &buffer_size)
+			|| !libp2p_net_multistream_write(session, buffer, buffer_size))
+		goto exit;
+	free(buffer);
+	buffer = NULL;
+	libp2p_net_event_loop_run_once(loop, 1000);
+	if (!libp2p_net_multistream_read(session, &buffer, &buffer_size, 5)
+			|| !libp2p_message_protobuf_decode(buffer, buffer_size, &response))
+		goto exit;
+	if (response->message_type != MESSAGE_TYPE_PING || response->key_size != message->key_size
+			|| memcmp(response->key, key, message->key_size) != 0)
+		goto exit;
+	retVal = 1;
+	exit:
+	if (buffer != NULL)
+		free(buffer);
+	if (response != NULL)
+		libp2p_message_free(response);
+	libp2p_message_free(message);
+	return retVal;
+}
+
+/***
+ * The in-tree DHT handler, answering over secio from an event loop. Nothing it
+ * does waits on the socket, and its replies are encrypted in the order they are sent.
+ */
+int test_dht_handler_secio_event_loop() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	struct TestSecioHandshake server, client;
+	pthread_t server_thread;
+	struct Libp2pVector* handlers = NULL;
+	struct Libp2pProtocolHandler* handler = NULL;
+	struct Libp2pEventLoop* loop = NULL;
+	char* protocol = "/ipfs/kad/1.0.0\n";
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+	struct timeval start, end;
+
+	memset(&server, 0, sizeof(server));
+	memset(&client, 0, sizeof(client));
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	if (!test_secio_handshake_side(&server, fds[0], "QmSecioServer"))
+		goto exit;
+	fds[0] = -1;
+	if (!test_secio_handshake_side(&client, fds[1], "QmSecioClient"))
+		goto exit;
+	fds[1] = -1;
+	if (pthread_create(&server_thread, NULL, test_secio_handshake_thread, &server) != 0)
+		goto exit;
+	test_secio_handshake_thread(&client);
+	pthread_join(server_thread, NULL);
+	if (!server.succeeded || !client.succeeded)
+		goto exit;
+
+	handler = libp2p_routing_dht_build_protocol_handler(server.peerstore, NULL, NULL);
+	handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(handlers, handler);
+	loop = libp2p_net_event_loop_new(handlers);
+	if (loop == NULL || !libp2p_net_event_loop_add_session(loop, server.session))
+		goto exit;
+	server.session = NULL;
+
+	// the upgrade is answered, and the loop goes back to waiting instead of waiting for the request
+	if (!libp2p_net_multistream_write(client.session, (unsigned char*)protocol, strlen(protocol)))
+		goto exit;
+	gettimeofday(&start, NULL);
+	libp2p_net_event_loop_run_once(loop, 1000);
+	libp2p_net_event_loop_run_once(loop, 100);
+	gettimeofday(&end, NULL);
+	if (end.tv_sec - start.tv_sec > 1)
+		goto exit;
+	if (!libp2p_net_multistream_read(client.session, &results, &results_size, 5)
+			|| results_size != strlen(protocol) || memcmp(results, protocol, results_size) != 0)
+		goto exit;
+
+	// the session stays upgraded
+	if (!test_dht_secio_ping(client.session, loop, "QmFirst") || !test_dht_secio_ping(client.session, loop, "QmSecond"))
+		goto exit;
+	if (loop->num_connections != 1)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	libp2p_net_event_loop_free(loop);
+	if (handlers != NULL)
+		libp2p_utils_vector_free(handlers);
+	if (handler != NULL) {
+		handler->Shutdown(handler->context);
+		free(handler);
+	}
+	if (server.session != NULL)
+		libp2p_session_context_free(server.session);
+	if (client.session != NULL)
+		libp2p_session_context_free(client.session);
+	test_secio_handshake_side_free(&server);
+	test_secio_handshake_side_free(&client);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	return retVal;
+}
+
+/***
+ * A DHT node on a TCP port, for test_dht_lookup_dial. It takes one connection,
+ * secures it, and answers from its own event loop until told to stop.
+ */
+struct TestDialServer {
+	int listener;
+	struct TestSecioHandshake side;
+	struct Libp2pEventLoop* loop;
+	volatile int stop;
+	int succeeded;
+};
+
+void* test_dial_server_thread(void* arg) {
+	struct TestDialServer* server = (struct TestDialServer*)arg;
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+	int fd = accept(server->listener, NULL, NULL);
+	if (fd < 0)
+		return NULL;
+	server->side.session = libp2p_session_context_new();
+	server->side.session->insecure_stream = libp2p_net_multistream_stream_new(fd, "127.0.0.1", 4001);
+	server->side.session->default_stream = server->side.session->insecure_stream;
+	if (!libp2p_net_multistream_negotiate(server->side.session))
+		return NULL;
+	// the dialer asks for secio
+	if (!libp2p_net_multistream_read(server->side.session, &results, &results_size, 5))
+		return NULL;
+	free(results);
+	if (!libp2p_secio_handshake(server->side.session, server->side.private_key, server->side.peerstore))
+		return NULL;
+	if (!libp2p_net_event_loop_add_session(server->loop, server->side.session))
+		return NULL;
+	server->side.session = NULL;
+	server->succeeded = 1;
+	while (!server->stop)
+		libp2p_net_event_loop_run_once(server->loop, 10);
+	return NULL;
+}
+
+/***
+ * Lookups dial peers through the dialer, which keeps the session open, so
+ * the next lookup to ask the same peer does not dial again
+ */
+int test_dht_lookup_dial() {
+	int retVal = 0;
+	struct TestDialServer server;
+	pthread_t server_thread;
+	int running = 0;
+	struct sockaddr_in address;
+	socklen_t address_size = sizeof(address);
+	char address_string[64];
+	struct Libp2pVector* handlers = NULL;
+	struct Libp2pProtocolHandler* handler = NULL;
+	struct Libp2pVector* client_handlers = NULL;
+	struct PublicKey public_key;
+	char* server_id = NULL;
+	struct Libp2pPeer* peer = NULL;
+	struct RsaPrivateKey* private_key = NULL;
+	struct PrivateKey* dialer_key = libp2p_crypto_private_key_new();
+	struct Peerstore* peerstore = NULL;
+	struct DhtLookupDialer dial;
+	struct DhtLookupEngine* engine = NULL;
+	struct DhtLookup* lookup = NULL;
+	struct SessionContext* session = NULL;
+
+	memset(&server, 0, sizeof(server));
+	memset(&dial, 0, sizeof(dial));
+	server.listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	if (server.listener < 0 || bind(server.listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server.listener, 4) != 0)
+		goto exit;
+	if (getsockname(server.listener, (struct sockaddr*)&address, &address_size) != 0)
+		goto exit;
+	sprintf(address_string, "/ip4/127.0.0.1/tcp/%d", ntohs(address.sin_port));
+
+	// the server knows where the target is
+	peer = test_lookup_peer("QmSecioServer");
+	server.side.peerstore = libp2p_peerstore_new(peer);
+	libp2p_peer_free(peer);
+	peer = test_lookup_peer("QmDialTarget");
+	peer->addr_head = libp2p_utils_linked_list_new();
+	peer->addr_head->item = multiaddress_new_from_string("/ip4/127.0.0.2/tcp/4001");
+	libp2p_peerstore_add_peer(server.side.peerstore, peer);
+	libp2p_peer_free(peer);
+	peer = NULL;
+	server.side.private_key = libp2p_crypto_rsa_rsa_private_key_new();
+	if (server.side.private_key == NULL || !libp2p_crypto_rsa_generate_keypair(server.side.private_key, 2048))
+		goto exit;
+	handler = libp2p_routing_dht_build_protocol_handler(server.side.peerstore, NULL, NULL);
+	handlers = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(handlers, handler);
+	server.loop = libp2p_net_event_loop_new(handlers);
+	if (server.loop == NULL || pthread_create(&server_thread, NULL, test_dial_server_thread, &server) != 0)
+		goto exit;
+	running = 1;
+
+	// the client knows only where the server is
+	public_key.type = KEYTYPE_RSA;
+	public_key.data = (unsigned char*)server.side.private_key->public_key_der;
+	public_key.data_size = server.side.private_key->public_key_length;
+	if (!libp2p_crypto_public_key_to_peer_id(&public_key, &server_id))
+		goto exit;
+	peer = test_lookup_peer("QmSecioClient");
+	peerstore = libp2p_peerstore_new(peer);
+	libp2p_peer_free(peer);
+	peer = test_lookup_peer(server_id);
+	peer->addr_head = libp2p_utils_linked_list_new();
+	peer->addr_head->item = multiaddress_new_from_string(address_string);
+	libp2p_peerstore_add_peer(peerstore, peer);
+	libp2p_peer_free(peer);
+	peer = NULL;
+	private_key = libp2p_crypto_rsa_rsa_private_key_new();
+	if (private_key == NULL || !libp2p_crypto_rsa_generate_keypair(private_key, 2048))
+		goto exit;
+	client_handlers = libp2p_utils_vector_new(1);
+	dial.dialer = libp2p_conn_dialer_new("QmSecioClient", dialer_key);
+	dial.private_key = private_key;
+	dial.peerstore = peerstore;
+	dial.loop = libp2p_net_event_loop_new(client_handlers);
+	dial.timeout_secs = 5;
+	if (dial.dialer == NULL || dial.loop == NULL)
+		goto exit;
+	engine = libp2p_routing_dht_lookup_engine_new(peerstore, dial.loop, libp2p_routing_dht_lookup_dial, &dial);
+	if (engine == NULL)
+		goto exit;
+
+	lookup = libp2p_routing_dht_lookup_start(engine, MESSAGE_TYPE_FIND_NODE, "QmDialTarget", 12, NULL, NULL);
+	if (!libp2p_routing_dht_lookup_run(lookup, 10000) || lookup->found_peer == NULL || !server.succeeded)
+		goto exit;
+	// the peerstore's copy of the server and the loop each borrow the session once
+	if (dial.dialer->num_connections != 1 || dial.loop->num_connections != 1
+			|| ((struct DialerConnection*)dial.dialer->connections->item)->borrowers != 2)
+		goto exit;
+	session = ((struct DialerConnection*)dial.dialer->connections->item)->session;
+	libp2p_routing_dht_lookup_free(lookup);
+
+	// the session is still open, so the next lookup uses it (the target itself can not be reached)
+	lookup = libp2p_routing_dht_lookup_start(engine, MESSAGE_TYPE_FIND_NODE, "QmDialTarget", 12, NULL, NULL);
+	if (!libp2p_routing_dht_lookup_run(lookup, 10000) || lookup->found_peer == NULL)
+		goto exit;
+	if (dial.dialer->num_connections != 1 || dial.loop->num_connections != 1
+			|| ((struct DialerConnection*)dial.dialer->connections->item)->session != session)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	libp2p_routing_dht_lookup_free(lookup);
+	libp2p_routing_dht_lookup_engine_free(engine);
+	// the loop hands its sessions back to the dialer, so it goes first
+	libp2p_net_event_loop_free(dial.loop);
+	libp2p_peerstore_free(peerstore);
+	libp2p_conn_dialer_free(dial.dialer);
+	libp2p_crypto_private_key_free(dialer_key);
+	if (private_key != NULL)
+		libp2p_crypto_rsa_rsa_private_key_free(private_key);
+	if (client_handlers != NULL)
+		libp2p_utils_vector_free(client_handlers);
+	if (server_id != NULL)
+		free(server_id);
+	if (running) {
+		server.stop = 1;
+		pthread_join(server_thread, NULL);
+	}
+	libp2p_net_event_loop_free(server.loop);
+	if (handlers != NULL)
+		libp2p_utils_vector_free(handlers);
+	if (handler != NULL) {
+		handler->Shutdown(handler->context);
+		free(handler);
+	}
+	if (server.side.session != NULL)
+		libp2p_session_context_free(server.side.session);
+	test_secio_handshake_side_free(&server.side);
+	if (server.listener >= 0)
+		close(server.listener);
+	return retVal;
+}
+
+#define TEST_KADEMLIA_SEARCHES 16
+
+struct TestKademliaSearch {
+	char peer_id[32];
+	struct MultiAddress** results;
+};
+
+void* test_kademlia_search_thread(void* arg) {
+	struct TestKademliaSearch* search = (struct TestKademliaSearch*)arg;
+	search->results = search_kademlia(search->peer_id, 2);
+	return NULL;
+}
+
+/***
+ * Searches from many threads run side by side, instead of waiting for each other
+ */
+int test_kademlia_search_concurrent() {
+	int retVal = 0;
+	int fd = -1;
+	int started = 0;
+	struct sockaddr_in address;
+	struct Libp2pVector* bootstrap = NULL;
+	struct TestKademliaSearch searches[TEST_KADEMLIA_SEARCHES];
+	pthread_t threads[TEST_KADEMLIA_SEARCHES];
+	int num_threads = 0;
+	struct timeval start, end;
+
+	memset(searches, 0, sizeof(searches));
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		goto exit;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+		goto exit;
+	// no one to ask, so nothing is found
+	bootstrap = libp2p_utils_vector_new(1);
+	if (start_kademlia(fd, AF_INET, "QmKademliaTestPeer", 1, bootstrap) != 0)
+		goto exit;
+	started = 1;
+	if (!announce_kademlia("QmAnnounced", 4001))
+		goto exit;
+
+	gettimeofday(&start, NULL);
+	for(num_threads = 0; num_threads < TEST_KADEMLIA_SEARCHES; num_threads++) {
+		sprintf(searches[num_threads].peer_id, "QmSearch%d", num_threads);
+		if (pthread_create(&threads[num_threads], NULL, test_kademlia_search_thread, &searches[num_threads]) != 0)
+			break;
+	}
+	for(int i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	gettimeofday(&end, NULL);
+	if (num_threads != TEST_KADEMLIA_SEARCHES)
+		goto exit;
+
+	for(int i = 0; i < num_threads; i++) {
+		if (searches[i].results != NULL) {
+			fprintf(stderr, "Search %d found something in an empty DHT.\n", i);
+			goto exit;
+		}
+	}
+	// each search times out after 2 seconds. Taking turns would take 16 times that
+	long elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+	fprintf(stdout, "%d concurrent searches finished in %ld ms\n", num_threads, elapsed);
+	if (elapsed > 4000)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (started)
+		stop_kademlia();
+	else if (fd >= 0)
+		close(fd);
+	for(int i = 0; i < TEST_KADEMLIA_SEARCHES; i++) {
+		if (searches[i].results != NULL) {
+			for(int j = 0; searches[i].results[j] != NULL; j++)
+				multiaddress_free(searches[i].results[j]);
+			free(searches[i].results);
+		}
+	}
+	if (bootstrap != NULL)
+		libp2p_utils_vector_free(bootstrap);
+	return retVal;
+}
+
+#define TEST_KADEMLIA_PINGS 8
+
+void* test_kademlia_ping_thread(void* arg) {
+	uint16_t port = *(uint16_t*)arg;
+	if (!ping_kademlia("127.0.0.1", port))
+		return NULL;
+	return arg;
+}
+
+/***
+ * Pings from other threads are sent by kademlia_thread
+ */
+int test_kademlia_ping_threads() {
+	int retVal = 0;
+	int fd = -1;
+	int node_fd = -1;
+	int started = 0;
+	struct sockaddr_in address;
+	socklen_t address_len = sizeof(address);
+	struct Libp2pVector* bootstrap = NULL;
+	pthread_t threads[TEST_KADEMLIA_PINGS];
+	int num_threads = 0;
+	uint16_t node_port;
+	char buffer[512];
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	node_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || node_fd < 0)
+		goto exit;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+		goto exit;
+	if (bind(node_fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+		goto exit;
+	if (getsockname(node_fd, (struct sockaddr*)&address, &address_len) != 0)
+		goto exit;
+	node_port = ntohs(address.sin_port);
+	if (ping_kademlia("not an address", node_port))
+		goto exit;
+	bootstrap = libp2p_utils_vector_new(1);
+	if (start_kademlia(fd, AF_INET, "QmKademliaTestPeer", 1, bootstrap) != 0)
+		goto exit;
+	started = 1;
+
+	for(num_threads = 0; num_threads < TEST_KADEMLIA_PINGS; num_threads++) {
+		if (pthread_create(&threads[num_threads], NULL, test_kademlia_ping_thread, &node_port) != 0)
+			break;
+	}
+	int queued = 0;
+	for(int i = 0; i < num_threads; i++) {
+		void* result = NULL;
+		pthread_join(threads[i], &result);
+		if (result != NULL)
+			queued++;
+	}
+	if (queued != TEST_KADEMLIA_PINGS)
+		goto exit;
+
+	// the pings should arrive without anything else waking kademlia_thread
+	int pings = 0;
+	while (pings < TEST_KADEMLIA_PINGS && socket_read_select4(node_fd, 2) > 0) {
+		ssize_t bytes = recv(node_fd, buffer, sizeof(buffer) - 1, 0);
+		if (bytes <= 0)
+			break;
+		buffer[bytes] = 0;
+		if (memmem(buffer, bytes, "1:q4:ping", 9) != NULL)
+			pings++;
+	}
+	if (pings != TEST_KADEMLIA_PINGS) {
+		fprintf(stderr, "Expected %d pings, received %d.\n", TEST_KADEMLIA_PINGS, pings);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (started)
+		stop_kademlia();
+	else if (fd >= 0)
+		close(fd);
+	if (node_fd >= 0)
+		close(node_fd);
+	if (bootstrap != NULL)
+		libp2p_utils_vector_free(bootstrap);
+	return retVal;
+}
+
+#define TEST_DHT_TRACE_PACKETS 20000
+
+/***
+ * Build an id that has exactly common bits in common with id
+ * @param id the id to start from
+ * @param common the number of leading bits in common
+ * @param results where to put the new id
+ */
+void test_dht_id_at(const unsigned char* id, int common, unsigned char* results) {
+	memcpy(results, id, 20);
+	if (common >= 160)
+		return;
+	unsigned char mask = 0xFF >> (common % 8);
+	results[common / 8] = (id[common / 8] & ~mask) | (random() & mask);
+	// the first bit that differs
+	results[common / 8] = (results[common / 8] & ~(0x80 >> (common % 8))) | (~id[common / 8] & (0x80 >> (common % 8)));
+	for(int i = common / 8 + 1; i < 20; i++)
+		results[i] = random() & 0xFF;
+}
+
+/***
+ * Build a bencoded reply, as it comes off the wire
+ * @param buffer where to put it. It is NUL terminated, as dht_periodic wants
+ * @param id the id of the node replying
+ * @param tid the first 2 bytes of the transaction id
+ * @param nodes the compact node info (26 bytes each)
+ * @param num_nodes the number of nodes
+ * @returns the length of the reply
+ */
+int test_dht_reply(unsigned char* buffer, const unsigned char* id, const char* tid, const unsigned char* nodes, int num_nodes) {
+	int pos = sprintf((char*)buffer, "d1:rd2:id20:");
+	memcpy(&buffer[pos], id, 20);
+	pos += 20;
+	if (num_nodes > 0) {
+		pos += sprintf((char*)&buffer[pos], "5:nodes%d:", num_nodes * 26);
+		memcpy(&buffer[pos], nodes, num_nodes * 26);
+		pos += num_nodes * 26;
+	}
+	pos += sprintf((char*)&buffer[pos], "e1:t4:%c%c", tid[0], tid[1]);
+	buffer[pos++] = 0;
+	buffer[pos++] = 0;
+	pos += sprintf((char*)&buffer[pos], "1:y1:re");
+	buffer[pos] = 0;
+	return pos;
+}
+
+void test_dht_address(int n, struct sockaddr_in* address) {
+	memset(address, 0, sizeof(struct sockaddr_in));
+	address->sin_family = AF_INET;
+	// TEST-NET-2, which is never routed
+	address->sin_addr.s_addr = htonl(0xC6336400 | (n % 254 + 1));
+	address->sin_port = htons(1024 + n % 60000);
+}
+
+/***
+ * The routing table fills one bucket per bit in common with our id, and
+ * dht_periodic keeps up with a stream of replies
+ */
+int test_dht_routing_table() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	int started = 0;
+	unsigned char myid[20];
+	unsigned char id[20];
+	unsigned char packet[512];
+	unsigned char nodes[8 * 26];
+	unsigned char* trace = NULL;
+	int* trace_sizes = NULL;
+	struct sockaddr_in* trace_from = NULL;
+	struct sockaddr_in address;
+	struct sockaddr_in* good_nodes = NULL;
+	struct sockaddr_in6 good_nodes6[1];
+	int good = 0, dubious = 0, num = 0, num6 = 0;
+	time_t tosleep = 0;
+	struct timeval start, end;
+
+	srandom(42);
+	for(int i = 0; i < 20; i++)
+		myid[i] = random() & 0xFF;
+	// replies go out on a unix socket, which will not send to an internet address
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0)
+		goto exit;
+	if (dht_init(fds[0], -1, myid, NULL) < 0)
+		goto exit;
+	started = 1;
+
+	// 8 pongs for each of the first 20 bits. All of them fit.
+	for(int common = 0; common < 20; common++) {
+		for(int i = 0; i < 8; i++) {
+			test_dht_id_at(myid, common, id);
+			int size = test_dht_reply(packet, id, "pn", NULL, 0);
+			test_dht_address(common * 8 + i, &address);
+			dht_periodic(packet, size, (struct sockaddr*)&address, sizeof(address), &tosleep, NULL, NULL);
+		}
+	}
+	dht_nodes(AF_INET, &good, &dubious, NULL, NULL);
+	if (good != 160 || dubious != 0) {
+		fprintf(stderr, "Expected 160 good nodes, but have %d good and %d dubious\n", good, dubious);
+		goto exit;
+	}
+	// a bucket that is not ours is not split when it is full
+	test_dht_id_at(myid, 5, id);
+	test_dht_address(1000, &address);
+	dht_insert_node(id, (struct sockaddr*)&address, sizeof(address));
+	if (dht_nodes(AF_INET, NULL, NULL, NULL, NULL) != 160)
+		goto exit;
+	num = 200;
+	good_nodes = malloc(sizeof(struct sockaddr_in) * num);
+	if (good_nodes == NULL)
+		goto exit;
+	if (dht_get_nodes(good_nodes, &num, good_nodes6, &num6) != 160 || num != 160)
+		goto exit;
+
+	// now a trace of find_node replies from all over, each with 8 more nodes
+	trace = malloc(TEST_DHT_TRACE_PACKETS * 512);
+	trace_sizes = malloc(TEST_DHT_TRACE_PACKETS * sizeof(int));
+	trace_from = malloc(TEST_DHT_TRACE_PACKETS * sizeof(struct sockaddr_in));
+	if (trace == NULL || trace_sizes == NULL || trace_from == NULL)
+		goto exit;
+	for(int i = 0; i < TEST_DHT_TRACE_PACKETS; i++) {
+		for(int j = 0; j < 8; j++) {
+			test_dht_id_at(myid, random() % 24, &nodes[j * 26]);
+			test_dht_address(random(), &address);
+			memcpy(&nodes[j * 26 + 20], &address.sin_addr, 4);
+			memcpy(&nodes[j * 26 + 24], &address.sin_port, 2);
+		}
+		test_dht_id_at(myid, random() % 24, id);
+		trace_sizes[i] = test_dht_reply(&trace[i * 512], id, "fn", nodes, 8);
+		test_dht_address(i, &trace_from[i]);
+	}
+	gettimeofday(&start, NULL);
+	for(int i = 0; i < TEST_DHT_TRACE_PACKETS; i++)
+		dht_periodic(&trace[i * 512], trace_sizes[i], (struct sockaddr*)&trace_from[i], sizeof(struct sockaddr_in), &tosleep, NULL, NULL);
+	gettimeofday(&end, NULL);
+	long long elapsed = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_usec - start.tv_usec) * 1000LL;
+	fprintf(stdout, "dht_periodic: %lld ns per packet, %d nodes\n", elapsed / TEST_DHT_TRACE_PACKETS, dht_nodes(AF_INET, NULL, NULL, NULL, NULL));
+	// the deep buckets fill up too
+	if (dht_nodes(AF_INET, NULL, NULL, NULL, NULL) <= 160)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (started)
+		dht_uninit();
+	if (fds[0] >= 0) {
+		close(fds[0]);
+		close(fds[1]);
+	}
+	free(good_nodes);
+	free(trace);
+	free(trace_sizes);
+	free(trace_from);
+	return retVal;
+}
+
+/***
+ * Build a bencoded get_peers or announce_peer query
+ * @param buffer where to put it, NUL terminated
+ * @param id the id of the node asking
+ * @param info_hash the hash
+ * @param port the port to announce, or 0 for get_peers
+ * @param token the token from get_peers (announce_peer only)
+ * @returns the length of the query
+ */
+int test_dht_peers_query(unsigned char* buffer, const unsigned char* id, const unsigned char* info_hash, int port, const unsigned char* token) {
+	int pos = sprintf((char*)buffer, "d1:ad2:id20:");
+	memcpy(&buffer[pos], id, 20);
+	pos += 20;
+	pos += sprintf((char*)&buffer[pos], "9:info_hash20:");
+	memcpy(&buffer[pos], info_hash, 20);
+	pos += 20;
+	if (port > 0) {
+		pos += sprintf((char*)&buffer[pos], "4:porti%de5:token8:", port);
+		memcpy(&buffer[pos], token, 8);
+		pos += 8;
+		pos += sprintf((char*)&buffer[pos], "e1:q13:announce_peer1:t4:ap");
+	} else {
+		pos += sprintf((char*)&buffer[pos], "e1:q9:get_peers1:t4:gp");
+	}
+	buffer[pos++] = 0;
+	buffer[pos++] = 0;
+	pos += sprintf((char*)&buffer[pos], "1:y1:qe");
+	buffer[pos] = 0;
+	return pos;
+}
+
+void test_dht_count_values(void* closure, int event, const unsigned char* info_hash, const void* data, size_t data_len) {
+	if (event == DHT_EVENT_VALUES)
+		(*(int*)closure)++;
+}
+
+/***
+ * Find an IPv4 address of this machine that is not loopback (dht.c ignores
+ * packets from 127.0.0.0/8)
+ * @param address where to put the address. The port is 0
+ * @returns true(1) if there is one, false(0) otherwise
+ */
+int test_dht_local_address(struct sockaddr_in* address) {
+	struct ifaddrs* interfaces = NULL;
+	int retVal = 0;
+
+	memset(address, 0, sizeof(struct sockaddr_in));
+	if (getifaddrs(&interfaces) != 0)
+		return 0;
+	for(struct ifaddrs* current = interfaces; current != NULL; current = current->ifa_next) {
+		if (current->ifa_addr != NULL && current->ifa_addr->sa_family == AF_INET
+				&& ((unsigned char*)&((struct sockaddr_in*)current->ifa_addr)->sin_addr)[0] != 127) {
+			memcpy(address, current->ifa_addr, sizeof(struct sockaddr_in));
+			address->sin_port = 0;
+			retVal = 1;
+			break;
+		}
+	}
+	freeifaddrs(interfaces);
+	return retVal;
+}
+
+/***
+ * Peers announced to us are stored by hash, once per address and port, and
+ * found again. The token for announce_peer comes back in a reply, so this
+ * needs an address that is not loopback (dht.c ignores 127.0.0.0/8).
+ */
+int test_dht_storage() {
+	int retVal = 0;
+	int started = 0;
+	int dht_fd = -1, reader_fd = -1;
+	struct sockaddr_in from;
+	socklen_t from_size = sizeof(from);
+	unsigned char myid[20], id[20], hash[20];
+	unsigned char packet[1024];
+	unsigned char token[8];
+	time_t tosleep = 0;
+	int size, count;
+
+	if (!test_dht_local_address(&from)) {
+		fprintf(stdout, "No address other than loopback. Skipping.\n");
+		retVal = 1;
+		goto exit;
+	}
+	reader_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	dht_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (reader_fd < 0 || dht_fd < 0)
+		goto exit;
+	if (bind(reader_fd, (struct sockaddr*)&from, sizeof(from)) != 0 || getsockname(reader_fd, (struct sockaddr*)&from, &from_size) != 0)
+		goto exit;
+	for(int i = 0; i < 20; i++) {
+		myid[i] = random() & 0xFF;
+		id[i] = random() & 0xFF;
+	}
+	if (dht_init(dht_fd, -1, myid, NULL) < 0)
+		goto exit;
+	started = 1;
+
+	// ask for a token
+	memset(hash, 1, 20);
+	size = test_dht_peers_query(packet, id, hash, 0, NULL);
+	dht_periodic(packet, size, (struct sockaddr*)&from, sizeof(from), &tosleep, NULL, NULL);
+	struct pollfd poll_fd = { reader_fd, POLLIN, 0 };
+	if (poll(&poll_fd, 1, 1000) != 1)
+		goto exit;
+	size = recv(reader_fd, packet, sizeof(packet) - 1, 0);
+	if (size <= 0)
+		goto exit;
+	unsigned char* position = memmem(packet, size, "5:token8:", 9);
+	if (position == NULL || position + 9 + 8 > packet + size)
+		goto exit;
+	memcpy(token, position + 9, 8);
+
+	// 200 hashes with one peer each
+	for(int i = 0; i < 200; i++) {
+		// an all zero hash is not allowed
+		memset(hash, 0, 20);
+		hash[0] = 1;
+		memcpy(&hash[1], &i, sizeof(int));
+		size = test_dht_peers_query(packet, id, hash, 4001, token);
+		dht_periodic(packet, size, (struct sockaddr*)&from, sizeof(from), &tosleep, NULL, NULL);
+	}
+	// and one with 64 ports, some announced twice
+	memset(hash, 0xAB, 20);
+	for(int i = 0; i < 64 + 16; i++) {
+		size = test_dht_peers_query(packet, id, hash, 5000 + i % 64, token);
+		dht_periodic(packet, size, (struct sockaddr*)&from, sizeof(from), &tosleep, NULL, NULL);
+	}
+
+	// dht_search answers from storage first
+	for(int i = 0; i < 200; i++) {
+		// an all zero hash is not allowed
+		memset(hash, 0, 20);
+		hash[0] = 1;
+		memcpy(&hash[1], &i, sizeof(int));
+		count = 0;
+		dht_search(hash, 0, AF_INET, test_dht_count_values, &count);
+		if (count != 1) {
+			fprintf(stderr, "Hash %d has %d peers\n", i, count);
+			goto exit;
+		}
+	}
+	memset(hash, 0xAB, 20);
+	count = 0;
+	dht_search(hash, 0, AF_INET, test_dht_count_values, &count);
+	if (count != 64) {
+		fprintf(stderr, "Expected 64 peers, but found %d\n", count);
+		goto exit;
+	}
+	memset(hash, 0xCD, 20);
+	count = 0;
+	dht_search(hash, 0, AF_INET, test_dht_count_values, &count);
+	if (count != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (started)
+		dht_uninit();
+	if (dht_fd >= 0)
+		close(dht_fd);
+	if (reader_fd >= 0)
+		close(reader_fd);
+	return retVal;
+}
+
+/***
+ * Nodes that send broken messages are not heard from again, until enough
+ * others have been blacklisted after them
+ */
+int test_dht_blacklist() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	int started = 0;
+	unsigned char myid[20];
+	unsigned char id[20];
+	unsigned char packet[512];
+	struct sockaddr_in address;
+	time_t tosleep = 0;
+	int size;
+	struct timeval start, end;
+
+	for(int i = 0; i < 20; i++)
+		myid[i] = random() & 0xFF;
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0)
+		goto exit;
+	if (dht_init(fds[0], -1, myid, NULL) < 0)
+		goto exit;
+	started = 1;
+
+	// a reply with a short transaction id gets a node blacklisted
+	gettimeofday(&start, NULL);
+	for(int i = 0; i < 5000; i++) {
+		test_dht_id_at(myid, 0, id);
+		size = test_dht_reply(packet, id, "pn", NULL, 0);
+		// cut the transaction id down to 2 bytes
+		char* tid = (char*)memmem(packet, size, "1:t4:", 5);
+		memmove(tid + 7, tid + 9, size - (tid + 9 - (char*)packet) + 1);
+		tid[3] = '2';
+		size -= 2;
+		test_dht_address(i, &address);
+		dht_periodic(packet, size, (struct sockaddr*)&address, sizeof(address), &tosleep, NULL, NULL);
+	}
+	gettimeofday(&end, NULL);
+	long long elapsed = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_usec - start.tv_usec) * 1000LL;
+	fprintf(stdout, "blacklisting: %lld ns per packet\n", elapsed / 5000);
+
+	// the most recent are ignored
+	for(int i = 4000; i < 5000; i++) {
+		test_dht_id_at(myid, 0, id);
+		size = test_dht_reply(packet, id, "pn", NULL, 0);
+		test_dht_address(i, &address);
+		dht_periodic(packet, size, (struct sockaddr*)&address, sizeof(address), &tosleep, NULL, NULL);
+	}
+	if (dht_nodes(AF_INET, NULL, NULL, NULL, NULL) != 0)
+		goto exit;
+	// the first ones were pushed out
+	test_dht_id_at(myid, 0, id);
+	size = test_dht_reply(packet, id, "pn", NULL, 0);
+	test_dht_address(0, &address);
+	dht_periodic(packet, size, (struct sockaddr*)&address, sizeof(address), &tosleep, NULL, NULL);
+	if (dht_nodes(AF_INET, NULL, NULL, NULL, NULL) != 1)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (started)
+		dht_uninit();
+	if (fds[0] >= 0) {
+		close(fds[0]);
+		close(fds[1]);
+	}
+	return retVal;
+}
+
+/***
+ * Build a get_peers reply with one peer in it
+ * @param buffer where to put the reply
+ * @param id the id of the node that replies
+ * @param tid the search's transaction id
+ * @param peer the peer's address and port (6 bytes)
+ * @returns the size of the reply
+ */
+int test_dht_values_reply(unsigned char* buffer, const unsigned char* id, unsigned short tid, const unsigned char* peer) {
+	int pos = sprintf((char*)buffer, "d1:rd2:id20:");
+	memcpy(&buffer[pos], id, 20);
+	pos += 20;
+	pos += sprintf((char*)&buffer[pos], "6:valuesl6:");
+	memcpy(&buffer[pos], peer, 6);
+	pos += 6;
+	pos += sprintf((char*)&buffer[pos], "ee1:t4:gp");
+	memcpy(&buffer[pos], &tid, 2);
+	pos += 2;
+	pos += sprintf((char*)&buffer[pos], "1:y1:re");
+	buffer[pos] = 0;
+	return pos;
+}
+
+struct TestDhtSearchValues {
+	unsigned char (*targets)[20];
+	int* found;
+	int num_targets;
+	int unknown;
+};
+
+void test_dht_search_values(void* closure, int event, const unsigned char* info_hash, const void* data, size_t data_len) {
+	struct TestDhtSearchValues* values = (struct TestDhtSearchValues*)closure;
+	if (event != DHT_EVENT_VALUES)
+		return;
+	int i;
+	memcpy(&i, info_hash, sizeof(int));
+	if (i < 0 || i >= values->num_targets || memcmp(values->targets[i], info_hash, 20) != 0)
+		values->unknown++;
+	else
+		values->found[i]++;
+}
+
+/***
+ * Count the searches a node is part of, as dht_dump_tables sees it
+ */
+int test_dht_count_search_node(const unsigned char* id) {
+	char* dump = NULL;
+	size_t dump_size = 0;
+	char hex[41];
+	int count = 0;
+	FILE* f = open_memstream(&dump, &dump_size);
+	if (f == NULL)
+		return -1;
+	dht_dump_tables(f);
+	fclose(f);
+	for(int i = 0; i < 20; i++)
+		sprintf(&hex[i * 2], "%02x", id[i]);
+	// search nodes are dumped as "Node <n> id <id> ..."
+	for(char* line = strtok(dump, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		if (strncmp(line, "Node ", 5) == 0 && strstr(line, hex) != NULL)
+			count++;
+	}
+	free(dump);
+	return count;
+}
+
+/***
+ * Replies find their search by transaction id, and a broken node is taken
+ * out of every search at once, with thousands of searches running
+ */
+int test_dht_searches() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	int started = 0;
+	int num_targets = 2000;
+	unsigned char myid[20], id[20];
+	unsigned char packet[512];
+	unsigned char peer[6] = { 198, 51, 100, 1, 0x1F, 0x90 };
+	struct sockaddr_in address;
+	struct TestDhtSearchValues values;
+	time_t tosleep = 0;
+	int size;
+	struct timeval start, end;
+
+	values.targets = malloc(num_targets * 20);
+	values.found = calloc(num_targets, sizeof(int));
+	values.num_targets = num_targets;
+	values.unknown = 0;
+	if (values.targets == NULL || values.found == NULL)
+		goto exit;
+	for(int i = 0; i < 20; i++) {
+		myid[i] = random() & 0xFF;
+		id[i] = random() & 0xFF;
+	}
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0)
+		goto exit;
+	if (dht_init(fds[0], -1, myid, NULL) < 0)
+		goto exit;
+	started = 1;
+
+	// each target starts with its number, so the callback can find it
+	for(int i = 0; i < num_targets; i++) {
+		for(int j = 0; j < 20; j++)
+			values.targets[i][j] = random() & 0xFF;
+		memcpy(values.targets[i], &i, sizeof(int));
+		if (dht_search(values.targets[i], 0, AF_INET, NULL, NULL) < 0)
+			goto exit;
+	}
+
+	// one node answers every transaction id there is
+	test_dht_address(1, &address);
+	gettimeofday(&start, NULL);
+	for(int tid = 0; tid < 65536; tid++) {
+		size = test_dht_values_reply(packet, id, tid, peer);
+		dht_periodic(packet, size, (struct sockaddr*)&address, sizeof(address), &tosleep, test_dht_search_values, &values);
+	}
+	gettimeofday(&end, NULL);
+	long long elapsed = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_usec - start.tv_usec) * 1000LL;
+	fprintf(stdout, "%d searches: %lld ns per reply\n", num_targets, elapsed / 65536);
+	if (values.unknown != 0)
+		goto exit;
+	for(int i = 0; i < num_targets; i++) {
+		if (values.found[i] != 1) {
+			fprintf(stderr, "Search %d got %d replies\n", i, values.found[i]);
+			goto exit;
+		}
+	}
+
+	// it is now part of every search, until it sends something broken
+	if (test_dht_count_search_node(id) != num_targets)
+		goto exit;
+	size = test_dht_reply(packet, id, "pn", NULL, 0);
+	char* tid = (char*)memmem(packet, size, "1:t4:", 5);
+	memmove(tid + 7, tid + 9, size - (tid + 9 - (char*)packet) + 1);
+	tid[3] = '2';
+	size -= 2;
+	gettimeofday(&start, NULL);
+	dht_periodic(packet, size, (struct sockaddr*)&address, sizeof(address), &tosleep, NULL, NULL);
+	gettimeofday(&end, NULL);
+	elapsed = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_usec - start.tv_usec) * 1000LL;
+	fprintf(stdout, "blacklisting from %d searches: %lld ns\n", num_targets, elapsed);
+	if (test_dht_count_search_node(id) != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (started)
+		dht_uninit();
+	if (fds[0] >= 0) {
+		close(fds[0]);
+		close(fds[1]);
+	}
+	free(values.targets);
+	free(values.found);
+	return retVal;
+}
+
+/***
+ * Read every datagram waiting on a socket
+ * @param fd the socket
+ * @param timeout_ms how long to wait for the first one
+ * @returns the number read
+ */
+int test_dht_drain(int fd, int timeout_ms) {
+	unsigned char packet[2048];
+	struct pollfd poll_fd = { fd, POLLIN, 0 };
+	int count = 0;
+	while (poll(&poll_fd, 1, count == 0 ? timeout_ms : 0) == 1) {
+		if (recv(fd, packet, sizeof(packet), MSG_DONTWAIT) < 0)
+			break;
+		count++;
+	}
+	return count;
+}
+
+#define TEST_DHT_SEND_ROUNDS 300
+#define TEST_DHT_SEND_BATCH 64
+
+/***
+ * Queued sends go out when flushed, and all of them arrive. Also compares
+ * the rate of sending one by one with sending in batches, over loopback.
+ */
+int test_dht_send_queue() {
+	int retVal = 0;
+	int started = 0;
+	int dht_fd = -1, reader_fd = -1;
+	struct sockaddr_in reader;
+	socklen_t reader_size = sizeof(reader);
+	unsigned char myid[20];
+	struct timeval start, end;
+	long long elapsed[2];
+	int received[2];
+
+	memset(&reader, 0, sizeof(reader));
+	reader.sin_family = AF_INET;
+	reader.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	reader_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	dht_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (reader_fd < 0 || dht_fd < 0)
+		goto exit;
+	if (bind(reader_fd, (struct sockaddr*)&reader, sizeof(reader)) != 0 || getsockname(reader_fd, (struct sockaddr*)&reader, &reader_size) != 0)
+		goto exit;
+	for(int i = 0; i < 20; i++)
+		myid[i] = random() & 0xFF;
+	if (dht_init(dht_fd, -1, myid, NULL) < 0)
+		goto exit;
+	started = 1;
+
+	// nothing goes out until it is flushed
+	dht_queue_sends(1);
+	for(int i = 0; i < 10; i++)
+		dht_ping_node((struct sockaddr*)&reader, sizeof(reader));
+	if (test_dht_drain(reader_fd, 100) != 0)
+		goto exit;
+	if (dht_flush() != 10 || test_dht_drain(reader_fd, 1000) != 10)
+		goto exit;
+	// more than fit in the queue, and the rest when it is turned off
+	for(int i = 0; i < 100; i++)
+		dht_ping_node((struct sockaddr*)&reader, sizeof(reader));
+	dht_queue_sends(0);
+	if (test_dht_drain(reader_fd, 1000) != 100)
+		goto exit;
+
+	// one by one, then in batches
+	for(int queued = 0; queued < 2; queued++) {
+		dht_queue_sends(queued);
+		received[queued] = 0;
+		gettimeofday(&start, NULL);
+		for(int round = 0; round < TEST_DHT_SEND_ROUNDS; round++) {
+			for(int i = 0; i < TEST_DHT_SEND_BATCH; i++)
+				dht_ping_node((struct sockaddr*)&reader, sizeof(reader));
+			if (queued)
+				dht_flush();
+			received[queued] += test_dht_drain(reader_fd, 1000);
+		}
+		gettimeofday(&end, NULL);
+		elapsed[queued] = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_usec - start.tv_usec);
+	}
+	dht_queue_sends(0);
+	fprintf(stdout, "sendto: %lld packets per second, sendmmsg: %lld packets per second\n",
+			received[0] * 1000000LL / (elapsed[0] > 0 ? elapsed[0] : 1),
+			received[1] * 1000000LL / (elapsed[1] > 0 ? elapsed[1] : 1));
+	// loopback should not drop anything at this rate
+	if (received[1] != TEST_DHT_SEND_ROUNDS * TEST_DHT_SEND_BATCH)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (started)
+		dht_uninit();
+	if (dht_fd >= 0)
+		close(dht_fd);
+	if (reader_fd >= 0)
+		close(reader_fd);
+	return retVal;
+}
+
+#define TEST_KADEMLIA_ROUNDS 150
+#define TEST_KADEMLIA_BATCH 128
+
+/***
+ * The rate at which kademlia_thread takes packets off its socket. Each round
+ * is a burst of replies, then a ping, whose pong says the burst was handled.
+ * Requests are rate limited, replies are not.
+ */
+int test_kademlia_packet_rate() {
+	int retVal = 0;
+	int fd = -1, peer_fd = -1;
+	int started = 0;
+	struct sockaddr_in address, peer;
+	socklen_t address_size = sizeof(address);
+	struct Libp2pVector* bootstrap = NULL;
+	unsigned char id[20];
+	unsigned char packet[512];
+	int size;
+	struct timeval start, end;
+
+	if (!test_dht_local_address(&address)) {
+		fprintf(stdout, "No address other than loopback. Skipping.\n");
+		return 1;
+	}
+	memcpy(&peer, &address, sizeof(peer));
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	peer_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || peer_fd < 0)
+		goto exit;
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || getsockname(fd, (struct sockaddr*)&address, &address_size) != 0)
+		goto exit;
+	if (bind(peer_fd, (struct sockaddr*)&peer, sizeof(peer)) != 0)
+		goto exit;
+	if (connect(peer_fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+		goto exit;
+	bootstrap = libp2p_utils_vector_new(1);
+	if (start_kademlia(fd, AF_INET, "QmKademliaRatePeer", 1, bootstrap) != 0)
+		goto exit;
+	started = 1;
+	// a line of debug output per packet would be all that is measured
+	dht_debug = NULL;
+
+	for(int i = 0; i < 20; i++)
+		id[i] = random() & 0xFF;
+	gettimeofday(&start, NULL);
+	for(int round = 0; round < TEST_KADEMLIA_ROUNDS; round++) {
+		size = test_dht_reply(packet, id, "pn", NULL, 0);
+		for(int i = 0; i < TEST_KADEMLIA_BATCH; i++)
+			send(peer_fd, packet, size, 0);
+		// d1:ad2:id20:<id>e1:q4:ping1:t4:<tid>1:y1:qe
+		size = sprintf((char*)packet, "d1:ad2:id20:");
+		memcpy(&packet[size], id, 20);
+		size += 20;
+		size += sprintf((char*)&packet[size], "e1:q4:ping1:t4:r%03d1:y1:qe", round % 1000);
+		send(peer_fd, packet, size, 0);
+		// wait for the pong to this round's ping
+		char tid[8];
+		sprintf(tid, "4:r%03d", round % 1000);
+		int found = 0;
+		struct pollfd poll_fd = { peer_fd, POLLIN, 0 };
+		while (!found && poll(&poll_fd, 1, 2000) == 1) {
+			size = recv(peer_fd, packet, sizeof(packet) - 1, 0);
+			if (size > 0 && memmem(packet, size, tid, 6) != NULL)
+				found = 1;
+		}
+		if (!found) {
+			fprintf(stderr, "No pong for round %d\n", round);
+			goto exit;
+		}
+	}
+	gettimeofday(&end, NULL);
+	long long elapsed = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_usec - start.tv_usec);
+	fprintf(stdout, "kademlia_thread: %lld packets per second\n",
+			(long long)TEST_KADEMLIA_ROUNDS * (TEST_KADEMLIA_BATCH + 1) * 1000000LL / (elapsed > 0 ? elapsed : 1));
+
+	retVal = 1;
+	exit:
+	if (started)
+		stop_kademlia();
+	else if (fd >= 0)
+		close(fd);
+	if (peer_fd >= 0)
+		close(peer_fd);
+	if (bootstrap != NULL)
+		libp2p_utils_vector_free(bootstrap);
+	return retVal;
+}
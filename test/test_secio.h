@@ -1,4 +1,9 @@
 #include <stdlib.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "libp2p/secio/secio.h"
 #include "libp2p/secio/exchange.h"
@@ -159,8 +164,63 @@ int test_secio_handshake() {
 	return retVal;
 }
 
-int libp2p_secio_encrypt(const struct SessionContext* session, const unsigned char* incoming, size_t incoming_size, unsigned char** outgoing, size_t* outgoing_size);
-int libp2p_secio_decrypt(const struct SessionContext* session, const unsigned char* incoming, size_t incoming_size, unsigned char** outgoing, size_t* outgoing_size);
+int libp2p_secio_encrypt(struct SessionContext* session, const unsigned char* incoming, size_t incoming_size, unsigned char** outgoing, size_t* outgoing_size);
+int libp2p_secio_decrypt(struct SessionContext* session, const unsigned char* incoming, size_t incoming_size, unsigned char** outgoing, size_t* outgoing_size);
+int libp2p_secio_make_mac_and_cipher(struct SessionContext* session, struct StretchedKey* stretched_key);
+int libp2p_secio_initialize_crypto(struct SessionContext* session);
+
+/***
+ * Build a session where the local and remote keys match, so that what is encrypted
+ * can be decrypted by the same session. The keys get their own copy of the iv, as CTR
+ * mode advances it.
+ */
+struct SessionContext* test_secio_loopback_session(struct StretchedKey* local_key, unsigned char* local_iv, struct StretchedKey* remote_key, unsigned char* remote_iv) {
+	struct SessionContext* session = libp2p_session_context_new();
+	if (session == NULL)
+		return NULL;
+	session->chosen_cipher = "AES-256";
+	session->chosen_hash = "SHA256";
+
+	memcpy(local_iv, "abcdefghijklmnop", 16);
+	memcpy(remote_iv, "abcdefghijklmnop", 16);
+	local_key->cipher_key = (unsigned char*)"abcdefghijklmnopqrstuvwxyzabcdef";
+	local_key->cipher_size = 32;
+	local_key->mac_size = 40;
+	local_key->mac_key = (unsigned char*)"abcdefghijklmnopqrstuvwxyzabcdefghijklmn";
+	local_key->iv_size = 16;
+	local_key->iv = local_iv;
+	*remote_key = *local_key;
+	remote_key->iv = remote_iv;
+
+	session->local_stretched_key = local_key;
+	session->remote_stretched_key = remote_key;
+
+	if (!libp2p_secio_make_mac_and_cipher(session, local_key)
+			|| !libp2p_secio_make_mac_and_cipher(session, remote_key)) {
+		session->local_stretched_key = NULL;
+		session->remote_stretched_key = NULL;
+		session->chosen_cipher = NULL;
+		session->chosen_hash = NULL;
+		libp2p_session_context_free(session);
+		return NULL;
+	}
+	libp2p_secio_initialize_crypto(session);
+	return session;
+}
+
+/***
+ * Release a session built by test_secio_loopback_session
+ */
+void test_secio_loopback_session_free(struct SessionContext* session) {
+	if (session == NULL)
+		return;
+	// these were not allocated
+	session->local_stretched_key = NULL;
+	session->remote_stretched_key = NULL;
+	session->chosen_cipher = NULL;
+	session->chosen_hash = NULL;
+	libp2p_session_context_free(session);
+}
 
 int test_secio_encrypt_decrypt() {
 	unsigned char* original = (unsigned char*)"This is a test message";
@@ -169,46 +229,578 @@ int test_secio_encrypt_decrypt() {
 	size_t encrypted_size = 0;
 	unsigned char* results = NULL;
 	size_t results_size = 0;
-	struct SessionContext secure_session;
-	struct StretchedKey stretched_key;
+	struct StretchedKey local_key;
+	struct StretchedKey remote_key;
+	unsigned char local_iv[16];
+	unsigned char remote_iv[16];
+	struct SessionContext* secure_session = test_secio_loopback_session(&local_key, local_iv, &remote_key, remote_iv);
+
+	if (secure_session == NULL) {
+		fprintf(stderr, "Unable to set up cipher and mac\n");
+		goto exit;
+	}
+
+	// do it twice, to be sure the contexts carry over from frame to frame
+	for(int i = 0; i < 2; i++) {
+		if (!libp2p_secio_encrypt(secure_session, original, strlen((char*)original), &encrypted, &encrypted_size)) {
+			fprintf(stderr, "Unable to encrypt\n");
+			goto exit;
+		}
+
+		if (!libp2p_secio_decrypt(secure_session, encrypted, encrypted_size, &results, &results_size)) {
+			fprintf(stderr, "Unable to decrypt\n");
+			goto exit;
+		}
+
+		if (results_size != strlen((char*)original)) {
+			fprintf(stderr, "Results size are different. Results size = %lu and original is %lu\n", results_size, strlen((char*)original));
+			goto exit;
+		}
+
+		if (strncmp((char*)original, (char*)results, strlen( (char*) original)) != 0) {
+			fprintf(stderr, "String comparison did not match\n");
+			goto exit;
+		}
+		free(results);
+		results = NULL;
+		free(encrypted);
+		encrypted = NULL;
+	}
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	if (encrypted != NULL)
+		free(encrypted);
+	test_secio_loopback_session_free(secure_session);
+	return retVal;
+}
+
+/***
+ * Build a frame in place, and take it apart again in place
+ */
+int test_secio_frame_in_place() {
+	int retVal = 0;
+	char* original = "This is a test message";
+	size_t original_size = strlen(original);
+	unsigned char frame[SECIO_FRAME_HEADROOM + original_size + SECIO_FRAME_TAILROOM];
+	size_t frame_size = 0, data_size = 0;
+	uint32_t wire_size = 0;
+	struct StretchedKey local_key;
+	struct StretchedKey remote_key;
+	unsigned char local_iv[16];
+	unsigned char remote_iv[16];
+	struct SessionContext* session = test_secio_loopback_session(&local_key, local_iv, &remote_key, remote_iv);
+
+	if (session == NULL)
+		goto exit;
 
-	secure_session.local_stretched_key = &stretched_key;
-	secure_session.remote_stretched_key = &stretched_key;
+	memcpy(&frame[SECIO_FRAME_HEADROOM], original, original_size);
+	if (!libp2p_secio_frame_in_place(session, frame, original_size, &frame_size)) {
+		fprintf(stderr, "Unable to build frame\n");
+		goto exit;
+	}
+	if (frame_size != sizeof(frame)) {
+		fprintf(stderr, "Frame size should be %lu but was %lu\n", sizeof(frame), frame_size);
+		goto exit;
+	}
+	memcpy(&wire_size, frame, 4);
+	if (ntohl(wire_size) != original_size + SECIO_FRAME_TAILROOM) {
+		fprintf(stderr, "Length prefix should be %lu but was %u\n", original_size + SECIO_FRAME_TAILROOM, ntohl(wire_size));
+		goto exit;
+	}
+	if (memcmp(&frame[SECIO_FRAME_HEADROOM], original, original_size) == 0) {
+		fprintf(stderr, "Frame was not encrypted\n");
+		goto exit;
+	}
+	if (!libp2p_secio_decrypt_in_place(session, &frame[SECIO_FRAME_HEADROOM], frame_size - SECIO_FRAME_HEADROOM, &data_size)) {
+		fprintf(stderr, "Unable to decrypt frame\n");
+		goto exit;
+	}
+	if (data_size != original_size || memcmp(&frame[SECIO_FRAME_HEADROOM], original, original_size) != 0) {
+		fprintf(stderr, "Decrypted frame does not match\n");
+		goto exit;
+	}
 
-	secure_session.local_stretched_key->cipher_key = (unsigned char*)"abcdefghijklmnopqrstuvwxyzabcdef";
-	secure_session.local_stretched_key->cipher_size = 32;
-	secure_session.local_stretched_key->mac_size = 40;
-	secure_session.local_stretched_key->mac_key = (unsigned char*)"abcdefghijklmnopqrstuvwxyzabcdefghijklmn";
-	secure_session.local_stretched_key->iv_size = 16;
-	secure_session.local_stretched_key->iv = (unsigned char*)"abcdefghijklmnop";
-	secure_session.mac_function = NULL;
+	retVal = 1;
+	exit:
+	test_secio_loopback_session_free(session);
+	return retVal;
+}
 
-	if (!libp2p_secio_encrypt(&secure_session, original, strlen((char*)original), &encrypted, &encrypted_size)) {
-		fprintf(stderr, "Unable to encrypt\n");
+/***
+ * Compare the per frame cost of keying the cipher and mac for every frame
+ * (the old way) against reusing the contexts kept in the session
+ */
+int test_secio_encrypt_speed() {
+	int retVal = 0;
+	int num_frames = 20000;
+	size_t frame_sizes[] = { 64, 1024, 16384 };
+	unsigned char* frame = NULL;
+	unsigned char* buffer = NULL;
+	unsigned char* encrypted = NULL;
+	size_t encrypted_size = 0;
+	struct StretchedKey local_key;
+	struct StretchedKey remote_key;
+	unsigned char local_iv[16];
+	unsigned char remote_iv[16];
+	struct timeval start, end;
+	double per_frame_rekey = 0.0, per_frame_session = 0.0;
+	struct SessionContext* session = test_secio_loopback_session(&local_key, local_iv, &remote_key, remote_iv);
+
+	if (session == NULL)
 		goto exit;
+
+	for(int j = 0; j < 3; j++) {
+		size_t frame_size = frame_sizes[j];
+		frame = malloc(frame_size);
+		memset(frame, 'x', frame_size);
+
+		// the old way: a fresh aes key schedule and hmac setup for each frame
+		gettimeofday(&start, NULL);
+		for(int i = 0; i < num_frames; i++) {
+			buffer = malloc(frame_size + 32);
+			mbedtls_aes_context cipher_ctx;
+			mbedtls_aes_init(&cipher_ctx);
+			mbedtls_aes_setkey_enc(&cipher_ctx, local_key.cipher_key, local_key.cipher_size * 8);
+			mbedtls_aes_crypt_ctr(&cipher_ctx, frame_size, &session->aes_encode_nonce_offset, local_key.iv, session->aes_encode_stream_block, frame, buffer);
+			mbedtls_aes_free(&cipher_ctx);
+			mbedtls_md_context_t ctx;
+			mbedtls_md_init(&ctx);
+			mbedtls_md_setup(&ctx, &mbedtls_sha256_info, 1);
+			mbedtls_md_hmac_starts(&ctx, local_key.mac_key, local_key.mac_size);
+			mbedtls_md_hmac_update(&ctx, buffer, frame_size);
+			mbedtls_md_hmac_finish(&ctx, &buffer[frame_size]);
+			mbedtls_md_free(&ctx);
+			free(buffer);
+			buffer = NULL;
+		}
+		gettimeofday(&end, NULL);
+		per_frame_rekey = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_usec - start.tv_usec) * 1e3) / num_frames;
+
+		// the new way: contexts keyed once per session
+		gettimeofday(&start, NULL);
+		for(int i = 0; i < num_frames; i++) {
+			if (!libp2p_secio_encrypt(session, frame, frame_size, &encrypted, &encrypted_size))
+				goto exit;
+			free(encrypted);
+			encrypted = NULL;
+		}
+		gettimeofday(&end, NULL);
+		per_frame_session = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_usec - start.tv_usec) * 1e3) / num_frames;
+
+		fprintf(stdout, "secio encrypt of %lu byte frames: rekey per frame %.0f ns, session contexts %.0f ns\n", frame_size, per_frame_rekey, per_frame_session);
+		free(frame);
+		frame = NULL;
+	}
+
+	retVal = 1;
+	exit:
+	if (frame != NULL)
+		free(frame);
+	if (encrypted != NULL)
+		free(encrypted);
+	test_secio_loopback_session_free(session);
+	return retVal;
+}
+
+int libp2p_secio_unencrypted_read(struct SessionContext* session, unsigned char** results, size_t* results_size, int timeout_secs);
+
+/***
+ * Read frames from a loopback socket pair
+ * @param read_buffer the read buffer to attach to the stream, or NULL for none
+ * @param num_frames the number of frames the other side will send
+ * @param frame_size the size of each frame
+ * @param elapsed_usecs how long the reads took
+ * @returns true(1) if all frames came through intact
+ */
+int test_secio_read_frames(struct RingBuffer* read_buffer, int num_frames, size_t frame_size, double* elapsed_usecs) {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	pid_t child = -1;
+	struct Stream stream;
+	struct SessionContext session;
+	struct timeval start, end;
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+
+	child = fork();
+	if (child < 0)
+		goto exit;
+	if (child == 0) {
+		// the writer. Send everything in large chunks, so the reader sees many frames per recv
+		size_t chunk_frames = 256;
+		size_t chunk_size = chunk_frames * (4 + frame_size);
+		unsigned char* chunk = malloc(chunk_size);
+		uint32_t size = htonl(frame_size);
+		close(fds[1]);
+		for(int i = 0; i < chunk_frames; i++) {
+			memcpy(&chunk[i * (4 + frame_size)], &size, 4);
+			memset(&chunk[i * (4 + frame_size) + 4], i, frame_size);
+		}
+		for(int sent = 0; sent < num_frames; sent += chunk_frames) {
+			size_t to_send = (num_frames - sent < chunk_frames ? num_frames - sent : chunk_frames) * (4 + frame_size);
+			size_t written = 0;
+			while (written < to_send) {
+				ssize_t rc = send(fds[0], &chunk[written], to_send - written, 0);
+				if (rc <= 0)
+					_exit(1);
+				written += rc;
+			}
+		}
+		free(chunk);
+		close(fds[0]);
+		_exit(0);
+	}
+
+	memset(&stream, 0, sizeof(struct Stream));
+	stream.socket_descriptor = &fds[1];
+	stream.read_buffer = read_buffer;
+	memset(&session, 0, sizeof(struct SessionContext));
+	session.insecure_stream = &stream;
+	session.default_stream = &stream;
+
+	gettimeofday(&start, NULL);
+	for(int i = 0; i < num_frames; i++) {
+		if (libp2p_secio_unencrypted_read(&session, &results, &results_size, 5) != frame_size) {
+			fprintf(stderr, "Frame %d was not read\n", i);
+			goto exit;
+		}
+		if (results[0] != (unsigned char)(i % 256) || results[frame_size - 1] != (unsigned char)(i % 256)) {
+			fprintf(stderr, "Frame %d has the wrong contents\n", i);
+			goto exit;
+		}
+		free(results);
+		results = NULL;
+	}
+	gettimeofday(&end, NULL);
+	*elapsed_usecs = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (child > 0)
+		waitpid(child, NULL, 0);
+	return retVal;
+}
+
+/***
+ * Throughput of reading small secio frames on a loopback socket pair, with and
+ * without a read buffer attached to the stream
+ */
+int test_secio_read_speed() {
+	int num_frames = 100000;
+	size_t frame_size = 64;
+	double unbuffered = 0.0, buffered = 0.0;
+	struct RingBuffer* read_buffer = libp2p_utils_ring_buffer_new(65536);
+	int retVal = 0;
+
+	if (!test_secio_read_frames(NULL, num_frames, frame_size, &unbuffered))
+		goto exit;
+	if (!test_secio_read_frames(read_buffer, num_frames, frame_size, &buffered))
+		goto exit;
+
+	fprintf(stdout, "secio read of %d %lu byte frames: unbuffered %.0f frames/sec, buffered %.0f frames/sec\n",
+			num_frames, frame_size, num_frames / (unbuffered / 1e6), num_frames / (buffered / 1e6));
+	retVal = 1;
+	exit:
+	libp2p_utils_ring_buffer_free(read_buffer);
+	return retVal;
+}
+
+int libp2p_secio_encrypted_write(void* stream_context, const unsigned char* bytes, size_t num_bytes);
+
+/***
+ * Two keyed sessions joined by a socket pair, so that what the writer sends the reader can decrypt
+ */
+struct TestSecioPair {
+	int fds[2];
+	struct StretchedKey writer_local, writer_remote, reader_local, reader_remote;
+	unsigned char writer_local_iv[16], writer_remote_iv[16], reader_local_iv[16], reader_remote_iv[16];
+	struct Stream writer_stream, reader_stream;
+	struct SessionContext* writer;
+	struct SessionContext* reader;
+};
+
+int test_secio_pair_open(struct TestSecioPair* pair) {
+	memset(pair, 0, sizeof(struct TestSecioPair));
+	pair->fds[0] = -1;
+	pair->fds[1] = -1;
+	pair->writer = test_secio_loopback_session(&pair->writer_local, pair->writer_local_iv, &pair->writer_remote, pair->writer_remote_iv);
+	pair->reader = test_secio_loopback_session(&pair->reader_local, pair->reader_local_iv, &pair->reader_remote, pair->reader_remote_iv);
+	if (pair->writer == NULL || pair->reader == NULL)
+		return 0;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair->fds) != 0)
+		return 0;
+	pair->writer_stream.socket_descriptor = &pair->fds[0];
+	pair->writer->insecure_stream = &pair->writer_stream;
+	pair->writer->secure_stream = &pair->writer_stream;
+	pair->writer->default_stream = &pair->writer_stream;
+	pair->reader_stream.socket_descriptor = &pair->fds[1];
+	pair->reader_stream.read_buffer = libp2p_utils_ring_buffer_new(65536);
+	pair->reader->insecure_stream = &pair->reader_stream;
+	pair->reader->secure_stream = &pair->reader_stream;
+	pair->reader->default_stream = &pair->reader_stream;
+	return 1;
+}
+
+void test_secio_pair_close(struct TestSecioPair* pair) {
+	if (pair->fds[0] >= 0)
+		close(pair->fds[0]);
+	if (pair->fds[1] >= 0)
+		close(pair->fds[1]);
+	libp2p_utils_ring_buffer_free(pair->reader_stream.read_buffer);
+	if (pair->reader_stream.pending != NULL)
+		free(pair->reader_stream.pending);
+	if (pair->reader_stream.large != NULL)
+		free(pair->reader_stream.large);
+	if (pair->writer != NULL) {
+		pair->writer->insecure_stream = pair->writer->secure_stream = pair->writer->default_stream = NULL;
+		test_secio_loopback_session_free(pair->writer);
+	}
+	if (pair->reader != NULL) {
+		pair->reader->insecure_stream = pair->reader->secure_stream = pair->reader->default_stream = NULL;
+		test_secio_loopback_session_free(pair->reader);
+	}
+}
+
+/***
+ * Send a varint prefixed message of big_size bytes, split into frames of frame_size
+ * @returns the message (without the prefix), or NULL on error
+ */
+unsigned char* test_secio_send_big_message(struct SessionContext* writer, size_t big_size, size_t frame_size) {
+	// varint of the size, then the data
+	unsigned char* big = malloc(big_size + 10);
+	size_t varint_size = 0;
+	for(size_t n = big_size; n > 0 || varint_size == 0; n >>= 7)
+		big[varint_size++] = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+	for(size_t i = 0; i < big_size; i++)
+		big[i + varint_size] = i % 251;
+	for(size_t sent = 0; sent < big_size + varint_size; sent += frame_size) {
+		size_t chunk = big_size + varint_size - sent < frame_size ? big_size + varint_size - sent : frame_size;
+		if (!libp2p_secio_encrypted_write(writer, &big[sent], chunk)) {
+			free(big);
+			return NULL;
+		}
 	}
+	memmove(big, &big[varint_size], big_size);
+	return big;
+}
+
+/***
+ * Multistream messages over secio: two messages in one frame, and one message
+ * spread over several frames
+ */
+int test_secio_multistream_read() {
+	int retVal = 0;
+	struct TestSecioPair pair;
+	unsigned char two_messages[] = { 3, 'o', 'n', 'e', 3, 't', 'w', 'o' };
+	size_t big_size = 50000;
+	unsigned char* big = NULL;
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+
+	if (!test_secio_pair_open(&pair))
+		goto exit;
+
+	if (!libp2p_secio_encrypted_write(pair.writer, two_messages, sizeof(two_messages)))
+		goto exit;
+	big = test_secio_send_big_message(pair.writer, big_size, 16000);
+	if (big == NULL)
+		goto exit;
+
+	if (libp2p_net_multistream_read(pair.reader, &results, &results_size, 5) != 3 || memcmp(results, "one", 3) != 0)
+		goto exit;
+	free(results);
+	results = NULL;
+	if (libp2p_net_multistream_read(pair.reader, &results, &results_size, 5) != 3 || memcmp(results, "two", 3) != 0)
+		goto exit;
+	free(results);
+	results = NULL;
+	if (libp2p_net_multistream_read(pair.reader, &results, &results_size, 5) != big_size || memcmp(results, big, big_size) != 0)
+		goto exit;
+	if (pair.reader_stream.pending_size != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	if (big != NULL)
+		free(big);
+	test_secio_pair_close(&pair);
+	return retVal;
+}
+
+/***
+ * A secure message that claims an impossible size is refused before any memory is set aside for it
+ */
+int test_secio_multistream_read_bad_size() {
+	int retVal = 0;
+	struct TestSecioPair pair;
+	// 2^64 - 1, then a little of the "message"
+	unsigned char huge[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01, 'x', 'y' };
+	unsigned char* results = NULL;
+	size_t results_size = 0;
 
-	if (!libp2p_secio_decrypt(&secure_session, encrypted, encrypted_size, &results, &results_size)) {
-		fprintf(stderr, "Unable to decrypt\n");
+	if (!test_secio_pair_open(&pair))
+		goto exit;
+	if (!libp2p_secio_encrypted_write(pair.writer, huge, sizeof(huge)))
+		goto exit;
+	if (libp2p_net_multistream_read(pair.reader, &results, &results_size, 5) != 0 || results != NULL)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	test_secio_pair_close(&pair);
+	return retVal;
+}
+
+/***
+ * Read a multi frame message as a chain of pieces, one per frame
+ */
+int test_secio_multistream_read_chain() {
+	int retVal = 0;
+	struct TestSecioPair pair;
+	size_t big_size = 50000;
+	unsigned char* big = NULL;
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+	struct MessageChain* chain = NULL;
+
+	if (!test_secio_pair_open(&pair))
+		goto exit;
+	big = test_secio_send_big_message(pair.writer, big_size, 16000);
+	if (big == NULL)
+		goto exit;
+
+	chain = libp2p_net_multistream_read_chain(pair.reader, 5);
+	if (chain == NULL)
+		goto exit;
+	// 4 frames went out, 4 pieces should come in
+	if (chain->count != 4 || chain->total_size != big_size) {
+		fprintf(stderr, "Chain has %d pieces and %lu bytes\n", chain->count, chain->total_size);
 		goto exit;
 	}
+	if (!libp2p_net_multistream_chain_linearize(chain, &results, &results_size))
+		goto exit;
+	if (results_size != big_size || memcmp(results, big, big_size) != 0)
+		goto exit;
 
-	if (results_size != strlen((char*)original)) {
-		fprintf(stderr, "Results size are different. Results size = %lu and original is %lu\n", results_size, strlen((char*)original));
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	if (big != NULL)
+		free(big);
+	libp2p_net_multistream_chain_free(chain);
+	test_secio_pair_close(&pair);
+	return retVal;
+}
+
+/***
+ * A frame too big for the read buffer is gathered as it arrives, and nothing
+ * waits on the socket in the meantime
+ */
+int test_secio_try_read_large() {
+	int retVal = 0;
+	struct TestSecioPair pair;
+	size_t big_size = 100000;
+	unsigned char* frame = NULL;
+	size_t frame_size = 0;
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+	size_t varint_size = 0;
+	struct timeval start, end;
+
+	if (!test_secio_pair_open(&pair))
+		goto exit;
+	frame = malloc(SECIO_FRAME_HEADROOM + big_size + 10 + SECIO_FRAME_TAILROOM);
+	unsigned char* data = &frame[SECIO_FRAME_HEADROOM];
+	for(size_t n = big_size; n > 0; n >>= 7)
+		data[varint_size++] = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+	for(size_t i = 0; i < big_size; i++)
+		data[varint_size + i] = i % 251;
+	if (!libp2p_secio_frame_in_place(pair.writer, frame, varint_size + big_size, &frame_size))
 		goto exit;
+	// NOTE: data is now encrypted
+
+	// half of it
+	if (send(pair.fds[0], frame, frame_size / 2, 0) != frame_size / 2)
+		goto exit;
+	gettimeofday(&start, NULL);
+	for(int i = 0; i < 10; i++) {
+		socket_fill_buffer(pair.fds[1], pair.reader_stream.read_buffer, MSG_DONTWAIT, 0);
+		if (libp2p_net_multistream_try_read(pair.reader, &results, &results_size) != 0)
+			goto exit;
 	}
+	gettimeofday(&end, NULL);
+	if (end.tv_sec - start.tv_sec > 1 || pair.reader_stream.large == NULL)
+		goto exit;
 
-	if (strncmp((char*)original, (char*)results, strlen( (char*) original)) != 0) {
-		fprintf(stderr, "String comparison did not match\n");
+	// and the rest
+	if (send(pair.fds[0], &frame[frame_size / 2], frame_size - frame_size / 2, 0) != frame_size - frame_size / 2)
 		goto exit;
+	for(int i = 0; i < 10 && results == NULL; i++) {
+		socket_fill_buffer(pair.fds[1], pair.reader_stream.read_buffer, MSG_DONTWAIT, 0);
+		if (libp2p_net_multistream_try_read(pair.reader, &results, &results_size) < 0)
+			goto exit;
 	}
+	if (results == NULL || results_size != big_size)
+		goto exit;
+	for(size_t i = 0; i < big_size; i++)
+		if (results[i] != i % 251)
+			goto exit;
+	if (pair.reader_stream.large != NULL)
+		goto exit;
 
 	retVal = 1;
 	exit:
 	if (results != NULL)
 		free(results);
-	if (encrypted != NULL)
-		free(encrypted);
+	if (frame != NULL)
+		free(frame);
+	test_secio_pair_close(&pair);
+	return retVal;
+}
+
+/***
+ * A secure message that claims to be too big is an error as soon as its prefix is
+ * decrypted, instead of frames piling up for it
+ */
+int test_secio_try_read_bad_size() {
+	int retVal = 0;
+	struct TestSecioPair pair;
+	// 1 GB
+	unsigned char huge[] = { 0x80, 0x80, 0x80, 0x80, 0x04, 'x' };
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+
+	if (!test_secio_pair_open(&pair))
+		goto exit;
+	if (!libp2p_secio_encrypted_write(pair.writer, huge, sizeof(huge)))
+		goto exit;
+	if (socket_fill_buffer(pair.fds[1], pair.reader_stream.read_buffer, 0, 5) <= 0)
+		goto exit;
+	if (libp2p_net_multistream_try_read(pair.reader, &results, &results_size) != -1 || results != NULL)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	test_secio_pair_close(&pair);
 	return retVal;
 }
 
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libp2p/utils/ring_buffer.h"
+#include "libp2p/utils/bloom_filter.h"
+
+/***
+ * Fill, drain, and wrap around a ring buffer
+ */
+int test_ring_buffer() {
+	int retVal = 0;
+	unsigned char in[10] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+	unsigned char out[10];
+	unsigned char* first = NULL;
+	unsigned char* second = NULL;
+	size_t first_size = 0, second_size = 0;
+	struct RingBuffer* buffer = libp2p_utils_ring_buffer_new(8);
+
+	if (buffer == NULL)
+		goto exit;
+
+	// only 8 should fit
+	if (libp2p_utils_ring_buffer_write(buffer, in, 10) != 8)
+		goto exit;
+	if (libp2p_utils_ring_buffer_space(buffer) != 0)
+		goto exit;
+	if (libp2p_utils_ring_buffer_read(buffer, out, 5) != 5 || memcmp(out, in, 5) != 0)
+		goto exit;
+
+	// this one wraps around the end
+	if (libp2p_utils_ring_buffer_write(buffer, &in[8], 2) != 2)
+		goto exit;
+	libp2p_utils_ring_buffer_free_regions(buffer, &first, &first_size, &second, &second_size);
+	if (first_size + second_size != 3)
+		goto exit;
+	if (libp2p_utils_ring_buffer_size(buffer) != 5)
+		goto exit;
+	if (libp2p_utils_ring_buffer_read(buffer, out, 10) != 5 || memcmp(out, &in[5], 5) != 0)
+		goto exit;
+	if (libp2p_utils_ring_buffer_size(buffer) != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	libp2p_utils_ring_buffer_free(buffer);
+	return retVal;
+}
+
+/***
+ * Keys that were added are always found, and few others are
+ */
+int test_bloom_filter() {
+	int retVal = 0;
+	int num_keys = 10000;
+	int false_positives = 0;
+	unsigned char key[8];
+	// 16KB is about 13 bits per key, so about 1 in 400 should be a false positive
+	struct BloomFilter* filter = libp2p_utils_bloom_filter_new(16 * 1024, 0);
+	if (filter == NULL)
+		goto exit;
+
+	for(int i = 0; i < num_keys; i++) {
+		memset(key, 0, 8);
+		memcpy(key, &i, sizeof(int));
+		libp2p_utils_bloom_filter_add(filter, key, 8);
+	}
+	for(int i = 0; i < num_keys; i++) {
+		memset(key, 0, 8);
+		memcpy(key, &i, sizeof(int));
+		if (!libp2p_utils_bloom_filter_contains(filter, key, 8))
+			goto exit;
+	}
+	for(int i = num_keys; i < num_keys * 2; i++) {
+		memset(key, 0, 8);
+		memcpy(key, &i, sizeof(int));
+		false_positives += libp2p_utils_bloom_filter_contains(filter, key, 8);
+	}
+	if (false_positives > num_keys / 100) {
+		fprintf(stderr, "%d false positives in %d keys\n", false_positives, num_keys);
+		goto exit;
+	}
+	libp2p_utils_bloom_filter_clear(filter);
+	memset(key, 0, 8);
+	if (libp2p_utils_bloom_filter_contains(filter, key, 8) || filter->num_keys != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	libp2p_utils_bloom_filter_free(filter);
+	return retVal;
+}
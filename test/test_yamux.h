@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "libp2p/net/yamux.h"
+#include "libp2p/net/multistream.h"
+
+/***
+ * Build a connection on one end of a socket pair
+ */
+struct SessionContext* test_yamux_connection(int socket_fd) {
+	struct SessionContext* session = libp2p_session_context_new();
+	session->insecure_stream = libp2p_net_multistream_stream_new(socket_fd, "127.0.0.1", 4001);
+	session->default_stream = session->insecure_stream;
+	return session;
+}
+
+/***
+ * Two channels share one connection, and each gets its own messages
+ */
+int test_yamux_channels() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	struct SessionContext* client_connection = NULL;
+	struct SessionContext* server_connection = NULL;
+	struct YamuxSession* client = NULL;
+	struct YamuxSession* server = NULL;
+	struct SessionContext* client_channels[2] = { NULL, NULL };
+	struct SessionContext* server_channels[2] = { NULL, NULL };
+	char* messages[] = { "/ipfs/kad/1.0.0\n", "/nodeio/1.0.0\n" };
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	client_connection = test_yamux_connection(fds[0]);
+	server_connection = test_yamux_connection(fds[1]);
+	client = libp2p_yamux_session_new(client_connection, 1);
+	server = libp2p_yamux_session_new(server_connection, 0);
+	if (client == NULL || server == NULL)
+		goto exit;
+
+	for(int i = 0; i < 2; i++) {
+		client_channels[i] = libp2p_yamux_open(client);
+		if (client_channels[i] == NULL)
+			goto exit;
+		if (!client_channels[i]->default_stream->write(client_channels[i], (unsigned char*)messages[i], strlen(messages[i])))
+			goto exit;
+	}
+	if (client->num_channels != 2)
+		goto exit;
+
+	// channels are accepted in the order they were opened
+	for(int i = 0; i < 2; i++) {
+		server_channels[i] = libp2p_yamux_accept(server, 5);
+		if (server_channels[i] == NULL)
+			goto exit;
+	}
+	// read the second first. The first one's message waits in its own buffer.
+	for(int i = 1; i >= 0; i--) {
+		if (!server_channels[i]->default_stream->read(server_channels[i], &results, &results_size, 5))
+			goto exit;
+		if (results_size != strlen(messages[i]) || memcmp(results, messages[i], results_size) != 0)
+			goto exit;
+		if (!server_channels[i]->default_stream->write(server_channels[i], results, results_size))
+			goto exit;
+		free(results);
+		results = NULL;
+	}
+	for(int i = 0; i < 2; i++) {
+		if (!client_channels[i]->default_stream->read(client_channels[i], &results, &results_size, 5))
+			goto exit;
+		if (results_size != strlen(messages[i]) || memcmp(results, messages[i], results_size) != 0)
+			goto exit;
+		free(results);
+		results = NULL;
+	}
+
+	// closing one channel leaves the other working
+	libp2p_session_context_free(client_channels[0]);
+	client_channels[0] = NULL;
+	if (client->num_channels != 1)
+		goto exit;
+	if (server_channels[0]->default_stream->read(server_channels[0], &results, &results_size, 5))
+		goto exit;
+	if (!client_channels[1]->default_stream->write(client_channels[1], (unsigned char*)"again", 5))
+		goto exit;
+	if (!server_channels[1]->default_stream->read(server_channels[1], &results, &results_size, 5))
+		goto exit;
+	if (results_size != 5 || memcmp(results, "again", 5) != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	// the sessions free the channels that are left
+	libp2p_yamux_session_free(client);
+	libp2p_yamux_session_free(server);
+	libp2p_session_context_free(client_connection);
+	libp2p_session_context_free(server_connection);
+	return retVal;
+}
+
+/***
+ * A message many times the size of the window gets through, as the reader
+ * opens the window while it waits
+ */
+int test_yamux_flow_control() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	pid_t child = -1;
+	int status = 0;
+	size_t big_size = 4 * YAMUX_INITIAL_WINDOW + 1000;
+	unsigned char* big = NULL;
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+	struct SessionContext* connection = NULL;
+	struct YamuxSession* yamux = NULL;
+	struct SessionContext* channel = NULL;
+
+	big = malloc(big_size);
+	for(size_t i = 0; i < big_size; i++)
+		big[i] = i % 251;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+
+	child = fork();
+	if (child < 0)
+		goto exit;
+	if (child == 0) {
+		// the other side echoes what it receives on the first channel
+		close(fds[0]);
+		connection = test_yamux_connection(fds[1]);
+		yamux = libp2p_yamux_session_new(connection, 0);
+		channel = libp2p_yamux_accept(yamux, 5);
+		if (channel == NULL)
+			_exit(1);
+		if (!channel->default_stream->read(channel, &results, &results_size, 5))
+			_exit(2);
+		if (!channel->default_stream->write(channel, results, results_size))
+			_exit(3);
+		// wait for the other side to finish
+		channel->default_stream->read(channel, &results, &results_size, 5);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	fds[1] = -1;
+	connection = test_yamux_connection(fds[0]);
+	fds[0] = -1;
+	yamux = libp2p_yamux_session_new(connection, 1);
+	channel = libp2p_yamux_open(yamux);
+	if (channel == NULL)
+		goto exit;
+	if (!channel->default_stream->write(channel, big, big_size))
+		goto exit;
+	if (!channel->default_stream->read(channel, &results, &results_size, 5))
+		goto exit;
+	if (results_size != big_size || memcmp(results, big, big_size) != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	if (big != NULL)
+		free(big);
+	libp2p_yamux_session_free(yamux);
+	libp2p_session_context_free(connection);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	if (child > 0) {
+		waitpid(child, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "The echo side of the test failed with %d\n", WEXITSTATUS(status));
+			retVal = 0;
+		}
+	}
+	return retVal;
+}
+
+/***
+ * A reader that falls behind keeps the window closed, and a frame
+ * bigger than the window is refused before its data arrives
+ */
+int test_yamux_window() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	struct SessionContext* client_connection = NULL;
+	struct SessionContext* server_connection = NULL;
+	struct SessionContext* idle_connection = NULL;
+	struct YamuxSession* client = NULL;
+	struct YamuxSession* server = NULL;
+	struct YamuxSession* idle = NULL;
+	struct SessionContext* client_channel = NULL;
+	struct SessionContext* server_channel = NULL;
+	struct YamuxChannel* channel = NULL;
+	unsigned char message[1000];
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+	int num_messages = 200;
+
+	memset(message, 'x', sizeof(message));
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	client_connection = test_yamux_connection(fds[0]);
+	server_connection = test_yamux_connection(fds[1]);
+	client = libp2p_yamux_session_new(client_connection, 1);
+	server = libp2p_yamux_session_new(server_connection, 0);
+	if (client == NULL || server == NULL)
+		goto exit;
+	client_channel = libp2p_yamux_open(client);
+	if (client_channel == NULL)
+		goto exit;
+	if (!client_channel->default_stream->write(client_channel, message, sizeof(message)))
+		goto exit;
+	server_channel = libp2p_yamux_accept(server, 5);
+	if (server_channel == NULL)
+		goto exit;
+	channel = (struct YamuxChannel*)server_channel->default_stream->socket_descriptor;
+	// the server takes it off the socket, but nobody reads the channel
+	for(int i = 1; i < num_messages; i++) {
+		if (!client_channel->default_stream->write(client_channel, message, sizeof(message)))
+			goto exit;
+		while (channel->buffer_size < (i + 1) * (sizeof(message) + 2)) {
+			if (!libp2p_yamux_process(server, 5))
+				goto exit;
+		}
+	}
+
+	// what is read opens the window, what is still buffered does not
+	for(int i = 0; i < num_messages; i++) {
+		if (!server_channel->default_stream->read(server_channel, &results, &results_size, 5))
+			goto exit;
+		free(results);
+		results = NULL;
+		if (results_size != sizeof(message))
+			goto exit;
+		if (channel->recv_window + channel->buffer_size > YAMUX_INITIAL_WINDOW)
+			goto exit;
+	}
+	if (channel->buffer_size != 0 || channel->recv_window < YAMUX_INITIAL_WINDOW / 2)
+		goto exit;
+
+	// a data frame that would overrun the window of a new channel
+	unsigned char header[YAMUX_HEADER_SIZE] = { YAMUX_VERSION, YAMUX_TYPE_DATA, 0, YAMUX_FLAG_SYN, 0, 0, 0, 1, 0xFF, 0xFF, 0xFF, 0xFF };
+	idle_connection = libp2p_session_context_new();
+	idle = libp2p_yamux_session_new(idle_connection, 0);
+	if (idle == NULL)
+		goto exit;
+	if (libp2p_yamux_handle_bytes(idle, header, YAMUX_HEADER_SIZE))
+		goto exit;
+	if (idle->input_size != 0 || idle->num_channels != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	libp2p_yamux_session_free(client);
+	libp2p_yamux_session_free(server);
+	libp2p_yamux_session_free(idle);
+	libp2p_session_context_free(client_connection);
+	libp2p_session_context_free(server_connection);
+	libp2p_session_context_free(idle_connection);
+	return retVal;
+}
+
+/***
+ * Without secio, frames are written and read as the yamux spec has them
+ */
+int test_yamux_wire_format() {
+	int retVal = 0;
+	int fds[2] = { -1, -1 };
+	struct SessionContext* client_connection = NULL;
+	struct YamuxSession* client = NULL;
+	struct SessionContext* channel = NULL;
+	unsigned char wire[64];
+	unsigned char* results = NULL;
+	size_t results_size = 0;
+	// window update with SYN for channel 2, then 3 bytes of data ("hi" with its varint)
+	unsigned char incoming[] = {
+		YAMUX_VERSION, YAMUX_TYPE_WINDOW_UPDATE, 0, YAMUX_FLAG_SYN, 0, 0, 0, 2, 0, 0, 0, 0,
+		YAMUX_VERSION, YAMUX_TYPE_DATA, 0, 0, 0, 0, 0, 2, 0, 0, 0, 3, 2, 'h', 'i' };
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		goto exit;
+	client_connection = test_yamux_connection(fds[0]);
+	client = libp2p_yamux_session_new(client_connection, 1);
+	if (client == NULL)
+		goto exit;
+
+	// what goes out
+	channel = libp2p_yamux_open(client);
+	if (channel == NULL || !channel->default_stream->write(channel, (unsigned char*)"hi", 2))
+		goto exit;
+	if (recv(fds[1], wire, sizeof(wire), MSG_WAITALL | MSG_DONTWAIT) != 2 * YAMUX_HEADER_SIZE + 3)
+		goto exit;
+	if (wire[0] != YAMUX_VERSION || wire[1] != YAMUX_TYPE_WINDOW_UPDATE || wire[3] != YAMUX_FLAG_SYN || wire[7] != 1)
+		goto exit;
+	if (wire[12] != YAMUX_VERSION || wire[13] != YAMUX_TYPE_DATA || wire[19] != 1 || wire[23] != 3)
+		goto exit;
+	if (memcmp(&wire[24], "\x02hi", 3) != 0)
+		goto exit;
+	libp2p_session_context_free(channel);
+	channel = NULL;
+
+	// what comes in
+	if (send(fds[1], incoming, sizeof(incoming), 0) != sizeof(incoming))
+		goto exit;
+	channel = libp2p_yamux_accept(client, 5);
+	if (channel == NULL)
+		goto exit;
+	if (!channel->default_stream->read(channel, &results, &results_size, 5) || results_size != 2 || memcmp(results, "hi", 2) != 0)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (results != NULL)
+		free(results);
+	if (channel != NULL)
+		libp2p_session_context_free(channel);
+	libp2p_yamux_session_free(client);
+	libp2p_session_context_free(client_connection);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	return retVal;
+}
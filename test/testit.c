@@ -1,3 +1,6 @@
+/* For memmem, open_memstream and random */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 
 #include "crypto/test_aes.h"
@@ -10,9 +13,13 @@
 #include "test_secio.h"
 #include "test_mbedtls.h"
 #include "test_multistream.h"
+#include "test_yamux.h"
 #include "test_conn.h"
 #include "test_record.h"
 #include "test_peer.h"
+#include "test_utils.h"
+#include "test_datastore.h"
+#include "test_routing.h"
 #include "libp2p/utils/logger.h"
 
 const char* names[] = {
@@ -42,21 +49,66 @@ const char* names[] = {
 		"test_secio_encrypt_decrypt",
 		"test_secio_exchange_protobuf_encode",
 		"test_secio_encrypt_like_go",
+		"test_secio_frame_in_place",
+		"test_secio_encrypt_speed",
+		"test_secio_read_speed",
+		"test_secio_multistream_read",
+		"test_secio_multistream_read_bad_size",
+		"test_secio_multistream_read_chain",
+		"test_secio_try_read_large",
+		"test_secio_try_read_bad_size",
 		"test_multistream_connect",
 		"test_multistream_get_list",
+		"test_multistream_write_framed",
+		"test_socket_read_syscalls",
+		"test_multistream_read_buffered",
+		"test_multistream_read_bad_size",
+		"test_multistream_event_loop",
+		"test_multistream_event_loop_large",
+		"test_multistream_async",
+		"test_yamux_channels",
+		"test_yamux_flow_control",
+		"test_yamux_window",
+		"test_yamux_wire_format",
 		"test_ephemeral_key_generate",
 		"test_ephemeral_key_sign",
 		"test_dialer_new",
 		"test_dialer_dial",
 		"test_dialer_dial_multistream",
+		"test_dialer_connection_pool",
+		"test_peer_connect_failure",
 		"test_record_protobuf",
 		"test_record_make_put_record",
 		"test_record_peer_protobuf",
 		"test_record_message_protobuf",
+		"test_record_store",
+		"test_record_store_get_value_speed",
 		"test_peer",
 		"test_peer_protobuf",
 		"test_peerstore",
-		"test_aes"
+		"test_peerstore_lookup_speed",
+		"benchmark_peerstore_lookup_speed",
+		"test_peerstore_closest_peers",
+		"test_providerstore",
+		"test_aes",
+		"test_ring_buffer",
+		"test_bloom_filter",
+		"test_datastore_has",
+		"test_datastore_bloom_filter",
+		"test_dht_lookup",
+		"test_dht_lookup_wait",
+		"test_dht_send_message_async",
+		"test_dht_send_message_async_handler",
+		"test_dht_handler_secio_event_loop",
+		"test_dht_lookup_dial",
+		"test_kademlia_search_concurrent",
+		"test_kademlia_ping_threads",
+		"test_dht_routing_table",
+		"test_dht_storage",
+		"test_dht_blacklist",
+		"test_dht_searches",
+		"test_dht_send_queue",
+		"test_kademlia_packet_rate"
 };
 
 int (*funcs[])(void) = {
@@ -86,21 +138,66 @@ int (*funcs[])(void) = {
 		test_secio_encrypt_decrypt,
 		test_secio_exchange_protobuf_encode,
 		test_secio_encrypt_like_go,
+		test_secio_frame_in_place,
+		test_secio_encrypt_speed,
+		test_secio_read_speed,
+		test_secio_multistream_read,
+		test_secio_multistream_read_bad_size,
+		test_secio_multistream_read_chain,
+		test_secio_try_read_large,
+		test_secio_try_read_bad_size,
 		test_multistream_connect,
 		test_multistream_get_list,
+		test_multistream_write_framed,
+		test_socket_read_syscalls,
+		test_multistream_read_buffered,
+		test_multistream_read_bad_size,
+		test_multistream_event_loop,
+		test_multistream_event_loop_large,
+		test_multistream_async,
+		test_yamux_channels,
+		test_yamux_flow_control,
+		test_yamux_window,
+		test_yamux_wire_format,
 		test_ephemeral_key_generate,
 		test_ephemeral_key_sign,
 		test_dialer_new,
 		test_dialer_dial,
 		test_dialer_dial_multistream,
+		test_dialer_connection_pool,
+		test_peer_connect_failure,
 		test_record_protobuf,
 		test_record_make_put_record,
 		test_record_peer_protobuf,
 		test_record_message_protobuf,
+		test_record_store,
+		test_record_store_get_value_speed,
 		test_peer,
 		test_peer_protobuf,
 		test_peerstore,
-		test_aes
+		test_peerstore_lookup_speed,
+		benchmark_peerstore_lookup_speed,
+		test_peerstore_closest_peers,
+		test_providerstore,
+		test_aes,
+		test_ring_buffer,
+		test_bloom_filter,
+		test_datastore_has,
+		test_datastore_bloom_filter,
+		test_dht_lookup,
+		test_dht_lookup_wait,
+		test_dht_send_message_async,
+		test_dht_send_message_async_handler,
+		test_dht_handler_secio_event_loop,
+		test_dht_lookup_dial,
+		test_kademlia_search_concurrent,
+		test_kademlia_ping_threads,
+		test_dht_routing_table,
+		test_dht_storage,
+		test_dht_blacklist,
+		test_dht_searches,
+		test_dht_send_queue,
+		test_kademlia_packet_rate
 };
 
 int testit(const char* name, int (*func)(void)) {
@@ -141,7 +238,8 @@ int main(int argc, char** argv) {
 			}
 		}
 		else
-			if (!only_one) {
+			// benchmarks take a long time, so they only run when asked for by name
+			if (!only_one && strncmp(names[i], "benchmark_", 10) != 0) {
 				tests_ran++;
 				counter += testit(names[i], funcs[i]);
 			}
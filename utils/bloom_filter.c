@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libp2p/utils/bloom_filter.h"
+
+/***
+ * Hash a key twice. The bits for a key are h1 + i * h2 (Kirsch and Mitzenmacher).
+ * @param key the key
+ * @param key_size the size of the key
+ * @param h1 the first hash
+ * @param h2 the second hash (always odd)
+ */
+static void libp2p_utils_bloom_filter_hash(const unsigned char* key, size_t key_size, uint64_t* h1, uint64_t* h2) {
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < key_size; i++) {
+		hash ^= key[i];
+		hash *= 1099511628211ULL;
+	}
+	*h1 = hash;
+	// a second, mostly independent hash from a mix of the first
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	*h2 = hash | 1;
+}
+
+/***
+ * Allocate a new, empty bloom filter
+ * @param size_bytes the size of the bit array in bytes
+ * @param num_hashes the number of bits set per key (0 for the default)
+ * @returns the filter, or NULL on error
+ */
+struct BloomFilter* libp2p_utils_bloom_filter_new(size_t size_bytes, int num_hashes) {
+	if (size_bytes == 0)
+		return NULL;
+	struct BloomFilter* out = (struct BloomFilter*) malloc(sizeof(struct BloomFilter));
+	if (out != NULL) {
+		out->bits = (unsigned char*) calloc(size_bytes, 1);
+		if (out->bits == NULL) {
+			free(out);
+			return NULL;
+		}
+		out->num_bits = size_bytes * 8;
+		out->num_hashes = num_hashes > 0 ? num_hashes : BLOOM_FILTER_DEFAULT_HASHES;
+		out->num_keys = 0;
+	}
+	return out;
+}
+
+/***
+ * Free the resources of a bloom filter
+ * @param filter the filter
+ */
+void libp2p_utils_bloom_filter_free(struct BloomFilter* filter) {
+	if (filter != NULL) {
+		if (filter->bits != NULL)
+			free(filter->bits);
+		free(filter);
+	}
+}
+
+/***
+ * Add a key
+ * @param filter the filter
+ * @param key the key
+ * @param key_size the size of the key
+ */
+void libp2p_utils_bloom_filter_add(struct BloomFilter* filter, const unsigned char* key, size_t key_size) {
+	uint64_t h1, h2;
+	libp2p_utils_bloom_filter_hash(key, key_size, &h1, &h2);
+	for(int i = 0; i < filter->num_hashes; i++) {
+		size_t bit = (h1 + i * h2) % filter->num_bits;
+		filter->bits[bit / 8] |= 1 << (bit % 8);
+	}
+	filter->num_keys++;
+}
+
+/***
+ * See if a key may have been added
+ * @param filter the filter
+ * @param key the key
+ * @param key_size the size of the key
+ * @returns false(0) if the key was never added, true(1) if it may have been
+ */
+int libp2p_utils_bloom_filter_contains(const struct BloomFilter* filter, const unsigned char* key, size_t key_size) {
+	uint64_t h1, h2;
+	libp2p_utils_bloom_filter_hash(key, key_size, &h1, &h2);
+	for(int i = 0; i < filter->num_hashes; i++) {
+		size_t bit = (h1 + i * h2) % filter->num_bits;
+		if ((filter->bits[bit / 8] & (1 << (bit % 8))) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+/***
+ * Estimate how often a key that was never added is reported as maybe added,
+ * from how many bits are set
+ * @param filter the filter
+ * @returns the estimated false positive rate (0.0 to 1.0)
+ */
+double libp2p_utils_bloom_filter_false_positive_rate(const struct BloomFilter* filter) {
+	size_t bits_set = 0;
+	for(size_t i = 0; i < filter->num_bits / 8; i++) {
+		for(unsigned char byte = filter->bits[i]; byte != 0; byte &= byte - 1)
+			bits_set++;
+	}
+	// every bit of a key has to be set by chance
+	double fill = (double)bits_set / filter->num_bits;
+	double rate = 1.0;
+	for(int i = 0; i < filter->num_hashes; i++)
+		rate *= fill;
+	return rate;
+}
+
+/***
+ * Remove all keys
+ * @param filter the filter
+ */
+void libp2p_utils_bloom_filter_clear(struct BloomFilter* filter) {
+	memset(filter->bits, 0, filter->num_bits / 8);
+	filter->num_keys = 0;
+}
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libp2p/utils/ring_buffer.h"
+
+struct RingBuffer* libp2p_utils_ring_buffer_new(size_t capacity) {
+	struct RingBuffer* buffer = (struct RingBuffer*)malloc(sizeof(struct RingBuffer));
+	if (buffer == NULL)
+		return NULL;
+	buffer->data = (unsigned char*)malloc(capacity);
+	if (buffer->data == NULL) {
+		free(buffer);
+		return NULL;
+	}
+	buffer->capacity = capacity;
+	buffer->head = 0;
+	buffer->size = 0;
+	return buffer;
+}
+
+void libp2p_utils_ring_buffer_free(struct RingBuffer* buffer) {
+	if (buffer != NULL) {
+		free(buffer->data);
+		free(buffer);
+	}
+}
+
+size_t libp2p_utils_ring_buffer_size(const struct RingBuffer* buffer) {
+	return buffer->size;
+}
+
+size_t libp2p_utils_ring_buffer_space(const struct RingBuffer* buffer) {
+	return buffer->capacity - buffer->size;
+}
+
+size_t libp2p_utils_ring_buffer_peek(const struct RingBuffer* buffer, unsigned char* out, size_t out_size) {
+	size_t to_read = out_size < buffer->size ? out_size : buffer->size;
+	size_t first = buffer->capacity - buffer->head;
+	if (first > to_read)
+		first = to_read;
+	memcpy(out, &buffer->data[buffer->head], first);
+	memcpy(&out[first], buffer->data, to_read - first);
+	return to_read;
+}
+
+size_t libp2p_utils_ring_buffer_read(struct RingBuffer* buffer, unsigned char* out, size_t out_size) {
+	size_t to_read = libp2p_utils_ring_buffer_peek(buffer, out, out_size);
+	buffer->head = (buffer->head + to_read) % buffer->capacity;
+	buffer->size -= to_read;
+	// when empty, start over at the beginning so the next fill is one region
+	if (buffer->size == 0)
+		buffer->head = 0;
+	return to_read;
+}
+
+size_t libp2p_utils_ring_buffer_write(struct RingBuffer* buffer, const unsigned char* in, size_t in_size) {
+	unsigned char* first = NULL;
+	unsigned char* second = NULL;
+	size_t first_size = 0, second_size = 0;
+	libp2p_utils_ring_buffer_free_regions(buffer, &first, &first_size, &second, &second_size);
+	if (in_size > first_size + second_size)
+		in_size = first_size + second_size;
+	if (first_size > in_size)
+		first_size = in_size;
+	memcpy(first, in, first_size);
+	if (in_size > first_size)
+		memcpy(second, &in[first_size], in_size - first_size);
+	libp2p_utils_ring_buffer_produce(buffer, in_size);
+	return in_size;
+}
+
+void libp2p_utils_ring_buffer_free_regions(struct RingBuffer* buffer, unsigned char** first, size_t* first_size, unsigned char** second, size_t* second_size) {
+	size_t tail = (buffer->head + buffer->size) % buffer->capacity;
+	size_t space = buffer->capacity - buffer->size;
+	*first = &buffer->data[tail];
+	*second = NULL;
+	*second_size = 0;
+	if (tail + space <= buffer->capacity) {
+		*first_size = space;
+	} else {
+		*first_size = buffer->capacity - tail;
+		*second = buffer->data;
+		*second_size = space - *first_size;
+	}
+}
+
+void libp2p_utils_ring_buffer_produce(struct RingBuffer* buffer, size_t num_bytes) {
+	buffer->size += num_bytes;
+}
@@ -62,7 +62,7 @@ void libp2p_utils_vector_delete(struct Libp2pVector *v, int index)
 
     v->items[index] = NULL;
 
-    for (int i = 0; i < v->total - 1; i++) {
+    for (int i = index; i < v->total - 1; i++) {
         v->items[i] = v->items[i + 1];
         v->items[i + 1] = NULL;
     }